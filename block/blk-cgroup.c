@@ -179,6 +179,23 @@ static inline void blkio_update_group_iops(struct blkio_group *blkg,
 	}
 }
 
+static inline void blkio_update_group_latency(struct blkio_group *blkg,
+			unsigned int latency)
+{
+	struct blkio_policy_type *blkiop;
+
+	list_for_each_entry(blkiop, &blkio_list, list) {
+
+		/* If this policy does not own the blkg, do not send updates */
+		if (blkiop->plid != blkg->plid)
+			continue;
+
+		if (blkiop->ops.blkio_update_group_latency_fn)
+			blkiop->ops.blkio_update_group_latency_fn(blkg->key,
+								blkg, latency);
+	}
+}
+
 /*
  * Add to the appropriate stat variable depending on the request type.
  * This should be called with the blkg->stats_lock held.
@@ -438,6 +455,25 @@ void blkiocg_update_completion_stats(struct blkio_group *blkg,
 }
 EXPORT_SYMBOL_GPL(blkiocg_update_completion_stats);
 
+/*
+ * Called by the throttle policy at the end of each latency window in which
+ * @blkg completed IO.  @latency is the mean latency in the window, in us.
+ */
+void blkiocg_update_latency_stats(struct blkio_group *blkg, uint64_t latency,
+					bool missed, bool throttled)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&blkg->stats_lock, flags);
+	blkg->stats.latency = latency;
+	if (missed)
+		blkg->stats.latency_missed++;
+	if (throttled)
+		blkg->stats.latency_throttled++;
+	spin_unlock_irqrestore(&blkg->stats_lock, flags);
+}
+EXPORT_SYMBOL_GPL(blkiocg_update_latency_stats);
+
 /*  Merged stats are per cpu.  */
 void blkiocg_update_io_merged_stats(struct blkio_group *blkg, bool direction,
 					bool sync)
@@ -728,6 +764,15 @@ static uint64_t blkio_get_stat(struct blkio_group *blkg,
 	if (type == BLKIO_STAT_TIME)
 		return blkio_fill_stat(key_str, MAX_KEY_LEN - 1,
 					blkg->stats.time, cb, dev);
+	if (type == BLKIO_STAT_LATENCY)
+		return blkio_fill_stat(key_str, MAX_KEY_LEN - 1,
+					blkg->stats.latency, cb, dev);
+	if (type == BLKIO_STAT_LATENCY_MISSED)
+		return blkio_fill_stat(key_str, MAX_KEY_LEN - 1,
+					blkg->stats.latency_missed, cb, dev);
+	if (type == BLKIO_STAT_LATENCY_THROTTLED)
+		return blkio_fill_stat(key_str, MAX_KEY_LEN - 1,
+					blkg->stats.latency_throttled, cb, dev);
 #ifdef CONFIG_DEBUG_BLK_CGROUP
 	if (type == BLKIO_STAT_UNACCOUNTED_TIME)
 		return blkio_fill_stat(key_str, MAX_KEY_LEN - 1,
@@ -853,6 +898,14 @@ static int blkio_policy_parse_and_set(char *buf,
 			newpn->fileid = fileid;
 			newpn->val.iops = (unsigned int)temp;
 			break;
+		case BLKIO_THROTL_latency_device:
+			if (temp > THROTL_LATENCY_MAX)
+				goto out;
+
+			newpn->plid = plid;
+			newpn->fileid = fileid;
+			newpn->val.latency = (unsigned int)temp;
+			break;
 		}
 		break;
 	default:
@@ -950,6 +1003,22 @@ unsigned int blkcg_get_write_iops(struct blkio_cgroup *blkcg, dev_t dev)
 	return iops;
 }
 
+unsigned int blkcg_get_latency(struct blkio_cgroup *blkcg, dev_t dev)
+{
+	struct blkio_policy_node *pn;
+	unsigned long flags;
+	unsigned int latency = -1;
+
+	spin_lock_irqsave(&blkcg->lock, flags);
+	pn = blkio_policy_search_node(blkcg, dev, BLKIO_POLICY_THROTL,
+				BLKIO_THROTL_latency_device);
+	if (pn)
+		latency = pn->val.latency;
+	spin_unlock_irqrestore(&blkcg->lock, flags);
+
+	return latency;
+}
+
 /* Checks whether user asked for deleting a policy rule */
 static bool blkio_delete_rule_command(struct blkio_policy_node *pn)
 {
@@ -969,6 +1038,10 @@ static bool blkio_delete_rule_command(struct blkio_policy_node *pn)
 		case BLKIO_THROTL_write_iops_device:
 			if (pn->val.iops == 0)
 				return 1;
+			break;
+		case BLKIO_THROTL_latency_device:
+			if (pn->val.latency == 0)
+				return 1;
 		}
 		break;
 	default:
@@ -994,6 +1067,9 @@ static void blkio_update_policy_rule(struct blkio_policy_node *oldpn,
 		case BLKIO_THROTL_read_iops_device:
 		case BLKIO_THROTL_write_iops_device:
 			oldpn->val.iops = newpn->val.iops;
+			break;
+		case BLKIO_THROTL_latency_device:
+			oldpn->val.latency = newpn->val.latency;
 		}
 		break;
 	default:
@@ -1008,7 +1084,7 @@ static void blkio_update_policy_rule(struct blkio_policy_node *oldpn,
 static void blkio_update_blkg_policy(struct blkio_cgroup *blkcg,
 		struct blkio_group *blkg, struct blkio_policy_node *pn)
 {
-	unsigned int weight, iops;
+	unsigned int weight, iops, latency;
 	u64 bps;
 
 	switch(pn->plid) {
@@ -1029,6 +1105,10 @@ static void blkio_update_blkg_policy(struct blkio_cgroup *blkcg,
 			iops = pn->val.iops ? pn->val.iops : (-1);
 			blkio_update_group_iops(blkg, iops, pn->fileid);
 			break;
+		case BLKIO_THROTL_latency_device:
+			latency = pn->val.latency ? pn->val.latency : (-1);
+			blkio_update_group_latency(blkg, latency);
+			break;
 		}
 		break;
 	default:
@@ -1140,6 +1220,10 @@ blkio_print_policy_node(struct seq_file *m, struct blkio_policy_node *pn)
 				seq_printf(m, "%u:%u\t%u\n", MAJOR(pn->dev),
 					MINOR(pn->dev), pn->val.iops);
 				break;
+			case BLKIO_THROTL_latency_device:
+				seq_printf(m, "%u:%u\t%u\n", MAJOR(pn->dev),
+					MINOR(pn->dev), pn->val.latency);
+				break;
 			}
 			break;
 		default:
@@ -1189,6 +1273,7 @@ static int blkiocg_file_read(struct cgroup *cgrp, struct cftype *cft,
 		case BLKIO_THROTL_write_bps_device:
 		case BLKIO_THROTL_read_iops_device:
 		case BLKIO_THROTL_write_iops_device:
+		case BLKIO_THROTL_latency_device:
 			blkio_read_policy_node_files(cft, blkcg, m);
 			return 0;
 		default:
@@ -1301,6 +1386,15 @@ static int blkiocg_file_read_map(struct cgroup *cgrp, struct cftype *cft,
 		case BLKIO_THROTL_io_serviced:
 			return blkio_read_blkg_stats(blkcg, cft, cb,
 						BLKIO_STAT_CPU_SERVICED, 1, 1);
+		case BLKIO_THROTL_io_latency:
+			return blkio_read_blkg_stats(blkcg, cft, cb,
+						BLKIO_STAT_LATENCY, 0, 0);
+		case BLKIO_THROTL_io_latency_missed:
+			return blkio_read_blkg_stats(blkcg, cft, cb,
+						BLKIO_STAT_LATENCY_MISSED, 0, 0);
+		case BLKIO_THROTL_io_latency_throttled:
+			return blkio_read_blkg_stats(blkcg, cft, cb,
+					BLKIO_STAT_LATENCY_THROTTLED, 0, 0);
 		default:
 			BUG();
 		}
@@ -1497,6 +1591,32 @@ struct cftype blkio_files[] = {
 				BLKIO_THROTL_io_serviced),
 		.read_map = blkiocg_file_read_map,
 	},
+	{
+		.name = "throttle.latency_device",
+		.private = BLKIOFILE_PRIVATE(BLKIO_POLICY_THROTL,
+				BLKIO_THROTL_latency_device),
+		.read_seq_string = blkiocg_file_read,
+		.write_string = blkiocg_file_write,
+		.max_write_len = 256,
+	},
+	{
+		.name = "throttle.io_latency",
+		.private = BLKIOFILE_PRIVATE(BLKIO_POLICY_THROTL,
+				BLKIO_THROTL_io_latency),
+		.read_map = blkiocg_file_read_map,
+	},
+	{
+		.name = "throttle.io_latency_missed",
+		.private = BLKIOFILE_PRIVATE(BLKIO_POLICY_THROTL,
+				BLKIO_THROTL_io_latency_missed),
+		.read_map = blkiocg_file_read_map,
+	},
+	{
+		.name = "throttle.io_latency_throttled",
+		.private = BLKIOFILE_PRIVATE(BLKIO_POLICY_THROTL,
+				BLKIO_THROTL_io_latency_throttled),
+		.read_map = blkiocg_file_read_map,
+	},
 #endif /* CONFIG_BLK_DEV_THROTTLING */
 
 #ifdef CONFIG_DEBUG_BLK_CGROUP
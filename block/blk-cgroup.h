@@ -23,6 +23,7 @@ enum blkio_policy_id {
 
 /* Max limits for throttle policy */
 #define THROTL_IOPS_MAX		UINT_MAX
+#define THROTL_LATENCY_MAX	(10 * USEC_PER_SEC)
 
 #if defined(CONFIG_BLK_CGROUP) || defined(CONFIG_BLK_CGROUP_MODULE)
 
@@ -43,6 +44,12 @@ enum stat_type {
 	BLKIO_STAT_QUEUED,
 	/* All the single valued stats go below this */
 	BLKIO_STAT_TIME,
+	/* Mean IO latency (in us) over the last latency window */
+	BLKIO_STAT_LATENCY,
+	/* Latency windows in which the group missed its target */
+	BLKIO_STAT_LATENCY_MISSED,
+	/* Latency windows in which the group's queue depth was cut */
+	BLKIO_STAT_LATENCY_THROTTLED,
 #ifdef CONFIG_DEBUG_BLK_CGROUP
 	/* Time not charged to this cgroup */
 	BLKIO_STAT_UNACCOUNTED_TIME,
@@ -109,6 +116,10 @@ enum blkcg_file_name_throtl {
 	BLKIO_THROTL_write_iops_device,
 	BLKIO_THROTL_io_service_bytes,
 	BLKIO_THROTL_io_serviced,
+	BLKIO_THROTL_latency_device,
+	BLKIO_THROTL_io_latency,
+	BLKIO_THROTL_io_latency_missed,
+	BLKIO_THROTL_io_latency_throttled,
 };
 
 struct blkio_cgroup {
@@ -123,6 +134,10 @@ struct blkio_group_stats {
 	/* total disk time and nr sectors dispatched by this group */
 	uint64_t time;
 	uint64_t stat_arr[BLKIO_STAT_QUEUED + 1][BLKIO_STAT_TOTAL];
+	/* latency target monitoring of the throttle policy */
+	uint64_t latency;
+	uint64_t latency_missed;
+	uint64_t latency_throttled;
 #ifdef CONFIG_DEBUG_BLK_CGROUP
 	/* Time not charged to this cgroup */
 	uint64_t unaccounted_time;
@@ -194,6 +209,8 @@ struct blkio_policy_node {
 		 */
 		u64 bps;
 		unsigned int iops;
+		/* target completion latency in microseconds */
+		unsigned int latency;
 	} val;
 };
 
@@ -207,6 +224,8 @@ extern unsigned int blkcg_get_read_iops(struct blkio_cgroup *blkcg,
 				     dev_t dev);
 extern unsigned int blkcg_get_write_iops(struct blkio_cgroup *blkcg,
 				     dev_t dev);
+extern unsigned int blkcg_get_latency(struct blkio_cgroup *blkcg,
+				     dev_t dev);
 
 typedef void (blkio_unlink_group_fn) (void *key, struct blkio_group *blkg);
 
@@ -220,6 +239,8 @@ typedef void (blkio_update_group_read_iops_fn) (void *key,
 			struct blkio_group *blkg, unsigned int read_iops);
 typedef void (blkio_update_group_write_iops_fn) (void *key,
 			struct blkio_group *blkg, unsigned int write_iops);
+typedef void (blkio_update_group_latency_fn) (void *key,
+			struct blkio_group *blkg, unsigned int latency);
 
 struct blkio_policy_ops {
 	blkio_unlink_group_fn *blkio_unlink_group_fn;
@@ -228,6 +249,7 @@ struct blkio_policy_ops {
 	blkio_update_group_write_bps_fn *blkio_update_group_write_bps_fn;
 	blkio_update_group_read_iops_fn *blkio_update_group_read_iops_fn;
 	blkio_update_group_write_iops_fn *blkio_update_group_write_iops_fn;
+	blkio_update_group_latency_fn *blkio_update_group_latency_fn;
 };
 
 struct blkio_policy_type {
@@ -327,6 +349,8 @@ void blkiocg_update_io_add_stats(struct blkio_group *blkg,
 		struct blkio_group *curr_blkg, bool direction, bool sync);
 void blkiocg_update_io_remove_stats(struct blkio_group *blkg,
 					bool direction, bool sync);
+void blkiocg_update_latency_stats(struct blkio_group *blkg, uint64_t latency,
+					bool missed, bool throttled);
 #else
 struct cgroup;
 static inline struct blkio_cgroup *
@@ -360,5 +384,7 @@ static inline void blkiocg_update_io_add_stats(struct blkio_group *blkg,
 		struct blkio_group *curr_blkg, bool direction, bool sync) {}
 static inline void blkiocg_update_io_remove_stats(struct blkio_group *blkg,
 						bool direction, bool sync) {}
+static inline void blkiocg_update_latency_stats(struct blkio_group *blkg,
+		uint64_t latency, bool missed, bool throttled) {}
 #endif
 #endif /* _BLK_CGROUP_H */
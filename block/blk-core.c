@@ -16,6 +16,7 @@
 #include <linux/backing-dev.h>
 #include <linux/bio.h>
 #include <linux/blkdev.h>
+#include <linux/blk-mq.h>
 #include <linux/highmem.h>
 #include <linux/mm.h>
 #include <linux/kernel_stat.h>
@@ -28,6 +29,7 @@
 #include <linux/task_io_accounting_ops.h>
 #include <linux/fault-inject.h>
 #include <linux/list_sort.h>
+#include <linux/hash.h>
 #include <linux/delay.h>
 
 #define CREATE_TRACE_POINTS
@@ -56,7 +58,7 @@ struct kmem_cache *blk_requestq_cachep;
  */
 static struct workqueue_struct *kblockd_workqueue;
 
-static void drive_stat_acct(struct request *rq, int new_io)
+void drive_stat_acct(struct request *rq, int new_io)
 {
 	struct hd_struct *part;
 	int rw = rq_data_dir(rq);
@@ -286,7 +288,16 @@ EXPORT_SYMBOL(blk_stop_queue);
 void blk_sync_queue(struct request_queue *q)
 {
 	del_timer_sync(&q->timeout);
-	cancel_delayed_work_sync(&q->delay_work);
+
+	if (q->mq_ops) {
+		struct blk_mq_hw_ctx *hctx;
+		int i;
+
+		queue_for_each_hw_ctx(q, hctx, i)
+			cancel_delayed_work_sync(&hctx->delayed_work);
+	} else {
+		cancel_delayed_work_sync(&q->delay_work);
+	}
 }
 EXPORT_SYMBOL(blk_sync_queue);
 
@@ -433,7 +444,9 @@ void blk_cleanup_queue(struct request_queue *q)
 	 * be trying to tear down @q before its elevator is initialized, in
 	 * which case we don't want to call into draining.
 	 */
-	if (q->elevator)
+	if (q->mq_ops)
+		blk_mq_drain_queue(q);
+	else if (q->elevator)
 		blk_drain_queue(q, true);
 
 	/* @q won't process any more request, flush async actions */
@@ -494,12 +507,16 @@ struct request_queue *blk_alloc_queue_node(gfp_t gfp_mask, int node_id)
 	q->backing_dev_info.name = "block";
 	q->node = node_id;
 
+	q->plug_stats = alloc_percpu(struct blk_plug_stats);
+	if (!q->plug_stats)
+		goto fail_id;
+
 	err = bdi_init(&q->backing_dev_info);
 	if (err)
-		goto fail_id;
+		goto fail_stats;
 
 	if (blk_throtl_init(q))
-		goto fail_id;
+		goto fail_stats;
 
 	setup_timer(&q->backing_dev_info.laptop_mode_wb_timer,
 		    laptop_mode_timer_fn, (unsigned long) q);
@@ -510,6 +527,7 @@ struct request_queue *blk_alloc_queue_node(gfp_t gfp_mask, int node_id)
 	INIT_LIST_HEAD(&q->flush_queue[1]);
 	INIT_LIST_HEAD(&q->flush_data_in_flight);
 	INIT_DELAYED_WORK(&q->delay_work, blk_delay_work);
+	q->poll_delay = -1;
 
 	kobject_init(&q->kobj, &blk_queue_ktype);
 
@@ -524,6 +542,8 @@ struct request_queue *blk_alloc_queue_node(gfp_t gfp_mask, int node_id)
 
 	return q;
 
+fail_stats:
+	free_percpu(q->plug_stats);
 fail_id:
 	ida_simple_remove(&blk_queue_ida, q->id);
 fail_q:
@@ -614,6 +634,9 @@ blk_init_allocated_queue(struct request_queue *q, request_fn_proc *rfn,
 
 	q->sg_reserved_size = INT_MAX;
 
+	if (wbt_init(q))
+		return NULL;
+
 	/*
 	 * all done
 	 */
@@ -979,6 +1002,9 @@ struct request *blk_get_request(struct request_queue *q, int rw, gfp_t gfp_mask)
 
 	BUG_ON(rw != READ && rw != WRITE);
 
+	if (q->mq_ops)
+		return blk_mq_alloc_request(q, rw, gfp_mask);
+
 	spin_lock_irq(q->queue_lock);
 	if (gfp_mask & __GFP_WAIT)
 		rq = get_request_wait(q, rw, NULL);
@@ -1129,6 +1155,12 @@ void __blk_put_request(struct request_queue *q, struct request *req)
 	if (unlikely(--req->ref_count))
 		return;
 
+	if (q->mq_ops) {
+		blk_mq_free_request(req);
+		return;
+	}
+
+	wbt_done(q, req);
 	elv_completed_request(q, req);
 
 	/* this is a bio leak */
@@ -1155,6 +1187,11 @@ void blk_put_request(struct request *req)
 	unsigned long flags;
 	struct request_queue *q = req->q;
 
+	if (q->mq_ops) {
+		__blk_put_request(q, req);
+		return;
+	}
+
 	spin_lock_irqsave(q->queue_lock, flags);
 	__blk_put_request(q, req);
 	spin_unlock_irqrestore(q->queue_lock, flags);
@@ -1193,8 +1230,8 @@ void blk_add_request_payload(struct request *rq, struct page *page,
 }
 EXPORT_SYMBOL_GPL(blk_add_request_payload);
 
-static bool bio_attempt_back_merge(struct request_queue *q, struct request *req,
-				   struct bio *bio)
+bool bio_attempt_back_merge(struct request_queue *q, struct request *req,
+			    struct bio *bio)
 {
 	const int ff = bio->bi_rw & REQ_FAILFAST_MASK;
 
@@ -1215,8 +1252,8 @@ static bool bio_attempt_back_merge(struct request_queue *q, struct request *req,
 	return true;
 }
 
-static bool bio_attempt_front_merge(struct request_queue *q,
-				    struct request *req, struct bio *bio)
+bool bio_attempt_front_merge(struct request_queue *q, struct request *req,
+			     struct bio *bio)
 {
 	const int ff = bio->bi_rw & REQ_FAILFAST_MASK;
 
@@ -1245,11 +1282,88 @@ static bool bio_attempt_front_merge(struct request_queue *q,
 	return true;
 }
 
+#define blk_plug_hash(sec)	hash_long((sec) >> 3, BLK_PLUG_HASH_BITS)
+
+static void blk_plug_hash_back(struct blk_plug *plug, struct request *rq)
+{
+	sector_t end = blk_rq_pos(rq) + blk_rq_sectors(rq);
+
+	hlist_add_head(&rq->hash, &plug->back_hash[blk_plug_hash(end)]);
+}
+
+/**
+ * blk_plug_add_request - add a request to a plug
+ * @plug: the plug
+ * @rq: request to add
+ * @list: @plug->list or @plug->mq_list
+ *
+ * Queue @rq on @plug and enter it in the merge lookup of the plug.  While
+ * plugged, @rq->hash links it on the plug's back merge hash, as the
+ * request is not on the elevator yet.
+ */
+void blk_plug_add_request(struct blk_plug *plug, struct request *rq,
+			  struct list_head *list)
+{
+	if (plug->last_merge && plug->last_merge->q != rq->q)
+		plug->multiple_queues = 1;
+
+	list_add_tail(&rq->queuelist, list);
+	plug->rq_count++;
+
+	blk_plug_hash_back(plug, rq);
+	plug->front_hint[blk_plug_hash(blk_rq_pos(rq))] = rq;
+	plug->last_merge = rq;
+}
+
+/*
+ * Unhash all requests of @plug before they are handed on to their queues,
+ * and start over with empty lookup tables.
+ */
+static void blk_plug_clear_merge(struct blk_plug *plug)
+{
+	struct hlist_node *pos, *n;
+	int i;
+
+	for (i = 0; i < BLK_PLUG_HASH_SIZE; i++)
+		hlist_for_each_safe(pos, n, &plug->back_hash[i])
+			hlist_del_init(pos);
+
+	memset(plug->front_hint, 0, sizeof(plug->front_hint));
+	plug->last_merge = NULL;
+	plug->rq_count = 0;
+	plug->multiple_queues = 0;
+}
+
+static bool blk_plug_try_merge(struct blk_plug *plug, struct request_queue *q,
+			       struct request *rq, struct bio *bio)
+{
+	int el_ret;
+
+	if (rq->q != q || !blk_rq_merge_ok(rq, bio))
+		return false;
+
+	el_ret = blk_try_merge(rq, bio);
+	if (el_ret == ELEVATOR_BACK_MERGE) {
+		if (!bio_attempt_back_merge(q, rq, bio))
+			return false;
+		hlist_del(&rq->hash);
+		blk_plug_hash_back(plug, rq);
+	} else if (el_ret == ELEVATOR_FRONT_MERGE) {
+		if (!bio_attempt_front_merge(q, rq, bio))
+			return false;
+		plug->front_hint[blk_plug_hash(blk_rq_pos(rq))] = rq;
+	} else
+		return false;
+
+	plug->last_merge = rq;
+	return true;
+}
+
 /**
- * attempt_plug_merge - try to merge with %current's plugged list
+ * blk_attempt_plug_merge - try to merge with %current's plugged list
  * @q: request_queue new bio is being queued at
  * @bio: new bio being queued
- * @request_count: out parameter for number of traversed plugged requests
+ * @request_count: out parameter for number of plugged requests of @q
  *
  * Determine whether @bio being queued on @q can be merged with a request
  * on %current's plugged list.  Returns %true if merge was successful,
@@ -1261,41 +1375,73 @@ static bool bio_attempt_front_merge(struct request_queue *q,
  * added on the elevator at this point.  In addition, we don't have
  * reliable access to the elevator outside queue lock.  Only check basic
  * merging parameters without querying the elevator.
+ *
+ * Candidates are the request last merged into, the requests ending where
+ * @bio starts, and the request last seen starting where @bio ends.  Only
+ * when the plug holds requests for other queues too is the list walked,
+ * to count the requests of @q.
  */
-static bool attempt_plug_merge(struct request_queue *q, struct bio *bio,
-			       unsigned int *request_count)
+bool blk_attempt_plug_merge(struct request_queue *q, struct bio *bio,
+			    unsigned int *request_count)
 {
 	struct blk_plug *plug;
 	struct request *rq;
-	bool ret = false;
+	struct list_head *plug_list;
+	struct hlist_node *pos;
+	sector_t end = bio->bi_sector + bio_sectors(bio);
 
 	plug = current->plug;
 	if (!plug)
-		goto out;
+		return false;
 	*request_count = 0;
 
-	list_for_each_entry_reverse(rq, &plug->list, queuelist) {
-		int el_ret;
+	this_cpu_inc(q->plug_stats->merge_attempts);
 
-		if (rq->q == q)
-			(*request_count)++;
+	rq = plug->last_merge;
+	if (rq && blk_plug_try_merge(plug, q, rq, bio))
+		goto merged;
 
-		if (rq->q != q || !blk_rq_merge_ok(rq, bio))
+	hlist_for_each_entry(rq, pos,
+			     &plug->back_hash[blk_plug_hash(bio->bi_sector)],
+			     hash) {
+		if (rq == plug->last_merge ||
+		    blk_rq_pos(rq) + blk_rq_sectors(rq) != bio->bi_sector)
 			continue;
+		if (blk_plug_try_merge(plug, q, rq, bio))
+			goto merged;
+	}
 
-		el_ret = blk_try_merge(rq, bio);
-		if (el_ret == ELEVATOR_BACK_MERGE) {
-			ret = bio_attempt_back_merge(q, rq, bio);
-			if (ret)
-				break;
-		} else if (el_ret == ELEVATOR_FRONT_MERGE) {
-			ret = bio_attempt_front_merge(q, rq, bio);
-			if (ret)
-				break;
-		}
+	rq = plug->front_hint[blk_plug_hash(end)];
+	if (rq && rq != plug->last_merge && blk_rq_pos(rq) == end &&
+	    blk_plug_try_merge(plug, q, rq, bio))
+		goto merged;
+
+	if (!plug->multiple_queues) {
+		/* all plugged requests are for one queue, but maybe not @q */
+		if (plug->last_merge && plug->last_merge->q == q)
+			*request_count = plug->rq_count;
+		return false;
 	}
-out:
-	return ret;
+
+	if (q->mq_ops)
+		plug_list = &plug->mq_list;
+	else
+		plug_list = &plug->list;
+
+	/* a front merge whose hint was overwritten is still found here */
+	list_for_each_entry_reverse(rq, plug_list, queuelist) {
+		if (rq->q != q)
+			continue;
+
+		(*request_count)++;
+		if (blk_plug_try_merge(plug, q, rq, bio))
+			goto merged;
+	}
+	return false;
+
+merged:
+	this_cpu_inc(q->plug_stats->merges);
+	return true;
 }
 
 void init_request_from_bio(struct request *req, struct bio *bio)
@@ -1310,6 +1456,7 @@ void init_request_from_bio(struct request *req, struct bio *bio)
 	req->__sector = bio->bi_sector;
 	req->ioprio = bio_prio(bio);
 	blk_rq_bio_prep(req->q, req, bio);
+	blk_rq_set_lat_op(req);
 }
 
 void blk_queue_bio(struct request_queue *q, struct bio *bio)
@@ -1319,6 +1466,7 @@ void blk_queue_bio(struct request_queue *q, struct bio *bio)
 	int el_ret, rw_flags, where = ELEVATOR_INSERT_SORT;
 	struct request *req;
 	unsigned int request_count = 0;
+	bool wb_acct;
 
 	/*
 	 * low level driver can indicate that it wants pages above a
@@ -1337,7 +1485,7 @@ void blk_queue_bio(struct request_queue *q, struct bio *bio)
 	 * Check if we can merge with the plugged list before grabbing
 	 * any locks.
 	 */
-	if (attempt_plug_merge(q, bio, &request_count))
+	if (blk_attempt_plug_merge(q, bio, &request_count))
 		return;
 
 	spin_lock_irq(q->queue_lock);
@@ -1360,6 +1508,9 @@ void blk_queue_bio(struct request_queue *q, struct bio *bio)
 	}
 
 get_rq:
+	/* may drop and retake the queue lock to wait for writeback room */
+	wb_acct = wbt_wait(q, bio, q->queue_lock);
+
 	/*
 	 * This sync check and mask will be re-done in init_request_from_bio(),
 	 * but we need to set it earlier to expose the sync flag to the
@@ -1375,6 +1526,8 @@ get_rq:
 	 */
 	req = get_request_wait(q, rw_flags, bio);
 	if (unlikely(!req)) {
+		if (wb_acct)
+			wbt_release(q);
 		bio_endio(bio, -ENODEV);	/* @q is dead */
 		goto out_unlock;
 	}
@@ -1386,6 +1539,8 @@ get_rq:
 	 * often, and the elevators are able to handle it.
 	 */
 	init_request_from_bio(req, bio);
+	if (wb_acct)
+		req->cmd_flags |= REQ_WB_TRACKED;
 
 	if (test_bit(QUEUE_FLAG_SAME_COMP, &q->queue_flags))
 		req->cpu = raw_smp_processor_id();
@@ -1413,7 +1568,7 @@ get_rq:
 				trace_block_plug(q);
 			}
 		}
-		list_add_tail(&req->queuelist, &plug->list);
+		blk_plug_add_request(plug, req, &plug->list);
 		drive_stat_acct(req, 1);
 	} else {
 		spin_lock_irq(q->queue_lock);
@@ -1802,6 +1957,7 @@ int blk_insert_cloned_request(struct request_queue *q, struct request *rq)
 	if (rq->cmd_flags & (REQ_FLUSH|REQ_FUA))
 		where = ELEVATOR_INSERT_FLUSH;
 
+	blk_rq_set_lat_op(rq);
 	add_acct_request(q, rq, where);
 	if (where == ELEVATOR_INSERT_FLUSH)
 		__blk_run_queue(q);
@@ -1855,7 +2011,7 @@ unsigned int blk_rq_err_bytes(const struct request *rq)
 }
 EXPORT_SYMBOL_GPL(blk_rq_err_bytes);
 
-static void blk_account_io_completion(struct request *req, unsigned int bytes)
+void blk_account_io_completion(struct request *req, unsigned int bytes)
 {
 	if (blk_do_io_stat(req)) {
 		const int rw = rq_data_dir(req);
@@ -1869,7 +2025,23 @@ static void blk_account_io_completion(struct request *req, unsigned int bytes)
 	}
 }
 
-static void blk_account_io_done(struct request *req)
+#ifdef CONFIG_BLK_LAT_HIST
+static void blk_account_io_latency(int cpu, struct request *req)
+{
+	u64 start = rq_start_time_ns(req);
+	u64 now = sched_clock();
+
+	/* sched_clock() may be a little off between cpus */
+	disk_lat_hist_add(cpu, req->rq_disk, req->lat_op,
+			  now > start ? now - start : 0);
+}
+#else
+static inline void blk_account_io_latency(int cpu, struct request *req)
+{
+}
+#endif
+
+void blk_account_io_done(struct request *req)
 {
 	/*
 	 * Account IO completion.  flush_rq isn't accounted as a
@@ -1887,6 +2059,7 @@ static void blk_account_io_done(struct request *req)
 
 		part_stat_inc(cpu, part, ios[rw]);
 		part_stat_add(cpu, part, ticks[rw], duration);
+		blk_account_io_latency(cpu, req);
 		part_round_stats(cpu, part);
 		part_dec_in_flight(part, rw);
 
@@ -2041,6 +2214,7 @@ void blk_start_request(struct request *req)
 	if (unlikely(blk_bidi_rq(req)))
 		req->next_rq->resid_len = blk_rq_bytes(req->next_rq);
 
+	wbt_issue(req->q, req);
 	blk_add_timer(req);
 }
 EXPORT_SYMBOL(blk_start_request);
@@ -2725,11 +2899,19 @@ EXPORT_SYMBOL(kblockd_schedule_delayed_work);
 void blk_start_plug(struct blk_plug *plug)
 {
 	struct task_struct *tsk = current;
+	int i;
 
 	plug->magic = PLUG_MAGIC;
 	INIT_LIST_HEAD(&plug->list);
+	INIT_LIST_HEAD(&plug->mq_list);
 	INIT_LIST_HEAD(&plug->cb_list);
 	plug->should_sort = 0;
+	plug->multiple_queues = 0;
+	plug->rq_count = 0;
+	plug->last_merge = NULL;
+	for (i = 0; i < BLK_PLUG_HASH_SIZE; i++)
+		INIT_HLIST_HEAD(&plug->back_hash[i]);
+	memset(plug->front_hint, 0, sizeof(plug->front_hint));
 
 	/*
 	 * If this is a nested plug, don't actually assign it. It will be
@@ -2817,6 +2999,11 @@ void blk_flush_plug_list(struct blk_plug *plug, bool from_schedule)
 	BUG_ON(plug->magic != PLUG_MAGIC);
 
 	flush_plug_callbacks(plug);
+	blk_plug_clear_merge(plug);
+
+	if (!list_empty(&plug->mq_list))
+		blk_mq_flush_plug_list(plug, from_schedule);
+
 	if (list_empty(&plug->list))
 		return;
 
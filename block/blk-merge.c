@@ -423,6 +423,10 @@ static int attempt_merge(struct request_queue *q, struct request *req,
 	 */
 	if (time_after(req->start_time, next->start_time))
 		req->start_time = next->start_time;
+#ifdef CONFIG_BLK_LAT_HIST
+	if (req->start_time_ns > next->start_time_ns)
+		req->start_time_ns = next->start_time_ns;
+#endif
 
 	req->biotail->bi_next = next->bio;
 	req->biotail = next->biotail;
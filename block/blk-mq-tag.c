@@ -0,0 +1,163 @@
+/*
+ * Tag allocation for the multiqueue block layer
+ *
+ * Each hardware queue owns a bitmap with one bit per preallocated
+ * request.  The first nr_reserved_tags bits are kept apart for
+ * requests the driver must be able to issue even when the queue is
+ * full, e.g. for error handling.  Allocation is a lockless search
+ * followed by test_and_set_bit(), starting at a per-cpu hint so that
+ * CPUs sharing a hardware queue tend to work on separate words.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+
+#include <linux/blk-mq.h>
+#include "blk.h"
+#include "blk-mq.h"
+
+struct blk_mq_tags {
+	unsigned int nr_tags;
+	unsigned int nr_reserved_tags;
+
+	unsigned long *bitmap;
+	unsigned int __percpu *alloc_hint;
+
+	wait_queue_head_t wait;
+};
+
+static void blk_mq_tag_range(struct blk_mq_tags *tags, bool reserved,
+			     unsigned int *start, unsigned int *end)
+{
+	if (reserved) {
+		*start = 0;
+		*end = tags->nr_reserved_tags;
+	} else {
+		*start = tags->nr_reserved_tags;
+		*end = tags->nr_tags;
+	}
+}
+
+bool blk_mq_has_free_tags(struct blk_mq_tags *tags, bool reserved)
+{
+	unsigned int start, end;
+
+	blk_mq_tag_range(tags, reserved, &start, &end);
+	return find_next_zero_bit(tags->bitmap, end, start) < end;
+}
+
+unsigned int blk_mq_get_tag(struct blk_mq_tags *tags, bool reserved)
+{
+	unsigned int start, end, last, tag;
+
+	blk_mq_tag_range(tags, reserved, &start, &end);
+	if (WARN_ON_ONCE(start == end))
+		return BLK_MQ_TAG_FAIL;
+
+	last = this_cpu_read(*tags->alloc_hint);
+	if (last < start || last >= end)
+		last = start;
+
+	do {
+		tag = find_next_zero_bit(tags->bitmap, end, last);
+		if (tag >= end) {
+			tag = find_next_zero_bit(tags->bitmap, last, start);
+			if (tag >= last)
+				return BLK_MQ_TAG_FAIL;
+		}
+		/* lost a race for @tag, carry on from there */
+		last = tag;
+	} while (test_and_set_bit_lock(tag, tags->bitmap));
+
+	this_cpu_write(*tags->alloc_hint, tag + 1);
+	return tag;
+}
+
+void blk_mq_put_tag(struct blk_mq_tags *tags, unsigned int tag)
+{
+	BUG_ON(tag >= tags->nr_tags);
+
+	clear_bit_unlock(tag, tags->bitmap);
+	smp_mb__after_clear_bit();
+	if (waitqueue_active(&tags->wait))
+		wake_up(&tags->wait);
+}
+
+/*
+ * Sleep until a tag of the requested kind has been freed.  The caller
+ * must not hold any tag-related state across this, as someone else may
+ * grab the freed tag first.
+ */
+void blk_mq_wait_for_tags(struct blk_mq_tags *tags, bool reserved)
+{
+	DEFINE_WAIT(wait);
+
+	prepare_to_wait(&tags->wait, &wait, TASK_UNINTERRUPTIBLE);
+	if (!blk_mq_has_free_tags(tags, reserved))
+		io_schedule();
+	finish_wait(&tags->wait, &wait);
+}
+
+void blk_mq_tag_busy_iter(struct blk_mq_tags *tags,
+			  void (*fn)(void *data, unsigned int tag), void *data)
+{
+	unsigned int tag;
+
+	for_each_set_bit(tag, tags->bitmap, tags->nr_tags)
+		fn(data, tag);
+}
+
+struct blk_mq_tags *blk_mq_init_tags(unsigned int nr_tags,
+				     unsigned int reserved_tags, int node)
+{
+	struct blk_mq_tags *tags;
+
+	if (nr_tags < reserved_tags + BLK_MQ_TAG_MIN) {
+		pr_err("blk-mq: tag depth too small\n");
+		return NULL;
+	}
+
+	tags = kzalloc_node(sizeof(*tags), GFP_KERNEL, node);
+	if (!tags)
+		return NULL;
+
+	tags->bitmap = kzalloc_node(BITS_TO_LONGS(nr_tags) * sizeof(long),
+				    GFP_KERNEL, node);
+	if (!tags->bitmap)
+		goto err_bitmap;
+
+	tags->alloc_hint = alloc_percpu(unsigned int);
+	if (!tags->alloc_hint)
+		goto err_hint;
+
+	tags->nr_tags = nr_tags;
+	tags->nr_reserved_tags = reserved_tags;
+	init_waitqueue_head(&tags->wait);
+	return tags;
+
+err_hint:
+	kfree(tags->bitmap);
+err_bitmap:
+	kfree(tags);
+	return NULL;
+}
+
+void blk_mq_free_tags(struct blk_mq_tags *tags)
+{
+	free_percpu(tags->alloc_hint);
+	kfree(tags->bitmap);
+	kfree(tags);
+}
+
+ssize_t blk_mq_tag_sysfs_show(struct blk_mq_tags *tags, char *page)
+{
+	if (!tags)
+		return 0;
+
+	return sprintf(page, "nr_tags=%u, reserved_tags=%u, busy=%u\n",
+		       tags->nr_tags, tags->nr_reserved_tags,
+		       bitmap_weight(tags->bitmap, tags->nr_tags));
+}
@@ -0,0 +1,1579 @@
+/*
+ * Block multiqueue core code
+ *
+ * Requests are queued on per-cpu software queues (struct blk_mq_ctx) and
+ * dispatched from per hardware queue contexts (struct blk_mq_hw_ctx), each
+ * of which serves a fixed set of CPUs.  Requests are preallocated per
+ * hardware queue and looked up by their tag, so that neither submission
+ * nor completion has to touch a lock shared by the whole queue.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/backing-dev.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/mm.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include <linux/smp.h>
+#include <linux/list_sort.h>
+#include <linux/cpu.h>
+#include <linux/cache.h>
+#include <linux/sched.h>
+#include <linux/delay.h>
+#include <linux/mempool.h>
+#include <linux/completion.h>
+
+#include <trace/events/block.h>
+
+#include <linux/blk-mq.h>
+#include "blk.h"
+#include "blk-mq.h"
+
+static DEFINE_MUTEX(all_q_mutex);
+static LIST_HEAD(all_q_list);
+
+/*
+ * Flushes around a write with REQ_FLUSH, and FUA emulation for devices
+ * that have a write back cache but no FUA support: the data is written
+ * without FUA and the cache flushed once it has completed, before the bio
+ * is ended.
+ */
+struct blk_mq_fua {
+	struct request_queue	*q;
+	bio_end_io_t		*end_io;
+	void			*private;
+	struct bio		*bio;
+	struct request		*rq;		/* held back for the preflush */
+	unsigned int		flags;		/* BLK_MQ_FUA_* still to do */
+	int			error;
+	struct list_head	list;		/* on q->mq_flush_* */
+};
+
+#define BLK_MQ_FUA_PREFLUSH	(1U << 0)
+#define BLK_MQ_FUA_POSTFLUSH	(1U << 1)
+
+#define BLK_MQ_FUA_POOL		16
+static mempool_t *blk_mq_fua_pool;
+
+/*
+ * Check if any of the ctx's have pending work in this hardware queue
+ */
+static bool blk_mq_hctx_has_pending(struct blk_mq_hw_ctx *hctx)
+{
+	unsigned int i;
+
+	for (i = 0; i < hctx->nr_ctx_map; i++)
+		if (hctx->ctx_map[i])
+			return true;
+
+	return !list_empty_careful(&hctx->dispatch);
+}
+
+/*
+ * Mark this ctx as having pending work in this hardware queue
+ */
+static void blk_mq_hctx_mark_pending(struct blk_mq_hw_ctx *hctx,
+				     struct blk_mq_ctx *ctx)
+{
+	if (!test_bit(ctx->index_hw, hctx->ctx_map))
+		set_bit(ctx->index_hw, hctx->ctx_map);
+}
+
+/*
+ * Every allocated request holds a usage count on its queue, so that
+ * blk_cleanup_queue() can wait for them to go away.  The count is per-cpu
+ * and only summed up when draining; requests are commonly freed from
+ * interrupt context on a different CPU than they were allocated on.
+ */
+static int blk_mq_queue_enter(struct request_queue *q)
+{
+	this_cpu_inc(*q->mq_usage);
+	smp_mb();
+
+	/* pairs with the barrier in blk_mq_drain_queue() */
+	if (unlikely(blk_queue_dead(q))) {
+		this_cpu_dec(*q->mq_usage);
+		return -ENODEV;
+	}
+
+	return 0;
+}
+
+static void blk_mq_queue_exit(struct request_queue *q)
+{
+	this_cpu_dec(*q->mq_usage);
+}
+
+static long blk_mq_queue_usage(struct request_queue *q)
+{
+	long sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += *per_cpu_ptr(q->mq_usage, cpu);
+
+	return sum;
+}
+
+/*
+ * Wait for all requests that were allocated before @q was marked dead.
+ * Called from blk_cleanup_queue().
+ */
+void blk_mq_drain_queue(struct request_queue *q)
+{
+	smp_mb();
+
+	while (true) {
+		blk_mq_run_queues(q, false);
+
+		if (!blk_mq_queue_usage(q))
+			break;
+
+		msleep(10);
+	}
+}
+
+bool blk_mq_can_queue(struct blk_mq_hw_ctx *hctx)
+{
+	return blk_mq_has_free_tags(hctx->tags, false);
+}
+EXPORT_SYMBOL(blk_mq_can_queue);
+
+static struct request *__blk_mq_alloc_request(struct blk_mq_hw_ctx *hctx,
+					      bool reserved)
+{
+	struct request *rq;
+	unsigned int tag;
+
+	tag = blk_mq_get_tag(hctx->tags, reserved);
+	if (tag == BLK_MQ_TAG_FAIL)
+		return NULL;
+
+	rq = hctx->rqs[tag];
+	blk_rq_init(hctx->queue, rq);
+	rq->tag = tag;
+
+	return rq;
+}
+
+static void blk_mq_rq_ctx_init(struct request_queue *q, struct blk_mq_ctx *ctx,
+			       struct request *rq, unsigned int rw_flags)
+{
+	if (blk_queue_io_stat(q))
+		rw_flags |= REQ_IO_STAT;
+
+	rq->mq_ctx = ctx;
+	rq->cmd_flags = rw_flags;
+	ctx->rq_dispatched[rw_is_sync(rw_flags)]++;
+}
+
+/*
+ * Returns with the ctx of the request pinned on success, the caller has
+ * to drop it with blk_mq_put_ctx().
+ */
+static struct request *blk_mq_alloc_request_pinned(struct request_queue *q,
+						   int rw, gfp_t gfp,
+						   bool reserved)
+{
+	struct blk_mq_hw_ctx *hctx;
+	struct blk_mq_ctx *ctx;
+	struct request *rq;
+
+	do {
+		ctx = blk_mq_get_ctx(q);
+		hctx = q->mq_ops->map_queue(q, ctx->cpu);
+
+		rq = __blk_mq_alloc_request(hctx, reserved);
+		if (rq) {
+			blk_mq_rq_ctx_init(q, ctx, rq, rw);
+			break;
+		}
+
+		blk_mq_put_ctx(ctx);
+		if (!(gfp & __GFP_WAIT))
+			break;
+
+		/* make sure what is queued goes out before we wait for it */
+		blk_mq_run_hw_queue(hctx, false);
+		blk_mq_wait_for_tags(hctx->tags, reserved);
+	} while (1);
+
+	return rq;
+}
+
+static struct request *__blk_mq_alloc_request_queue(struct request_queue *q,
+						    int rw, gfp_t gfp,
+						    bool reserved)
+{
+	struct request *rq;
+
+	if (blk_mq_queue_enter(q))
+		return NULL;
+
+	rq = blk_mq_alloc_request_pinned(q, rw, gfp, reserved);
+	if (!rq) {
+		blk_mq_queue_exit(q);
+		return NULL;
+	}
+
+	blk_mq_put_ctx(rq->mq_ctx);
+	return rq;
+}
+
+struct request *blk_mq_alloc_request(struct request_queue *q, int rw,
+				     gfp_t gfp)
+{
+	return __blk_mq_alloc_request_queue(q, rw, gfp, false);
+}
+EXPORT_SYMBOL(blk_mq_alloc_request);
+
+struct request *blk_mq_alloc_reserved_request(struct request_queue *q, int rw,
+					      gfp_t gfp)
+{
+	return __blk_mq_alloc_request_queue(q, rw, gfp, true);
+}
+EXPORT_SYMBOL(blk_mq_alloc_reserved_request);
+
+static void __blk_mq_free_request(struct blk_mq_hw_ctx *hctx,
+				  struct blk_mq_ctx *ctx, struct request *rq)
+{
+	const unsigned int tag = rq->tag;
+	struct request_queue *q = rq->q;
+
+	clear_bit(REQ_ATOM_STARTED, &rq->atomic_flags);
+	blk_mq_put_tag(hctx->tags, tag);
+	blk_mq_queue_exit(q);
+}
+
+void blk_mq_free_request(struct request *rq)
+{
+	struct blk_mq_ctx *ctx = rq->mq_ctx;
+	struct blk_mq_hw_ctx *hctx;
+	struct request_queue *q = rq->q;
+
+	ctx->rq_completed[rq_is_sync(rq)]++;
+	wbt_done(q, rq);
+
+	/* the tag belongs to the hardware queue of the allocating ctx */
+	hctx = q->mq_ops->map_queue(q, ctx->cpu);
+	__blk_mq_free_request(hctx, ctx, rq);
+}
+EXPORT_SYMBOL(blk_mq_free_request);
+
+struct request *blk_mq_tag_to_rq(struct blk_mq_hw_ctx *hctx, unsigned int tag)
+{
+	return hctx->rqs[tag];
+}
+EXPORT_SYMBOL(blk_mq_tag_to_rq);
+
+static void blk_mq_bio_endio(struct request *rq, struct bio *bio, int error)
+{
+	if (error)
+		clear_bit(BIO_UPTODATE, &bio->bi_flags);
+	else if (!test_bit(BIO_UPTODATE, &bio->bi_flags))
+		error = -EIO;
+
+	if (unlikely(rq->cmd_flags & REQ_QUIET))
+		set_bit(BIO_QUIET, &bio->bi_flags);
+
+	bio_endio(bio, error);
+}
+
+static void __blk_mq_end_io(struct request *rq, int error)
+{
+	struct bio *bio = rq->bio;
+	unsigned int bytes = 0;
+
+	trace_block_rq_complete(rq->q, rq);
+
+	while (bio) {
+		struct bio *next = bio->bi_next;
+
+		bio->bi_next = NULL;
+		bytes += bio->bi_size;
+		blk_mq_bio_endio(rq, bio, error);
+		bio = next;
+	}
+	rq->bio = rq->biotail = NULL;
+
+	blk_account_io_completion(rq, bytes);
+	blk_account_io_done(rq);
+
+	if (rq->end_io)
+		rq->end_io(rq, error);
+	else
+		blk_mq_free_request(rq);
+}
+
+static void blk_mq_end_io_remote(void *data)
+{
+	struct request *rq = data;
+
+	__blk_mq_end_io(rq, rq->errors);
+}
+
+/*
+ * Complete @rq on the CPU that submitted it if the queue asks for it and
+ * the completing CPU doesn't share a cache with the submitter.
+ */
+static void __blk_mq_complete_request(struct request *rq, int error)
+{
+	struct request_queue *q = rq->q;
+	struct blk_mq_ctx *ctx = rq->mq_ctx;
+	bool shared = false;
+	int cpu;
+
+	if (!test_bit(QUEUE_FLAG_SAME_COMP, &q->queue_flags)) {
+		__blk_mq_end_io(rq, error);
+		return;
+	}
+
+	cpu = get_cpu();
+	if (!test_bit(QUEUE_FLAG_SAME_FORCE, &q->queue_flags))
+		shared = cpus_share_cache(cpu, ctx->cpu);
+
+	if (cpu != ctx->cpu && !shared && cpu_online(ctx->cpu)) {
+		rq->errors = error;
+		rq->csd.func = blk_mq_end_io_remote;
+		rq->csd.info = rq;
+		rq->csd.flags = 0;
+		__smp_call_function_single(ctx->cpu, &rq->csd, 0);
+	} else {
+		__blk_mq_end_io(rq, error);
+	}
+	put_cpu();
+}
+
+/**
+ * blk_mq_end_io - end I/O on a request
+ * @rq:		the request being processed
+ * @error:	%0 for success, < %0 for error
+ *
+ * Description:
+ *     Ends all I/O on a request.  May be called from any context,
+ *     typically the driver's interrupt handler.  If the request has
+ *     already timed out, the timeout handler owns it and this is a nop.
+ */
+void blk_mq_end_io(struct request *rq, int error)
+{
+	if (!blk_mark_rq_complete(rq))
+		__blk_mq_complete_request(rq, error);
+}
+EXPORT_SYMBOL(blk_mq_end_io);
+
+static void blk_mq_start_request(struct request *rq)
+{
+	struct request_queue *q = rq->q;
+
+	trace_block_rq_issue(q, rq);
+	wbt_issue(q, rq);
+
+	/*
+	 * The deadline must be visible before the started bit, which is what
+	 * the timeout handler goes by.
+	 */
+	rq->deadline = jiffies + q->rq_timeout;
+	smp_mb__before_clear_bit();
+	set_bit(REQ_ATOM_STARTED, &rq->atomic_flags);
+
+	if (q->rq_timeout && !timer_pending(&q->timeout))
+		mod_timer(&q->timeout, round_jiffies_up(rq->deadline));
+}
+
+static void blk_mq_requeue_request(struct request *rq)
+{
+	struct request_queue *q = rq->q;
+
+	trace_block_rq_requeue(q, rq);
+	clear_bit(REQ_ATOM_STARTED, &rq->atomic_flags);
+}
+
+struct blk_mq_timeout_data {
+	struct blk_mq_hw_ctx *hctx;
+	unsigned long *next;
+	unsigned int *next_set;
+};
+
+static enum blk_eh_timer_return blk_mq_rq_timed_out(struct request *rq)
+{
+	struct blk_mq_ops *ops = rq->q->mq_ops;
+	enum blk_eh_timer_return ret = BLK_EH_RESET_TIMER;
+
+	if (ops->timeout)
+		ret = ops->timeout(rq);
+
+	switch (ret) {
+	case BLK_EH_HANDLED:
+		__blk_mq_complete_request(rq, rq->errors);
+		break;
+	case BLK_EH_RESET_TIMER:
+		rq->deadline = jiffies + rq->q->rq_timeout;
+		blk_clear_rq_complete(rq);
+		break;
+	case BLK_EH_NOT_HANDLED:
+		break;
+	default:
+		printk(KERN_ERR "block: bad eh return: %d\n", ret);
+		break;
+	}
+	return ret;
+}
+
+static void blk_mq_timeout_check(void *__data, unsigned int tag)
+{
+	struct blk_mq_timeout_data *data = __data;
+	struct request *rq = data->hctx->rqs[tag];
+
+	if (!test_bit(REQ_ATOM_STARTED, &rq->atomic_flags))
+		return;
+
+	if (time_after_eq(jiffies, rq->deadline)) {
+		if (blk_mark_rq_complete(rq) ||
+		    blk_mq_rq_timed_out(rq) != BLK_EH_RESET_TIMER)
+			return;
+		/* the timer was reset, rearm it for the new deadline */
+	}
+
+	if (!*data->next_set || time_after(*data->next, rq->deadline)) {
+		*data->next = rq->deadline;
+		*data->next_set = 1;
+	}
+}
+
+static void blk_mq_rq_timer(unsigned long data)
+{
+	struct request_queue *q = (struct request_queue *) data;
+	struct blk_mq_hw_ctx *hctx;
+	unsigned long next = 0;
+	unsigned int next_set = 0;
+	int i;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		struct blk_mq_timeout_data data = {
+			.hctx		= hctx,
+			.next		= &next,
+			.next_set	= &next_set,
+		};
+
+		blk_mq_tag_busy_iter(hctx->tags, blk_mq_timeout_check, &data);
+	}
+
+	if (next_set)
+		mod_timer(&q->timeout, round_jiffies_up(next));
+}
+
+/*
+ * Run this hardware queue, pulling any software queues mapped to it in.
+ * Note that this function currently has various problems around ordering
+ * of IO. In particular, we'd like FIFO behaviour on handling existing
+ * items on the hctx->dispatch list. Ignore that for now.
+ */
+static void __blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx)
+{
+	struct request_queue *q = hctx->queue;
+	struct blk_mq_ctx *ctx;
+	struct request *rq;
+	LIST_HEAD(rq_list);
+	int bit, queued;
+
+	if (unlikely(test_bit(BLK_MQ_S_STOPPED, &hctx->state)))
+		return;
+
+	hctx->run++;
+
+	/*
+	 * Touch any software queue that has pending entries.
+	 */
+	for_each_set_bit(bit, hctx->ctx_map, hctx->nr_ctx) {
+		clear_bit(bit, hctx->ctx_map);
+		ctx = hctx->ctxs[bit];
+		BUG_ON(bit != ctx->index_hw);
+
+		spin_lock(&ctx->lock);
+		list_splice_tail_init(&ctx->rq_list, &rq_list);
+		spin_unlock(&ctx->lock);
+	}
+
+	/*
+	 * If we have previous entries on our dispatch list, grab them
+	 * and stuff them at the front for more fair dispatch.
+	 */
+	if (!list_empty_careful(&hctx->dispatch)) {
+		spin_lock(&hctx->lock);
+		if (!list_empty(&hctx->dispatch))
+			list_splice_init(&hctx->dispatch, &rq_list);
+		spin_unlock(&hctx->lock);
+	}
+
+	/*
+	 * Now process all the entries, sending them to the driver.
+	 */
+	queued = 0;
+	while (!list_empty(&rq_list)) {
+		int ret;
+
+		rq = list_first_entry(&rq_list, struct request, queuelist);
+		list_del_init(&rq->queuelist);
+
+		blk_mq_start_request(rq);
+
+		ret = q->mq_ops->queue_rq(hctx, rq);
+		switch (ret) {
+		case BLK_MQ_RQ_QUEUE_OK:
+			queued++;
+			continue;
+		case BLK_MQ_RQ_QUEUE_BUSY:
+			/*
+			 * The driver is out of resources, keep the rest
+			 * for the next run.  It is expected to stop the
+			 * queue and restart it when it can take more.
+			 */
+			list_add(&rq->queuelist, &rq_list);
+			blk_mq_requeue_request(rq);
+			break;
+		default:
+			pr_err("blk-mq: bad return on queue: %d\n", ret);
+			/* fall through */
+		case BLK_MQ_RQ_QUEUE_ERROR:
+			rq->errors = -EIO;
+			blk_mq_end_io(rq, rq->errors);
+			break;
+		}
+
+		if (ret == BLK_MQ_RQ_QUEUE_BUSY)
+			break;
+	}
+
+	if (!queued)
+		hctx->dispatched[0]++;
+	else if (queued < (1 << (BLK_MQ_MAX_DISPATCH_ORDER - 1)))
+		hctx->dispatched[ilog2(queued) + 1]++;
+
+	/*
+	 * Any items that need requeuing? Stuff them into hctx->dispatch,
+	 * that is where we will continue on next queue run.
+	 */
+	if (!list_empty(&rq_list)) {
+		spin_lock(&hctx->lock);
+		list_splice(&rq_list, &hctx->dispatch);
+		spin_unlock(&hctx->lock);
+	}
+}
+
+/**
+ * blk_mq_run_hw_queue - dispatch the requests pending on a hardware queue
+ * @hctx:	the hardware queue
+ * @async:	defer to kblockd rather than dispatching from this context
+ *
+ * Dispatching inline is only done from a CPU that maps to @hctx, so
+ * that the software queues it drains are cache hot.
+ */
+void blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx, bool async)
+{
+	if (unlikely(test_bit(BLK_MQ_S_STOPPED, &hctx->state)))
+		return;
+
+	if (!async && cpumask_test_cpu(raw_smp_processor_id(), hctx->cpumask))
+		__blk_mq_run_hw_queue(hctx);
+	else
+		kblockd_schedule_delayed_work(hctx->queue, &hctx->delayed_work,
+					      0);
+}
+EXPORT_SYMBOL(blk_mq_run_hw_queue);
+
+void blk_mq_run_queues(struct request_queue *q, bool async)
+{
+	struct blk_mq_hw_ctx *hctx;
+	int i;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (!blk_mq_hctx_has_pending(hctx) ||
+		    test_bit(BLK_MQ_S_STOPPED, &hctx->state))
+			continue;
+
+		blk_mq_run_hw_queue(hctx, async);
+	}
+}
+EXPORT_SYMBOL(blk_mq_run_queues);
+
+void blk_mq_stop_hw_queue(struct blk_mq_hw_ctx *hctx)
+{
+	cancel_delayed_work(&hctx->delayed_work);
+	set_bit(BLK_MQ_S_STOPPED, &hctx->state);
+}
+EXPORT_SYMBOL(blk_mq_stop_hw_queue);
+
+void blk_mq_stop_hw_queues(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	int i;
+
+	queue_for_each_hw_ctx(q, hctx, i)
+		blk_mq_stop_hw_queue(hctx);
+}
+EXPORT_SYMBOL(blk_mq_stop_hw_queues);
+
+void blk_mq_start_hw_queue(struct blk_mq_hw_ctx *hctx)
+{
+	clear_bit(BLK_MQ_S_STOPPED, &hctx->state);
+	__blk_mq_run_hw_queue(hctx);
+}
+EXPORT_SYMBOL(blk_mq_start_hw_queue);
+
+/*
+ * Restart stopped hardware queues.  Safe to call from the driver's
+ * completion interrupt, the queues are run from kblockd.
+ */
+void blk_mq_start_stopped_hw_queues(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	int i;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (!test_bit(BLK_MQ_S_STOPPED, &hctx->state))
+			continue;
+
+		clear_bit(BLK_MQ_S_STOPPED, &hctx->state);
+		blk_mq_run_hw_queue(hctx, true);
+	}
+}
+EXPORT_SYMBOL(blk_mq_start_stopped_hw_queues);
+
+static void blk_mq_work_fn(struct work_struct *work)
+{
+	struct blk_mq_hw_ctx *hctx;
+
+	hctx = container_of(work, struct blk_mq_hw_ctx, delayed_work.work);
+	__blk_mq_run_hw_queue(hctx);
+}
+
+static void __blk_mq_insert_request(struct blk_mq_hw_ctx *hctx,
+				    struct request *rq, bool at_head)
+{
+	struct blk_mq_ctx *ctx = rq->mq_ctx;
+
+	trace_block_rq_insert(hctx->queue, rq);
+
+	if (at_head)
+		list_add(&rq->queuelist, &ctx->rq_list);
+	else
+		list_add_tail(&rq->queuelist, &ctx->rq_list);
+	blk_mq_hctx_mark_pending(hctx, ctx);
+}
+
+/**
+ * blk_mq_insert_request - queue a prepared request for dispatch
+ * @q:		the queue @rq was allocated from
+ * @rq:		the request
+ * @at_head:	queue at the front rather than the back of its software queue
+ * @run_queue:	run the hardware queue once @rq is queued
+ *
+ * Used for requests that don't come in through blk_mq_make_request(),
+ * e.g. those executed with blk_execute_rq().
+ */
+void blk_mq_insert_request(struct request_queue *q, struct request *rq,
+			   bool at_head, bool run_queue)
+{
+	struct blk_mq_ctx *ctx = rq->mq_ctx;
+	struct blk_mq_hw_ctx *hctx;
+
+	/*
+	 * The request stays on the software queue it was allocated from,
+	 * even if that CPU went offline since: its tag belongs to that
+	 * queue's hardware queue, which can be run from any CPU.
+	 */
+	hctx = q->mq_ops->map_queue(q, ctx->cpu);
+
+	spin_lock(&ctx->lock);
+	__blk_mq_insert_request(hctx, rq, at_head);
+	spin_unlock(&ctx->lock);
+
+	if (run_queue)
+		blk_mq_run_hw_queue(hctx, false);
+}
+EXPORT_SYMBOL(blk_mq_insert_request);
+
+static void blk_mq_insert_requests(struct request_queue *q,
+				   struct blk_mq_ctx *ctx,
+				   struct list_head *list,
+				   int depth,
+				   bool from_schedule)
+{
+	struct blk_mq_hw_ctx *hctx;
+
+	trace_block_unplug(q, depth, !from_schedule);
+
+	hctx = q->mq_ops->map_queue(q, ctx->cpu);
+
+	spin_lock(&ctx->lock);
+	while (!list_empty(list)) {
+		struct request *rq;
+
+		rq = list_first_entry(list, struct request, queuelist);
+		list_del_init(&rq->queuelist);
+		__blk_mq_insert_request(hctx, rq, false);
+	}
+	spin_unlock(&ctx->lock);
+
+	blk_mq_run_hw_queue(hctx, from_schedule);
+}
+
+static int plug_ctx_cmp(void *priv, struct list_head *a, struct list_head *b)
+{
+	struct request *rqa = container_of(a, struct request, queuelist);
+	struct request *rqb = container_of(b, struct request, queuelist);
+
+	return !(rqa->mq_ctx < rqb->mq_ctx ||
+		 (rqa->mq_ctx == rqb->mq_ctx &&
+		  blk_rq_pos(rqa) < blk_rq_pos(rqb)));
+}
+
+void blk_mq_flush_plug_list(struct blk_plug *plug, bool from_schedule)
+{
+	struct blk_mq_ctx *this_ctx;
+	struct request_queue *this_q;
+	struct request *rq;
+	LIST_HEAD(list);
+	LIST_HEAD(ctx_list);
+	unsigned int depth;
+
+	list_splice_init(&plug->mq_list, &list);
+
+	list_sort(NULL, &list, plug_ctx_cmp);
+
+	this_q = NULL;
+	this_ctx = NULL;
+	depth = 0;
+
+	while (!list_empty(&list)) {
+		rq = list_entry_rq(list.next);
+		list_del_init(&rq->queuelist);
+		BUG_ON(!rq->q);
+		if (rq->mq_ctx != this_ctx) {
+			if (this_ctx) {
+				blk_mq_insert_requests(this_q, this_ctx,
+						       &ctx_list, depth,
+						       from_schedule);
+			}
+
+			this_ctx = rq->mq_ctx;
+			this_q = rq->q;
+			depth = 0;
+		}
+
+		depth++;
+		list_add_tail(&rq->queuelist, &ctx_list);
+	}
+
+	/*
+	 * If 'this_ctx' is set, we know we have entries to complete
+	 * on 'ctx_list'. Do those.
+	 */
+	if (this_ctx) {
+		blk_mq_insert_requests(this_q, this_ctx, &ctx_list, depth,
+				       from_schedule);
+	}
+}
+
+static void blk_mq_bio_to_request(struct request *rq, struct bio *bio)
+{
+	init_request_from_bio(rq, bio);
+	drive_stat_acct(rq, 1);
+}
+
+/*
+ * Merge @bio into a request still waiting on the software queue.  Only
+ * the most recently queued requests are looked at, the queue is meant
+ * to be short.
+ */
+static bool blk_mq_attempt_merge(struct request_queue *q,
+				 struct blk_mq_ctx *ctx, struct bio *bio)
+{
+	struct request *rq;
+	int checked = 8;
+
+	list_for_each_entry_reverse(rq, &ctx->rq_list, queuelist) {
+		int el_ret;
+
+		if (!checked--)
+			break;
+
+		if (!blk_rq_merge_ok(rq, bio))
+			continue;
+
+		el_ret = blk_try_merge(rq, bio);
+		if (el_ret == ELEVATOR_BACK_MERGE) {
+			if (bio_attempt_back_merge(q, rq, bio)) {
+				ctx->rq_merged++;
+				return true;
+			}
+			break;
+		} else if (el_ret == ELEVATOR_FRONT_MERGE) {
+			if (bio_attempt_front_merge(q, rq, bio)) {
+				ctx->rq_merged++;
+				return true;
+			}
+			break;
+		}
+	}
+
+	return false;
+}
+
+static void blk_mq_fua_done(struct blk_mq_fua *fua, int error)
+{
+	struct request_queue *q = fua->q;
+	struct bio *bio = fua->bio;
+
+	bio->bi_end_io = fua->end_io;
+	bio->bi_private = fua->private;
+	mempool_free(fua, blk_mq_fua_pool);
+
+	bio_endio(bio, error);
+	blk_mq_queue_exit(q);
+}
+
+/*
+ * Queue @fua for the next cache flush.  Only one flush is in flight per
+ * queue, on the tag each hardware queue keeps for it, and it serves all
+ * the writes that were waiting when it was issued.  May be called from
+ * any context.
+ */
+static void blk_mq_fua_queue_flush(struct request_queue *q,
+				   struct blk_mq_fua *fua)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&q->mq_flush_lock, flags);
+	list_add_tail(&fua->list, &q->mq_flush_pending);
+	spin_unlock_irqrestore(&q->mq_flush_lock, flags);
+
+	kblockd_schedule_work(q, &q->mq_flush_work);
+}
+
+static void blk_mq_flush_rq_end_io(struct request *rq, int error)
+{
+	struct request_queue *q = rq->q;
+	struct blk_mq_fua *fua, *next;
+	unsigned long flags;
+	LIST_HEAD(done);
+	bool ready = false;
+
+	rq->mq_ctx->rq_completed[rq_is_sync(rq)]++;
+	/* the tag stays ours, but the timeout handler must leave it be */
+	clear_bit(REQ_ATOM_STARTED, &rq->atomic_flags);
+
+	spin_lock_irqsave(&q->mq_flush_lock, flags);
+	list_splice_init(&q->mq_flush_running, &done);
+	q->mq_flush_busy = false;
+
+	list_for_each_entry_safe(fua, next, &done, list) {
+		if (!(fua->flags & BLK_MQ_FUA_PREFLUSH))
+			continue;
+		/* the data goes next, from process context */
+		fua->flags &= ~BLK_MQ_FUA_PREFLUSH;
+		fua->error = error;
+		list_move_tail(&fua->list, &q->mq_flush_ready);
+		ready = true;
+	}
+	if (!list_empty(&q->mq_flush_pending))
+		ready = true;
+	spin_unlock_irqrestore(&q->mq_flush_lock, flags);
+
+	list_for_each_entry_safe(fua, next, &done, list) {
+		list_del(&fua->list);
+		blk_mq_fua_done(fua, error);
+	}
+
+	if (ready)
+		kblockd_schedule_work(q, &q->mq_flush_work);
+}
+
+static void blk_mq_start_flush(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	struct blk_mq_ctx *ctx;
+	struct request *rq;
+
+	ctx = blk_mq_get_ctx(q);
+	hctx = q->mq_ops->map_queue(q, ctx->cpu);
+
+	rq = hctx->rqs[BLK_MQ_FLUSH_TAG];
+	blk_rq_init(q, rq);
+	rq->tag = BLK_MQ_FLUSH_TAG;
+	blk_mq_rq_ctx_init(q, ctx, rq, WRITE_FLUSH);
+	rq->cmd_type = REQ_TYPE_FS;
+	rq->end_io = blk_mq_flush_rq_end_io;
+	blk_mq_put_ctx(ctx);
+
+	blk_mq_insert_request(q, rq, false, true);
+}
+
+/*
+ * Queue the data of writes whose preflush is done, and start a flush for
+ * the writes waiting for one.  Nothing here waits for a tag or for IO.
+ */
+static void blk_mq_flush_work(struct work_struct *work)
+{
+	struct request_queue *q = container_of(work, struct request_queue,
+					       mq_flush_work);
+	struct blk_mq_fua *fua, *next;
+	LIST_HEAD(ready);
+	bool start = false;
+
+	spin_lock_irq(&q->mq_flush_lock);
+	list_splice_init(&q->mq_flush_ready, &ready);
+	if (!q->mq_flush_busy && !list_empty(&q->mq_flush_pending)) {
+		list_splice_init(&q->mq_flush_pending, &q->mq_flush_running);
+		q->mq_flush_busy = true;
+		start = true;
+	}
+	spin_unlock_irq(&q->mq_flush_lock);
+
+	list_for_each_entry_safe(fua, next, &ready, list) {
+		struct request *rq = fua->rq;
+
+		list_del(&fua->list);
+		/* on error, the request's end_io ends @fua as well */
+		if (fua->error)
+			blk_mq_end_io(rq, fua->error);
+		else
+			blk_mq_insert_request(q, rq, false, true);
+	}
+
+	if (start)
+		blk_mq_start_flush(q);
+}
+
+static void blk_mq_fua_end_io(struct bio *bio, int error)
+{
+	struct blk_mq_fua *fua = bio->bi_private;
+
+	if (error || !(fua->flags & BLK_MQ_FUA_POSTFLUSH))
+		blk_mq_fua_done(fua, error);
+	else
+		blk_mq_fua_queue_flush(fua->q, fua);
+}
+
+/*
+ * Devices with a write back cache set REQ_FLUSH, and possibly REQ_FUA, in
+ * q->flush_flags.  An empty flush is passed on to the driver as is.  For
+ * a flush with data the cache is flushed before the data is queued, and
+ * FUA is emulated with a flush once the data has completed if the device
+ * doesn't support it.  Returns the state to sequence those flushes with,
+ * or %NULL if there are none.
+ */
+static struct blk_mq_fua *blk_mq_flush_fua(struct request_queue *q,
+					   struct bio *bio)
+{
+	struct blk_mq_fua *fua;
+	unsigned int flags = 0;
+
+	if (!bio->bi_size) {
+		/* an empty FUA write is just a cache flush */
+		bio->bi_rw &= ~REQ_FUA;
+		bio->bi_rw |= REQ_FLUSH;
+		return NULL;
+	}
+
+	if (bio->bi_rw & REQ_FLUSH)
+		flags |= BLK_MQ_FUA_PREFLUSH;
+	if ((bio->bi_rw & REQ_FUA) && !(q->flush_flags & REQ_FUA))
+		flags |= BLK_MQ_FUA_POSTFLUSH;
+	if (!flags)
+		return NULL;
+
+	bio->bi_rw &= ~REQ_FLUSH;
+	if (flags & BLK_MQ_FUA_POSTFLUSH)
+		bio->bi_rw &= ~REQ_FUA;
+
+	fua = mempool_alloc(blk_mq_fua_pool, GFP_NOIO);
+	fua->q = q;
+	fua->bio = bio;
+	fua->rq = NULL;
+	fua->end_io = bio->bi_end_io;
+	fua->private = bio->bi_private;
+	fua->flags = flags;
+	fua->error = 0;
+
+	/* the flushes need @q, hold it until blk_mq_fua_done() */
+	this_cpu_inc(*q->mq_usage);
+
+	bio->bi_end_io = blk_mq_fua_end_io;
+	bio->bi_private = fua;
+	return fua;
+}
+
+static void blk_mq_make_request(struct request_queue *q, struct bio *bio)
+{
+	const int is_sync = rw_is_sync(bio->bi_rw);
+	const int is_flush_fua = bio->bi_rw & (REQ_FLUSH | REQ_FUA);
+	const int rw = bio_data_dir(bio);
+	unsigned int rw_flags = rw;
+	struct blk_mq_hw_ctx *hctx;
+	struct blk_mq_ctx *ctx;
+	struct blk_mq_fua *fua = NULL;
+	struct blk_plug *plug;
+	struct request *rq;
+	unsigned int use_plug, request_count = 0;
+	bool wb_acct;
+
+	/*
+	 * If we have multiple hardware queues, just go directly to
+	 * one of those for sync IO.
+	 */
+	use_plug = !is_flush_fua && ((q->nr_hw_queues == 1) || !is_sync);
+
+	blk_queue_bounce(q, &bio);
+
+	if (unlikely(is_flush_fua))
+		fua = blk_mq_flush_fua(q, bio);
+
+	if (use_plug && blk_attempt_plug_merge(q, bio, &request_count))
+		return;
+
+	wb_acct = wbt_wait(q, bio, NULL);
+
+	if (blk_mq_queue_enter(q)) {
+		if (wb_acct)
+			wbt_release(q);
+		bio_endio(bio, -EIO);
+		return;
+	}
+
+	ctx = blk_mq_get_ctx(q);
+	hctx = q->mq_ops->map_queue(q, ctx->cpu);
+
+	if (!is_flush_fua && (hctx->flags & BLK_MQ_F_SHOULD_MERGE) &&
+	    !blk_queue_nomerges(q)) {
+		bool merged;
+
+		spin_lock(&ctx->lock);
+		merged = blk_mq_attempt_merge(q, ctx, bio);
+		spin_unlock(&ctx->lock);
+
+		if (merged) {
+			blk_mq_put_ctx(ctx);
+			blk_mq_queue_exit(q);
+			if (wb_acct)
+				wbt_release(q);
+			return;
+		}
+	}
+
+	if (is_sync)
+		rw_flags |= REQ_SYNC;
+
+	trace_block_getrq(q, bio, rw);
+	rq = __blk_mq_alloc_request(hctx, false);
+	if (likely(rq))
+		blk_mq_rq_ctx_init(q, ctx, rq, rw_flags);
+	else {
+		blk_mq_put_ctx(ctx);
+		trace_block_sleeprq(q, bio, rw);
+		rq = blk_mq_alloc_request_pinned(q, rw_flags,
+						 __GFP_WAIT | GFP_ATOMIC, false);
+		ctx = rq->mq_ctx;
+		hctx = q->mq_ops->map_queue(q, ctx->cpu);
+	}
+
+	hctx->queued++;
+	blk_mq_bio_to_request(rq, bio);
+	if (wb_acct)
+		rq->cmd_flags |= REQ_WB_TRACKED;
+	blk_mq_put_ctx(ctx);
+
+	if (fua && (fua->flags & BLK_MQ_FUA_PREFLUSH)) {
+		fua->rq = rq;
+		blk_mq_fua_queue_flush(q, fua);
+		return;
+	}
+
+	/*
+	 * With the plug held, the request is only queued when the plug is
+	 * flushed, so that a batch can be handed to the driver at once.
+	 */
+	plug = current->plug;
+	if (use_plug && plug) {
+		if (list_empty(&plug->mq_list))
+			trace_block_plug(q);
+		else if (request_count >= BLK_MAX_REQUEST_COUNT) {
+			blk_flush_plug_list(plug, false);
+			trace_block_plug(q);
+		}
+		blk_plug_add_request(plug, rq, &plug->mq_list);
+		return;
+	}
+
+	spin_lock(&ctx->lock);
+	__blk_mq_insert_request(hctx, rq, false);
+	spin_unlock(&ctx->lock);
+
+	blk_mq_run_hw_queue(hctx, !is_sync || is_flush_fua);
+}
+
+/*
+ * Default mapping to a software queue, since we use one per CPU.
+ */
+struct blk_mq_hw_ctx *blk_mq_map_queue(struct request_queue *q, const int cpu)
+{
+	return q->queue_hw_ctx[q->mq_map[cpu]];
+}
+EXPORT_SYMBOL(blk_mq_map_queue);
+
+/*
+ * poll_fn for blk_poll(): reap the hardware queue serving this CPU, which
+ * is where a synchronous submitter's request went.
+ */
+static int blk_mq_poll(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+
+	hctx = q->mq_ops->map_queue(q, raw_smp_processor_id());
+	return q->mq_ops->poll(hctx);
+}
+
+static size_t order_to_size(unsigned int order)
+{
+	return (size_t)PAGE_SIZE << order;
+}
+
+static void blk_mq_free_rq_map(struct blk_mq_hw_ctx *hctx)
+{
+	struct page *page;
+
+	while (!list_empty(&hctx->page_list)) {
+		page = list_first_entry(&hctx->page_list, struct page, lru);
+		list_del_init(&page->lru);
+		__free_pages(page, page_private(page));
+	}
+
+	kfree(hctx->rqs);
+	hctx->rqs = NULL;
+
+	if (hctx->tags)
+		blk_mq_free_tags(hctx->tags);
+	hctx->tags = NULL;
+}
+
+/*
+ * Preallocate the requests of @hctx, along with the driver's per-request
+ * data, in as few and as large chunks as we can get.  If memory is tight,
+ * the queue depth is reduced rather than failing outright.
+ */
+static int blk_mq_init_rq_map(struct blk_mq_hw_ctx *hctx,
+			      unsigned int reserved_tags, int node)
+{
+	unsigned int i, j, entries_per_page, max_order = 4;
+	size_t rq_size, left;
+
+	hctx->rqs = kmalloc_node(hctx->queue_depth * sizeof(struct request *),
+				 GFP_KERNEL, node);
+	if (!hctx->rqs)
+		return -ENOMEM;
+
+	/*
+	 * rq_size is the size of the request plus driver payload, rounded
+	 * to the cacheline size
+	 */
+	rq_size = round_up(sizeof(struct request) + hctx->cmd_size,
+			   cache_line_size());
+	left = rq_size * hctx->queue_depth;
+
+	for (i = 0; i < hctx->queue_depth;) {
+		int this_order = max_order;
+		struct page *page;
+		int to_do;
+		void *p;
+
+		while (this_order && left < order_to_size(this_order - 1))
+			this_order--;
+
+		do {
+			page = alloc_pages_node(node,
+						GFP_KERNEL | __GFP_NOWARN,
+						this_order);
+			if (page)
+				break;
+			if (!this_order--)
+				break;
+			if (order_to_size(this_order) < rq_size)
+				break;
+		} while (1);
+
+		if (!page)
+			break;
+
+		set_page_private(page, this_order);
+		list_add_tail(&page->lru, &hctx->page_list);
+
+		p = page_address(page);
+		entries_per_page = order_to_size(this_order) / rq_size;
+		to_do = min(entries_per_page, hctx->queue_depth - i);
+		left -= to_do * rq_size;
+		for (j = 0; j < to_do; j++) {
+			hctx->rqs[i] = p;
+			blk_rq_init(hctx->queue, hctx->rqs[i]);
+			p += rq_size;
+			i++;
+		}
+	}
+
+	if (i < (reserved_tags + BLK_MQ_TAG_MIN))
+		goto err_rq_map;
+	else if (i != hctx->queue_depth) {
+		hctx->queue_depth = i;
+		pr_warn("%s: queue depth set to %u because of low memory\n",
+			__func__, i);
+	}
+
+	hctx->tags = blk_mq_init_tags(hctx->queue_depth, reserved_tags, node);
+	if (!hctx->tags)
+		goto err_rq_map;
+
+	/* the first reserved tag is for flushes, see blk_mq_start_flush() */
+	if (blk_mq_get_tag(hctx->tags, true) != BLK_MQ_FLUSH_TAG)
+		goto err_rq_map;
+
+	return 0;
+
+err_rq_map:
+	blk_mq_free_rq_map(hctx);
+	return -ENOMEM;
+}
+
+static void blk_mq_exit_hw_queues(struct request_queue *q,
+				  struct blk_mq_ops *ops, unsigned int nr_init)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (i < nr_init && ops->exit_hctx)
+			ops->exit_hctx(hctx, i);
+
+		blk_mq_free_rq_map(hctx);
+		kfree(hctx->ctx_map);
+		kfree(hctx->ctxs);
+		hctx->ctx_map = NULL;
+		hctx->ctxs = NULL;
+	}
+}
+
+static int blk_mq_init_hw_queues(struct request_queue *q,
+				 struct blk_mq_reg *reg, void *driver_data)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i;
+
+	/*
+	 * Initialize hardware queues
+	 */
+	queue_for_each_hw_ctx(q, hctx, i) {
+		unsigned int num_maps;
+		int node;
+
+		node = hctx->numa_node;
+		if (node == NUMA_NO_NODE)
+			node = hctx->numa_node = reg->numa_node;
+
+		INIT_DELAYED_WORK(&hctx->delayed_work, blk_mq_work_fn);
+		spin_lock_init(&hctx->lock);
+		INIT_LIST_HEAD(&hctx->dispatch);
+		hctx->queue = q;
+		hctx->queue_num = i;
+		hctx->flags = reg->flags;
+		hctx->queue_depth = reg->queue_depth;
+		hctx->cmd_size = reg->cmd_size;
+
+		/*
+		 * Allocate space for all possible cpus to avoid allocation in
+		 * runtime
+		 */
+		hctx->ctxs = kmalloc_node(nr_cpu_ids * sizeof(void *),
+					  GFP_KERNEL, node);
+		if (!hctx->ctxs)
+			break;
+
+		num_maps = BITS_TO_LONGS(nr_cpu_ids);
+		hctx->ctx_map = kzalloc_node(num_maps * sizeof(unsigned long),
+					     GFP_KERNEL, node);
+		if (!hctx->ctx_map)
+			break;
+
+		hctx->nr_ctx_map = num_maps;
+		hctx->nr_ctx = 0;
+
+		if (blk_mq_init_rq_map(hctx, reg->reserved_tags + 1, node))
+			break;
+
+		if (reg->ops->init_hctx &&
+		    reg->ops->init_hctx(hctx, driver_data, i))
+			break;
+	}
+
+	if (i == q->nr_hw_queues)
+		return 0;
+
+	/*
+	 * Init failed, undo what was done for the queues before @i
+	 */
+	blk_mq_exit_hw_queues(q, reg->ops, i);
+	return -ENOMEM;
+}
+
+static void blk_mq_init_cpu_queues(struct request_queue *q,
+				   unsigned int nr_hw_queues)
+{
+	unsigned int i;
+
+	for_each_possible_cpu(i) {
+		struct blk_mq_ctx *__ctx = per_cpu_ptr(q->queue_ctx, i);
+		struct blk_mq_hw_ctx *hctx;
+
+		memset(__ctx, 0, sizeof(*__ctx));
+		__ctx->cpu = i;
+		spin_lock_init(&__ctx->lock);
+		INIT_LIST_HEAD(&__ctx->rq_list);
+		__ctx->queue = q;
+
+		/* If the cpu isn't online, the cpu is mapped to first hctx */
+		if (!cpu_online(i))
+			continue;
+
+		hctx = q->mq_ops->map_queue(q, i);
+
+		/*
+		 * Set local node, IFF we have more than one hw queue. If
+		 * not, we remain on the home node of the device
+		 */
+		if (nr_hw_queues > 1 && hctx->numa_node == NUMA_NO_NODE)
+			hctx->numa_node = cpu_to_node(i);
+	}
+}
+
+static void blk_mq_map_swqueue(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	struct blk_mq_ctx *ctx;
+	unsigned int i;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		cpumask_clear(hctx->cpumask);
+		hctx->nr_ctx = 0;
+	}
+
+	/*
+	 * Map software to hardware queues
+	 */
+	for_each_possible_cpu(i) {
+		ctx = per_cpu_ptr(q->queue_ctx, i);
+		hctx = q->mq_ops->map_queue(q, i);
+		cpumask_set_cpu(i, hctx->cpumask);
+		ctx->index_hw = hctx->nr_ctx;
+		hctx->ctxs[hctx->nr_ctx++] = ctx;
+	}
+}
+
+/**
+ * blk_mq_init_queue - create a multiqueue request queue
+ * @reg:	hardware queue layout and operations of the driver
+ * @driver_data: passed to @reg->ops->init_hctx for each hardware queue
+ *
+ * Returns the new queue, or an ERR_PTR() value on failure.  The queue is
+ * torn down with blk_cleanup_queue() like any other.
+ */
+struct request_queue *blk_mq_init_queue(struct blk_mq_reg *reg,
+					void *driver_data)
+{
+	struct blk_mq_hw_ctx **hctxs;
+	struct blk_mq_ctx *ctx;
+	struct request_queue *q;
+	int i;
+
+	if (!reg->nr_hw_queues ||
+	    !reg->ops->queue_rq || !reg->ops->map_queue)
+		return ERR_PTR(-EINVAL);
+
+	if (!reg->queue_depth)
+		reg->queue_depth = BLK_MQ_MAX_DEPTH;
+	else if (reg->queue_depth > BLK_MQ_MAX_DEPTH) {
+		pr_err("blk-mq: queuedepth too large (%u)\n", reg->queue_depth);
+		reg->queue_depth = BLK_MQ_MAX_DEPTH;
+	}
+
+	if (reg->queue_depth < (reg->reserved_tags + 1 + BLK_MQ_TAG_MIN))
+		return ERR_PTR(-EINVAL);
+
+	ctx = alloc_percpu(struct blk_mq_ctx);
+	if (!ctx)
+		return ERR_PTR(-ENOMEM);
+
+	hctxs = kmalloc_node(reg->nr_hw_queues * sizeof(*hctxs),
+			     GFP_KERNEL | __GFP_ZERO, reg->numa_node);
+	if (!hctxs)
+		goto err_percpu;
+
+	for (i = 0; i < reg->nr_hw_queues; i++) {
+		hctxs[i] = kzalloc_node(sizeof(struct blk_mq_hw_ctx),
+					GFP_KERNEL, reg->numa_node);
+		if (!hctxs[i])
+			goto err_hctxs;
+
+		if (!zalloc_cpumask_var(&hctxs[i]->cpumask, GFP_KERNEL))
+			goto err_hctxs;
+
+		INIT_LIST_HEAD(&hctxs[i]->page_list);
+		hctxs[i]->numa_node = NUMA_NO_NODE;
+		hctxs[i]->queue_num = i;
+	}
+
+	q = blk_alloc_queue_node(GFP_KERNEL, reg->numa_node);
+	if (!q)
+		goto err_hctxs;
+
+	q->mq_map = blk_mq_make_queue_map(reg);
+	if (!q->mq_map)
+		goto err_map;
+
+	q->mq_usage = alloc_percpu(long);
+	if (!q->mq_usage)
+		goto err_map;
+
+	setup_timer(&q->timeout, blk_mq_rq_timer, (unsigned long) q);
+	spin_lock_init(&q->mq_flush_lock);
+	INIT_LIST_HEAD(&q->mq_flush_pending);
+	INIT_LIST_HEAD(&q->mq_flush_running);
+	INIT_LIST_HEAD(&q->mq_flush_ready);
+	INIT_WORK(&q->mq_flush_work, blk_mq_flush_work);
+	blk_queue_rq_timeout(q, reg->timeout ? reg->timeout : 30 * HZ);
+
+	q->nr_queues = nr_cpu_ids;
+	q->nr_hw_queues = reg->nr_hw_queues;
+
+	q->queue_ctx = ctx;
+	q->queue_hw_ctx = hctxs;
+
+	q->mq_ops = reg->ops;
+	q->queue_flags = QUEUE_FLAG_MQ_DEFAULT;
+
+	blk_queue_make_request(q, blk_mq_make_request);
+	q->nr_requests = reg->queue_depth;
+	if (reg->ops->poll)
+		blk_queue_poll_fn(q, blk_mq_poll);
+
+	blk_mq_init_cpu_queues(q, reg->nr_hw_queues);
+
+	if (wbt_init(q))
+		goto err_counter;
+
+	if (blk_mq_init_hw_queues(q, reg, driver_data))
+		goto err_counter;
+
+	blk_mq_map_swqueue(q);
+	blk_mq_sysfs_init(q);
+
+	mutex_lock(&all_q_mutex);
+	list_add_tail(&q->all_q_node, &all_q_list);
+	mutex_unlock(&all_q_mutex);
+
+	return q;
+
+err_counter:
+	free_percpu(q->mq_usage);
+	q->mq_usage = NULL;
+err_map:
+	q->mq_ops = NULL;
+	q->queue_hw_ctx = NULL;
+	q->queue_ctx = NULL;
+	q->nr_hw_queues = 0;
+	kfree(q->mq_map);
+	q->mq_map = NULL;
+	blk_cleanup_queue(q);
+err_hctxs:
+	for (i = 0; i < reg->nr_hw_queues; i++) {
+		if (!hctxs[i])
+			break;
+		free_cpumask_var(hctxs[i]->cpumask);
+		kfree(hctxs[i]);
+	}
+	kfree(hctxs);
+err_percpu:
+	free_percpu(ctx);
+	return ERR_PTR(-ENOMEM);
+}
+EXPORT_SYMBOL(blk_mq_init_queue);
+
+/*
+ * Called from blk_release_queue() once the last reference to @q is gone.
+ */
+void blk_mq_free_queue(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	int i;
+
+	queue_for_each_hw_ctx(q, hctx, i)
+		cancel_delayed_work_sync(&hctx->delayed_work);
+	cancel_work_sync(&q->mq_flush_work);
+
+	blk_mq_exit_hw_queues(q, q->mq_ops, q->nr_hw_queues);
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		free_cpumask_var(hctx->cpumask);
+		kfree(hctx);
+	}
+
+	kfree(q->queue_hw_ctx);
+	kfree(q->mq_map);
+	free_percpu(q->queue_ctx);
+	free_percpu(q->mq_usage);
+
+	q->queue_hw_ctx = NULL;
+	q->queue_ctx = NULL;
+	q->mq_map = NULL;
+	q->mq_usage = NULL;
+
+	mutex_lock(&all_q_mutex);
+	list_del_init(&q->all_q_node);
+	mutex_unlock(&all_q_mutex);
+}
+
+/*
+ * Software queues of offline CPUs stay mapped, as the requests sitting on
+ * them hold tags of their hardware queue.  When a CPU goes away, kick the
+ * hardware queues it fed so that nothing is left stranded.
+ */
+static int __cpuinit blk_mq_cpu_notify(struct notifier_block *self,
+				       unsigned long action, void *hcpu)
+{
+	unsigned int cpu = (unsigned long) hcpu;
+	struct request_queue *q;
+
+	if (action != CPU_DEAD && action != CPU_DEAD_FROZEN)
+		return NOTIFY_OK;
+
+	mutex_lock(&all_q_mutex);
+	list_for_each_entry(q, &all_q_list, all_q_node) {
+		struct blk_mq_ctx *ctx = __blk_mq_get_ctx(q, cpu);
+
+		if (!list_empty_careful(&ctx->rq_list))
+			blk_mq_run_hw_queue(q->mq_ops->map_queue(q, cpu), true);
+	}
+	mutex_unlock(&all_q_mutex);
+
+	return NOTIFY_OK;
+}
+
+static int __init blk_mq_init(void)
+{
+	blk_mq_fua_pool = mempool_create_kmalloc_pool(BLK_MQ_FUA_POOL,
+						sizeof(struct blk_mq_fua));
+	if (!blk_mq_fua_pool)
+		panic("Failed to create blk-mq FUA pool\n");
+
+	hotcpu_notifier(blk_mq_cpu_notify, 0);
+	return 0;
+}
+subsys_initcall(blk_mq_init);
@@ -0,0 +1,74 @@
+#ifndef INT_BLK_MQ_H
+#define INT_BLK_MQ_H
+
+struct blk_mq_ctx {
+	struct {
+		spinlock_t		lock;
+		struct list_head	rq_list;
+	}  ____cacheline_aligned_in_smp;
+
+	unsigned int		cpu;
+	unsigned int		index_hw;
+
+	/* incremented at dispatch time */
+	unsigned long		rq_dispatched[2];
+	unsigned long		rq_merged;
+
+	/* incremented at completion time */
+	unsigned long		____cacheline_aligned_in_smp rq_completed[2];
+
+	struct request_queue	*queue;
+	struct kobject		kobj;
+};
+
+/*
+ * CPU -> queue mappings
+ */
+int blk_mq_update_queue_map(unsigned int *map, unsigned int nr_queues);
+unsigned int *blk_mq_make_queue_map(struct blk_mq_reg *reg);
+
+/*
+ * Tags
+ */
+#define BLK_MQ_TAG_FAIL		((unsigned int) -1)
+#define BLK_MQ_TAG_MIN		1
+#define BLK_MQ_FLUSH_TAG	0	/* kept by each hw queue for flushes */
+
+struct blk_mq_tags *blk_mq_init_tags(unsigned int nr_tags,
+				     unsigned int reserved_tags, int node);
+void blk_mq_free_tags(struct blk_mq_tags *tags);
+unsigned int blk_mq_get_tag(struct blk_mq_tags *tags, bool reserved);
+void blk_mq_put_tag(struct blk_mq_tags *tags, unsigned int tag);
+bool blk_mq_has_free_tags(struct blk_mq_tags *tags, bool reserved);
+void blk_mq_wait_for_tags(struct blk_mq_tags *tags, bool reserved);
+void blk_mq_tag_busy_iter(struct blk_mq_tags *tags,
+			  void (*fn)(void *data, unsigned int tag), void *data);
+ssize_t blk_mq_tag_sysfs_show(struct blk_mq_tags *tags, char *page);
+
+/*
+ * sysfs helpers
+ */
+void blk_mq_sysfs_init(struct request_queue *q);
+
+static inline struct blk_mq_ctx *__blk_mq_get_ctx(struct request_queue *q,
+						  unsigned int cpu)
+{
+	return per_cpu_ptr(q->queue_ctx, cpu);
+}
+
+/*
+ * This assumes per-cpu software queueing queues.  Note that we don't
+ * keep preemption disabled beyond blk_mq_put_ctx(), so a request's
+ * ctx need not match the CPU it is later inserted or completed on.
+ */
+static inline struct blk_mq_ctx *blk_mq_get_ctx(struct request_queue *q)
+{
+	return __blk_mq_get_ctx(q, get_cpu());
+}
+
+static inline void blk_mq_put_ctx(struct blk_mq_ctx *ctx)
+{
+	put_cpu();
+}
+
+#endif
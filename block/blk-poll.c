@@ -0,0 +1,114 @@
+/*
+ * Polled completion for synchronous IO
+ *
+ * For devices that complete IO in a few microseconds, taking the interrupt
+ * and waking the submitter costs a good part of the total latency.  A task
+ * waiting for its own IO may instead reap the completion queue of its CPU's
+ * hardware queue itself, through the driver's poll_fn.
+ *
+ * With io_poll_delay set, the task first sleeps for part of the expected
+ * latency, so that it doesn't burn a CPU for the whole time the device is
+ * busy.  The delay is fixed (in usecs), or half the mean latency of polled
+ * IO so far when set to 0.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/sched.h>
+#include <linux/hrtimer.h>
+
+#include "blk.h"
+
+static void blk_poll_account(struct request_queue *q, ktime_t issued)
+{
+	u64 nsec;
+
+	if (!issued.tv64)
+		return;
+
+	nsec = ktime_to_ns(ktime_sub(ktime_get(), issued));
+	if (q->poll_nsec)
+		q->poll_nsec = (7 * q->poll_nsec + nsec) >> 3;
+	else
+		q->poll_nsec = nsec;
+}
+
+/*
+ * Sleep until @issued plus the configured delay, unless the IO completes
+ * first.  Returns true if we slept at all, as our wait condition may have
+ * changed meanwhile.
+ */
+static bool blk_poll_hybrid_sleep(struct request_queue *q, ktime_t issued)
+{
+	ktime_t expires;
+	s64 delay_ns;
+
+	if (q->poll_delay < 0 || !issued.tv64)
+		return false;
+
+	if (q->poll_delay > 0)
+		delay_ns = (s64)q->poll_delay * NSEC_PER_USEC;
+	else
+		delay_ns = q->poll_nsec / 2;
+	if (!delay_ns)
+		return false;
+
+	expires = ktime_add_ns(issued, delay_ns);
+	if (ktime_to_ns(ktime_sub(expires, ktime_get())) <= 0)
+		return false;
+
+	q->poll_sleeps++;
+	schedule_hrtimeout(&expires, HRTIMER_MODE_ABS);
+	return true;
+}
+
+/**
+ * blk_poll - wait for IO completion by polling the device
+ * @q:		the queue the IO was issued to
+ * @issued:	when the IO was issued, or zero if not known
+ *
+ * Description:
+ *    The caller has set itself up to be woken by the completion of its IO
+ *    and set current->state accordingly, as it would before io_schedule().
+ *    If @q has polling enabled, spin on the driver's completion queue until
+ *    we are woken.  Returns true when the caller should re-check its wait
+ *    condition, and false if it should go on and sleep in io_schedule().
+ */
+bool blk_poll(struct request_queue *q, ktime_t issued)
+{
+	long state = current->state;
+
+	if (!q->poll_fn || !blk_queue_poll(q))
+		return false;
+
+	/* our IO may still sit in the plug, io_schedule() would flush it */
+	blk_flush_plug(current);
+
+	if (blk_poll_hybrid_sleep(q, issued))
+		return true;
+
+	while (!need_resched()) {
+		int found = q->poll_fn(q);
+
+		if (current->state == TASK_RUNNING) {
+			if (found > 0)
+				q->poll_hits++;
+			else
+				q->poll_misses++;
+			blk_poll_account(q, issued);
+			return true;
+		}
+
+		if (signal_pending_state(state, current)) {
+			__set_current_state(TASK_RUNNING);
+			return true;
+		}
+
+		cpu_relax();
+	}
+
+	q->poll_misses++;
+	return false;
+}
+EXPORT_SYMBOL_GPL(blk_poll);
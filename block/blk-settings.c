@@ -99,6 +99,20 @@ void blk_queue_lld_busy(struct request_queue *q, lld_busy_fn *fn)
 }
 EXPORT_SYMBOL_GPL(blk_queue_lld_busy);
 
+/**
+ * blk_queue_poll_fn - set driver's completion polling function
+ * @q:  queue
+ * @fn: function that reaps completions for the calling CPU's hardware
+ *      queue and returns how many it found
+ *
+ * Polling itself stays off until enabled through the io_poll sysfs file.
+ */
+void blk_queue_poll_fn(struct request_queue *q, poll_q_fn *fn)
+{
+	q->poll_fn = fn;
+}
+EXPORT_SYMBOL_GPL(blk_queue_poll_fn);
+
 /**
  * blk_set_default_limits - reset limits to default values
  * @lim:  the queue_limits structure to reset
@@ -6,6 +6,7 @@
 #include <linux/module.h>
 #include <linux/bio.h>
 #include <linux/blkdev.h>
+#include <linux/blk-mq.h>
 #include <linux/blktrace_api.h>
 
 #include "blk.h"
@@ -273,6 +274,70 @@ queue_rq_affinity_store(struct request_queue *q, const char *page, size_t count)
 	return ret;
 }
 
+static ssize_t queue_poll_show(struct request_queue *q, char *page)
+{
+	return queue_var_show(blk_queue_poll(q), page);
+}
+
+static ssize_t queue_poll_store(struct request_queue *q, const char *page,
+				size_t count)
+{
+	unsigned long poll_on;
+	ssize_t ret;
+
+	if (!q->poll_fn)
+		return -EINVAL;
+
+	ret = queue_var_store(&poll_on, page, count);
+	spin_lock_irq(q->queue_lock);
+	if (poll_on)
+		queue_flag_set(QUEUE_FLAG_POLL, q);
+	else
+		queue_flag_clear(QUEUE_FLAG_POLL, q);
+	spin_unlock_irq(q->queue_lock);
+
+	return ret;
+}
+
+static ssize_t queue_poll_delay_show(struct request_queue *q, char *page)
+{
+	return sprintf(page, "%d\n", q->poll_delay);
+}
+
+static ssize_t queue_poll_delay_store(struct request_queue *q,
+				      const char *page, size_t count)
+{
+	long delay;
+
+	if (kstrtol(page, 10, &delay) || delay < -1 || delay > USEC_PER_SEC)
+		return -EINVAL;
+
+	q->poll_delay = delay;
+	return count;
+}
+
+static ssize_t queue_poll_stats_show(struct request_queue *q, char *page)
+{
+	return sprintf(page, "hits=%lu, misses=%lu, sleeps=%lu, mean_nsec=%llu\n",
+		       q->poll_hits, q->poll_misses, q->poll_sleeps,
+		       (unsigned long long)q->poll_nsec);
+}
+
+static ssize_t queue_plug_merge_stats_show(struct request_queue *q, char *page)
+{
+	unsigned long attempts = 0, merges = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct blk_plug_stats *stats = per_cpu_ptr(q->plug_stats, cpu);
+
+		attempts += stats->merge_attempts;
+		merges += stats->merges;
+	}
+
+	return sprintf(page, "attempts=%lu, merges=%lu\n", attempts, merges);
+}
+
 static struct queue_sysfs_entry queue_requests_entry = {
 	.attr = {.name = "nr_requests", .mode = S_IRUGO | S_IWUSR },
 	.show = queue_requests_show,
@@ -387,6 +452,41 @@ static struct queue_sysfs_entry queue_random_entry = {
 	.store = queue_store_random,
 };
 
+static struct queue_sysfs_entry queue_poll_entry = {
+	.attr = {.name = "io_poll", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_poll_show,
+	.store = queue_poll_store,
+};
+
+static struct queue_sysfs_entry queue_poll_delay_entry = {
+	.attr = {.name = "io_poll_delay", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_poll_delay_show,
+	.store = queue_poll_delay_store,
+};
+
+static struct queue_sysfs_entry queue_poll_stats_entry = {
+	.attr = {.name = "io_poll_stats", .mode = S_IRUGO },
+	.show = queue_poll_stats_show,
+};
+
+static struct queue_sysfs_entry queue_plug_merge_stats_entry = {
+	.attr = {.name = "plug_merge_stats", .mode = S_IRUGO },
+	.show = queue_plug_merge_stats_show,
+};
+
+#ifdef CONFIG_BLK_WBT
+static struct queue_sysfs_entry queue_wbt_lat_entry = {
+	.attr = {.name = "wbt_lat_usec", .mode = S_IRUGO | S_IWUSR },
+	.show = wbt_lat_show,
+	.store = wbt_lat_store,
+};
+
+static struct queue_sysfs_entry queue_wbt_stats_entry = {
+	.attr = {.name = "wbt_stats", .mode = S_IRUGO },
+	.show = wbt_stats_show,
+};
+#endif
+
 static struct attribute *default_attrs[] = {
 	&queue_requests_entry.attr,
 	&queue_ra_entry.attr,
@@ -409,6 +509,14 @@ static struct attribute *default_attrs[] = {
 	&queue_rq_affinity_entry.attr,
 	&queue_iostats_entry.attr,
 	&queue_random_entry.attr,
+	&queue_poll_entry.attr,
+	&queue_poll_delay_entry.attr,
+	&queue_poll_stats_entry.attr,
+	&queue_plug_merge_stats_entry.attr,
+#ifdef CONFIG_BLK_WBT
+	&queue_wbt_lat_entry.attr,
+	&queue_wbt_stats_entry.attr,
+#endif
 	NULL,
 };
 
@@ -487,6 +595,7 @@ static void blk_release_queue(struct kobject *kobj)
 	}
 
 	blk_throtl_exit(q);
+	wbt_exit(q);
 
 	if (rl->rq_pool)
 		mempool_destroy(rl->rq_pool);
@@ -494,10 +603,14 @@ static void blk_release_queue(struct kobject *kobj)
 	if (q->queue_tags)
 		__blk_queue_free_tags(q);
 
+	if (q->mq_ops)
+		blk_mq_free_queue(q);
+
 	blk_throtl_release(q);
 	blk_trace_shutdown(q);
 
 	bdi_destroy(&q->backing_dev_info);
+	free_percpu(q->plug_stats);
 
 	ida_simple_remove(&blk_queue_ida, q->id);
 	kmem_cache_free(blk_requestq_cachep, q);
@@ -535,6 +648,9 @@ int blk_register_queue(struct gendisk *disk)
 
 	kobject_uevent(&q->kobj, KOBJ_ADD);
 
+	if (q->mq_ops)
+		blk_mq_register_disk(disk);
+
 	if (!q->request_fn)
 		return 0;
 
@@ -557,6 +673,9 @@ void blk_unregister_queue(struct gendisk *disk)
 	if (WARN_ON(!q))
 		return;
 
+	if (q->mq_ops)
+		blk_mq_unregister_disk(disk);
+
 	if (q->request_fn)
 		elv_unregister_queue(q);
 
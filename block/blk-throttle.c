@@ -21,8 +21,14 @@ static int throtl_quantum = 32;
 /* Throttling is performed over 100ms slice and after that slice is renewed */
 static unsigned long throtl_slice = HZ/10;	/* 100 ms */
 
+/* Latency targets are checked against the mean latency of 100ms windows */
+static unsigned long throtl_lat_window = HZ/10;
+
 /* A workqueue to queue throttle related work */
 static struct workqueue_struct *kthrotld_workqueue;
+
+/* Bios whose latency is monitored, see throtl_lat_track() */
+static struct kmem_cache *throtl_lat_cache;
 static void throtl_schedule_delayed_work(struct throtl_data *td,
 				unsigned long delay);
 
@@ -80,6 +86,18 @@ struct throtl_grp {
 	/* Some throttle limits got updated for the group */
 	int limits_changed;
 
+	/* Target completion latency in us, -1 if none */
+	unsigned int latency;
+	/* Counted in td->nr_lat_groups, under the queue lock */
+	bool lat_counted;
+
+	/* Bios sent to the device and not completed yet */
+	atomic_t nr_inflight;
+
+	/* Latency samples of the current window, under td->lat_lock */
+	u64 lat_sum;
+	unsigned int lat_nr;
+
 	struct rcu_head rcu_head;
 };
 
@@ -106,6 +124,27 @@ struct throtl_data
 	struct delayed_work throtl_work;
 
 	int limits_changed;
+
+	/*
+	 * Latency targets.  When a group misses its target, all groups
+	 * with a looser target, or none, are cut to lat_depth bios in
+	 * flight.  lat_victim is the target being protected; both are
+	 * UINT_MAX while nobody is cut.
+	 */
+	unsigned int nr_lat_groups;
+	unsigned int lat_victim;
+	unsigned int lat_depth;
+	unsigned long lat_window_end;
+	int lat_check;
+	spinlock_t lat_lock;
+};
+
+struct throtl_lat_bio {
+	struct throtl_data *td;
+	struct throtl_grp *tg;
+	bio_end_io_t *bi_end_io;
+	void *bi_private;
+	ktime_t start;
 };
 
 enum tg_state_flags {
@@ -192,6 +231,8 @@ static void throtl_init_group(struct throtl_grp *tg)
 	/* Practically unlimited BW */
 	tg->bps[0] = tg->bps[1] = -1;
 	tg->iops[0] = tg->iops[1] = -1;
+	tg->latency = -1;
+	atomic_set(&tg->nr_inflight, 0);
 
 	/*
 	 * Take the initial reference that will be released on destroy
@@ -246,6 +287,25 @@ throtl_tg_fill_dev_details(struct throtl_data *td, struct throtl_grp *tg)
 	spin_unlock_irq(td->queue->queue_lock);
 }
 
+/*
+ * tg->latency is updated under blkcg_lock only, so nr_lat_groups follows
+ * what was last seen here rather than the current value.
+ */
+static void throtl_tg_count_latency(struct throtl_data *td,
+				    struct throtl_grp *tg)
+{
+	bool has_target = ACCESS_ONCE(tg->latency) != -1;
+
+	if (has_target == tg->lat_counted)
+		return;
+
+	tg->lat_counted = has_target;
+	if (has_target)
+		td->nr_lat_groups++;
+	else
+		td->nr_lat_groups--;
+}
+
 static void throtl_init_add_tg_lists(struct throtl_data *td,
 			struct throtl_grp *tg, struct blkio_cgroup *blkcg)
 {
@@ -259,8 +319,10 @@ static void throtl_init_add_tg_lists(struct throtl_data *td,
 	tg->bps[WRITE] = blkcg_get_write_bps(blkcg, tg->blkg.dev);
 	tg->iops[READ] = blkcg_get_read_iops(blkcg, tg->blkg.dev);
 	tg->iops[WRITE] = blkcg_get_write_iops(blkcg, tg->blkg.dev);
+	tg->latency = blkcg_get_latency(blkcg, tg->blkg.dev);
 
 	throtl_add_group_to_td_list(td, tg);
+	throtl_tg_count_latency(td, tg);
 }
 
 /* Should be called without queue lock and outside of rcu period */
@@ -673,8 +735,15 @@ static bool tg_with_in_bps_limit(struct throtl_data *td, struct throtl_grp *tg,
 	return 0;
 }
 
-static bool tg_no_rule_group(struct throtl_grp *tg, bool rw) {
-	if (tg->bps[rw] == -1 && tg->iops[rw] == -1)
+/* Is @tg's queue depth cut to protect a tighter latency target? */
+static inline bool tg_lat_cut(struct throtl_data *td, struct throtl_grp *tg)
+{
+	return td->lat_depth != UINT_MAX && tg->latency > td->lat_victim;
+}
+
+static bool tg_no_rule_group(struct throtl_data *td, struct throtl_grp *tg,
+			     bool rw) {
+	if (tg->bps[rw] == -1 && tg->iops[rw] == -1 && !tg_lat_cut(td, tg))
 		return 1;
 	return 0;
 }
@@ -697,6 +766,17 @@ static bool tg_may_dispatch(struct throtl_data *td, struct throtl_grp *tg,
 	 */
 	BUG_ON(tg->nr_queued[rw] && bio != bio_list_peek(&tg->bio_lists[rw]));
 
+	/*
+	 * Over the queue depth allowed by latency targets.  There is no
+	 * telling when enough IO completes, so check again next tick.
+	 */
+	if (tg_lat_cut(td, tg) &&
+	    atomic_read(&tg->nr_inflight) >= td->lat_depth) {
+		if (wait)
+			*wait = 1;
+		return 0;
+	}
+
 	/* If tg->bps = -1, then BW is unlimited */
 	if (tg->bps[rw] == -1 && tg->iops[rw] == -1) {
 		if (wait)
@@ -734,6 +814,66 @@ static bool tg_may_dispatch(struct throtl_data *td, struct throtl_grp *tg,
 	return 0;
 }
 
+static void throtl_lat_end_io(struct bio *bio, int error)
+{
+	struct throtl_lat_bio *lb = bio->bi_private;
+	struct throtl_data *td = lb->td;
+	struct throtl_grp *tg = lb->tg;
+	u64 nsec = ktime_to_ns(ktime_sub(ktime_get(), lb->start));
+	unsigned long flags;
+
+	bio->bi_end_io = lb->bi_end_io;
+	bio->bi_private = lb->bi_private;
+	kmem_cache_free(throtl_lat_cache, lb);
+
+	spin_lock_irqsave(&td->lat_lock, flags);
+	tg->lat_sum += nsec;
+	tg->lat_nr++;
+	spin_unlock_irqrestore(&td->lat_lock, flags);
+	atomic_dec(&tg->nr_inflight);
+
+	/* The window is over, have the dispatch work look at it */
+	if (time_after_eq(jiffies, td->lat_window_end) &&
+	    !xchg(&td->lat_check, true))
+		queue_delayed_work(kthrotld_workqueue, &td->throtl_work, 0);
+
+	throtl_put_tg(tg);
+	bio_endio(bio, error);
+}
+
+/*
+ * Bios leaving the throttling layer for a device with latency targets are
+ * followed to completion, to learn each group's latency and queue depth.
+ * Must be called with a valid reference on @tg, or under rcu.
+ */
+static void throtl_lat_track(struct throtl_data *td, struct throtl_grp *tg,
+			     struct bio *bio)
+{
+	struct throtl_lat_bio *lb;
+
+	if (!td->nr_lat_groups || !throtl_lat_cache)
+		return;
+
+	if (!atomic_inc_not_zero(&tg->ref))
+		return;
+
+	lb = kmem_cache_alloc(throtl_lat_cache, GFP_ATOMIC);
+	if (!lb) {
+		throtl_put_tg(tg);
+		return;
+	}
+
+	lb->td = td;
+	lb->tg = tg;
+	lb->bi_end_io = bio->bi_end_io;
+	lb->bi_private = bio->bi_private;
+	lb->start = ktime_get();
+	atomic_inc(&tg->nr_inflight);
+
+	bio->bi_end_io = throtl_lat_end_io;
+	bio->bi_private = lb;
+}
+
 static void throtl_charge_bio(struct throtl_grp *tg, struct bio *bio)
 {
 	bool rw = bio_data_dir(bio);
@@ -786,6 +926,7 @@ static void tg_dispatch_one_bio(struct throtl_data *td, struct throtl_grp *tg,
 
 	bio = bio_list_pop(&tg->bio_lists[rw]);
 	tg->nr_queued[rw]--;
+	throtl_lat_track(td, tg, bio);
 	/* Drop bio reference on tg */
 	throtl_put_tg(tg);
 
@@ -883,8 +1024,9 @@ static void throtl_process_limit_change(struct throtl_data *td)
 			continue;
 
 		throtl_log_tg(td, tg, "limit change rbps=%llu wbps=%llu"
-			" riops=%u wiops=%u", tg->bps[READ], tg->bps[WRITE],
-			tg->iops[READ], tg->iops[WRITE]);
+			" riops=%u wiops=%u latency=%u", tg->bps[READ],
+			tg->bps[WRITE], tg->iops[READ], tg->iops[WRITE],
+			tg->latency);
 
 		/*
 		 * Restart the slices for both READ and WRITES. It
@@ -897,6 +1039,78 @@ static void throtl_process_limit_change(struct throtl_data *td)
 
 		if (throtl_tg_on_rr(tg))
 			tg_update_disptime(td, tg);
+
+		throtl_tg_count_latency(td, tg);
+	}
+
+	if (!td->nr_lat_groups) {
+		td->lat_depth = UINT_MAX;
+		td->lat_victim = UINT_MAX;
+	}
+}
+
+/*
+ * At the end of each latency window, compare every group's mean latency
+ * with its target.  If a group missed, halve the queue depth allowed to
+ * all groups with looser targets.  Once all groups meet their targets,
+ * give the depth back gradually, and lift the cut once it gets to the
+ * size of the request queue.  Groups that are cut themselves don't count
+ * as missing; they pay for the others.
+ */
+static void throtl_lat_check(struct throtl_data *td)
+{
+	struct request_queue *q = td->queue;
+	unsigned int missed = UINT_MAX, max_depth;
+	bool cut_any = td->lat_depth != UINT_MAX;
+	struct throtl_grp *tg;
+	struct hlist_node *pos;
+
+	if (!td->nr_lat_groups && !cut_any)
+		return;
+
+	if (time_before(jiffies, td->lat_window_end))
+		return;
+
+	td->lat_window_end = jiffies + throtl_lat_window;
+	xchg(&td->lat_check, false);
+
+	hlist_for_each_entry(tg, pos, &td->tg_list, tg_node) {
+		bool cut = tg_lat_cut(td, tg), miss;
+		unsigned int nr;
+		u64 lat;
+
+		spin_lock(&td->lat_lock);
+		lat = tg->lat_sum;
+		nr = tg->lat_nr;
+		tg->lat_sum = 0;
+		tg->lat_nr = 0;
+		spin_unlock(&td->lat_lock);
+
+		if (!nr)
+			continue;
+
+		lat = div64_u64(lat, (u64)nr * NSEC_PER_USEC);
+		miss = tg->latency != -1 && lat > tg->latency;
+		if (miss && !cut && tg->latency < missed)
+			missed = tg->latency;
+
+		blkiocg_update_latency_stats(&tg->blkg, lat, miss, cut);
+	}
+
+	max_depth = q->nr_requests ? q->nr_requests : BLKDEV_MAX_RQ;
+	if (missed != UINT_MAX) {
+		td->lat_victim = min(td->lat_victim, missed);
+		td->lat_depth = max(cut_any ? td->lat_depth / 2 : max_depth / 2,
+				    1U);
+		throtl_log(td, "latency target %u missed, depth=%u",
+				td->lat_victim, td->lat_depth);
+	} else if (cut_any) {
+		td->lat_depth += max(td->lat_depth / 4, 1U);
+		if (td->lat_depth >= max_depth) {
+			td->lat_depth = UINT_MAX;
+			td->lat_victim = UINT_MAX;
+		}
+		throtl_log(td, "latency targets met, depth=%u", td->lat_depth);
 	}
 }
 
@@ -912,6 +1126,7 @@ static int throtl_dispatch(struct request_queue *q)
 	spin_lock_irq(q->queue_lock);
 
 	throtl_process_limit_change(td);
+	throtl_lat_check(td);
 
 	if (!total_nr_queued(td))
 		goto out;
@@ -980,6 +1195,8 @@ throtl_destroy_tg(struct throtl_data *td, struct throtl_grp *tg)
 	BUG_ON(hlist_unhashed(&tg->tg_node));
 
 	hlist_del_init(&tg->tg_node);
+	if (tg->lat_counted)
+		td->nr_lat_groups--;
 
 	/*
 	 * Put the reference taken at the time of creation so that when all
@@ -1087,6 +1304,16 @@ static void throtl_update_blkio_group_write_iops(void *key,
 	throtl_update_blkio_group_common(td, tg);
 }
 
+static void throtl_update_blkio_group_latency(void *key,
+			struct blkio_group *blkg, unsigned int latency)
+{
+	struct throtl_data *td = key;
+	struct throtl_grp *tg = tg_of_blkg(blkg);
+
+	tg->latency = latency;
+	throtl_update_blkio_group_common(td, tg);
+}
+
 static void throtl_shutdown_wq(struct request_queue *q)
 {
 	struct throtl_data *td = q->td;
@@ -1105,6 +1332,8 @@ static struct blkio_policy_type blkio_policy_throtl = {
 					throtl_update_blkio_group_read_iops,
 		.blkio_update_group_write_iops_fn =
 					throtl_update_blkio_group_write_iops,
+		.blkio_update_group_latency_fn =
+					throtl_update_blkio_group_latency,
 	},
 	.plid = BLKIO_POLICY_THROTL,
 };
@@ -1134,9 +1363,10 @@ bool blk_throtl_bio(struct request_queue *q, struct bio *bio)
 	if (tg) {
 		throtl_tg_fill_dev_details(td, tg);
 
-		if (tg_no_rule_group(tg, rw)) {
+		if (tg_no_rule_group(td, tg, rw)) {
 			blkiocg_update_dispatch_stats(&tg->blkg, bio->bi_size,
 					rw, rw_is_sync(bio->bi_rw));
+			throtl_lat_track(td, tg, bio);
 			rcu_read_unlock();
 			goto out;
 		}
@@ -1165,6 +1395,7 @@ bool blk_throtl_bio(struct request_queue *q, struct bio *bio)
 	/* Bio is with-in rate limit of group */
 	if (tg_may_dispatch(td, tg, bio, NULL)) {
 		throtl_charge_bio(tg, bio);
+		throtl_lat_track(td, tg, bio);
 
 		/*
 		 * We need to trim slice even when bios are not being queued
@@ -1251,6 +1482,10 @@ int blk_throtl_init(struct request_queue *q)
 	td->tg_service_tree = THROTL_RB_ROOT;
 	td->limits_changed = false;
 	INIT_DELAYED_WORK(&td->throtl_work, blk_throtl_work);
+	td->lat_victim = UINT_MAX;
+	td->lat_depth = UINT_MAX;
+	td->lat_window_end = jiffies;
+	spin_lock_init(&td->lat_lock);
 
 	/* alloc and Init root group. */
 	td->queue = q;
@@ -1323,6 +1558,9 @@ static int __init throtl_init(void)
 	if (!kthrotld_workqueue)
 		panic("Failed to create kthrotld\n");
 
+	/* without it, latency targets are simply not enforced */
+	throtl_lat_cache = KMEM_CACHE(throtl_lat_bio, 0);
+
 	blkio_policy_register(&blkio_policy_throtl);
 	return 0;
 }
@@ -0,0 +1,343 @@
+/*
+ * Writeback throttling
+ *
+ * Background writeback can fill a device queue with async writes faster
+ * than the device drains them, and reads or fsyncs issued meanwhile
+ * queue up behind all of it.  The dirty limits in balance_dirty_pages()
+ * only cap how much is dirty, not how much of it sits in the queue.
+ *
+ * So cap the number of async writes in flight per queue, and size the
+ * cap by the read latency the device delivers: if the fastest read of
+ * a 100ms window still took longer than the target, halve the depth
+ * allowed to writeback; while reads meet the target, or there are none,
+ * give it back a step per window.
+ *
+ * Sync writes (O_DIRECT, fsync and friends) are never held back, and
+ * neither are flushes, FUA writes and discards.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/slab.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/ktime.h>
+
+#include "blk.h"
+
+/* default read latency targets, in usecs */
+#define WBT_LAT_ROT		75000
+#define WBT_LAT_NONROT		2000
+
+/* after this many empty windows the device counts as idle */
+#define WBT_IDLE_WINDOWS	4
+
+struct rq_wb {
+	struct request_queue *queue;
+
+	/* async writes in flight, and who waits for one to finish */
+	atomic_t inflight;
+	wait_queue_head_t wait;
+
+	/* read latency target in usecs: -1 picks the default, 0 is off */
+	int lat_usec;
+
+	/* limit is (3/4 of nr_requests) >> scale_step */
+	unsigned int scale_step;
+
+	/* the current window, under lock */
+	spinlock_t lock;
+	u64 win_nsec;
+	u64 win_start;
+	u64 win_min_lat;
+	unsigned int win_reads;
+
+	/* stats */
+	unsigned long throttled;
+	unsigned long scaled_down;
+	unsigned long scaled_up;
+};
+
+static inline bool wbt_should_throttle(struct bio *bio)
+{
+	const unsigned long mask = REQ_WRITE | REQ_SYNC | REQ_DISCARD |
+				   REQ_FLUSH | REQ_FUA;
+
+	return (bio->bi_rw & mask) == REQ_WRITE;
+}
+
+static u64 wbt_lat_nsec(struct rq_wb *rwb)
+{
+	int lat = rwb->lat_usec;
+
+	if (lat < 0)
+		lat = blk_queue_nonrot(rwb->queue) ? WBT_LAT_NONROT :
+						     WBT_LAT_ROT;
+	return (u64)lat * NSEC_PER_USEC;
+}
+
+static inline bool wbt_enabled(struct rq_wb *rwb)
+{
+	return rwb && rwb->lat_usec;
+}
+
+static unsigned int wbt_limit(struct rq_wb *rwb)
+{
+	struct request_queue *q = rwb->queue;
+	unsigned int depth = q->nr_requests ? q->nr_requests : BLKDEV_MAX_RQ;
+
+	depth = max(depth * 3 / 4, 1U);
+	return max(depth >> rwb->scale_step, 1U);
+}
+
+/* Take an inflight slot if fewer than @limit are taken. */
+static bool wbt_inflight_inc(struct rq_wb *rwb, unsigned int limit)
+{
+	int cur = atomic_read(&rwb->inflight);
+
+	for (;;) {
+		int old;
+
+		if (cur >= (int)limit)
+			return false;
+		old = atomic_cmpxchg(&rwb->inflight, cur, cur + 1);
+		if (old == cur)
+			return true;
+		cur = old;
+	}
+}
+
+/*
+ * End the current window if it is over.  Returns true if writeback got
+ * more room, so that waiters should be woken.
+ */
+static bool wbt_window_check(struct rq_wb *rwb, u64 now)
+{
+	bool wake = false;
+
+	if (now - rwb->win_start < rwb->win_nsec)
+		return false;
+
+	if (now - rwb->win_start >= WBT_IDLE_WINDOWS * rwb->win_nsec) {
+		/* idle device, start over */
+		wake = rwb->scale_step != 0;
+		rwb->scale_step = 0;
+	} else if (rwb->win_reads && rwb->win_min_lat > wbt_lat_nsec(rwb)) {
+		if (wbt_limit(rwb) > 1) {
+			rwb->scale_step++;
+			rwb->scaled_down++;
+		}
+	} else if (rwb->scale_step) {
+		rwb->scale_step--;
+		rwb->scaled_up++;
+		wake = true;
+	}
+
+	rwb->win_start = now;
+	rwb->win_min_lat = ULLONG_MAX;
+	rwb->win_reads = 0;
+	return wake;
+}
+
+/**
+ * wbt_wait - wait for room to issue a writeback request
+ * @q:		the request queue
+ * @bio:	the bio about to get a request
+ * @lock:	lock held by the caller, to be dropped while sleeping
+ *
+ * Description:
+ *    Returns true if @bio took an inflight slot, in which case the caller
+ *    marks its request with REQ_WB_TRACKED, or gives the slot back with
+ *    wbt_release() if it ends up without a request.
+ */
+bool wbt_wait(struct request_queue *q, struct bio *bio, spinlock_t *lock)
+{
+	struct rq_wb *rwb = q->rq_wb;
+	DEFINE_WAIT(wait);
+	bool tracked = true;
+
+	if (!wbt_enabled(rwb) || !wbt_should_throttle(bio))
+		return false;
+
+	if (wbt_inflight_inc(rwb, wbt_limit(rwb)))
+		return true;
+
+	rwb->throttled++;
+	for (;;) {
+		prepare_to_wait_exclusive(&rwb->wait, &wait,
+					  TASK_UNINTERRUPTIBLE);
+		if (!wbt_enabled(rwb)) {
+			tracked = false;
+			break;
+		}
+		if (wbt_inflight_inc(rwb, wbt_limit(rwb)))
+			break;
+
+		if (lock)
+			spin_unlock_irq(lock);
+		io_schedule();
+		if (lock)
+			spin_lock_irq(lock);
+	}
+	finish_wait(&rwb->wait, &wait);
+
+	return tracked;
+}
+
+/**
+ * wbt_release - give back an inflight slot taken by wbt_wait()
+ * @q:		the request queue
+ */
+void wbt_release(struct request_queue *q)
+{
+	struct rq_wb *rwb = q->rq_wb;
+
+	atomic_dec(&rwb->inflight);
+	smp_mb__after_atomic_dec();
+	if (waitqueue_active(&rwb->wait))
+		wake_up(&rwb->wait);
+}
+
+/**
+ * wbt_issue - note the time a request is handed to the driver
+ * @q:		the request queue
+ * @rq:		the request
+ */
+void wbt_issue(struct request_queue *q, struct request *rq)
+{
+	if (wbt_enabled(q->rq_wb))
+		rq->issue_time_ns = ktime_to_ns(ktime_get());
+}
+
+/**
+ * wbt_done - account a request that is freed
+ * @q:		the request queue
+ * @rq:		the request
+ *
+ * Description:
+ *    Called for every request when it is freed, whether it completed or
+ *    was merged into another.  Releases writeback slots, and samples the
+ *    latency of reads that were issued.
+ */
+void wbt_done(struct request_queue *q, struct request *rq)
+{
+	struct rq_wb *rwb = q->rq_wb;
+	u64 issued = rq->issue_time_ns;
+	bool tracked = rq->cmd_flags & REQ_WB_TRACKED;
+	unsigned long flags;
+	bool wake = false;
+	u64 now;
+
+	if (!rwb)
+		return;
+
+	rq->cmd_flags &= ~REQ_WB_TRACKED;
+	rq->issue_time_ns = 0;
+
+	if (!tracked && !(issued && rq->cmd_type == REQ_TYPE_FS &&
+			  rq_data_dir(rq) == READ))
+		return;
+
+	if (wbt_enabled(rwb)) {
+		now = ktime_to_ns(ktime_get());
+
+		spin_lock_irqsave(&rwb->lock, flags);
+		if (!tracked && now > issued) {
+			rwb->win_min_lat = min(rwb->win_min_lat, now - issued);
+			rwb->win_reads++;
+		}
+		wake = wbt_window_check(rwb, now);
+		spin_unlock_irqrestore(&rwb->lock, flags);
+	}
+
+	if (tracked) {
+		atomic_dec(&rwb->inflight);
+		smp_mb__after_atomic_dec();
+	}
+
+	if (waitqueue_active(&rwb->wait)) {
+		if (wake)
+			wake_up_all(&rwb->wait);
+		else if (tracked)
+			wake_up(&rwb->wait);
+	}
+}
+
+ssize_t wbt_lat_show(struct request_queue *q, char *page)
+{
+	struct rq_wb *rwb = q->rq_wb;
+
+	if (!rwb)
+		return sprintf(page, "0\n");
+	if (!rwb->lat_usec)
+		return sprintf(page, "0\n");
+	return sprintf(page, "%llu\n",
+		       (unsigned long long)div_u64(wbt_lat_nsec(rwb),
+						   NSEC_PER_USEC));
+}
+
+ssize_t wbt_lat_store(struct request_queue *q, const char *page, size_t count)
+{
+	struct rq_wb *rwb = q->rq_wb;
+	long lat;
+
+	if (!rwb)
+		return -EINVAL;
+
+	if (kstrtol(page, 10, &lat) || lat < -1 || lat > USEC_PER_SEC)
+		return -EINVAL;
+
+	spin_lock_irq(&rwb->lock);
+	rwb->lat_usec = lat;
+	rwb->scale_step = 0;
+	spin_unlock_irq(&rwb->lock);
+
+	/* the limit may be gone, or off altogether */
+	wake_up_all(&rwb->wait);
+	return count;
+}
+
+ssize_t wbt_stats_show(struct request_queue *q, char *page)
+{
+	struct rq_wb *rwb = q->rq_wb;
+
+	if (!rwb)
+		return -EINVAL;
+
+	return sprintf(page, "inflight=%d, limit=%u, scale_step=%u, "
+		       "throttled=%lu, scaled_down=%lu, scaled_up=%lu\n",
+		       atomic_read(&rwb->inflight), wbt_limit(rwb),
+		       rwb->scale_step, rwb->throttled, rwb->scaled_down,
+		       rwb->scaled_up);
+}
+
+int wbt_init(struct request_queue *q)
+{
+	struct rq_wb *rwb;
+
+	if (q->rq_wb)
+		return 0;
+
+	rwb = kzalloc_node(sizeof(*rwb), GFP_KERNEL, q->node);
+	if (!rwb)
+		return -ENOMEM;
+
+	rwb->queue = q;
+	atomic_set(&rwb->inflight, 0);
+	init_waitqueue_head(&rwb->wait);
+	spin_lock_init(&rwb->lock);
+	rwb->lat_usec = -1;
+	rwb->win_nsec = 100 * NSEC_PER_MSEC;
+	rwb->win_start = ktime_to_ns(ktime_get());
+	rwb->win_min_lat = ULLONG_MAX;
+
+	q->rq_wb = rwb;
+	return 0;
+}
+
+void wbt_exit(struct request_queue *q)
+{
+	kfree(q->rq_wb);
+	q->rq_wb = NULL;
+}
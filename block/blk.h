@@ -29,6 +29,19 @@ void __blk_queue_free_tags(struct request_queue *q);
 bool __blk_end_bidi_request(struct request *rq, int error,
 			    unsigned int nr_bytes, unsigned int bidi_bytes);
 
+bool bio_attempt_back_merge(struct request_queue *q, struct request *req,
+			    struct bio *bio);
+bool bio_attempt_front_merge(struct request_queue *q, struct request *req,
+			     struct bio *bio);
+bool blk_attempt_plug_merge(struct request_queue *q, struct bio *bio,
+			    unsigned int *request_count);
+void blk_plug_add_request(struct blk_plug *plug, struct request *rq,
+			  struct list_head *list);
+
+void drive_stat_acct(struct request *rq, int new_io);
+void blk_account_io_completion(struct request *req, unsigned int bytes);
+void blk_account_io_done(struct request *req);
+
 void blk_rq_timed_out_timer(unsigned long data);
 void blk_delete_timer(struct request *);
 void blk_add_timer(struct request *);
@@ -39,6 +52,7 @@ void __generic_unplug_device(struct request_queue *);
  */
 enum rq_atomic_flags {
 	REQ_ATOM_COMPLETE = 0,
+	REQ_ATOM_STARTED,
 };
 
 /*
@@ -181,6 +195,28 @@ static inline int blk_do_io_stat(struct request *rq)
 	        (rq->cmd_flags & REQ_DISCARD));
 }
 
+#ifdef CONFIG_BLK_LAT_HIST
+/*
+ * Classify @rq for the latency histogram while its flags are still those
+ * of the bio: blk_insert_flush() clears REQ_FLUSH before it completes.
+ */
+static inline void blk_rq_set_lat_op(struct request *rq)
+{
+	if (rq->cmd_flags & REQ_DISCARD)
+		rq->lat_op = DISK_LAT_DISCARD;
+	else if (rq->cmd_flags & REQ_FLUSH)
+		rq->lat_op = DISK_LAT_FLUSH;
+	else if (rq_data_dir(rq) == WRITE)
+		rq->lat_op = DISK_LAT_WRITE;
+	else
+		rq->lat_op = DISK_LAT_READ;
+}
+#else
+static inline void blk_rq_set_lat_op(struct request *rq)
+{
+}
+#endif
+
 /*
  * Internal io_context interface
  */
@@ -234,4 +270,32 @@ static inline void blk_throtl_exit(struct request_queue *q) { }
 static inline void blk_throtl_release(struct request_queue *q) { }
 #endif /* CONFIG_BLK_DEV_THROTTLING */
 
+/*
+ * Writeback throttling
+ */
+#ifdef CONFIG_BLK_WBT
+extern bool wbt_wait(struct request_queue *q, struct bio *bio,
+		     spinlock_t *lock);
+extern void wbt_release(struct request_queue *q);
+extern void wbt_issue(struct request_queue *q, struct request *rq);
+extern void wbt_done(struct request_queue *q, struct request *rq);
+extern ssize_t wbt_lat_show(struct request_queue *q, char *page);
+extern ssize_t wbt_lat_store(struct request_queue *q, const char *page,
+			     size_t count);
+extern ssize_t wbt_stats_show(struct request_queue *q, char *page);
+extern int wbt_init(struct request_queue *q);
+extern void wbt_exit(struct request_queue *q);
+#else /* CONFIG_BLK_WBT */
+static inline bool wbt_wait(struct request_queue *q, struct bio *bio,
+			    spinlock_t *lock)
+{
+	return false;
+}
+static inline void wbt_release(struct request_queue *q) { }
+static inline void wbt_issue(struct request_queue *q, struct request *rq) { }
+static inline void wbt_done(struct request_queue *q, struct request *rq) { }
+static inline int wbt_init(struct request_queue *q) { return 0; }
+static inline void wbt_exit(struct request_queue *q) { }
+#endif /* CONFIG_BLK_WBT */
+
 #endif /* BLK_INTERNAL_H */
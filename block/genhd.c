@@ -978,6 +978,75 @@ static ssize_t disk_discard_alignment_show(struct device *dev,
 	return sprintf(buf, "%d\n", queue_discard_alignment(disk->queue));
 }
 
+#ifdef CONFIG_BLK_LAT_HIST
+/**
+ * disk_lat_hist_add - account the latency of a completed request
+ * @cpu:	the current cpu, as returned by part_stat_lock()
+ * @disk:	the disk the request was issued to
+ * @op:		DISK_LAT_* type of the request
+ * @nsec:	time from allocation of the request to its completion
+ */
+void disk_lat_hist_add(int cpu, struct gendisk *disk, int op, u64 nsec)
+{
+	unsigned long usec = div_u64(nsec, NSEC_PER_USEC);
+	int bucket = usec ? ilog2(usec) : 0;
+
+	bucket = min(bucket, DISK_LAT_BUCKETS - 1);
+	per_cpu_ptr(disk->lat_hist, cpu)->buckets[op][bucket]++;
+}
+
+/*
+ * One line per bucket: the lower bound of the bucket in usecs, then the
+ * number of reads, writes, flushes and discards that fell into it.
+ */
+static ssize_t disk_lat_hist_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct gendisk *disk = dev_to_disk(dev);
+	char *start = buf;
+	int b, op, cpu;
+
+	for (b = 0; b < DISK_LAT_BUCKETS; b++) {
+		unsigned long sum[DISK_LAT_NR_OPS] = { 0 };
+
+		for_each_possible_cpu(cpu) {
+			struct disk_lat_hist *hist;
+
+			hist = per_cpu_ptr(disk->lat_hist, cpu);
+			for (op = 0; op < DISK_LAT_NR_OPS; op++)
+				sum[op] += hist->buckets[op][b];
+		}
+
+		buf += sprintf(buf, "%8lu %lu %lu %lu %lu\n",
+			       b ? 1UL << b : 0UL, sum[DISK_LAT_READ],
+			       sum[DISK_LAT_WRITE], sum[DISK_LAT_FLUSH],
+			       sum[DISK_LAT_DISCARD]);
+	}
+
+	return buf - start;
+}
+
+static int disk_alloc_lat_hist(struct gendisk *disk)
+{
+	disk->lat_hist = alloc_percpu(struct disk_lat_hist);
+	return disk->lat_hist ? 0 : -ENOMEM;
+}
+
+static void disk_free_lat_hist(struct gendisk *disk)
+{
+	free_percpu(disk->lat_hist);
+}
+#else
+static inline int disk_alloc_lat_hist(struct gendisk *disk)
+{
+	return 0;
+}
+
+static inline void disk_free_lat_hist(struct gendisk *disk)
+{
+}
+#endif
+
 static DEVICE_ATTR(range, S_IRUGO, disk_range_show, NULL);
 static DEVICE_ATTR(ext_range, S_IRUGO, disk_ext_range_show, NULL);
 static DEVICE_ATTR(removable, S_IRUGO, disk_removable_show, NULL);
@@ -989,6 +1058,9 @@ static DEVICE_ATTR(discard_alignment, S_IRUGO, disk_discard_alignment_show,
 static DEVICE_ATTR(capability, S_IRUGO, disk_capability_show, NULL);
 static DEVICE_ATTR(stat, S_IRUGO, part_stat_show, NULL);
 static DEVICE_ATTR(inflight, S_IRUGO, part_inflight_show, NULL);
+#ifdef CONFIG_BLK_LAT_HIST
+static DEVICE_ATTR(latency_hist, S_IRUGO, disk_lat_hist_show, NULL);
+#endif
 #ifdef CONFIG_FAIL_MAKE_REQUEST
 static struct device_attribute dev_attr_fail =
 	__ATTR(make-it-fail, S_IRUGO|S_IWUSR, part_fail_show, part_fail_store);
@@ -1010,6 +1082,9 @@ static struct attribute *disk_attrs[] = {
 	&dev_attr_capability.attr,
 	&dev_attr_stat.attr,
 	&dev_attr_inflight.attr,
+#ifdef CONFIG_BLK_LAT_HIST
+	&dev_attr_latency_hist.attr,
+#endif
 #ifdef CONFIG_FAIL_MAKE_REQUEST
 	&dev_attr_fail.attr,
 #endif
@@ -1105,6 +1180,7 @@ static void disk_release(struct device *dev)
 	disk_replace_part_tbl(disk, NULL);
 	free_part_stats(&disk->part0);
 	free_part_info(&disk->part0);
+	disk_free_lat_hist(disk);
 	if (disk->queue)
 		blk_put_queue(disk->queue);
 	kfree(disk);
@@ -1260,8 +1336,14 @@ struct gendisk *alloc_disk_node(int minors, int node_id)
 			kfree(disk);
 			return NULL;
 		}
+		if (disk_alloc_lat_hist(disk)) {
+			free_part_stats(&disk->part0);
+			kfree(disk);
+			return NULL;
+		}
 		disk->node_id = node_id;
 		if (disk_expand_part_tbl(disk, 0)) {
+			disk_free_lat_hist(disk);
 			free_part_stats(&disk->part0);
 			kfree(disk);
 			return NULL;
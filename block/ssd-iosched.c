@@ -0,0 +1,386 @@
+/*
+ *  SSD deadline i/o scheduler.
+ *
+ *  A deadline scheduler for devices without a seek penalty.  Requests are
+ *  served in arrival order from a read FIFO and two write FIFOs, sync and
+ *  async, with no sector sorting, and the device is never idled for.
+ *  Reads are preferred over writes within the read and write deadlines,
+ *  and async writes are held back once the device has async_depth of them
+ *  in flight, so that reads and sync writes don't queue up behind
+ *  writeback at the device.  Sync writes queued after held back async
+ *  writes go ahead of them.
+ *
+ *  See Documentation/block/ssd-iosched.txt
+ */
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/elevator.h>
+#include <linux/bio.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/init.h>
+
+static const int read_expire = HZ / 10;	/* max time before a read is submitted. */
+static const int write_expire = HZ;	/* ditto for writes, these limits are SOFT! */
+static const int writes_starved = 4;	/* max times reads can starve a write */
+static const int fifo_batch = 16;	/* # of requests of one direction in a row */
+static const int async_depth = 16;	/* max async writes at the device */
+
+enum {
+	SSD_FIFO_READ,
+	SSD_FIFO_SYNC_WRITE,
+	SSD_FIFO_ASYNC_WRITE,
+	SSD_NR_FIFOS,
+};
+
+struct ssd_data {
+	struct list_head fifo_list[SSD_NR_FIFOS];
+
+	/*
+	 * the current batch
+	 */
+	int batch_dir;
+	unsigned int batching;		/* requests dispatched in this batch */
+	unsigned int starved;		/* times reads have starved writes */
+	bool async_throttled;		/* async write held back by async_depth */
+
+	/*
+	 * settings that change how the i/o scheduler behaves
+	 */
+	int fifo_expire[2];
+	int fifo_batch;
+	int writes_starved;
+	int async_depth;
+};
+
+static inline int ssd_rq_fifo(struct request *rq)
+{
+	if (rq_data_dir(rq) == READ)
+		return SSD_FIFO_READ;
+	return rq_is_sync(rq) ? SSD_FIFO_SYNC_WRITE : SSD_FIFO_ASYNC_WRITE;
+}
+
+static void ssd_add_request(struct request_queue *q, struct request *rq)
+{
+	struct ssd_data *sd = q->elevator->elevator_data;
+	const int data_dir = rq_data_dir(rq);
+
+	rq_set_fifo_time(rq, jiffies + sd->fifo_expire[data_dir]);
+	list_add_tail(&rq->queuelist, &sd->fifo_list[ssd_rq_fifo(rq)]);
+}
+
+static void ssd_merged_requests(struct request_queue *q, struct request *req,
+				struct request *next)
+{
+	/*
+	 * if next expires before rq, assign its expire time to rq
+	 * and move into next position (next will be deleted) in fifo,
+	 * unless a sync write merged into an async one or the other way
+	 * around, which would put req on the wrong fifo
+	 */
+	if (!list_empty(&req->queuelist) && !list_empty(&next->queuelist) &&
+	    ssd_rq_fifo(req) == ssd_rq_fifo(next)) {
+		if (time_before(rq_fifo_time(next), rq_fifo_time(req))) {
+			list_move(&req->queuelist, &next->queuelist);
+			rq_set_fifo_time(req, rq_fifo_time(next));
+		}
+	}
+
+	rq_fifo_clear(next);
+}
+
+static int ssd_allow_merge(struct request_queue *q, struct request *rq,
+			   struct bio *bio)
+{
+	/*
+	 * a sync write merged into an async one would wait with it while
+	 * async writes are held back
+	 */
+	if ((bio->bi_rw & REQ_SYNC) && !rq_is_sync(rq))
+		return 0;
+	return 1;
+}
+
+/*
+ * Neighbours in the fifo are the likeliest to be sector neighbours too,
+ * with requests served in arrival order.
+ */
+static struct request *
+ssd_former_request(struct request_queue *q, struct request *rq)
+{
+	struct ssd_data *sd = q->elevator->elevator_data;
+
+	if (rq->queuelist.prev == &sd->fifo_list[ssd_rq_fifo(rq)])
+		return NULL;
+	return rq_entry_fifo(rq->queuelist.prev);
+}
+
+static struct request *
+ssd_latter_request(struct request_queue *q, struct request *rq)
+{
+	struct ssd_data *sd = q->elevator->elevator_data;
+
+	if (rq->queuelist.next == &sd->fifo_list[ssd_rq_fifo(rq)])
+		return NULL;
+	return rq_entry_fifo(rq->queuelist.next);
+}
+
+/*
+ * returns 1 if the oldest request of fifo is past its deadline
+ */
+static inline int ssd_fifo_expired(struct ssd_data *sd, int fifo)
+{
+	if (list_empty(&sd->fifo_list[fifo]))
+		return 0;
+
+	return time_after(jiffies,
+			  rq_fifo_time(rq_entry_fifo(sd->fifo_list[fifo].next)));
+}
+
+static inline int ssd_dir_queued(struct ssd_data *sd, int ddir)
+{
+	if (ddir == READ)
+		return !list_empty(&sd->fifo_list[SSD_FIFO_READ]);
+	return !list_empty(&sd->fifo_list[SSD_FIFO_SYNC_WRITE]) ||
+	       !list_empty(&sd->fifo_list[SSD_FIFO_ASYNC_WRITE]);
+}
+
+static inline int ssd_dir_expired(struct ssd_data *sd, int ddir)
+{
+	if (ddir == READ)
+		return ssd_fifo_expired(sd, SSD_FIFO_READ);
+	return ssd_fifo_expired(sd, SSD_FIFO_SYNC_WRITE) ||
+	       ssd_fifo_expired(sd, SSD_FIFO_ASYNC_WRITE);
+}
+
+/*
+ * The oldest write, or the oldest sync write if async writes can't go.
+ * Both write fifos use write_expire, so the earlier deadline is the
+ * earlier arrival.
+ */
+static struct request *ssd_next_write(struct ssd_data *sd, bool async_ok)
+{
+	struct list_head *sync = &sd->fifo_list[SSD_FIFO_SYNC_WRITE];
+	struct list_head *async = &sd->fifo_list[SSD_FIFO_ASYNC_WRITE];
+	struct request *srq, *arq;
+
+	srq = list_empty(sync) ? NULL : rq_entry_fifo(sync->next);
+	if (!async_ok || list_empty(async))
+		return srq;
+
+	arq = rq_entry_fifo(async->next);
+	if (srq && !time_before(rq_fifo_time(arq), rq_fifo_time(srq)))
+		return srq;
+	return arq;
+}
+
+static int ssd_dispatch_requests(struct request_queue *q, int force)
+{
+	struct ssd_data *sd = q->elevator->elevator_data;
+	const int reads = ssd_dir_queued(sd, READ);
+	const int writes = ssd_dir_queued(sd, WRITE);
+	const bool async_ok = force ||
+			      q->in_flight[BLK_RW_ASYNC] < sd->async_depth;
+	struct request *rq;
+	int data_dir;
+
+	if (!reads && !writes)
+		return 0;
+
+	/*
+	 * go on with the current batch, unless the other direction
+	 * has a request past its deadline
+	 */
+	if (sd->batching < sd->fifo_batch &&
+	    ssd_dir_queued(sd, sd->batch_dir) &&
+	    !ssd_dir_expired(sd, !sd->batch_dir)) {
+		data_dir = sd->batch_dir;
+	} else {
+		data_dir = reads ? READ : WRITE;
+		if (reads && writes && (ssd_dir_expired(sd, WRITE) ||
+					sd->starved++ >= sd->writes_starved))
+			data_dir = WRITE;
+		if (data_dir == WRITE)
+			sd->starved = 0;
+
+		sd->batch_dir = data_dir;
+		sd->batching = 0;
+	}
+
+	if (data_dir == READ)
+		rq = rq_entry_fifo(sd->fifo_list[SSD_FIFO_READ].next);
+	else
+		rq = ssd_next_write(sd, async_ok);
+
+	if (!rq) {
+		/*
+		 * only async writes are queued and the device has its fill
+		 * of them, reads may still go ahead
+		 */
+		if (!reads) {
+			sd->async_throttled = true;
+			return 0;
+		}
+
+		rq = rq_entry_fifo(sd->fifo_list[SSD_FIFO_READ].next);
+		sd->batch_dir = READ;
+		sd->batching = 0;
+	}
+
+	sd->batching++;
+	rq_fifo_clear(rq);
+	elv_dispatch_add_tail(q, rq);
+
+	return 1;
+}
+
+static void ssd_completed_request(struct request_queue *q, struct request *rq)
+{
+	struct ssd_data *sd = q->elevator->elevator_data;
+
+	/*
+	 * the driver may not run the queue on completion by itself, so
+	 * kick it once an async write held back can go
+	 */
+	if (sd->async_throttled && !rq_is_sync(rq)) {
+		sd->async_throttled = false;
+		blk_run_queue_async(q);
+	}
+}
+
+static void ssd_exit_queue(struct elevator_queue *e)
+{
+	struct ssd_data *sd = e->elevator_data;
+
+	BUG_ON(!list_empty(&sd->fifo_list[SSD_FIFO_READ]));
+	BUG_ON(!list_empty(&sd->fifo_list[SSD_FIFO_SYNC_WRITE]));
+	BUG_ON(!list_empty(&sd->fifo_list[SSD_FIFO_ASYNC_WRITE]));
+
+	kfree(sd);
+}
+
+static void *ssd_init_queue(struct request_queue *q)
+{
+	struct ssd_data *sd;
+
+	sd = kmalloc_node(sizeof(*sd), GFP_KERNEL | __GFP_ZERO, q->node);
+	if (!sd)
+		return NULL;
+
+	INIT_LIST_HEAD(&sd->fifo_list[SSD_FIFO_READ]);
+	INIT_LIST_HEAD(&sd->fifo_list[SSD_FIFO_SYNC_WRITE]);
+	INIT_LIST_HEAD(&sd->fifo_list[SSD_FIFO_ASYNC_WRITE]);
+	sd->batch_dir = READ;
+	sd->fifo_expire[READ] = read_expire;
+	sd->fifo_expire[WRITE] = write_expire;
+	sd->writes_starved = writes_starved;
+	sd->fifo_batch = fifo_batch;
+	sd->async_depth = async_depth;
+	return sd;
+}
+
+/*
+ * sysfs parts below
+ */
+
+static ssize_t
+ssd_var_show(int var, char *page)
+{
+	return sprintf(page, "%d\n", var);
+}
+
+static ssize_t
+ssd_var_store(int *var, const char *page, size_t count)
+{
+	char *p = (char *) page;
+
+	*var = simple_strtol(p, &p, 10);
+	return count;
+}
+
+#define SHOW_FUNCTION(__FUNC, __VAR, __CONV)				\
+static ssize_t __FUNC(struct elevator_queue *e, char *page)		\
+{									\
+	struct ssd_data *sd = e->elevator_data;				\
+	int __data = __VAR;						\
+	if (__CONV)							\
+		__data = jiffies_to_msecs(__data);			\
+	return ssd_var_show(__data, (page));				\
+}
+SHOW_FUNCTION(ssd_read_expire_show, sd->fifo_expire[READ], 1);
+SHOW_FUNCTION(ssd_write_expire_show, sd->fifo_expire[WRITE], 1);
+SHOW_FUNCTION(ssd_writes_starved_show, sd->writes_starved, 0);
+SHOW_FUNCTION(ssd_fifo_batch_show, sd->fifo_batch, 0);
+SHOW_FUNCTION(ssd_async_depth_show, sd->async_depth, 0);
+#undef SHOW_FUNCTION
+
+#define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX, __CONV)			\
+static ssize_t __FUNC(struct elevator_queue *e, const char *page, size_t count)	\
+{									\
+	struct ssd_data *sd = e->elevator_data;				\
+	int __data;							\
+	int ret = ssd_var_store(&__data, (page), count);		\
+	if (__data < (MIN))						\
+		__data = (MIN);						\
+	else if (__data > (MAX))					\
+		__data = (MAX);						\
+	if (__CONV)							\
+		*(__PTR) = msecs_to_jiffies(__data);			\
+	else								\
+		*(__PTR) = __data;					\
+	return ret;							\
+}
+STORE_FUNCTION(ssd_read_expire_store, &sd->fifo_expire[READ], 0, INT_MAX, 1);
+STORE_FUNCTION(ssd_write_expire_store, &sd->fifo_expire[WRITE], 0, INT_MAX, 1);
+STORE_FUNCTION(ssd_writes_starved_store, &sd->writes_starved, INT_MIN, INT_MAX, 0);
+STORE_FUNCTION(ssd_fifo_batch_store, &sd->fifo_batch, 1, INT_MAX, 0);
+STORE_FUNCTION(ssd_async_depth_store, &sd->async_depth, 1, INT_MAX, 0);
+#undef STORE_FUNCTION
+
+#define SSD_ATTR(name) \
+	__ATTR(name, S_IRUGO|S_IWUSR, ssd_##name##_show, \
+				      ssd_##name##_store)
+
+static struct elv_fs_entry ssd_attrs[] = {
+	SSD_ATTR(read_expire),
+	SSD_ATTR(write_expire),
+	SSD_ATTR(writes_starved),
+	SSD_ATTR(fifo_batch),
+	SSD_ATTR(async_depth),
+	__ATTR_NULL
+};
+
+static struct elevator_type iosched_ssd = {
+	.ops = {
+		.elevator_merge_req_fn =	ssd_merged_requests,
+		.elevator_allow_merge_fn =	ssd_allow_merge,
+		.elevator_dispatch_fn =		ssd_dispatch_requests,
+		.elevator_add_req_fn =		ssd_add_request,
+		.elevator_completed_req_fn =	ssd_completed_request,
+		.elevator_former_req_fn =	ssd_former_request,
+		.elevator_latter_req_fn =	ssd_latter_request,
+		.elevator_init_fn =		ssd_init_queue,
+		.elevator_exit_fn =		ssd_exit_queue,
+	},
+
+	.elevator_attrs = ssd_attrs,
+	.elevator_name = "ssd",
+	.elevator_owner = THIS_MODULE,
+};
+
+static int __init ssd_init(void)
+{
+	return elv_register(&iosched_ssd);
+}
+
+static void __exit ssd_exit(void)
+{
+	elv_unregister(&iosched_ssd);
+}
+
+module_init(ssd_init);
+module_exit(ssd_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("SSD deadline IO scheduler");
@@ -76,6 +76,7 @@
 #include <linux/sysfs.h>
 #include <linux/miscdevice.h>
 #include <linux/falloc.h>
+#include <linux/mempool.h>
 
 #include <asm/uaccess.h>
 
@@ -458,6 +459,408 @@ out:
 	return ret;
 }
 
+/*
+ * Direct IO mode
+ *
+ * Instead of reading and writing the backing file through its page cache,
+ * which caches every block a second time and serializes all IO in the loop
+ * thread, bios are remapped to the blocks that back the file and sent to
+ * the device underneath straight from the submitter, any number at a time.
+ *
+ * The file's block map is taken once when the mode is switched on, the way
+ * swapon does it.  So the file must be fully allocated, and its blocks must
+ * stay put: like a swap file it is marked S_SWAPFILE while in use, which
+ * refuses truncation, unlinking and the online defragmenters.  Discard is
+ * not supported, as punching holes would free blocks we still map.
+ */
+struct loop_extent {
+	sector_t	file_sector;	/* first sector of the file covered */
+	sector_t	disk_sector;	/* where that is on lo_dio_bdev */
+	sector_t	nr_sects;
+};
+
+struct loop_dio {
+	struct loop_device	*lo;
+	struct bio		*bio;		/* the bio sent to the loop */
+	atomic_t		remaining;	/* clones in flight, plus one */
+	int			error;
+};
+
+static struct bio_set *loop_bio_set;
+static mempool_t *loop_dio_pool;
+
+static struct loop_extent *loop_find_extent(struct loop_device *lo,
+					    sector_t sector)
+{
+	unsigned int low = 0, high = lo->lo_nr_extents;
+
+	while (low < high) {
+		unsigned int mid = (low + high) / 2;
+		struct loop_extent *ext = &lo->lo_extents[mid];
+
+		if (sector < ext->file_sector)
+			high = mid;
+		else if (sector >= ext->file_sector + ext->nr_sects)
+			low = mid + 1;
+		else
+			return ext;
+	}
+	return NULL;
+}
+
+static void loop_dio_put(struct loop_dio *dio)
+{
+	struct loop_device *lo = dio->lo;
+
+	if (!atomic_dec_and_test(&dio->remaining))
+		return;
+
+	bio_endio(dio->bio, dio->error);
+	mempool_free(dio, loop_dio_pool);
+	if (atomic_dec_and_test(&lo->lo_dio_inflight))
+		wake_up(&lo->lo_dio_wait);
+}
+
+static void loop_dio_end_io(struct bio *clone, int error)
+{
+	struct loop_dio *dio = clone->bi_private;
+
+	if (error)
+		dio->error = error;
+	bio_put(clone);
+	loop_dio_put(dio);
+}
+
+static void loop_dio_destructor(struct bio *clone)
+{
+	bio_free(clone, loop_bio_set);
+}
+
+static struct bio *loop_dio_alloc(struct loop_dio *dio, sector_t sector,
+				  unsigned int nr_vecs)
+{
+	struct bio *clone;
+
+	clone = bio_alloc_bioset(GFP_NOIO, min_t(unsigned int, nr_vecs,
+						 BIO_MAX_PAGES), loop_bio_set);
+	clone->bi_destructor = loop_dio_destructor;
+	clone->bi_bdev = dio->lo->lo_dio_bdev;
+	clone->bi_sector = sector;
+	clone->bi_rw = dio->bio->bi_rw;
+	clone->bi_end_io = loop_dio_end_io;
+	clone->bi_private = dio;
+	return clone;
+}
+
+static void loop_dio_send(struct loop_dio *dio, struct bio *clone)
+{
+	atomic_inc(&dio->remaining);
+	generic_make_request(clone);
+}
+
+/*
+ * Remap @bio onto lo_dio_bdev.  Its segments are packed into clones for as
+ * long as they stay contiguous on disk; a new clone starts wherever the
+ * file is fragmented.  The caller has accounted @bio in lo_dio_inflight.
+ */
+static void loop_dio_make_request(struct loop_device *lo, struct bio *bio)
+{
+	struct bio *clone = NULL;
+	struct loop_dio *dio;
+	struct bio_vec *bvec;
+	sector_t sector;
+	int i;
+
+	dio = mempool_alloc(loop_dio_pool, GFP_NOIO);
+	dio->lo = lo;
+	dio->bio = bio;
+	atomic_set(&dio->remaining, 1);
+	dio->error = 0;
+
+	if (bio->bi_rw & REQ_DISCARD) {
+		dio->error = -EOPNOTSUPP;
+		goto out;
+	}
+
+	/* an empty flush only has to reach the device */
+	if (!bio->bi_size) {
+		loop_dio_send(dio, loop_dio_alloc(dio, 0, 0));
+		goto out;
+	}
+
+	sector = bio->bi_sector + (lo->lo_offset >> 9);
+	bio_for_each_segment(bvec, bio, i) {
+		unsigned int offset = bvec->bv_offset;
+		unsigned int left = bvec->bv_len;
+
+		if (left & 511) {
+			dio->error = -EIO;
+			goto out;
+		}
+
+		while (left) {
+			struct loop_extent *ext = loop_find_extent(lo, sector);
+			sector_t disk_sector;
+			unsigned int len;
+
+			if (!ext) {
+				dio->error = -EIO;
+				goto out;
+			}
+			disk_sector = ext->disk_sector +
+				(sector - ext->file_sector);
+			len = min_t(sector_t, left >> 9,
+				    ext->file_sector + ext->nr_sects - sector) << 9;
+
+			if (clone && (clone->bi_sector + (clone->bi_size >> 9) !=
+				      disk_sector ||
+				      bio_add_page(clone, bvec->bv_page, len,
+						   offset) < len)) {
+				loop_dio_send(dio, clone);
+				clone = NULL;
+			}
+			if (!clone) {
+				clone = loop_dio_alloc(dio, disk_sector,
+						       bio->bi_vcnt - i);
+				/* an empty bio always takes a page */
+				if (bio_add_page(clone, bvec->bv_page, len,
+						 offset) < len)
+					BUG();
+			}
+
+			sector += len >> 9;
+			offset += len;
+			left -= len;
+		}
+	}
+
+out:
+	if (clone)
+		loop_dio_send(dio, clone);
+	loop_dio_put(dio);
+}
+
+/* Called with lo_lock held. */
+static bool loop_dio_get(struct loop_device *lo)
+{
+	if (!(lo->lo_flags & LO_FLAGS_DIRECT_IO))
+		return false;
+	atomic_inc(&lo->lo_dio_inflight);
+	return true;
+}
+
+#define LOOP_FIEMAP_BATCH	32
+
+/*
+ * bmap() hands out preallocated but unwritten blocks just like written
+ * ones: reading them behind the file system's back returns whatever the
+ * disk held before, and writing them leaves them flagged unwritten, so
+ * the data reads back as zeroes.  Refuse files that have any, or whose
+ * layout the file system won't tell us.  Some ->fiemap() implementations
+ * take i_mutex, so this must be called without it.
+ */
+static int loop_dio_check_extents(struct file *file, struct inode *inode)
+{
+	const u32 bad = FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC |
+			FIEMAP_EXTENT_UNWRITTEN;
+	struct fiemap_extent_info fieinfo = { 0, };
+	struct fiemap_extent *extents;
+	u64 start = 0, size = i_size_read(inode);
+	int error = 0;
+
+	/* without fallocate there is no way to get unwritten extents */
+	if (!file->f_op->fallocate)
+		return 0;
+	if (!inode->i_op->fiemap)
+		return -EINVAL;
+
+	extents = kmalloc(LOOP_FIEMAP_BATCH * sizeof(*extents), GFP_KERNEL);
+	if (!extents)
+		return -ENOMEM;
+
+	while (start < size) {
+		unsigned int i;
+
+		fieinfo.fi_extents_mapped = 0;
+		fieinfo.fi_extents_max = LOOP_FIEMAP_BATCH;
+		fieinfo.fi_kernel_extents = extents;
+
+		error = inode->i_op->fiemap(inode, &fieinfo, start, size - start);
+		if (error)
+			break;
+		if (!fieinfo.fi_extents_mapped)
+			break;
+
+		for (i = 0; i < fieinfo.fi_extents_mapped; i++) {
+			if (extents[i].fe_flags & bad) {
+				error = -EINVAL;
+				goto out;
+			}
+		}
+		i--;
+		if (extents[i].fe_flags & FIEMAP_EXTENT_LAST)
+			break;
+		start = extents[i].fe_logical + extents[i].fe_length;
+		cond_resched();
+	}
+out:
+	kfree(extents);
+	return error;
+}
+
+static int loop_dio_map_file(struct loop_device *lo, struct inode *inode)
+{
+	unsigned int blkbits = inode->i_blkbits;
+	sector_t sects_per_block = 1 << (blkbits - 9);
+	struct loop_extent *map = NULL, *ext = NULL;
+	unsigned int nr = 0, max = 0;
+	sector_t block, nr_blocks;
+	int error = 0;
+
+	if (!inode->i_mapping->a_ops->bmap)
+		return -EINVAL;
+
+	nr_blocks = (i_size_read(inode) + (1 << blkbits) - 1) >> blkbits;
+	for (block = 0; block < nr_blocks; block++) {
+		sector_t phys = bmap(inode, block);
+
+		cond_resched();
+
+		/* a hole, or a file system that can't tell */
+		if (!phys) {
+			error = -EINVAL;
+			goto fail;
+		}
+
+		if (ext &&
+		    ext->file_sector + ext->nr_sects == block * sects_per_block &&
+		    ext->disk_sector + ext->nr_sects == phys * sects_per_block) {
+			ext->nr_sects += sects_per_block;
+			continue;
+		}
+
+		if (nr == max) {
+			struct loop_extent *new;
+
+			max = max ? 2 * max : 16;
+			new = krealloc(map, max * sizeof(*map), GFP_KERNEL);
+			if (!new) {
+				error = -ENOMEM;
+				goto fail;
+			}
+			map = new;
+		}
+		ext = &map[nr++];
+		ext->file_sector = block * sects_per_block;
+		ext->disk_sector = phys * sects_per_block;
+		ext->nr_sects = sects_per_block;
+	}
+
+	lo->lo_extents = map;
+	lo->lo_nr_extents = nr;
+	return 0;
+
+fail:
+	kfree(map);
+	return error;
+}
+
+/*
+ * Switch to direct IO.  Runs in the loop thread, so everything queued
+ * before has completed, and whatever it finds queued behind it already
+ * takes the direct path.
+ */
+static int loop_dio_enable(struct loop_device *lo)
+{
+	struct file *file = lo->lo_backing_file;
+	struct inode *inode = file->f_mapping->host;
+	struct block_device *bdev;
+	int error;
+
+	bdev = S_ISBLK(inode->i_mode) ? inode->i_bdev : inode->i_sb->s_bdev;
+	if (!bdev ||
+	    bdev_logical_block_size(bdev) > queue_logical_block_size(lo->lo_queue) ||
+	    (lo->lo_offset & (bdev_logical_block_size(bdev) - 1)))
+		return -EINVAL;
+
+	/* get delayed allocations done, and our writes out of the cache */
+	error = filemap_write_and_wait(file->f_mapping);
+	if (error)
+		return error;
+
+	if (S_ISBLK(inode->i_mode)) {
+		lo->lo_extents = kzalloc(sizeof(*lo->lo_extents), GFP_KERNEL);
+		if (!lo->lo_extents)
+			return -ENOMEM;
+		lo->lo_extents->nr_sects = i_size_read(inode) >> 9;
+		lo->lo_nr_extents = 1;
+	} else {
+		/* check the extents with no locks held, to fail early */
+		error = loop_dio_check_extents(file, inode);
+		if (error)
+			return error;
+
+		mutex_lock(&inode->i_mutex);
+		if (IS_SWAPFILE(inode))
+			error = -EBUSY;
+		else
+			inode->i_flags |= S_SWAPFILE;
+		mutex_unlock(&inode->i_mutex);
+		if (error)
+			return error;
+
+		/*
+		 * S_SWAPFILE keeps the file from being truncated from here
+		 * on, but the file may have changed before: check again.
+		 */
+		error = loop_dio_check_extents(file, inode);
+		if (!error)
+			error = loop_dio_map_file(lo, inode);
+		if (error) {
+			mutex_lock(&inode->i_mutex);
+			inode->i_flags &= ~S_SWAPFILE;
+			mutex_unlock(&inode->i_mutex);
+			return error;
+		}
+	}
+
+	/* don't let a stale cached copy shadow what we write from now on */
+	invalidate_inode_pages2(file->f_mapping);
+
+	lo->lo_dio_bdev = bdev;
+	spin_lock_irq(&lo->lo_lock);
+	lo->lo_flags |= LO_FLAGS_DIRECT_IO;
+	spin_unlock_irq(&lo->lo_lock);
+	return 0;
+}
+
+static void loop_dio_disable(struct loop_device *lo)
+{
+	struct inode *inode = lo->lo_backing_file->f_mapping->host;
+
+	if (!(lo->lo_flags & LO_FLAGS_DIRECT_IO))
+		return;
+
+	spin_lock_irq(&lo->lo_lock);
+	lo->lo_flags &= ~LO_FLAGS_DIRECT_IO;
+	spin_unlock_irq(&lo->lo_lock);
+
+	wait_event(lo->lo_dio_wait, !atomic_read(&lo->lo_dio_inflight));
+
+	/* whatever is cached predates the writes we sent around it */
+	invalidate_inode_pages2(lo->lo_backing_file->f_mapping);
+
+	if (!S_ISBLK(inode->i_mode)) {
+		mutex_lock(&inode->i_mutex);
+		inode->i_flags &= ~S_SWAPFILE;
+		mutex_unlock(&inode->i_mutex);
+	}
+	kfree(lo->lo_extents);
+	lo->lo_extents = NULL;
+	lo->lo_nr_extents = 0;
+	lo->lo_dio_bdev = NULL;
+}
+
 /*
  * Add bio to back of pending list
  */
@@ -489,6 +892,11 @@ static void loop_make_request(struct request_queue *q, struct bio *old_bio)
 		goto out;
 	if (unlikely(rw == WRITE && (lo->lo_flags & LO_FLAGS_READ_ONLY)))
 		goto out;
+	if (loop_dio_get(lo)) {
+		spin_unlock_irq(&lo->lo_lock);
+		loop_dio_make_request(lo, old_bio);
+		return;
+	}
 	loop_add_bio(lo, old_bio);
 	wake_up(&lo->lo_event);
 	spin_unlock_irq(&lo->lo_lock);
@@ -501,6 +909,8 @@ out:
 
 struct switch_request {
 	struct file *file;
+	bool dio;		/* switch to direct IO instead */
+	int error;
 	struct completion wait;
 };
 
@@ -508,9 +918,21 @@ static void do_loop_switch(struct loop_device *, struct switch_request *);
 
 static inline void loop_handle_bio(struct loop_device *lo, struct bio *bio)
 {
+	bool dio;
+
 	if (unlikely(!bio->bi_bdev)) {
 		do_loop_switch(lo, bio->bi_private);
 		bio_put(bio);
+		return;
+	}
+
+	spin_lock_irq(&lo->lo_lock);
+	dio = loop_dio_get(lo);
+	spin_unlock_irq(&lo->lo_lock);
+
+	if (dio) {
+		/* queued behind the switch to direct IO */
+		loop_dio_make_request(lo, bio);
 	} else {
 		int ret = do_bio_filebacked(lo, bio);
 		bio_endio(bio, ret);
@@ -560,19 +982,25 @@ static int loop_thread(void *data)
  * First it needs to flush existing IO, it does this by sending a magic
  * BIO down the pipe. The completion of this BIO does the actual switch.
  */
-static int loop_switch(struct loop_device *lo, struct file *file)
+static int __loop_switch(struct loop_device *lo, struct switch_request *w)
 {
-	struct switch_request w;
 	struct bio *bio = bio_alloc(GFP_KERNEL, 0);
 	if (!bio)
 		return -ENOMEM;
-	init_completion(&w.wait);
-	w.file = file;
-	bio->bi_private = &w;
+	init_completion(&w->wait);
+	w->error = 0;
+	bio->bi_private = w;
 	bio->bi_bdev = NULL;
 	loop_make_request(lo->lo_queue, bio);
-	wait_for_completion(&w.wait);
-	return 0;
+	wait_for_completion(&w->wait);
+	return w->error;
+}
+
+static int loop_switch(struct loop_device *lo, struct file *file)
+{
+	struct switch_request w = { .file = file };
+
+	return __loop_switch(lo, &w);
 }
 
 /*
@@ -596,6 +1024,11 @@ static void do_loop_switch(struct loop_device *lo, struct switch_request *p)
 	struct file *old_file = lo->lo_backing_file;
 	struct address_space *mapping;
 
+	if (p->dio) {
+		p->error = loop_dio_enable(lo);
+		goto out;
+	}
+
 	/* if no new file, only flush of queued bios requested */
 	if (!file)
 		goto out;
@@ -636,6 +1069,11 @@ static int loop_change_fd(struct loop_device *lo, struct block_device *bdev,
 	if (!(lo->lo_flags & LO_FLAGS_READ_ONLY))
 		goto out;
 
+	/* the block map is the old file's */
+	error = -EBUSY;
+	if (lo->lo_flags & LO_FLAGS_DIRECT_IO)
+		goto out;
+
 	error = -EBADF;
 	file = fget(arg);
 	if (!file)
@@ -676,6 +1114,8 @@ static inline int is_loop_device(struct file *file)
 	return i && S_ISBLK(i->i_mode) && MAJOR(i->i_rdev) == LOOP_MAJOR;
 }
 
+static int loop_set_dio(struct loop_device *lo, unsigned long arg);
+
 /* loop sysfs attributes */
 
 static ssize_t loop_attr_show(struct device *dev, char *page,
@@ -687,6 +1127,17 @@ static ssize_t loop_attr_show(struct device *dev, char *page,
 	return callback(lo, page);
 }
 
+static ssize_t loop_attr_store(struct device *dev, const char *page,
+			       size_t count,
+			       ssize_t (*callback)(struct loop_device *,
+						   const char *, size_t))
+{
+	struct gendisk *disk = dev_to_disk(dev);
+	struct loop_device *lo = disk->private_data;
+
+	return callback(lo, page, count);
+}
+
 #define LOOP_ATTR_RO(_name)						\
 static ssize_t loop_attr_##_name##_show(struct loop_device *, char *);	\
 static ssize_t loop_attr_do_show_##_name(struct device *d,		\
@@ -697,6 +1148,25 @@ static ssize_t loop_attr_do_show_##_name(struct device *d,		\
 static struct device_attribute loop_attr_##_name =			\
 	__ATTR(_name, S_IRUGO, loop_attr_do_show_##_name, NULL);
 
+#define LOOP_ATTR_RW(_name)						\
+static ssize_t loop_attr_##_name##_show(struct loop_device *, char *);	\
+static ssize_t loop_attr_##_name##_store(struct loop_device *,		\
+					 const char *, size_t);		\
+static ssize_t loop_attr_do_show_##_name(struct device *d,		\
+				struct device_attribute *attr, char *b)	\
+{									\
+	return loop_attr_show(d, b, loop_attr_##_name##_show);		\
+}									\
+static ssize_t loop_attr_do_store_##_name(struct device *d,		\
+				struct device_attribute *attr,		\
+				const char *b, size_t c)		\
+{									\
+	return loop_attr_store(d, b, c, loop_attr_##_name##_store);	\
+}									\
+static struct device_attribute loop_attr_##_name =			\
+	__ATTR(_name, S_IRUGO | S_IWUSR, loop_attr_do_show_##_name,	\
+	       loop_attr_do_store_##_name);
+
 static ssize_t loop_attr_backing_file_show(struct loop_device *lo, char *buf)
 {
 	ssize_t ret;
@@ -743,11 +1213,38 @@ static ssize_t loop_attr_partscan_show(struct loop_device *lo, char *buf)
 	return sprintf(buf, "%s\n", partscan ? "1" : "0");
 }
 
+static ssize_t loop_attr_dio_show(struct loop_device *lo, char *buf)
+{
+	int dio = (lo->lo_flags & LO_FLAGS_DIRECT_IO);
+
+	return sprintf(buf, "%s\n", dio ? "1" : "0");
+}
+
+static ssize_t loop_attr_dio_store(struct loop_device *lo, const char *buf,
+				   size_t count)
+{
+	unsigned long dio;
+	int err;
+
+	err = kstrtoul(buf, 10, &dio);
+	if (err)
+		return err;
+
+	/* lo_ctl_mutex is held over removal of this attribute */
+	if (!mutex_trylock(&lo->lo_ctl_mutex))
+		return restart_syscall();
+	err = loop_set_dio(lo, dio);
+	mutex_unlock(&lo->lo_ctl_mutex);
+
+	return err ? err : count;
+}
+
 LOOP_ATTR_RO(backing_file);
 LOOP_ATTR_RO(offset);
 LOOP_ATTR_RO(sizelimit);
 LOOP_ATTR_RO(autoclear);
 LOOP_ATTR_RO(partscan);
+LOOP_ATTR_RW(dio);
 
 static struct attribute *loop_attrs[] = {
 	&loop_attr_backing_file.attr,
@@ -755,6 +1252,7 @@ static struct attribute *loop_attrs[] = {
 	&loop_attr_sizelimit.attr,
 	&loop_attr_autoclear.attr,
 	&loop_attr_partscan.attr,
+	&loop_attr_dio.attr,
 	NULL,
 };
 
@@ -785,10 +1283,12 @@ static void loop_config_discard(struct loop_device *lo)
 	 * We use punch hole to reclaim the free space used by the
 	 * image a.k.a. discard. However we do support discard if
 	 * encryption is enabled, because it may give an attacker
-	 * useful information.
+	 * useful information.  Nor with direct IO, where punching
+	 * holes would free blocks that we still have mapped.
 	 */
 	if ((!file->f_op->fallocate) ||
-	    lo->lo_encrypt_key_size) {
+	    lo->lo_encrypt_key_size ||
+	    (lo->lo_flags & LO_FLAGS_DIRECT_IO)) {
 		q->limits.discard_granularity = 0;
 		q->limits.discard_alignment = 0;
 		q->limits.max_discard_sectors = 0;
@@ -987,6 +1487,7 @@ static int loop_clr_fd(struct loop_device *lo)
 	spin_unlock_irq(&lo->lo_lock);
 
 	kthread_stop(lo->lo_thread);
+	loop_dio_disable(lo);
 
 	spin_lock_irq(&lo->lo_lock);
 	lo->lo_backing_file = NULL;
@@ -1048,6 +1549,11 @@ loop_set_status(struct loop_device *lo, const struct loop_info64 *info)
 		return -ENXIO;
 	if ((unsigned int) info->lo_encrypt_key_size > LO_KEY_SIZE)
 		return -EINVAL;
+	if ((lo->lo_flags & LO_FLAGS_DIRECT_IO) &&
+	    (info->lo_encrypt_type || info->lo_encrypt_key_size ||
+	     (info->lo_offset &
+	      (bdev_logical_block_size(lo->lo_dio_bdev) - 1))))
+		return -EINVAL;
 
 	err = loop_release_xfer(lo);
 	if (err)
@@ -1259,6 +1765,13 @@ static int loop_set_capacity(struct loop_device *lo, struct block_device *bdev)
 	err = figure_loop_size(lo, lo->lo_offset, lo->lo_sizelimit);
 	if (unlikely(err))
 		goto out;
+	/* the file may have grown past the blocks we have mapped */
+	if (lo->lo_flags & LO_FLAGS_DIRECT_IO) {
+		loop_set_dio(lo, 0);
+		err = loop_set_dio(lo, 1);
+		if (err)
+			goto out;
+	}
 	sec = get_capacity(lo->lo_disk);
 	/* the width of sector_t may be narrow for bit-shift */
 	sz = sec;
@@ -1273,6 +1786,35 @@ static int loop_set_capacity(struct loop_device *lo, struct block_device *bdev)
 	return err;
 }
 
+/*
+ * Switch direct IO on or off.  Encrypted devices always go through the
+ * loop thread, as the data has to be transformed on its way.
+ */
+static int loop_set_dio(struct loop_device *lo, unsigned long arg)
+{
+	struct switch_request w = { .dio = true };
+	int err;
+
+	if (lo->lo_state != Lo_bound)
+		return -ENXIO;
+
+	if (!arg) {
+		loop_dio_disable(lo);
+		loop_config_discard(lo);
+		return 0;
+	}
+
+	if (lo->lo_flags & LO_FLAGS_DIRECT_IO)
+		return 0;
+	if (lo->lo_encryption || lo->lo_encrypt_key_size)
+		return -EINVAL;
+
+	err = __loop_switch(lo, &w);
+	if (!err)
+		loop_config_discard(lo);
+	return err;
+}
+
 static int lo_ioctl(struct block_device *bdev, fmode_t mode,
 	unsigned int cmd, unsigned long arg)
 {
@@ -1316,6 +1858,11 @@ static int lo_ioctl(struct block_device *bdev, fmode_t mode,
 		if ((mode & FMODE_WRITE) || capable(CAP_SYS_ADMIN))
 			err = loop_set_capacity(lo, bdev);
 		break;
+	case LOOP_SET_DIRECT_IO:
+		err = -EPERM;
+		if ((mode & FMODE_WRITE) || capable(CAP_SYS_ADMIN))
+			err = loop_set_dio(lo, arg);
+		break;
 	default:
 		err = lo->ioctl ? lo->ioctl(lo, cmd, arg) : -EINVAL;
 	}
@@ -1470,6 +2017,7 @@ static int lo_compat_ioctl(struct block_device *bdev, fmode_t mode,
 		arg = (unsigned long) compat_ptr(arg);
 	case LOOP_SET_FD:
 	case LOOP_CHANGE_FD:
+	case LOOP_SET_DIRECT_IO:
 		err = lo_ioctl(bdev, mode, cmd, arg);
 		break;
 	default:
@@ -1662,6 +2210,8 @@ static int loop_add(struct loop_device **l, int i)
 	lo->lo_number		= i;
 	lo->lo_thread		= NULL;
 	init_waitqueue_head(&lo->lo_event);
+	init_waitqueue_head(&lo->lo_dio_wait);
+	atomic_set(&lo->lo_dio_inflight, 0);
 	spin_lock_init(&lo->lo_lock);
 	disk->major		= LOOP_MAJOR;
 	disk->first_minor	= i << part_shift;
@@ -1859,8 +2409,18 @@ static int __init loop_init(void)
 		range = 1UL << MINORBITS;
 	}
 
+	err = -ENOMEM;
+	loop_bio_set = bioset_create(BIO_POOL_SIZE, 0);
+	if (!loop_bio_set)
+		goto misc_out;
+	loop_dio_pool = mempool_create_kmalloc_pool(BIO_POOL_SIZE,
+						    sizeof(struct loop_dio));
+	if (!loop_dio_pool)
+		goto bioset_out;
+
+	err = -EIO;
 	if (register_blkdev(LOOP_MAJOR, "loop"))
-		return -EIO;
+		goto pool_out;
 
 	blk_register_region(MKDEV(LOOP_MAJOR, 0), range,
 				  THIS_MODULE, loop_probe, NULL, NULL);
@@ -1873,6 +2433,14 @@ static int __init loop_init(void)
 
 	printk(KERN_INFO "loop: module loaded\n");
 	return 0;
+
+pool_out:
+	mempool_destroy(loop_dio_pool);
+bioset_out:
+	bioset_free(loop_bio_set);
+misc_out:
+	misc_deregister(&loop_misc);
+	return err;
 }
 
 static int loop_exit_cb(int id, void *ptr, void *data)
@@ -1896,6 +2464,8 @@ static void __exit loop_exit(void)
 	blk_unregister_region(MKDEV(LOOP_MAJOR, 0), range);
 	unregister_blkdev(LOOP_MAJOR, "loop");
 
+	mempool_destroy(loop_dio_pool);
+	bioset_free(loop_bio_set);
 	misc_deregister(&loop_misc);
 }
 
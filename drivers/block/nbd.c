@@ -15,6 +15,7 @@
 #include <linux/major.h>
 
 #include <linux/blkdev.h>
+#include <linux/blk-mq.h>
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/sched.h>
@@ -60,16 +61,15 @@ static struct nbd_device *nbd_dev;
 static int max_part;
 
 /*
- * Use just one lock (or at most 1 per NIC). Two arguments for this:
- * 1. Each NIC is essentially a synchronization point for all servers
- *    accessed through that NIC so there's no need to have more locks
- *    than NICs anyway.
- * 2. More locks lead to more "Dirty cache line bouncing" which will slow
- *    down each lock to the point where they're actually slower than just
- *    a single lock.
- * Thanks go to Jens Axboe and Al Viro for their LKML emails explaining this!
+ * Per request data.  The handle sent to the server is the request's tag,
+ * so that a reply finds its request without a search, and on whichever
+ * connection the request went out.
  */
-static DEFINE_SPINLOCK(nbd_lock);
+struct nbd_cmd {
+	struct nbd_sock *nsock;	/* connection the request is queued to */
+	struct list_head list;	/* on nsock->waiting_queue */
+	bool sent;		/* waiting for the reply */
+};
 
 #ifndef NDEBUG
 static const char *ioctl_cmd_to_ascii(int cmd)
@@ -103,20 +103,21 @@ static const char *nbdcmd_to_ascii(int cmd)
 
 static void nbd_end_request(struct request *req)
 {
+	struct nbd_cmd *cmd = blk_mq_rq_to_pdu(req);
 	int error = req->errors ? -EIO : 0;
-	struct request_queue *q = req->q;
-	unsigned long flags;
 
 	dprintk(DBG_BLKDEV, "%s: request %p: %s\n", req->rq_disk->disk_name,
 			req, error ? "failed" : "done");
 
-	spin_lock_irqsave(q->queue_lock, flags);
-	__blk_end_request_all(req, error);
-	spin_unlock_irqrestore(q->queue_lock, flags);
+	if (cmd->nsock)
+		atomic_dec(&cmd->nsock->inflight);
+	blk_mq_end_io(req, error);
 }
 
-static void sock_shutdown(struct nbd_device *nbd, int lock)
+static void sock_shutdown(struct nbd_sock *nsock, int lock)
 {
+	struct nbd_device *nbd = nsock->nbd;
+
 	/* Forcibly shutdown the socket causing all listeners
 	 * to error
 	 *
@@ -124,14 +125,26 @@ static void sock_shutdown(struct nbd_device *nbd, int lock)
 	 * there should be a more generic interface rather than
 	 * calling socket ops directly here */
 	if (lock)
-		mutex_lock(&nbd->tx_lock);
-	if (nbd->sock) {
-		dev_warn(disk_to_dev(nbd->disk), "shutting down socket\n");
-		kernel_sock_shutdown(nbd->sock, SHUT_RDWR);
-		nbd->sock = NULL;
+		mutex_lock(&nsock->tx_lock);
+	if (nsock->sock) {
+		dev_warn(disk_to_dev(nbd->disk),
+			 "shutting down socket %d\n", nsock->index);
+		kernel_sock_shutdown(nsock->sock, SHUT_RDWR);
+		spin_lock_irq(&nbd->queue_lock);
+		nsock->sock = NULL;
+		spin_unlock_irq(&nbd->queue_lock);
 	}
 	if (lock)
-		mutex_unlock(&nbd->tx_lock);
+		mutex_unlock(&nsock->tx_lock);
+}
+
+/* A connection going down takes all the others with it. */
+static void nbd_shutdown_socks(struct nbd_device *nbd)
+{
+	int i;
+
+	for (i = 0; i < nbd->num_connections; i++)
+		sock_shutdown(nbd->socks[i], 1);
 }
 
 static void nbd_xmit_timeout(unsigned long arg)
@@ -146,10 +159,11 @@ static void nbd_xmit_timeout(unsigned long arg)
 /*
  *  Send or receive packet.
  */
-static int sock_xmit(struct nbd_device *nbd, int send, void *buf, int size,
+static int sock_xmit(struct nbd_sock *nsock, int send, void *buf, int size,
 		int msg_flags)
 {
-	struct socket *sock = nbd->sock;
+	struct nbd_device *nbd = nsock->nbd;
+	struct socket *sock = nsock->sock;
 	int result;
 	struct msghdr msg;
 	struct kvec iov;
@@ -200,7 +214,7 @@ static int sock_xmit(struct nbd_device *nbd, int send, void *buf, int size,
 				task_pid_nr(current), current->comm,
 				dequeue_signal_lock(current, &current->blocked, &info));
 			result = -EINTR;
-			sock_shutdown(nbd, !send);
+			sock_shutdown(nsock, !send);
 			break;
 		}
 
@@ -218,36 +232,38 @@ static int sock_xmit(struct nbd_device *nbd, int send, void *buf, int size,
 	return result;
 }
 
-static inline int sock_send_bvec(struct nbd_device *nbd, struct bio_vec *bvec,
+static inline int sock_send_bvec(struct nbd_sock *nsock, struct bio_vec *bvec,
 		int flags)
 {
 	int result;
 	void *kaddr = kmap(bvec->bv_page);
-	result = sock_xmit(nbd, 1, kaddr + bvec->bv_offset,
+	result = sock_xmit(nsock, 1, kaddr + bvec->bv_offset,
 			   bvec->bv_len, flags);
 	kunmap(bvec->bv_page);
 	return result;
 }
 
-/* always call with the tx_lock held */
-static int nbd_send_req(struct nbd_device *nbd, struct request *req)
+/* always call with the connection's tx_lock held */
+static int nbd_send_req(struct nbd_sock *nsock, struct request *req)
 {
+	struct nbd_device *nbd = nsock->nbd;
 	int result, flags;
 	struct nbd_request request;
 	unsigned long size = blk_rq_bytes(req);
+	u64 handle = (u32)req->tag;
 
 	request.magic = htonl(NBD_REQUEST_MAGIC);
 	request.type = htonl(nbd_cmd(req));
 	request.from = cpu_to_be64((u64)blk_rq_pos(req) << 9);
 	request.len = htonl(size);
-	memcpy(request.handle, &req, sizeof(req));
+	memcpy(request.handle, &handle, sizeof(handle));
 
 	dprintk(DBG_TX, "%s: request %p: sending control (%s@%llu,%uB)\n",
 			nbd->disk->disk_name, req,
 			nbdcmd_to_ascii(nbd_cmd(req)),
 			(unsigned long long)blk_rq_pos(req) << 9,
 			blk_rq_bytes(req));
-	result = sock_xmit(nbd, 1, &request, sizeof(request),
+	result = sock_xmit(nsock, 1, &request, sizeof(request),
 			(nbd_cmd(req) == NBD_CMD_WRITE) ? MSG_MORE : 0);
 	if (result <= 0) {
 		dev_err(disk_to_dev(nbd->disk),
@@ -268,7 +284,7 @@ static int nbd_send_req(struct nbd_device *nbd, struct request *req)
 				flags = MSG_MORE;
 			dprintk(DBG_TX, "%s: request %p: sending %d bytes data\n",
 					nbd->disk->disk_name, req, bvec->bv_len);
-			result = sock_send_bvec(nbd, bvec, flags);
+			result = sock_send_bvec(nsock, bvec, flags);
 			if (result <= 0) {
 				dev_err(disk_to_dev(nbd->disk),
 					"Send data failed (result %d)\n",
@@ -283,25 +299,33 @@ error_out:
 	return -EIO;
 }
 
-static struct request *nbd_find_request(struct nbd_device *nbd,
-					struct request *xreq)
+static struct request *nbd_find_request(struct nbd_sock *nsock, u64 handle)
 {
-	struct request *req, *tmp;
+	struct nbd_device *nbd = nsock->nbd;
+	struct blk_mq_hw_ctx *hctx = nbd->disk->queue->queue_hw_ctx[0];
+	struct request *req;
+	struct nbd_cmd *cmd;
 	int err;
 
-	err = wait_event_interruptible(nbd->active_wq, nbd->active_req != xreq);
+	if (handle >= hctx->queue_depth)
+		return ERR_PTR(-ENOENT);
+
+	req = blk_mq_tag_to_rq(hctx, handle);
+	cmd = blk_mq_rq_to_pdu(req);
+
+	err = wait_event_interruptible(nsock->active_wq,
+				       nsock->active_req != req);
 	if (unlikely(err))
 		goto out;
 
-	spin_lock(&nbd->queue_lock);
-	list_for_each_entry_safe(req, tmp, &nbd->queue_head, queuelist) {
-		if (req != xreq)
-			continue;
-		list_del_init(&req->queuelist);
-		spin_unlock(&nbd->queue_lock);
+	/* only a request sent on this connection may be answered on it */
+	spin_lock_irq(&nbd->queue_lock);
+	if (cmd->sent && cmd->nsock == nsock) {
+		cmd->sent = false;
+		spin_unlock_irq(&nbd->queue_lock);
 		return req;
 	}
-	spin_unlock(&nbd->queue_lock);
+	spin_unlock_irq(&nbd->queue_lock);
 
 	err = -ENOENT;
 
@@ -309,25 +333,27 @@ out:
 	return ERR_PTR(err);
 }
 
-static inline int sock_recv_bvec(struct nbd_device *nbd, struct bio_vec *bvec)
+static inline int sock_recv_bvec(struct nbd_sock *nsock, struct bio_vec *bvec)
 {
 	int result;
 	void *kaddr = kmap(bvec->bv_page);
-	result = sock_xmit(nbd, 0, kaddr + bvec->bv_offset, bvec->bv_len,
+	result = sock_xmit(nsock, 0, kaddr + bvec->bv_offset, bvec->bv_len,
 			MSG_WAITALL);
 	kunmap(bvec->bv_page);
 	return result;
 }
 
 /* NULL returned = something went wrong, inform userspace */
-static struct request *nbd_read_stat(struct nbd_device *nbd)
+static struct request *nbd_read_stat(struct nbd_sock *nsock)
 {
+	struct nbd_device *nbd = nsock->nbd;
 	int result;
 	struct nbd_reply reply;
 	struct request *req;
+	u64 handle;
 
 	reply.magic = 0;
-	result = sock_xmit(nbd, 0, &reply, sizeof(reply), MSG_WAITALL);
+	result = sock_xmit(nsock, 0, &reply, sizeof(reply), MSG_WAITALL);
 	if (result <= 0) {
 		dev_err(disk_to_dev(nbd->disk),
 			"Receive control failed (result %d)\n", result);
@@ -341,14 +367,15 @@ static struct request *nbd_read_stat(struct nbd_device *nbd)
 		goto harderror;
 	}
 
-	req = nbd_find_request(nbd, *(struct request **)reply.handle);
+	memcpy(&handle, reply.handle, sizeof(handle));
+	req = nbd_find_request(nsock, handle);
 	if (IS_ERR(req)) {
 		result = PTR_ERR(req);
 		if (result != -ENOENT)
 			goto harderror;
 
-		dev_err(disk_to_dev(nbd->disk), "Unexpected reply (%p)\n",
-			reply.handle);
+		dev_err(disk_to_dev(nbd->disk), "Unexpected reply (%llx)\n",
+			(unsigned long long)handle);
 		result = -EBADR;
 		goto harderror;
 	}
@@ -367,7 +394,7 @@ static struct request *nbd_read_stat(struct nbd_device *nbd)
 		struct bio_vec *bvec;
 
 		rq_for_each_segment(bvec, req, iter) {
-			result = sock_recv_bvec(nbd, bvec);
+			result = sock_recv_bvec(nsock, bvec);
 			if (result <= 0) {
 				dev_err(disk_to_dev(nbd->disk), "Receive data failed (result %d)\n",
 					result);
@@ -398,6 +425,79 @@ static struct device_attribute pid_attr = {
 	.show = pid_show,
 };
 
+static int nbd_recv_thread(void *data)
+{
+	struct nbd_sock *nsock = data;
+	struct request *req;
+
+	set_user_nice(current, -20);
+	while ((req = nbd_read_stat(nsock)) != NULL)
+		nbd_end_request(req);
+
+	nbd_shutdown_socks(nsock->nbd);
+
+	/* stay around for kthread_stop() */
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+static int nbd_thread(void *data);
+
+/*
+ * Every connection gets a thread to send its requests, and all but the
+ * first one a thread to receive the replies; nbd_do_it() receives on the
+ * first one itself.
+ */
+static int nbd_start_threads(struct nbd_device *nbd)
+{
+	const char *name = nbd->disk->disk_name;
+	struct task_struct *thread;
+	int i;
+
+	for (i = 0; i < nbd->num_connections; i++) {
+		struct nbd_sock *nsock = nbd->socks[i];
+
+		thread = kthread_create(nbd_thread, nsock, "%s-tx%d", name, i);
+		if (IS_ERR(thread))
+			return PTR_ERR(thread);
+		nsock->send_thread = thread;
+		wake_up_process(thread);
+
+		if (!i)
+			continue;
+
+		thread = kthread_create(nbd_recv_thread, nsock, "%s-rx%d",
+					name, i);
+		if (IS_ERR(thread))
+			return PTR_ERR(thread);
+		nsock->recv_thread = thread;
+		wake_up_process(thread);
+	}
+	return 0;
+}
+
+/* The sockets must be shut down already, or the threads may not stop. */
+static void nbd_stop_threads(struct nbd_device *nbd)
+{
+	int i;
+
+	for (i = 0; i < nbd->num_connections; i++) {
+		struct nbd_sock *nsock = nbd->socks[i];
+
+		if (nsock->recv_thread)
+			kthread_stop(nsock->recv_thread);
+		nsock->recv_thread = NULL;
+		if (nsock->send_thread)
+			kthread_stop(nsock->send_thread);
+		nsock->send_thread = NULL;
+	}
+}
+
 static int nbd_do_it(struct nbd_device *nbd)
 {
 	struct request *req;
@@ -405,7 +505,6 @@ static int nbd_do_it(struct nbd_device *nbd)
 
 	BUG_ON(nbd->magic != NBD_MAGIC);
 
-	nbd->pid = task_pid_nr(current);
 	ret = device_create_file(disk_to_dev(nbd->disk), &pid_attr);
 	if (ret) {
 		dev_err(disk_to_dev(nbd->disk), "device_create_file failed!\n");
@@ -413,8 +512,15 @@ static int nbd_do_it(struct nbd_device *nbd)
 		return ret;
 	}
 
-	while ((req = nbd_read_stat(nbd)) != NULL)
-		nbd_end_request(req);
+	ret = nbd_start_threads(nbd);
+	if (ret)
+		nbd->harderror = ret;
+	else
+		while ((req = nbd_read_stat(nbd->socks[0])) != NULL)
+			nbd_end_request(req);
+
+	nbd_shutdown_socks(nbd);
+	nbd_stop_threads(nbd);
 
 	device_remove_file(disk_to_dev(nbd->disk), &pid_attr);
 	nbd->pid = 0;
@@ -423,33 +529,114 @@ static int nbd_do_it(struct nbd_device *nbd)
 
 static void nbd_clear_que(struct nbd_device *nbd)
 {
+	struct blk_mq_hw_ctx *hctx = nbd->disk->queue->queue_hw_ctx[0];
 	struct request *req;
+	struct nbd_cmd *cmd;
+	LIST_HEAD(list);
+	int i;
 
 	BUG_ON(nbd->magic != NBD_MAGIC);
 
 	/*
-	 * Because we have set nbd->sock to NULL under the tx_lock, all
-	 * modifications to the list must have completed by now.  For
-	 * the same reason, the active_req must be NULL.
-	 *
-	 * As a consequence, we don't need to take the spin lock while
-	 * purging the list here.
+	 * Because we have set every nsock->sock to NULL under its tx_lock
+	 * and stopped the threads, nothing is sent or received any more,
+	 * and new requests are failed right away.  What is left waits to
+	 * be sent, or for a reply that won't come.
 	 */
-	BUG_ON(nbd->sock);
-	BUG_ON(nbd->active_req);
+	spin_lock_irq(&nbd->queue_lock);
+	for (i = 0; i < nbd->num_connections; i++) {
+		struct nbd_sock *nsock = nbd->socks[i];
+
+		BUG_ON(nsock->sock);
+		BUG_ON(nsock->active_req);
+		list_splice_tail_init(&nsock->waiting_queue, &list);
+	}
+	spin_unlock_irq(&nbd->queue_lock);
 
-	while (!list_empty(&nbd->queue_head)) {
-		req = list_entry(nbd->queue_head.next, struct request,
-				 queuelist);
-		list_del_init(&req->queuelist);
+	while (!list_empty(&list)) {
+		cmd = list_first_entry(&list, struct nbd_cmd, list);
+		list_del_init(&cmd->list);
+		req = blk_mq_rq_from_pdu(cmd);
+		req->errors++;
+		nbd_end_request(req);
+	}
+
+	for (i = 0; i < hctx->queue_depth; i++) {
+		req = blk_mq_tag_to_rq(hctx, i);
+		cmd = blk_mq_rq_to_pdu(req);
+		if (!cmd->sent)
+			continue;
+		cmd->sent = false;
 		req->errors++;
 		nbd_end_request(req);
 	}
 }
 
+static int nbd_add_sock(struct nbd_device *nbd, struct file *file)
+{
+	struct nbd_sock **socks, **old;
+	struct nbd_sock *nsock;
+	int n = nbd->num_connections;
 
-static void nbd_handle_req(struct nbd_device *nbd, struct request *req)
+	nsock = kzalloc(sizeof(*nsock), GFP_KERNEL);
+	if (!nsock)
+		return -ENOMEM;
+	socks = kmalloc((n + 1) * sizeof(*socks), GFP_KERNEL);
+	if (!socks) {
+		kfree(nsock);
+		return -ENOMEM;
+	}
+
+	nsock->nbd = nbd;
+	nsock->file = file;
+	nsock->sock = SOCKET_I(file->f_path.dentry->d_inode);
+	nsock->index = n;
+	mutex_init(&nsock->tx_lock);
+	init_waitqueue_head(&nsock->active_wq);
+	INIT_LIST_HEAD(&nsock->waiting_queue);
+	init_waitqueue_head(&nsock->waiting_wq);
+	atomic_set(&nsock->inflight, 0);
+
+	spin_lock_irq(&nbd->queue_lock);
+	old = nbd->socks;
+	if (n)
+		memcpy(socks, old, n * sizeof(*socks));
+	socks[n] = nsock;
+	nbd->socks = socks;
+	nbd->num_connections = n + 1;
+	spin_unlock_irq(&nbd->queue_lock);
+
+	kfree(old);
+	return 0;
+}
+
+/* Drop all connections, nbd_clear_que() must have been run. */
+static void nbd_free_socks(struct nbd_device *nbd)
+{
+	struct nbd_sock **socks;
+	int i, n;
+
+	spin_lock_irq(&nbd->queue_lock);
+	socks = nbd->socks;
+	n = nbd->num_connections;
+	nbd->socks = NULL;
+	nbd->num_connections = 0;
+	nbd->next_sock = 0;
+	spin_unlock_irq(&nbd->queue_lock);
+
+	for (i = 0; i < n; i++) {
+		BUG_ON(atomic_read(&socks[i]->inflight));
+		fput(socks[i]->file);
+		kfree(socks[i]);
+	}
+	kfree(socks);
+}
+
+static void nbd_handle_req(struct nbd_sock *nsock, struct request *req)
 {
+	struct nbd_device *nbd = nsock->nbd;
+	struct nbd_cmd *cmd = blk_mq_rq_to_pdu(req);
+
 	if (req->cmd_type != REQ_TYPE_FS)
 		goto error_out;
 
@@ -465,29 +652,29 @@ static void nbd_handle_req(struct nbd_device *nbd, struct request *req)
 
 	req->errors = 0;
 
-	mutex_lock(&nbd->tx_lock);
-	if (unlikely(!nbd->sock)) {
-		mutex_unlock(&nbd->tx_lock);
+	mutex_lock(&nsock->tx_lock);
+	if (unlikely(!nsock->sock)) {
+		mutex_unlock(&nsock->tx_lock);
 		dev_err(disk_to_dev(nbd->disk),
 			"Attempted send on closed socket\n");
 		goto error_out;
 	}
 
-	nbd->active_req = req;
+	nsock->active_req = req;
 
-	if (nbd_send_req(nbd, req) != 0) {
+	if (nbd_send_req(nsock, req) != 0) {
 		dev_err(disk_to_dev(nbd->disk), "Request send failed\n");
 		req->errors++;
 		nbd_end_request(req);
 	} else {
-		spin_lock(&nbd->queue_lock);
-		list_add(&req->queuelist, &nbd->queue_head);
-		spin_unlock(&nbd->queue_lock);
+		spin_lock_irq(&nbd->queue_lock);
+		cmd->sent = true;
+		spin_unlock_irq(&nbd->queue_lock);
 	}
 
-	nbd->active_req = NULL;
-	mutex_unlock(&nbd->tx_lock);
-	wake_up_all(&nbd->active_wq);
+	nsock->active_req = NULL;
+	mutex_unlock(&nsock->tx_lock);
+	wake_up_all(&nsock->active_wq);
 
 	return;
 
@@ -498,28 +685,29 @@ error_out:
 
 static int nbd_thread(void *data)
 {
-	struct nbd_device *nbd = data;
-	struct request *req;
+	struct nbd_sock *nsock = data;
+	struct nbd_device *nbd = nsock->nbd;
+	struct nbd_cmd *cmd;
 
 	set_user_nice(current, -20);
-	while (!kthread_should_stop() || !list_empty(&nbd->waiting_queue)) {
+	while (!kthread_should_stop() || !list_empty(&nsock->waiting_queue)) {
 		/* wait for something to do */
-		wait_event_interruptible(nbd->waiting_wq,
+		wait_event_interruptible(nsock->waiting_wq,
 					 kthread_should_stop() ||
-					 !list_empty(&nbd->waiting_queue));
+					 !list_empty(&nsock->waiting_queue));
 
 		/* extract request */
-		if (list_empty(&nbd->waiting_queue))
+		if (list_empty(&nsock->waiting_queue))
 			continue;
 
 		spin_lock_irq(&nbd->queue_lock);
-		req = list_entry(nbd->waiting_queue.next, struct request,
-				 queuelist);
-		list_del_init(&req->queuelist);
+		cmd = list_entry(nsock->waiting_queue.next, struct nbd_cmd,
+				 list);
+		list_del_init(&cmd->list);
 		spin_unlock_irq(&nbd->queue_lock);
 
 		/* handle request */
-		nbd_handle_req(nbd, req);
+		nbd_handle_req(nsock, blk_mq_rq_from_pdu(cmd));
 	}
 	return 0;
 }
@@ -531,41 +719,86 @@ static int nbd_thread(void *data)
  *   { printk( "Warning: Ignoring result!\n"); nbd_end_request( req ); }
  */
 
-static void do_nbd_request(struct request_queue *q)
+/*
+ * Pick the connection with the fewest requests on it, going round the
+ * connections on a tie.  Called with queue_lock held.
+ */
+static struct nbd_sock *nbd_pick_sock(struct nbd_device *nbd)
 {
-	struct request *req;
-	
-	while ((req = blk_fetch_request(q)) != NULL) {
-		struct nbd_device *nbd;
+	struct nbd_sock *best = NULL;
+	int i, n = nbd->num_connections;
 
-		spin_unlock_irq(q->queue_lock);
+	for (i = 0; i < n; i++) {
+		struct nbd_sock *nsock = nbd->socks[(nbd->next_sock + i) % n];
 
-		dprintk(DBG_BLKDEV, "%s: request %p: dequeued (flags=%x)\n",
-				req->rq_disk->disk_name, req, req->cmd_type);
+		if (!nsock->sock)
+			continue;
+		if (!best || atomic_read(&nsock->inflight) <
+			     atomic_read(&best->inflight))
+			best = nsock;
+	}
 
-		nbd = req->rq_disk->private_data;
+	if (best)
+		nbd->next_sock = (best->index + 1) % n;
+	return best;
+}
 
-		BUG_ON(nbd->magic != NBD_MAGIC);
+static int nbd_queue_rq(struct blk_mq_hw_ctx *hctx, struct request *req)
+{
+	struct nbd_device *nbd = hctx->driver_data;
+	struct nbd_cmd *cmd = blk_mq_rq_to_pdu(req);
+	struct nbd_sock *nsock;
+	unsigned long flags;
 
-		if (unlikely(!nbd->sock)) {
-			dev_err(disk_to_dev(nbd->disk),
-				"Attempted send on closed socket\n");
-			req->errors++;
-			nbd_end_request(req);
-			spin_lock_irq(q->queue_lock);
-			continue;
-		}
+	dprintk(DBG_BLKDEV, "%s: request %p: dequeued (flags=%x)\n",
+			req->rq_disk->disk_name, req, req->cmd_type);
 
-		spin_lock_irq(&nbd->queue_lock);
-		list_add_tail(&req->queuelist, &nbd->waiting_queue);
-		spin_unlock_irq(&nbd->queue_lock);
+	BUG_ON(nbd->magic != NBD_MAGIC);
 
-		wake_up(&nbd->waiting_wq);
+	cmd->nsock = NULL;
+	cmd->sent = false;
 
-		spin_lock_irq(q->queue_lock);
+	spin_lock_irqsave(&nbd->queue_lock, flags);
+	nsock = nbd_pick_sock(nbd);
+	if (unlikely(!nsock)) {
+		spin_unlock_irqrestore(&nbd->queue_lock, flags);
+		dev_err(disk_to_dev(nbd->disk),
+			"Attempted send on closed socket\n");
+		return BLK_MQ_RQ_QUEUE_ERROR;
 	}
+
+	cmd->nsock = nsock;
+	atomic_inc(&nsock->inflight);
+	list_add_tail(&cmd->list, &nsock->waiting_queue);
+	spin_unlock_irqrestore(&nbd->queue_lock, flags);
+
+	wake_up(&nsock->waiting_wq);
+	return BLK_MQ_RQ_QUEUE_OK;
 }
 
+static int nbd_init_hctx(struct blk_mq_hw_ctx *hctx, void *data,
+			 unsigned int index)
+{
+	int i;
+
+	/* replies are checked against the pdu of any tag they name */
+	for (i = 0; i < hctx->queue_depth; i++) {
+		struct nbd_cmd *cmd = blk_mq_rq_to_pdu(hctx->rqs[i]);
+
+		memset(cmd, 0, sizeof(*cmd));
+		INIT_LIST_HEAD(&cmd->list);
+	}
+
+	hctx->driver_data = data;
+	return 0;
+}
+
+static struct blk_mq_ops nbd_mq_ops = {
+	.queue_rq	= nbd_queue_rq,
+	.map_queue	= blk_mq_map_queue,
+	.init_hctx	= nbd_init_hctx,
+};
+
 /* Must be called with tx_lock held */
 
 static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *nbd,
@@ -574,41 +807,61 @@ static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *nbd,
 	switch (cmd) {
 	case NBD_DISCONNECT: {
 		struct request sreq;
+		int i, sent = 0;
 
 		dev_info(disk_to_dev(nbd->disk), "NBD_DISCONNECT\n");
 
 		blk_rq_init(NULL, &sreq);
 		sreq.cmd_type = REQ_TYPE_SPECIAL;
 		nbd_cmd(&sreq) = NBD_CMD_DISC;
-		if (!nbd->sock)
+		for (i = 0; i < nbd->num_connections; i++) {
+			struct nbd_sock *nsock = nbd->socks[i];
+
+			mutex_lock(&nsock->tx_lock);
+			if (nsock->sock) {
+				nbd_send_req(nsock, &sreq);
+				sent++;
+			}
+			mutex_unlock(&nsock->tx_lock);
+		}
+		if (!sent)
 			return -EINVAL;
-		nbd_send_req(nbd, &sreq);
-                return 0;
+		return 0;
 	}
  
 	case NBD_CLEAR_SOCK: {
-		struct file *file;
+		int i;
 
-		nbd->sock = NULL;
-		file = nbd->file;
-		nbd->file = NULL;
+		/* NBD_DO_IT cleans up once its connections are down */
+		if (nbd->pid) {
+			nbd_shutdown_socks(nbd);
+			return 0;
+		}
+
+		spin_lock_irq(&nbd->queue_lock);
+		for (i = 0; i < nbd->num_connections; i++)
+			nbd->socks[i]->sock = NULL;
+		spin_unlock_irq(&nbd->queue_lock);
 		nbd_clear_que(nbd);
-		BUG_ON(!list_empty(&nbd->queue_head));
-		if (file)
-			fput(file);
+		nbd_free_socks(nbd);
 		return 0;
 	}
 
 	case NBD_SET_SOCK: {
 		struct file *file;
-		if (nbd->file)
+		int error;
+
+		if (nbd->pid)
 			return -EBUSY;
 		file = fget(arg);
 		if (file) {
 			struct inode *inode = file->f_path.dentry->d_inode;
 			if (S_ISSOCK(inode->i_mode)) {
-				nbd->file = file;
-				nbd->sock = SOCKET_I(inode);
+				error = nbd_add_sock(nbd, file);
+				if (error) {
+					fput(file);
+					return error;
+				}
 				if (max_part > 0)
 					bdev->bd_invalidated = 1;
 				return 0;
@@ -646,36 +899,25 @@ static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *nbd,
 		return 0;
 
 	case NBD_DO_IT: {
-		struct task_struct *thread;
-		struct file *file;
 		int error;
 
 		if (nbd->pid)
 			return -EBUSY;
-		if (!nbd->file)
+		if (!nbd->num_connections)
 			return -EINVAL;
 
+		/* no connections come or go while we run */
+		nbd->pid = task_pid_nr(current);
 		mutex_unlock(&nbd->tx_lock);
 
-		thread = kthread_create(nbd_thread, nbd, nbd->disk->disk_name);
-		if (IS_ERR(thread)) {
-			mutex_lock(&nbd->tx_lock);
-			return PTR_ERR(thread);
-		}
-		wake_up_process(thread);
 		error = nbd_do_it(nbd);
-		kthread_stop(thread);
 
 		mutex_lock(&nbd->tx_lock);
 		if (error)
 			return error;
-		sock_shutdown(nbd, 0);
-		file = nbd->file;
-		nbd->file = NULL;
 		nbd_clear_que(nbd);
 		dev_warn(disk_to_dev(nbd->disk), "queue cleared\n");
-		if (file)
-			fput(file);
+		nbd_free_socks(nbd);
 		nbd->bytesize = 0;
 		bdev->bd_inode->i_size = 0;
 		set_capacity(nbd->disk, 0);
@@ -689,16 +931,19 @@ static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *nbd,
 		 * This is for compatibility only.  The queue is always cleared
 		 * by NBD_DO_IT or NBD_CLEAR_SOCK.
 		 */
-		BUG_ON(!nbd->sock && !list_empty(&nbd->queue_head));
 		return 0;
 
-	case NBD_PRINT_DEBUG:
-		dev_info(disk_to_dev(nbd->disk),
-			"next = %p, prev = %p, head = %p\n",
-			nbd->queue_head.next, nbd->queue_head.prev,
-			&nbd->queue_head);
+	case NBD_PRINT_DEBUG: {
+		int i;
+
+		for (i = 0; i < nbd->num_connections; i++)
+			dev_info(disk_to_dev(nbd->disk),
+				"socket %d: %s, %d requests\n", i,
+				nbd->socks[i]->sock ? "up" : "down",
+				atomic_read(&nbd->socks[i]->inflight));
 		return 0;
 	}
+	}
 	return -ENOTTY;
 }
 
@@ -735,6 +980,15 @@ static const struct block_device_operations nbd_fops =
  *  (Just smiley confuses emacs :-)
  */
 
+static struct blk_mq_reg nbd_mq_reg = {
+	.ops		= &nbd_mq_ops,
+	.nr_hw_queues	= 1,
+	.queue_depth	= 128,
+	.cmd_size	= sizeof(struct nbd_cmd),
+	.numa_node	= NUMA_NO_NODE,
+	.flags		= BLK_MQ_F_SHOULD_MERGE,
+};
+
 static int __init nbd_init(void)
 {
 	int err = -ENOMEM;
@@ -775,6 +1029,8 @@ static int __init nbd_init(void)
 
 	for (i = 0; i < nbds_max; i++) {
 		struct gendisk *disk = alloc_disk(1 << part_shift);
+		struct request_queue *q;
+
 		if (!disk)
 			goto out;
 		nbd_dev[i].disk = disk;
@@ -783,11 +1039,13 @@ static int __init nbd_init(void)
 		 * every gendisk to have its very own request_queue struct.
 		 * These structs are big so we dynamically allocate them.
 		 */
-		disk->queue = blk_init_queue(do_nbd_request, &nbd_lock);
-		if (!disk->queue) {
+		q = blk_mq_init_queue(&nbd_mq_reg, &nbd_dev[i]);
+		if (IS_ERR(q)) {
 			put_disk(disk);
 			goto out;
 		}
+		disk->queue = q;
+		q->queuedata = &nbd_dev[i];
 		/*
 		 * Tell the block layer that we are not a rotational device
 		 */
@@ -804,15 +1062,12 @@ static int __init nbd_init(void)
 
 	for (i = 0; i < nbds_max; i++) {
 		struct gendisk *disk = nbd_dev[i].disk;
-		nbd_dev[i].file = NULL;
+		nbd_dev[i].socks = NULL;
+		nbd_dev[i].num_connections = 0;
 		nbd_dev[i].magic = NBD_MAGIC;
 		nbd_dev[i].flags = 0;
-		INIT_LIST_HEAD(&nbd_dev[i].waiting_queue);
 		spin_lock_init(&nbd_dev[i].queue_lock);
-		INIT_LIST_HEAD(&nbd_dev[i].queue_head);
 		mutex_init(&nbd_dev[i].tx_lock);
-		init_waitqueue_head(&nbd_dev[i].active_wq);
-		init_waitqueue_head(&nbd_dev[i].waiting_wq);
 		nbd_dev[i].blksize = 1024;
 		nbd_dev[i].bytesize = 0;
 		disk->major = NBD_MAJOR;
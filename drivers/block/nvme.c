@@ -672,6 +672,24 @@ static irqreturn_t nvme_process_cq(struct nvme_queue *nvmeq)
 	return IRQ_HANDLED;
 }
 
+/*
+ * blk_poll() support: process the completion queue of this CPU's queue
+ * pair, where a synchronous submitter's command went.
+ */
+static int nvme_poll(struct request_queue *q)
+{
+	struct nvme_ns *ns = q->queuedata;
+	struct nvme_queue *nvmeq = get_nvmeq(ns->dev);
+	int found;
+
+	spin_lock_irq(&nvmeq->q_lock);
+	found = nvme_process_cq(nvmeq) == IRQ_HANDLED;
+	spin_unlock_irq(&nvmeq->q_lock);
+	put_nvmeq(nvmeq);
+
+	return found;
+}
+
 static irqreturn_t nvme_irq(int irq, void *data)
 {
 	irqreturn_t result;
@@ -1329,6 +1347,7 @@ static struct nvme_ns *nvme_alloc_ns(struct nvme_dev *dev, int nsid,
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, ns->queue);
 /*	queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, ns->queue); */
 	blk_queue_make_request(ns->queue, nvme_make_request);
+	blk_queue_poll_fn(ns->queue, nvme_poll);
 	ns->dev = dev;
 	ns->queue->queuedata = ns;
 
@@ -2,6 +2,7 @@
 #include <linux/spinlock.h>
 #include <linux/slab.h>
 #include <linux/blkdev.h>
+#include <linux/blk-mq.h>
 #include <linux/hdreg.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
@@ -13,27 +14,36 @@
 #include <linux/idr.h>
 
 #define PART_BITS 4
+#define VQ_NAME_LEN 16
 
 static int major;
 static DEFINE_IDA(vd_index_ida);
 
+/* Tags per request virtqueue; the ring pushes back when it fills up. */
+static unsigned int virtblk_queue_depth = 64;
+module_param_named(queue_depth, virtblk_queue_depth, uint, 0444);
+MODULE_PARM_DESC(queue_depth, "Number of requests in flight per virtqueue");
+
 struct workqueue_struct *virtblk_wq;
 
-struct virtio_blk
-{
+struct virtio_blk_vq {
+	struct virtqueue *vq;
 	spinlock_t lock;
+	char name[VQ_NAME_LEN];
 
+	/* Statistics, protected by lock */
+	unsigned long submitted;
+	unsigned long completed;
+	unsigned long ring_full;
+} ____cacheline_aligned_in_smp;
+
+struct virtio_blk
+{
 	struct virtio_device *vdev;
-	struct virtqueue *vq;
 
 	/* The disk structure for the kernel. */
 	struct gendisk *disk;
 
-	/* Request tracking. */
-	struct list_head reqs;
-
-	mempool_t *pool;
-
 	/* Process context for config space updates */
 	struct work_struct config_work;
 
@@ -49,74 +59,127 @@ struct virtio_blk
 	/* Ida index - used to track minor number allocations. */
 	int index;
 
-	/* Scatterlist: can be too big for stack. */
-	struct scatterlist sg[/*sg_elems*/];
+	/* num of vqs, one per blk-mq hardware queue */
+	int num_vqs;
+	struct virtio_blk_vq *vqs;
 };
 
+/* Lives in the blk-mq pdu behind each struct request. */
 struct virtblk_req
 {
-	struct list_head list;
 	struct request *req;
 	struct virtio_blk_outhdr out_hdr;
 	struct virtio_scsi_inhdr in_hdr;
 	u8 status;
+	struct scatterlist sg[];
 };
 
-static void blk_done(struct virtqueue *vq)
+static int virtblk_vq_index(struct virtio_blk *vblk, struct virtqueue *vq)
+{
+	int i;
+
+	for (i = 0; i < vblk->num_vqs; i++)
+		if (vblk->vqs[i].vq == vq)
+			return i;
+
+	BUG();
+}
+
+static void virtblk_request_done(struct virtblk_req *vbr)
+{
+	struct request *req = vbr->req;
+	int error;
+
+	switch (vbr->status) {
+	case VIRTIO_BLK_S_OK:
+		error = 0;
+		break;
+	case VIRTIO_BLK_S_UNSUPP:
+		error = -ENOTTY;
+		break;
+	default:
+		error = -EIO;
+		break;
+	}
+
+	switch (req->cmd_type) {
+	case REQ_TYPE_BLOCK_PC:
+		req->resid_len = vbr->in_hdr.residual;
+		req->sense_len = vbr->in_hdr.sense_len;
+		req->errors = vbr->in_hdr.errors;
+		break;
+	case REQ_TYPE_SPECIAL:
+		req->errors = (error != 0);
+		break;
+	default:
+		break;
+	}
+
+	blk_mq_end_io(req, error);
+}
+
+/* Called with bvq->lock held, returns the number of requests completed. */
+static int __virtblk_reap(struct virtio_blk_vq *bvq)
 {
-	struct virtio_blk *vblk = vq->vdev->priv;
 	struct virtblk_req *vbr;
 	unsigned int len;
-	unsigned long flags;
+	int found = 0;
 
-	spin_lock_irqsave(&vblk->lock, flags);
-	while ((vbr = virtqueue_get_buf(vblk->vq, &len)) != NULL) {
-		int error;
+	while ((vbr = virtqueue_get_buf(bvq->vq, &len)) != NULL) {
+		virtblk_request_done(vbr);
+		bvq->completed++;
+		found++;
+	}
+	return found;
+}
 
-		switch (vbr->status) {
-		case VIRTIO_BLK_S_OK:
-			error = 0;
-			break;
-		case VIRTIO_BLK_S_UNSUPP:
-			error = -ENOTTY;
-			break;
-		default:
-			error = -EIO;
-			break;
-		}
+static void virtblk_done(struct virtqueue *vq)
+{
+	struct virtio_blk *vblk = vq->vdev->priv;
+	struct virtio_blk_vq *bvq = &vblk->vqs[virtblk_vq_index(vblk, vq)];
+	bool req_done = false;
+	unsigned long flags;
 
-		switch (vbr->req->cmd_type) {
-		case REQ_TYPE_BLOCK_PC:
-			vbr->req->resid_len = vbr->in_hdr.residual;
-			vbr->req->sense_len = vbr->in_hdr.sense_len;
-			vbr->req->errors = vbr->in_hdr.errors;
-			break;
-		case REQ_TYPE_SPECIAL:
-			vbr->req->errors = (error != 0);
-			break;
-		default:
-			break;
-		}
+	spin_lock_irqsave(&bvq->lock, flags);
+	do {
+		virtqueue_disable_cb(vq);
+		if (__virtblk_reap(bvq))
+			req_done = true;
+	} while (!virtqueue_enable_cb(vq));
+	spin_unlock_irqrestore(&bvq->lock, flags);
 
-		__blk_end_request_all(vbr->req, error);
-		list_del(&vbr->list);
-		mempool_free(vbr, vblk->pool);
-	}
 	/* In case queue is stopped waiting for more buffers. */
-	blk_start_queue(vblk->disk->queue);
-	spin_unlock_irqrestore(&vblk->lock, flags);
+	if (req_done)
+		blk_mq_start_stopped_hw_queues(vblk->disk->queue);
 }
 
-static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
-		   struct request *req)
+/* blk_poll() support: reap without waiting for the interrupt. */
+static int virtblk_poll(struct blk_mq_hw_ctx *hctx)
 {
+	struct virtio_blk *vblk = hctx->queue->queuedata;
+	struct virtio_blk_vq *bvq = &vblk->vqs[hctx->queue_num];
+	unsigned long flags;
+	int found;
+
+	spin_lock_irqsave(&bvq->lock, flags);
+	found = __virtblk_reap(bvq);
+	spin_unlock_irqrestore(&bvq->lock, flags);
+
+	if (found)
+		blk_mq_start_stopped_hw_queues(vblk->disk->queue);
+	return found;
+}
+
+static int virtio_queue_rq(struct blk_mq_hw_ctx *hctx, struct request *req)
+{
+	struct virtio_blk *vblk = hctx->queue->queuedata;
+	struct virtio_blk_vq *bvq = &vblk->vqs[hctx->queue_num];
+	struct virtblk_req *vbr = blk_mq_rq_to_pdu(req);
 	unsigned long num, out = 0, in = 0;
-	struct virtblk_req *vbr;
+	unsigned long flags;
+	bool notify;
 
-	vbr = mempool_alloc(vblk->pool, GFP_ATOMIC);
-	if (!vbr)
-		/* When another request finishes we'll try again. */
-		return false;
+	BUG_ON(req->nr_phys_segments + 2 > vblk->sg_elems);
 
 	vbr->req = req;
 
@@ -147,7 +210,8 @@ static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
 		}
 	}
 
-	sg_set_buf(&vblk->sg[out++], &vbr->out_hdr, sizeof(vbr->out_hdr));
+	sg_init_table(vbr->sg, vblk->sg_elems);
+	sg_set_buf(&vbr->sg[out++], &vbr->out_hdr, sizeof(vbr->out_hdr));
 
 	/*
 	 * If this is a packet command we need a couple of additional headers.
@@ -156,17 +220,17 @@ static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
 	 * inhdr with additional status information before the normal inhdr.
 	 */
 	if (vbr->req->cmd_type == REQ_TYPE_BLOCK_PC)
-		sg_set_buf(&vblk->sg[out++], vbr->req->cmd, vbr->req->cmd_len);
+		sg_set_buf(&vbr->sg[out++], vbr->req->cmd, vbr->req->cmd_len);
 
-	num = blk_rq_map_sg(q, vbr->req, vblk->sg + out);
+	num = blk_rq_map_sg(hctx->queue, vbr->req, vbr->sg + out);
 
 	if (vbr->req->cmd_type == REQ_TYPE_BLOCK_PC) {
-		sg_set_buf(&vblk->sg[num + out + in++], vbr->req->sense, SCSI_SENSE_BUFFERSIZE);
-		sg_set_buf(&vblk->sg[num + out + in++], &vbr->in_hdr,
+		sg_set_buf(&vbr->sg[num + out + in++], vbr->req->sense, SCSI_SENSE_BUFFERSIZE);
+		sg_set_buf(&vbr->sg[num + out + in++], &vbr->in_hdr,
 			   sizeof(vbr->in_hdr));
 	}
 
-	sg_set_buf(&vblk->sg[num + out + in++], &vbr->status,
+	sg_set_buf(&vbr->sg[num + out + in++], &vbr->status,
 		   sizeof(vbr->status));
 
 	if (num) {
@@ -179,36 +243,26 @@ static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
 		}
 	}
 
-	if (virtqueue_add_buf(vblk->vq, vblk->sg, out, in, vbr, GFP_ATOMIC)<0) {
-		mempool_free(vbr, vblk->pool);
-		return false;
-	}
-
-	list_add_tail(&vbr->list, &vblk->reqs);
-	return true;
-}
-
-static void do_virtblk_request(struct request_queue *q)
-{
-	struct virtio_blk *vblk = q->queuedata;
-	struct request *req;
-	unsigned int issued = 0;
-
-	while ((req = blk_peek_request(q)) != NULL) {
-		BUG_ON(req->nr_phys_segments + 2 > vblk->sg_elems);
-
-		/* If this request fails, stop queue and wait for something to
-		   finish to restart it. */
-		if (!do_req(q, vblk, req)) {
-			blk_stop_queue(q);
-			break;
-		}
-		blk_start_request(req);
-		issued++;
+	spin_lock_irqsave(&bvq->lock, flags);
+	if (virtqueue_add_buf(bvq->vq, vbr->sg, out, in, vbr, GFP_ATOMIC) < 0) {
+		/*
+		 * The ring is full.  Make sure the host sees what is already
+		 * there, and stop until a completion restarts us.  Stopping
+		 * under the lock means virtblk_done() can't miss it.
+		 */
+		bvq->ring_full++;
+		virtqueue_kick(bvq->vq);
+		blk_mq_stop_hw_queue(hctx);
+		spin_unlock_irqrestore(&bvq->lock, flags);
+		return BLK_MQ_RQ_QUEUE_BUSY;
 	}
+	bvq->submitted++;
+	notify = virtqueue_kick_prepare(bvq->vq);
+	spin_unlock_irqrestore(&bvq->lock, flags);
 
-	if (issued)
-		virtqueue_kick(vblk->vq);
+	if (notify)
+		virtqueue_notify(bvq->vq);
+	return BLK_MQ_RQ_QUEUE_OK;
 }
 
 /* return id (s/n) string for *disk to *id_str
@@ -316,6 +370,34 @@ static ssize_t virtblk_serial_show(struct device *dev,
 }
 DEVICE_ATTR(serial, S_IRUGO, virtblk_serial_show, NULL);
 
+/* One line per request virtqueue: name, submitted, completed, ring full */
+static ssize_t virtblk_vq_stats_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct gendisk *disk = dev_to_disk(dev);
+	struct virtio_blk *vblk = disk->private_data;
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < vblk->num_vqs; i++) {
+		struct virtio_blk_vq *bvq = &vblk->vqs[i];
+		unsigned long submitted, completed, ring_full;
+
+		spin_lock_irq(&bvq->lock);
+		submitted = bvq->submitted;
+		completed = bvq->completed;
+		ring_full = bvq->ring_full;
+		spin_unlock_irq(&bvq->lock);
+
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				 "%s %lu %lu %lu\n", bvq->name,
+				 submitted, completed, ring_full);
+	}
+
+	return len;
+}
+DEVICE_ATTR(vq_stats, S_IRUGO, virtblk_vq_stats_show, NULL);
+
 static void virtblk_config_changed_work(struct work_struct *work)
 {
 	struct virtio_blk *vblk =
@@ -365,16 +447,68 @@ static void virtblk_config_changed(struct virtio_device *vdev)
 
 static int init_vq(struct virtio_blk *vblk)
 {
-	int err = 0;
+	struct virtio_device *vdev = vblk->vdev;
+	vq_callback_t **callbacks;
+	struct virtqueue **vqs;
+	const char **names;
+	int err, i, num_vqs;
+
+	/*
+	 * The number of queues is fixed at probe time, as blk-mq sizes its
+	 * hardware contexts after it; a restore reuses what we had.
+	 */
+	num_vqs = vblk->num_vqs;
+
+	names = kmalloc(num_vqs * sizeof(*names), GFP_KERNEL);
+	callbacks = kmalloc(num_vqs * sizeof(*callbacks), GFP_KERNEL);
+	vqs = kmalloc(num_vqs * sizeof(*vqs), GFP_KERNEL);
+	if (!names || !callbacks || !vqs) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < num_vqs; i++) {
+		callbacks[i] = virtblk_done;
+		/* A single queue keeps the name hosts have always seen. */
+		if (num_vqs == 1)
+			strcpy(vblk->vqs[i].name, "requests");
+		else
+			snprintf(vblk->vqs[i].name, VQ_NAME_LEN,
+				 "req.%d", i);
+		names[i] = vblk->vqs[i].name;
+	}
+
+	err = vdev->config->find_vqs(vdev, num_vqs, vqs, callbacks, names);
+	if (err)
+		goto out;
 
-	/* We expect one virtqueue, for output. */
-	vblk->vq = virtio_find_single_vq(vblk->vdev, blk_done, "requests");
-	if (IS_ERR(vblk->vq))
-		err = PTR_ERR(vblk->vq);
+	for (i = 0; i < num_vqs; i++)
+		vblk->vqs[i].vq = vqs[i];
 
+out:
+	kfree(vqs);
+	kfree(callbacks);
+	kfree(names);
 	return err;
 }
 
+/*
+ * Point each virtqueue's interrupt at the CPUs that submit to it, so a
+ * completion is handled where its request came from.
+ */
+static void virtblk_set_affinity(struct virtio_blk *vblk)
+{
+	struct request_queue *q = vblk->disk->queue;
+	struct blk_mq_hw_ctx *hctx;
+	int i;
+
+	if (vblk->num_vqs == 1)
+		return;
+
+	queue_for_each_hw_ctx(q, hctx, i)
+		virtqueue_set_affinity(vblk->vqs[i].vq, hctx->cpumask);
+}
+
 /*
  * Legacy naming scheme used for virtio devices.  We are stuck with it for
  * virtio blk but don't ever use it for any new driver.
@@ -403,14 +537,21 @@ static int virtblk_name_format(char *prefix, int index, char *buf, int buflen)
 	return 0;
 }
 
+static struct blk_mq_ops virtio_mq_ops = {
+	.queue_rq	= virtio_queue_rq,
+	.map_queue	= blk_mq_map_queue,
+	.poll		= virtblk_poll,
+};
+
 static int __devinit virtblk_probe(struct virtio_device *vdev)
 {
 	struct virtio_blk *vblk;
 	struct request_queue *q;
-	int err, index;
+	struct blk_mq_reg reg;
+	int err, index, i;
 	u64 cap;
 	u32 v, blk_size, sg_elems, opt_io_size;
-	u16 min_io_size;
+	u16 min_io_size, num_vqs;
 	u8 physical_block_exp, alignment_offset;
 
 	err = ida_simple_get(&vd_index_ida, 0, minor_to_index(1 << MINORBITS),
@@ -430,46 +571,64 @@ static int __devinit virtblk_probe(struct virtio_device *vdev)
 
 	/* We need an extra sg elements at head and tail. */
 	sg_elems += 2;
-	vdev->priv = vblk = kmalloc(sizeof(*vblk) +
-				    sizeof(vblk->sg[0]) * sg_elems, GFP_KERNEL);
+	vdev->priv = vblk = kzalloc(sizeof(*vblk), GFP_KERNEL);
 	if (!vblk) {
 		err = -ENOMEM;
 		goto out_free_index;
 	}
 
-	INIT_LIST_HEAD(&vblk->reqs);
-	spin_lock_init(&vblk->lock);
 	vblk->vdev = vdev;
 	vblk->sg_elems = sg_elems;
-	sg_init_table(vblk->sg, vblk->sg_elems);
 	mutex_init(&vblk->config_lock);
 	INIT_WORK(&vblk->config_work, virtblk_config_changed_work);
 	vblk->config_enable = true;
 
-	err = init_vq(vblk);
-	if (err)
-		goto out_free_vblk;
-
-	vblk->pool = mempool_create_kmalloc_pool(1,sizeof(struct virtblk_req));
-	if (!vblk->pool) {
+	/* The host may offer one request virtqueue per vcpu. */
+	err = virtio_config_val(vdev, VIRTIO_BLK_F_MQ,
+				offsetof(struct virtio_blk_config, num_queues),
+				&num_vqs);
+	if (err || !num_vqs)
+		num_vqs = 1;
+
+	/* More queues than CPUs can never be used by blk-mq. */
+	vblk->num_vqs = min_t(unsigned int, num_vqs, nr_cpu_ids);
+	vblk->vqs = kcalloc(vblk->num_vqs, sizeof(*vblk->vqs), GFP_KERNEL);
+	if (!vblk->vqs) {
 		err = -ENOMEM;
-		goto out_free_vq;
+		goto out_free_vblk;
 	}
+	for (i = 0; i < vblk->num_vqs; i++)
+		spin_lock_init(&vblk->vqs[i].lock);
+
+	err = init_vq(vblk);
+	if (err)
+		goto out_free_vqs;
 
 	/* FIXME: How many partitions?  How long is a piece of string? */
 	vblk->disk = alloc_disk(1 << PART_BITS);
 	if (!vblk->disk) {
 		err = -ENOMEM;
-		goto out_mempool;
+		goto out_free_vq;
 	}
 
-	q = vblk->disk->queue = blk_init_queue(do_virtblk_request, &vblk->lock);
-	if (!q) {
-		err = -ENOMEM;
+	memset(&reg, 0, sizeof(reg));
+	reg.ops = &virtio_mq_ops;
+	reg.nr_hw_queues = vblk->num_vqs;
+	reg.queue_depth = virtblk_queue_depth;
+	reg.cmd_size = sizeof(struct virtblk_req) +
+			sizeof(struct scatterlist) * sg_elems;
+	reg.numa_node = NUMA_NO_NODE;
+	reg.flags = BLK_MQ_F_SHOULD_MERGE;
+
+	q = blk_mq_init_queue(&reg, vblk);
+	if (IS_ERR(q)) {
+		err = PTR_ERR(q);
 		goto out_put_disk;
 	}
+	vblk->disk->queue = q;
 
 	q->queuedata = vblk;
+	virtblk_set_affinity(vblk);
 
 	virtblk_name_format("vd", index, vblk->disk->disk_name, DISK_NAME_LEN);
 
@@ -557,6 +716,9 @@ static int __devinit virtblk_probe(struct virtio_device *vdev)
 
 	add_disk(vblk->disk);
 	err = device_create_file(disk_to_dev(vblk->disk), &dev_attr_serial);
+	if (err)
+		goto out_del_disk;
+	err = device_create_file(disk_to_dev(vblk->disk), &dev_attr_vq_stats);
 	if (err)
 		goto out_del_disk;
 
@@ -567,10 +729,10 @@ out_del_disk:
 	blk_cleanup_queue(vblk->disk->queue);
 out_put_disk:
 	put_disk(vblk->disk);
-out_mempool:
-	mempool_destroy(vblk->pool);
 out_free_vq:
 	vdev->config->del_vqs(vdev);
+out_free_vqs:
+	kfree(vblk->vqs);
 out_free_vblk:
 	kfree(vblk);
 out_free_index:
@@ -589,9 +751,6 @@ static void __devexit virtblk_remove(struct virtio_device *vdev)
 	vblk->config_enable = false;
 	mutex_unlock(&vblk->config_lock);
 
-	/* Nothing should be pending. */
-	BUG_ON(!list_empty(&vblk->reqs));
-
 	/* Stop all the virtqueues. */
 	vdev->config->reset(vdev);
 
@@ -600,8 +759,8 @@ static void __devexit virtblk_remove(struct virtio_device *vdev)
 	del_gendisk(vblk->disk);
 	blk_cleanup_queue(vblk->disk->queue);
 	put_disk(vblk->disk);
-	mempool_destroy(vblk->pool);
 	vdev->config->del_vqs(vdev);
+	kfree(vblk->vqs);
 	kfree(vblk);
 	ida_simple_remove(&vd_index_ida, index);
 }
@@ -621,9 +780,7 @@ static int virtblk_freeze(struct virtio_device *vdev)
 
 	flush_work(&vblk->config_work);
 
-	spin_lock_irq(vblk->disk->queue->queue_lock);
-	blk_stop_queue(vblk->disk->queue);
-	spin_unlock_irq(vblk->disk->queue->queue_lock);
+	blk_mq_stop_hw_queues(vblk->disk->queue);
 	blk_sync_queue(vblk->disk->queue);
 
 	vdev->config->del_vqs(vdev);
@@ -638,9 +795,8 @@ static int virtblk_restore(struct virtio_device *vdev)
 	vblk->config_enable = true;
 	ret = init_vq(vdev->priv);
 	if (!ret) {
-		spin_lock_irq(vblk->disk->queue->queue_lock);
-		blk_start_queue(vblk->disk->queue);
-		spin_unlock_irq(vblk->disk->queue->queue_lock);
+		virtblk_set_affinity(vblk);
+		blk_mq_start_stopped_hw_queues(vblk->disk->queue);
 	}
 	return ret;
 }
@@ -654,7 +810,7 @@ static const struct virtio_device_id id_table[] = {
 static unsigned int features[] = {
 	VIRTIO_BLK_F_SEG_MAX, VIRTIO_BLK_F_SIZE_MAX, VIRTIO_BLK_F_GEOMETRY,
 	VIRTIO_BLK_F_RO, VIRTIO_BLK_F_BLK_SIZE, VIRTIO_BLK_F_SCSI,
-	VIRTIO_BLK_F_FLUSH, VIRTIO_BLK_F_TOPOLOGY
+	VIRTIO_BLK_F_FLUSH, VIRTIO_BLK_F_TOPOLOGY, VIRTIO_BLK_F_MQ
 };
 
 /*
@@ -26,12 +26,15 @@
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/device.h>
+#include <linux/file.h>
+#include <linux/fs.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
 #include <linux/slab.h>
 #include <linux/lzo.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
 #include "zram_drv.h"
 
@@ -133,10 +136,201 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+static void zram_reset_bdev(struct zram *zram)
+{
+	if (!zram->backing_dev)
+		return;
+
+	set_blocksize(zram->bdev, zram->old_block_size);
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	filp_close(zram->backing_dev, NULL);
+
+	zram->backing_dev = NULL;
+	zram->bdev = NULL;
+	zram->old_block_size = 0;
+
+	vfree(zram->bitmap);
+	zram->bitmap = NULL;
+	zram->nr_pages = 0;
+}
+
+/*
+ * Must be called with init_lock held for writing on an uninitialized
+ * device. Any previously configured backing device is released.
+ */
+int zram_set_backing_dev(struct zram *zram, const char *file_name)
+{
+	int ret;
+	unsigned long nr_pages, *bitmap = NULL;
+	unsigned int old_block_size;
+	struct file *backing_dev;
+	struct block_device *bdev = NULL;
+	struct inode *inode;
+
+	backing_dev = filp_open(file_name, O_RDWR | O_LARGEFILE, 0);
+	if (IS_ERR(backing_dev))
+		return PTR_ERR(backing_dev);
+
+	inode = backing_dev->f_mapping->host;
+	if (!S_ISBLK(inode->i_mode)) {
+		ret = -ENOTBLK;
+		goto out;
+	}
+
+	bdev = bdget(inode->i_rdev);
+	if (!bdev) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* blkdev_get() drops the bdev reference on failure */
+	ret = blkdev_get(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL, zram);
+	if (ret < 0) {
+		bdev = NULL;
+		goto out;
+	}
+
+	nr_pages = i_size_read(inode) >> PAGE_SHIFT;
+	if (nr_pages < 2) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	bitmap = vzalloc(BITS_TO_LONGS(nr_pages) * sizeof(long));
+	if (!bitmap) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	old_block_size = block_size(bdev);
+	ret = set_blocksize(bdev, PAGE_SIZE);
+	if (ret)
+		goto out;
+
+	zram_reset_bdev(zram);
+
+	zram->old_block_size = old_block_size;
+	zram->bdev = bdev;
+	zram->backing_dev = backing_dev;
+	zram->bitmap = bitmap;
+	zram->nr_pages = nr_pages;
+
+	pr_info("setup backing device %s\n", file_name);
+	return 0;
+
+out:
+	vfree(bitmap);
+	if (bdev)
+		blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	filp_close(backing_dev, NULL);
+	return ret;
+}
+
+/*
+ * Block 0 is never handed out so that a written back page can keep its
+ * block index in table[].handle without being mistaken for an empty slot.
+ */
+static unsigned long zram_alloc_block(struct zram *zram)
+{
+	unsigned long blk_idx;
+
+	spin_lock(&zram->bitmap_lock);
+	blk_idx = find_next_zero_bit(zram->bitmap, zram->nr_pages, 1);
+	if (blk_idx >= zram->nr_pages) {
+		spin_unlock(&zram->bitmap_lock);
+		return 0;
+	}
+	set_bit(blk_idx, zram->bitmap);
+	spin_unlock(&zram->bitmap_lock);
+
+	return blk_idx;
+}
+
+static void zram_free_block(struct zram *zram, unsigned long blk_idx)
+{
+	spin_lock(&zram->bitmap_lock);
+	WARN_ON_ONCE(!test_bit(blk_idx, zram->bitmap));
+	clear_bit(blk_idx, zram->bitmap);
+	spin_unlock(&zram->bitmap_lock);
+}
+
+struct zram_bdev_read {
+	struct work_struct work;
+	struct completion done;
+	struct zram *zram;
+	struct page *page;
+	unsigned long blk_idx;
+	int error;
+};
+
+static void zram_bdev_read_end_io(struct bio *bio, int err)
+{
+	struct zram_bdev_read *zr = bio->bi_private;
+
+	if (!test_bit(BIO_UPTODATE, &bio->bi_flags))
+		zr->error = err ? err : -EIO;
+	bio_put(bio);
+	complete(&zr->done);
+}
+
+static void zram_bdev_read_work(struct work_struct *work)
+{
+	struct zram_bdev_read *zr;
+	struct bio *bio;
+
+	zr = container_of(work, struct zram_bdev_read, work);
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	bio->bi_bdev = zr->zram->bdev;
+	bio->bi_sector = zr->blk_idx << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_end_io = zram_bdev_read_end_io;
+	bio->bi_private = zr;
+	if (!bio_add_page(bio, zr->page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		zr->error = -EIO;
+		complete(&zr->done);
+		return;
+	}
+
+	submit_bio(READ, bio);
+}
+
+/*
+ * Synchronously read a page from the backing device. We are usually called
+ * from zram_make_request() where bios submitted by this task are only
+ * dispatched once we return, so the read is issued from a workqueue.
+ */
+static int zram_read_from_bdev(struct zram *zram, struct page *page,
+			       unsigned long blk_idx)
+{
+	struct zram_bdev_read zr;
+
+	zr.zram = zram;
+	zr.page = page;
+	zr.blk_idx = blk_idx;
+	zr.error = 0;
+	init_completion(&zr.done);
+
+	INIT_WORK_ONSTACK(&zr.work, zram_bdev_read_work);
+	queue_work(system_unbound_wq, &zr.work);
+	wait_for_completion(&zr.done);
+	flush_work(&zr.work);
+	destroy_work_on_stack(&zr.work);
+
+	zram_stat64_inc(zram, &zram->stats.bd_reads);
+
+	return zr.error;
+}
+#endif /* CONFIG_ZRAM_WRITEBACK */
+
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	void *handle = zram->table[index].handle;
 
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+
 	if (unlikely(!handle)) {
 		/*
 		 * No memory is allocated for zero filled pages.
@@ -149,6 +343,15 @@ static void zram_free_page(struct zram *zram, size_t index)
 		return;
 	}
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+		zram_free_block(zram, (unsigned long)handle);
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_stat_dec(&zram->stats.bd_count);
+		goto out;
+	}
+#endif
+
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		__free_page(handle);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
@@ -203,6 +406,49 @@ static inline int is_partial_io(struct bio_vec *bvec)
 	return bvec->bv_len != PAGE_SIZE;
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+static int zram_bvec_read_from_bdev(struct zram *zram, struct bio_vec *bvec,
+				    u32 index, int offset)
+{
+	int ret;
+	struct page *page = bvec->bv_page;
+	unsigned char *user_mem, *src;
+
+	if (is_partial_io(bvec)) {
+		page = alloc_page(GFP_NOIO);
+		if (!page) {
+			pr_info("Error allocating temp memory!\n");
+			return -ENOMEM;
+		}
+	}
+
+	ret = zram_read_from_bdev(zram, page,
+				  (unsigned long)zram->table[index].handle);
+	if (unlikely(ret)) {
+		pr_err("Backing device read failed! err=%d, page=%u\n",
+		       ret, index);
+		zram_stat64_inc(zram, &zram->stats.failed_reads);
+		goto out;
+	}
+
+	if (is_partial_io(bvec)) {
+		user_mem = kmap_atomic(bvec->bv_page);
+		src = kmap_atomic(page);
+		memcpy(user_mem + bvec->bv_offset, src + offset,
+		       bvec->bv_len);
+		kunmap_atomic(src);
+		kunmap_atomic(user_mem);
+	}
+
+	flush_dcache_page(bvec->bv_page);
+
+out:
+	if (is_partial_io(bvec))
+		__free_page(page);
+	return ret;
+}
+#endif
+
 static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 			  u32 index, int offset, struct bio *bio)
 {
@@ -227,6 +473,12 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 		return 0;
 	}
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/* Page was written back to the backing device */
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB)))
+		return zram_bvec_read_from_bdev(zram, bvec, index, offset);
+#endif
+
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		handle_uncompressed_page(zram, bvec, index, offset);
@@ -287,15 +539,37 @@ static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
 		return 0;
 	}
 
-	cmem = zs_map_object(zram->mem_pool, zram->table[index].handle);
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/* Page was written back to the backing device */
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+		struct page *page = alloc_page(GFP_NOIO);
+
+		if (!page)
+			return -ENOMEM;
+		ret = zram_read_from_bdev(zram, page,
+				(unsigned long)zram->table[index].handle);
+		if (!ret) {
+			cmem = kmap_atomic(page);
+			memcpy(mem, cmem, PAGE_SIZE);
+			kunmap_atomic(cmem);
+		} else {
+			zram_stat64_inc(zram, &zram->stats.failed_reads);
+		}
+		__free_page(page);
+		return ret;
+	}
+#endif
 
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		cmem = kmap_atomic(zram->table[index].handle);
 		memcpy(mem, cmem, PAGE_SIZE);
 		kunmap_atomic(cmem);
 		return 0;
 	}
 
+	cmem = zs_map_object(zram->mem_pool, zram->table[index].handle);
+
 	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
 				    zram->table[index].size,
 				    mem, &clen);
@@ -457,6 +731,11 @@ static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
 
 	if (rw == READ) {
 		down_read(&zram->lock);
+		/*
+		 * Concurrent readers may only ever clear this bit, so doing
+		 * it under the read lock is safe.
+		 */
+		zram_clear_flag(zram, index, ZRAM_IDLE);
 		ret = zram_bvec_read(zram, bvec, index, offset, bio);
 		up_read(&zram->lock);
 	} else {
@@ -577,6 +856,220 @@ error:
 	bio_io_error(bio);
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+void zram_mark_idle(struct zram *zram)
+{
+	size_t index;
+
+	down_write(&zram->lock);
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		if (!zram->table[index].handle ||
+		    zram_test_flag(zram, index, ZRAM_WB))
+			continue;
+		zram_set_flag(zram, index, ZRAM_IDLE);
+	}
+	up_write(&zram->lock);
+}
+
+struct zram_wb_batch {
+	atomic_t pending;	/* bios in flight, plus one for submitter */
+	struct completion done;
+	int error;
+	int nr_pages;
+	u32 index[ZRAM_WB_BATCH_PAGES];
+	unsigned long blk_idx[ZRAM_WB_BATCH_PAGES];
+	struct page *pages[ZRAM_WB_BATCH_PAGES];
+};
+
+static void zram_wb_end_io(struct bio *bio, int err)
+{
+	struct zram_wb_batch *wb = bio->bi_private;
+
+	if (!test_bit(BIO_UPTODATE, &bio->bi_flags))
+		wb->error = err ? err : -EIO;
+	bio_put(bio);
+
+	if (atomic_dec_and_test(&wb->pending))
+		complete(&wb->done);
+}
+
+static void zram_wb_submit_bio(struct zram_wb_batch *wb, struct bio *bio)
+{
+	atomic_inc(&wb->pending);
+	submit_bio(WRITE, bio);
+}
+
+/*
+ * Write out all pages collected in the batch, merging runs of contiguous
+ * backing device blocks into a single bio, and wait for completion.
+ */
+static int zram_wb_write_batch(struct zram *zram, struct zram_wb_batch *wb)
+{
+	int i;
+	struct bio *bio = NULL;
+	struct blk_plug plug;
+
+	atomic_set(&wb->pending, 1);
+	init_completion(&wb->done);
+	wb->error = 0;
+
+	blk_start_plug(&plug);
+	for (i = 0; i < wb->nr_pages; i++) {
+		if (bio && wb->blk_idx[i] == wb->blk_idx[i - 1] + 1 &&
+		    bio_add_page(bio, wb->pages[i], PAGE_SIZE, 0))
+			continue;
+
+		if (bio)
+			zram_wb_submit_bio(wb, bio);
+
+		bio = bio_alloc(GFP_NOIO, wb->nr_pages - i);
+		bio->bi_bdev = zram->bdev;
+		bio->bi_sector = wb->blk_idx[i] << SECTORS_PER_PAGE_SHIFT;
+		bio->bi_end_io = zram_wb_end_io;
+		bio->bi_private = wb;
+		if (!bio_add_page(bio, wb->pages[i], PAGE_SIZE, 0)) {
+			bio_put(bio);
+			bio = NULL;
+			wb->error = -EIO;
+			break;
+		}
+	}
+	if (bio)
+		zram_wb_submit_bio(wb, bio);
+	blk_finish_plug(&plug);
+
+	if (!atomic_dec_and_test(&wb->pending))
+		wait_for_completion(&wb->done);
+
+	return wb->error;
+}
+
+/*
+ * Replace the in-memory copy of each written back page by a reference to
+ * its backing device block, unless the page was freed or rewritten while
+ * the I/O was in flight (which clears ZRAM_UNDER_WB).
+ */
+static void zram_wb_commit_batch(struct zram *zram, struct zram_wb_batch *wb,
+				 int error)
+{
+	int i;
+	u32 index;
+
+	down_write(&zram->lock);
+	for (i = 0; i < wb->nr_pages; i++) {
+		index = wb->index[i];
+
+		if (error || !zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+			zram_free_block(zram, wb->blk_idx[i]);
+			continue;
+		}
+
+		zram_free_page(zram, index);
+
+		zram->table[index].handle = (void *)wb->blk_idx[i];
+		zram_set_flag(zram, index, ZRAM_WB);
+		zram_stat_inc(&zram->stats.pages_stored);
+		zram_stat_inc(&zram->stats.bd_count);
+		zram_stat64_inc(zram, &zram->stats.bd_writes);
+	}
+	up_write(&zram->lock);
+
+	wb->nr_pages = 0;
+}
+
+static bool zram_wb_eligible(struct zram *zram, u32 index,
+			     enum zram_wb_mode mode)
+{
+	if (!zram->table[index].handle ||
+	    zram_test_flag(zram, index, ZRAM_ZERO) ||
+	    zram_test_flag(zram, index, ZRAM_WB) ||
+	    zram_test_flag(zram, index, ZRAM_UNDER_WB))
+		return false;
+
+	if (mode == ZRAM_WB_HUGE)
+		return zram_test_flag(zram, index, ZRAM_UNCOMPRESSED);
+
+	return zram_test_flag(zram, index, ZRAM_IDLE);
+}
+
+/*
+ * Write back all pages selected by @mode to the backing device. Must be
+ * called with init_lock held on an initialized device.
+ */
+int zram_writeback(struct zram *zram, enum zram_wb_mode mode)
+{
+	int i, ret = 0;
+	u32 index;
+	unsigned long blk_idx;
+	struct zram_wb_batch *wb;
+
+	if (!zram->backing_dev)
+		return -ENODEV;
+
+	wb = kzalloc(sizeof(*wb), GFP_KERNEL);
+	if (!wb)
+		return -ENOMEM;
+
+	for (i = 0; i < ZRAM_WB_BATCH_PAGES; i++) {
+		wb->pages[i] = alloc_page(GFP_KERNEL);
+		if (!wb->pages[i]) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		down_write(&zram->lock);
+		if (!zram_wb_eligible(zram, index, mode)) {
+			up_write(&zram->lock);
+			continue;
+		}
+
+		blk_idx = zram_alloc_block(zram);
+		if (!blk_idx) {
+			up_write(&zram->lock);
+			ret = -ENOSPC;
+			break;
+		}
+
+		if (zram_read_before_write(zram,
+				page_address(wb->pages[wb->nr_pages]), index)) {
+			up_write(&zram->lock);
+			zram_free_block(zram, blk_idx);
+			continue;
+		}
+		zram_set_flag(zram, index, ZRAM_UNDER_WB);
+		up_write(&zram->lock);
+
+		wb->index[wb->nr_pages] = index;
+		wb->blk_idx[wb->nr_pages] = blk_idx;
+		if (++wb->nr_pages < ZRAM_WB_BATCH_PAGES)
+			continue;
+
+		ret = zram_wb_write_batch(zram, wb);
+		zram_wb_commit_batch(zram, wb, ret);
+		if (ret)
+			break;
+	}
+
+	if (wb->nr_pages) {
+		int err = zram_wb_write_batch(zram, wb);
+
+		zram_wb_commit_batch(zram, wb, err);
+		if (!ret)
+			ret = err;
+	}
+
+out:
+	for (i = 0; i < ZRAM_WB_BATCH_PAGES; i++)
+		if (wb->pages[i])
+			__free_page(wb->pages[i]);
+	kfree(wb);
+	return ret;
+}
+#endif /* CONFIG_ZRAM_WRITEBACK */
+
 void __zram_reset_device(struct zram *zram)
 {
 	size_t index;
@@ -596,6 +1089,10 @@ void __zram_reset_device(struct zram *zram)
 		if (!handle)
 			continue;
 
+		/* Backing device blocks are released with the bitmap */
+		if (unlikely(zram_test_flag(zram, index, ZRAM_WB)))
+			continue;
+
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
 			__free_page(handle);
 		else
@@ -608,6 +1105,10 @@ void __zram_reset_device(struct zram *zram)
 	zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+	zram_reset_bdev(zram);
+#endif
+
 	/* Reset stats */
 	memset(&zram->stats, 0, sizeof(zram->stats));
 
@@ -708,6 +1209,9 @@ static int create_device(struct zram *zram, int device_id)
 	init_rwsem(&zram->lock);
 	init_rwsem(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+#ifdef CONFIG_ZRAM_WRITEBACK
+	spin_lock_init(&zram->bitmap_lock);
+#endif
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -51,8 +51,8 @@ static const size_t max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   ZS_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_USER_SIZE - sizeof(struct zobj_header)
+ * otherwise, zs_malloc() would always return failure.
  */
 
 /*-- End of configurable params */
@@ -74,14 +74,35 @@ enum zram_pageflags {
 	/* Page consists entirely of zeros */
 	ZRAM_ZERO,
 
+	/* Page has been written back to the backing device */
+	ZRAM_WB,
+
+	/* Page is being written back to the backing device */
+	ZRAM_UNDER_WB,
+
+	/* Page has not been accessed since the last idle marking */
+	ZRAM_IDLE,
+
 	__NR_ZRAM_PAGEFLAGS,
 };
 
+/* Writeback modes (see writeback sysfs node) */
+enum zram_wb_mode {
+	/* Write back pages that are stored uncompressed */
+	ZRAM_WB_HUGE,
+
+	/* Write back pages not accessed since the last idle marking */
+	ZRAM_WB_IDLE,
+};
+
+/* Maximum no. of pages collected before a writeback batch is submitted */
+#define ZRAM_WB_BATCH_PAGES	32
+
 /*-- Data structures */
 
 /* Allocated for each disk page */
 struct table {
-	void *handle;
+	void *handle;	/* block index on backing device if ZRAM_WB */
 	u16 size;	/* object size (excluding header) */
 	u8 count;	/* object ref count (not yet used) */
 	u8 flags;
@@ -99,6 +120,11 @@ struct zram_stats {
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
+#ifdef CONFIG_ZRAM_WRITEBACK
+	u64 bd_reads;		/* no. of pages read back from backing device */
+	u64 bd_writes;		/* no. of pages written to backing device */
+	u32 bd_count;		/* no. of pages currently on backing device */
+#endif
 };
 
 struct zram {
@@ -121,6 +147,15 @@ struct zram {
 	u64 disksize;	/* bytes */
 
 	struct zram_stats stats;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	struct file *backing_dev;
+	struct block_device *bdev;
+	unsigned int old_block_size;
+	/* Allocated blocks on the backing device (bit 0 is never used) */
+	unsigned long *bitmap;
+	unsigned long nr_pages;	/* size of backing device in pages */
+	spinlock_t bitmap_lock;
+#endif
 };
 
 extern struct zram *zram_devices;
@@ -131,5 +166,10 @@ extern struct attribute_group zram_disk_attr_group;
 
 extern int zram_init_device(struct zram *zram);
 extern void __zram_reset_device(struct zram *zram);
+#ifdef CONFIG_ZRAM_WRITEBACK
+extern int zram_set_backing_dev(struct zram *zram, const char *file_name);
+extern void zram_mark_idle(struct zram *zram);
+extern int zram_writeback(struct zram *zram, enum zram_wb_mode mode);
+#endif
 
 #endif
@@ -17,9 +17,12 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
+#include <linux/debugfs.h>
 #include <linux/errno.h>
 #include <linux/highmem.h>
 #include <linux/init.h>
+#include <linux/seq_file.h>
 #include <linux/string.h>
 #include <linux/slab.h>
 #include <asm/tlbflush.h>
@@ -43,6 +46,12 @@
 /* per-cpu VM mapping areas for zspage accesses that cross page boundaries */
 static DEFINE_PER_CPU(struct mapping_area, zs_map_area);
 
+static atomic_t zs_pool_id = ATOMIC_INIT(0);
+
+#ifdef CONFIG_DEBUG_FS
+static struct dentry *zs_stat_root;
+#endif
+
 static int is_first_page(struct page *page)
 {
 	return test_bit(PG_private, &page->flags);
@@ -122,6 +131,7 @@ static void insert_zspage(struct page *page, struct size_class *class,
 		list_add_tail(&page->lru, &(*head)->lru);
 
 	*head = page;
+	class->zspage_count[fullness]++;
 }
 
 static void remove_zspage(struct page *page, struct size_class *class,
@@ -143,6 +153,7 @@ static void remove_zspage(struct page *page, struct size_class *class,
 					struct page, lru);
 
 	list_del_init(&page->lru);
+	class->zspage_count[fullness]--;
 }
 
 static enum fullness_group fix_fullness_group(struct zs_pool *pool,
@@ -230,30 +241,80 @@ static struct page *get_next_page(struct page *page)
 	return next;
 }
 
-/* Encode <page, obj_idx> as a single handle value */
-static void *obj_location_to_handle(struct page *page, unsigned long obj_idx)
+/* Encode <page, obj_idx> as a single obj value */
+static void *location_to_obj(struct page *page, unsigned long obj_idx)
 {
-	unsigned long handle;
+	unsigned long obj;
 
 	if (!page) {
 		BUG_ON(obj_idx);
 		return NULL;
 	}
 
-	handle = page_to_pfn(page) << OBJ_INDEX_BITS;
-	handle |= (obj_idx & OBJ_INDEX_MASK);
+	obj = page_to_pfn(page) << OBJ_INDEX_BITS;
+	obj |= (obj_idx & OBJ_INDEX_MASK);
+	obj <<= OBJ_TAG_BITS;
 
-	return (void *)handle;
+	return (void *)obj;
 }
 
-/* Decode <page, obj_idx> pair from the given object handle */
-static void obj_handle_to_location(void *handle, struct page **page,
+/* Decode <page, obj_idx> pair from the given obj value */
+static void obj_to_location(void *obj, struct page **page,
 				unsigned long *obj_idx)
 {
-	unsigned long hval = (unsigned long)handle;
+	unsigned long oval = (unsigned long)obj >> OBJ_TAG_BITS;
+
+	*page = pfn_to_page(oval >> OBJ_INDEX_BITS);
+	*obj_idx = oval & OBJ_INDEX_MASK;
+}
+
+static void *handle_to_obj(unsigned long handle)
+{
+	return (void *)(*(unsigned long *)handle & ~BIT(HANDLE_PIN_BIT));
+}
+
+/*
+ * Update the obj value a handle refers to. The pin bit is part of the
+ * same word, so callers holding the pin must pass it along in @obj.
+ */
+static void record_obj(unsigned long handle, void *obj)
+{
+	*(volatile unsigned long *)handle = (unsigned long)obj;
+}
+
+static void pin_tag(unsigned long handle)
+{
+	bit_spin_lock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static int trypin_tag(unsigned long handle)
+{
+	return bit_spin_trylock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static void unpin_tag(unsigned long handle)
+{
+	bit_spin_unlock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
 
-	*page = pfn_to_page(hval >> OBJ_INDEX_BITS);
-	*obj_idx = hval & OBJ_INDEX_MASK;
+static void class_lock(struct size_class *class)
+{
+	if (!spin_trylock(&class->lock)) {
+		spin_lock(&class->lock);
+		class->lock_contended++;
+	}
+	class->lock_acquired++;
+#ifdef CONFIG_ZSMALLOC_LOCK_STAT
+	class->lock_start = local_clock();
+#endif
+}
+
+static void class_unlock(struct size_class *class)
+{
+#ifdef CONFIG_ZSMALLOC_LOCK_STAT
+	class->lock_hold_ns += local_clock() - class->lock_start;
+#endif
+	spin_unlock(&class->lock);
 }
 
 static unsigned long obj_idx_to_offset(struct page *page,
@@ -330,7 +391,7 @@ static void init_zspage(struct page *first_page, struct size_class *class)
 		for (i = 1; i <= objs_on_page; i++) {
 			off += class->size;
 			if (off < PAGE_SIZE) {
-				link->next = obj_location_to_handle(page, i);
+				link->next = location_to_obj(page, i);
 				link += class->size / sizeof(*link);
 			}
 		}
@@ -341,7 +402,7 @@ static void init_zspage(struct page *first_page, struct size_class *class)
 		 * page (if present)
 		 */
 		next_page = get_next_page(page);
-		link->next = obj_location_to_handle(next_page, 0);
+		link->next = location_to_obj(next_page, 0);
 		kunmap_atomic(link);
 		page = next_page;
 		off = (off + class->size) % PAGE_SIZE;
@@ -396,9 +457,9 @@ static struct page *alloc_zspage(struct size_class *class, gfp_t flags)
 
 	init_zspage(first_page, class);
 
-	first_page->freelist = obj_location_to_handle(first_page, 0);
+	first_page->freelist = location_to_obj(first_page, 0);
 	/* Maximum number of objects we can store in this zspage */
-	first_page->objects = class->zspage_order * PAGE_SIZE / class->size;
+	first_page->objects = class->objs_per_zspage;
 
 	error = 0; /* Success */
 
@@ -513,6 +574,538 @@ static struct notifier_block zs_cpu_nb = {
 	.notifier_call = zs_cpu_notifier
 };
 
+/*
+ * Take a free object from the zspage's freelist and mark it allocated
+ * by storing @handle in its header. Called with class->lock held.
+ */
+static void *obj_malloc(struct size_class *class, struct page *first_page,
+			unsigned long handle)
+{
+	void *obj;
+	struct link_free *link;
+	struct page *m_page;
+	unsigned long m_objidx, m_offset;
+
+	obj = first_page->freelist;
+	obj_to_location(obj, &m_page, &m_objidx);
+	m_offset = obj_idx_to_offset(m_page, m_objidx, class->size);
+
+	link = (struct link_free *)kmap_atomic(m_page) +
+					m_offset / sizeof(*link);
+	first_page->freelist = link->next;
+	link->handle = handle | OBJ_ALLOCATED_TAG;
+	kunmap_atomic(link);
+
+	first_page->inuse++;
+	class->objs_inuse++;
+
+	return obj;
+}
+
+/* Return an object to its zspage's freelist. Called with class->lock held. */
+static void obj_free(struct size_class *class, void *obj)
+{
+	struct link_free *link;
+	struct page *first_page, *f_page;
+	unsigned long f_objidx, f_offset;
+
+	obj_to_location(obj, &f_page, &f_objidx);
+	first_page = get_first_page(f_page);
+	f_offset = obj_idx_to_offset(f_page, f_objidx, class->size);
+
+	/* Insert this object in containing zspage's freelist */
+	link = (struct link_free *)((unsigned char *)kmap_atomic(f_page)
+							+ f_offset);
+	link->next = first_page->freelist;
+	kunmap_atomic(link);
+	first_page->freelist = obj;
+
+	first_page->inuse--;
+	class->objs_inuse--;
+}
+
+/* Copy a whole object, either end of which may span two pages */
+static void zs_object_copy(struct size_class *class, void *dst, void *src)
+{
+	struct page *s_page, *d_page;
+	unsigned long s_objidx, d_objidx;
+	unsigned long s_off, d_off;
+	void *s_addr, *d_addr;
+	int s_size, d_size, size;
+	int written = 0;
+
+	obj_to_location(src, &s_page, &s_objidx);
+	obj_to_location(dst, &d_page, &d_objidx);
+
+	s_off = obj_idx_to_offset(s_page, s_objidx, class->size);
+	d_off = obj_idx_to_offset(d_page, d_objidx, class->size);
+
+	s_size = d_size = class->size;
+	if (s_off + class->size > PAGE_SIZE)
+		s_size = PAGE_SIZE - s_off;
+	if (d_off + class->size > PAGE_SIZE)
+		d_size = PAGE_SIZE - d_off;
+
+	s_addr = kmap_atomic(s_page);
+	d_addr = kmap_atomic(d_page);
+
+	while (1) {
+		size = min(s_size, d_size);
+		memcpy(d_addr + d_off, s_addr + s_off, size);
+		written += size;
+
+		if (written == class->size)
+			break;
+
+		s_off += size;
+		s_size -= size;
+		d_off += size;
+		d_size -= size;
+
+		/* kmap_atomic() mappings must be released in reverse order */
+		if (s_off >= PAGE_SIZE) {
+			kunmap_atomic(d_addr);
+			kunmap_atomic(s_addr);
+			s_page = get_next_page(s_page);
+			BUG_ON(!s_page);
+			s_addr = kmap_atomic(s_page);
+			d_addr = kmap_atomic(d_page);
+			s_size = class->size - written;
+			s_off = 0;
+		}
+
+		if (d_off >= PAGE_SIZE) {
+			kunmap_atomic(d_addr);
+			d_page = get_next_page(d_page);
+			BUG_ON(!d_page);
+			d_addr = kmap_atomic(d_page);
+			d_size = class->size - written;
+			d_off = 0;
+		}
+	}
+
+	kunmap_atomic(d_addr);
+	kunmap_atomic(s_addr);
+}
+
+/*
+ * Move live objects from zspage @src to zspage @dst until @src is empty
+ * or @dst is full. Returns -EAGAIN if an object which is currently mapped
+ * (pinned) is found, since it cannot be moved.
+ * Called with class->lock held.
+ */
+static int migrate_zspage(struct size_class *class, struct page *src,
+			  struct page *dst)
+{
+	struct page *s_page = src;
+	unsigned long off, obj_idx, handle;
+	struct link_free *link;
+	void *used_obj, *free_obj;
+
+	while (s_page) {
+		off = is_first_page(s_page) ? 0 : s_page->index;
+
+		for (obj_idx = 0; off < PAGE_SIZE;
+		     obj_idx++, off += class->size) {
+			if (!src->inuse)
+				return 0;
+
+			link = (struct link_free *)kmap_atomic(s_page) +
+							off / sizeof(*link);
+			handle = link->handle;
+			kunmap_atomic(link);
+
+			if (!(handle & OBJ_ALLOCATED_TAG))
+				continue;
+			handle &= ~OBJ_ALLOCATED_TAG;
+
+			if (dst->inuse == dst->objects)
+				return 0;
+
+			if (!trypin_tag(handle))
+				return -EAGAIN;
+
+			used_obj = location_to_obj(s_page, obj_idx);
+			free_obj = obj_malloc(class, dst, handle);
+			zs_object_copy(class, free_obj, used_obj);
+			record_obj(handle, (void *)((unsigned long)free_obj |
+						    BIT(HANDLE_PIN_BIT)));
+			unpin_tag(handle);
+			obj_free(class, used_obj);
+		}
+
+		s_page = get_next_page(s_page);
+	}
+
+	return 0;
+}
+
+/* Detach a zspage from its fullness list so it can be worked on */
+static struct page *isolate_zspage(struct size_class *class,
+				   enum fullness_group fullness)
+{
+	struct page *page = class->fullness_list[fullness];
+
+	if (page)
+		remove_zspage(page, class, fullness);
+
+	return page;
+}
+
+static struct page *isolate_target_page(struct size_class *class)
+{
+	struct page *page;
+
+	page = isolate_zspage(class, ZS_ALMOST_FULL);
+	if (!page)
+		page = isolate_zspage(class, ZS_ALMOST_EMPTY);
+
+	return page;
+}
+
+/* Put an isolated, non-empty zspage back on the right fullness list */
+static void putback_zspage(struct size_class *class, struct page *first_page)
+{
+	enum fullness_group fullness;
+
+	BUG_ON(!first_page->inuse);
+
+	fullness = get_fullness_group(first_page);
+	insert_zspage(first_page, class, fullness);
+	set_zspage_mapping(first_page, class->index, fullness);
+}
+
+/*
+ * Number of pages that compaction could free in this class if all live
+ * objects were packed into as few zspages as possible.
+ */
+static unsigned long zs_can_compact(struct size_class *class)
+{
+	unsigned long zspages, obj_wasted;
+
+	zspages = (unsigned long)class->pages_allocated / class->zspage_order;
+	obj_wasted = zspages * class->objs_per_zspage - class->objs_inuse;
+
+	return obj_wasted / class->objs_per_zspage * class->zspage_order;
+}
+
+static unsigned long __zs_compact(struct size_class *class)
+{
+	int ret = 0;
+	unsigned long freed = 0;
+	struct page *src, *dst = NULL;
+
+	class_lock(class);
+	while (zs_can_compact(class)) {
+		/* Sparsely used zspages are emptied into fuller ones */
+		src = isolate_zspage(class, ZS_ALMOST_EMPTY);
+		if (!src)
+			break;
+
+		while ((dst = isolate_target_page(class))) {
+			ret = migrate_zspage(class, src, dst);
+			putback_zspage(class, dst);
+			if (ret || !src->inuse)
+				break;
+		}
+
+		if (!src->inuse) {
+			class->pages_allocated -= class->zspage_order;
+			class->pages_compacted += class->zspage_order;
+			freed += class->zspage_order;
+			free_zspage(src);
+		} else {
+			putback_zspage(class, src);
+		}
+
+		if (ret || !dst)
+			break;
+
+		class_unlock(class);
+		cond_resched();
+		class_lock(class);
+	}
+	class_unlock(class);
+
+	return freed;
+}
+
+/*
+ * Return @nr objects to their zspages under a single class lock hold and
+ * free their handles. The objects must not be visible to any user, so
+ * only compaction, which also takes the class lock, can move them.
+ */
+static void zs_free_batch(struct zs_pool *pool, struct size_class *class,
+			  unsigned long *handles, int nr)
+{
+	int i;
+	void *obj;
+	struct page *first_page, *f_page, *tmp;
+	unsigned long f_objidx;
+	enum fullness_group fullness;
+	LIST_HEAD(free_list);
+
+	class_lock(class);
+	for (i = 0; i < nr; i++) {
+		obj = handle_to_obj(handles[i]);
+		obj_to_location(obj, &f_page, &f_objidx);
+		first_page = get_first_page(f_page);
+
+		obj_free(class, obj);
+		fullness = fix_fullness_group(pool, first_page);
+		if (fullness == ZS_EMPTY) {
+			class->pages_allocated -= class->zspage_order;
+			list_add(&first_page->lru, &free_list);
+		}
+	}
+	class->mag_drains += nr;
+	class_unlock(class);
+
+	list_for_each_entry_safe(first_page, tmp, &free_list, lru) {
+		list_del_init(&first_page->lru);
+		free_zspage(first_page);
+	}
+
+	for (i = 0; i < nr; i++)
+		kmem_cache_free(pool->handle_cache, (void *)handles[i]);
+}
+
+/* Hand the objects cached in every CPU's magazines back to their classes */
+static void zs_drain_mags(struct zs_pool *pool)
+{
+	int cpu, i, nr;
+	struct zs_magazine *mag;
+	unsigned long handles[ZS_MAG_SIZE];
+
+	for_each_possible_cpu(cpu) {
+		for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+			mag = &per_cpu_ptr(pool->mags, cpu)->mag[i];
+			if (!mag->count)
+				continue;
+
+			spin_lock(&mag->lock);
+			nr = mag->count;
+			memcpy(handles, mag->handles, nr * sizeof(handles[0]));
+			mag->count = 0;
+			spin_unlock(&mag->lock);
+
+			if (nr)
+				zs_free_batch(pool, &pool->size_class[i],
+					      handles, nr);
+		}
+	}
+}
+
+static unsigned long zs_cached_objects(struct zs_pool *pool, int class_idx)
+{
+	int cpu;
+	unsigned long nr = 0;
+
+	for_each_possible_cpu(cpu)
+		nr += per_cpu_ptr(pool->mags, cpu)->mag[class_idx].count;
+
+	return nr;
+}
+
+static unsigned long zs_compactable_pages(struct zs_pool *pool)
+{
+	int i;
+	unsigned long pages = 0;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++)
+		pages += zs_can_compact(&pool->size_class[i]);
+
+	return pages;
+}
+
+/*
+ * What the shrinker can give back, in pages: compactable pages, and the
+ * space taken by objects cached in the magazines
+ */
+static unsigned long zs_reclaimable(struct zs_pool *pool)
+{
+	int i;
+	unsigned long cached = 0;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++)
+		cached += zs_cached_objects(pool, i) *
+			  pool->size_class[i].size;
+
+	return zs_compactable_pages(pool) + (cached >> PAGE_SHIFT);
+}
+
+static int zs_shrinker_shrink(struct shrinker *shrinker,
+			      struct shrink_control *sc)
+{
+	struct zs_pool *pool = container_of(shrinker, struct zs_pool,
+					    shrinker);
+
+	/* Avoid recursing into compaction if reclaim started from here */
+	if (sc->nr_to_scan && !mutex_trylock(&pool->compact_lock))
+		return -1;
+
+	if (sc->nr_to_scan) {
+		int i;
+
+		zs_drain_mags(pool);
+		for (i = 0; i < ZS_SIZE_CLASSES; i++)
+			__zs_compact(&pool->size_class[i]);
+		mutex_unlock(&pool->compact_lock);
+	}
+
+	return min_t(unsigned long, zs_reclaimable(pool), INT_MAX);
+}
+
+#ifdef CONFIG_DEBUG_FS
+static int zs_stats_show(struct seq_file *s, void *v)
+{
+	int i;
+	struct zs_pool *pool = s->private;
+	unsigned long total_compacted = 0;
+
+	seq_printf(s, " %5s %5s %11s %12s %13s %10s %10s %16s %11s\n",
+			"class", "size", "almost_full", "almost_empty",
+			"obj_allocated", "obj_used", "pages_used",
+			"pages_per_zspage", "compactable");
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+		unsigned long almost_full, almost_empty, obj_allocated;
+		unsigned long obj_used, pages_used, compactable;
+
+		spin_lock(&class->lock);
+		almost_full = class->zspage_count[ZS_ALMOST_FULL];
+		almost_empty = class->zspage_count[ZS_ALMOST_EMPTY];
+		pages_used = (unsigned long)class->pages_allocated;
+		obj_allocated = pages_used / class->zspage_order *
+					class->objs_per_zspage;
+		obj_used = class->objs_inuse;
+		compactable = zs_can_compact(class);
+		total_compacted += class->pages_compacted;
+		spin_unlock(&class->lock);
+
+		if (!pages_used)
+			continue;
+
+		seq_printf(s, " %5u %5d %11lu %12lu %13lu %10lu %10lu %16d %11lu\n",
+			class->index, class->size, almost_full, almost_empty,
+			obj_allocated, obj_used, pages_used,
+			class->zspage_order, compactable);
+	}
+
+	seq_printf(s, "\npages_compacted: %lu\n", total_compacted);
+
+	return 0;
+}
+
+static int zs_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, zs_stats_show, inode->i_private);
+}
+
+static const struct file_operations zs_stats_fops = {
+	.open		= zs_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int zs_lock_stats_show(struct seq_file *s, void *v)
+{
+	int i;
+	struct zs_pool *pool = s->private;
+
+	seq_printf(s, " %5s %5s %12s %12s %12s %12s %8s", "class", "size",
+			"acquired", "contended", "refills", "drained",
+			"cached");
+#ifdef CONFIG_ZSMALLOC_LOCK_STAT
+	seq_printf(s, " %14s", "hold_ns");
+#endif
+	seq_putc(s, '\n');
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+		unsigned long acquired, contended, refills, drains;
+#ifdef CONFIG_ZSMALLOC_LOCK_STAT
+		u64 hold_ns;
+#endif
+
+		spin_lock(&class->lock);
+		acquired = class->lock_acquired;
+		contended = class->lock_contended;
+		refills = class->mag_refills;
+		drains = class->mag_drains;
+#ifdef CONFIG_ZSMALLOC_LOCK_STAT
+		hold_ns = class->lock_hold_ns;
+#endif
+		spin_unlock(&class->lock);
+
+		if (!acquired)
+			continue;
+
+		seq_printf(s, " %5u %5d %12lu %12lu %12lu %12lu %8lu",
+			class->index, class->size, acquired, contended,
+			refills, drains, zs_cached_objects(pool, i));
+#ifdef CONFIG_ZSMALLOC_LOCK_STAT
+		seq_printf(s, " %14llu", hold_ns);
+#endif
+		seq_putc(s, '\n');
+	}
+
+	return 0;
+}
+
+static int zs_lock_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, zs_lock_stats_show, inode->i_private);
+}
+
+static const struct file_operations zs_lock_stats_fops = {
+	.open		= zs_lock_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void zs_pool_stat_create(struct zs_pool *pool)
+{
+	char name[32];
+
+	if (!zs_stat_root)
+		return;
+
+	snprintf(name, sizeof(name), "%s.%d", pool->name, pool->id);
+	pool->stat_dentry = debugfs_create_dir(name, zs_stat_root);
+	if (!pool->stat_dentry)
+		return;
+
+	debugfs_create_file("classes", S_IRUGO, pool->stat_dentry, pool,
+			    &zs_stats_fops);
+	debugfs_create_file("locks", S_IRUGO, pool->stat_dentry, pool,
+			    &zs_lock_stats_fops);
+}
+
+static void zs_pool_stat_destroy(struct zs_pool *pool)
+{
+	debugfs_remove_recursive(pool->stat_dentry);
+}
+
+static void zs_stat_init(void)
+{
+	zs_stat_root = debugfs_create_dir("zsmalloc", NULL);
+}
+
+static void zs_stat_exit(void)
+{
+	debugfs_remove_recursive(zs_stat_root);
+}
+#else
+static inline void zs_pool_stat_create(struct zs_pool *pool) { }
+static inline void zs_pool_stat_destroy(struct zs_pool *pool) { }
+static inline void zs_stat_init(void) { }
+static inline void zs_stat_exit(void) { }
+#endif
+
 static void zs_exit(void)
 {
 	int cpu;
@@ -520,6 +1113,7 @@ static void zs_exit(void)
 	for_each_online_cpu(cpu)
 		zs_cpu_notifier(NULL, CPU_DEAD, (void *)(long)cpu);
 	unregister_cpu_notifier(&zs_cpu_nb);
+	zs_stat_exit();
 }
 
 static int zs_init(void)
@@ -532,6 +1126,7 @@ static int zs_init(void)
 		if (notifier_to_errno(ret))
 			goto fail;
 	}
+	zs_stat_init();
 	return 0;
 fail:
 	zs_exit();
@@ -540,7 +1135,7 @@ fail:
 
 struct zs_pool *zs_create_pool(const char *name, gfp_t flags)
 {
-	int i, ovhd_size;
+	int i, cpu, ovhd_size;
 	struct zs_pool *pool;
 
 	if (!name)
@@ -564,13 +1159,45 @@ struct zs_pool *zs_create_pool(const char *name, gfp_t flags)
 		class->index = i;
 		spin_lock_init(&class->lock);
 		class->zspage_order = get_zspage_order(size);
+		class->objs_per_zspage = class->zspage_order * PAGE_SIZE / size;
 
 	}
 
 	pool->flags = flags;
 	pool->name = name;
+	pool->id = atomic_inc_return(&zs_pool_id);
+	mutex_init(&pool->compact_lock);
+
+	pool->handle_cache_name = kasprintf(GFP_KERNEL, "zs_handle-%s.%d",
+					    name, pool->id);
+	if (!pool->handle_cache_name)
+		goto fail;
+	pool->handle_cache = kmem_cache_create(pool->handle_cache_name,
+					ZS_HANDLE_SIZE, 0, 0, NULL);
+	if (!pool->handle_cache)
+		goto fail;
+
+	pool->mags = alloc_percpu(struct zs_pcpu_mags);
+	if (!pool->mags)
+		goto fail;
+	for_each_possible_cpu(cpu)
+		for (i = 0; i < ZS_SIZE_CLASSES; i++)
+			spin_lock_init(&per_cpu_ptr(pool->mags, cpu)->mag[i].lock);
+
+	pool->shrinker.shrink = zs_shrinker_shrink;
+	pool->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&pool->shrinker);
+
+	zs_pool_stat_create(pool);
 
 	return pool;
+
+fail:
+	if (pool->handle_cache)
+		kmem_cache_destroy(pool->handle_cache);
+	kfree(pool->handle_cache_name);
+	kfree(pool);
+	return NULL;
 }
 EXPORT_SYMBOL_GPL(zs_create_pool);
 
@@ -578,6 +1205,12 @@ void zs_destroy_pool(struct zs_pool *pool)
 {
 	int i;
 
+	zs_pool_stat_destroy(pool);
+	unregister_shrinker(&pool->shrinker);
+
+	zs_drain_mags(pool);
+	free_percpu(pool->mags);
+
 	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
 		int fg;
 		struct size_class *class = &pool->size_class[i];
@@ -590,117 +1223,167 @@ void zs_destroy_pool(struct zs_pool *pool)
 			}
 		}
 	}
+	kmem_cache_destroy(pool->handle_cache);
+	kfree(pool->handle_cache_name);
 	kfree(pool);
 }
 EXPORT_SYMBOL_GPL(zs_destroy_pool);
 
+/*
+ * Allocate up to ZS_MAG_BATCH objects under a single class lock hold.
+ * The first one is returned and the rest go to this CPU's magazine. Only
+ * the first object may grow the class by a zspage.
+ */
+static void *zs_malloc_refill(struct zs_pool *pool, struct size_class *class)
+{
+	int i, nr;
+	void *obj;
+	struct page *first_page;
+	struct zs_magazine *mag;
+	unsigned long handles[ZS_MAG_BATCH];
+
+	for (nr = 0; nr < ZS_MAG_BATCH; nr++) {
+		handles[nr] = (unsigned long)kmem_cache_alloc(
+			pool->handle_cache, pool->flags & ~__GFP_HIGHMEM);
+		if (!handles[nr])
+			break;
+	}
+	if (!nr)
+		return NULL;
+
+	class_lock(class);
+	for (i = 0; i < nr; i++) {
+		first_page = find_get_zspage(class);
+		if (!first_page) {
+			if (i)
+				break;
+
+			class_unlock(class);
+			first_page = alloc_zspage(class, pool->flags);
+			if (unlikely(!first_page)) {
+				for (i = 0; i < nr; i++)
+					kmem_cache_free(pool->handle_cache,
+							(void *)handles[i]);
+				return NULL;
+			}
+
+			set_zspage_mapping(first_page, class->index, ZS_EMPTY);
+			class_lock(class);
+			class->pages_allocated += class->zspage_order;
+		}
+
+		obj = obj_malloc(class, first_page, handles[i]);
+		record_obj(handles[i], obj);
+
+		/* Now move the zspage to another fullness group, if required */
+		fix_fullness_group(pool, first_page);
+	}
+	class->mag_refills++;
+	class_unlock(class);
+
+	while (nr > i)
+		kmem_cache_free(pool->handle_cache, (void *)handles[--nr]);
+
+	/*
+	 * We may have been migrated, or raced with other allocations, so
+	 * objects which no longer fit in the magazine are simply freed.
+	 */
+	mag = &get_cpu_ptr(pool->mags)->mag[class->index];
+	spin_lock(&mag->lock);
+	while (nr > 1 && mag->count < ZS_MAG_SIZE)
+		mag->handles[mag->count++] = handles[--nr];
+	spin_unlock(&mag->lock);
+	put_cpu_ptr(pool->mags);
+
+	if (nr > 1)
+		zs_free_batch(pool, class, handles + 1, nr - 1);
+
+	return (void *)handles[0];
+}
+
 /**
  * zs_malloc - Allocate block of given size from pool.
  * @pool: pool to allocate from
  * @size: size of block to allocate
- * @page: page no. that holds the object
- * @offset: location of object within page
  *
- * On success, <page, offset> identifies block allocated
- * and 0 is returned. On failure, <page, offset> is set to
- * 0 and -ENOMEM is returned.
+ * On success, handle to the allocated object is returned,
+ * otherwise NULL.
  *
- * Allocation requests with size > ZS_MAX_ALLOC_SIZE will fail.
+ * Allocation requests with size > ZS_MAX_USER_SIZE will fail.
  */
 void *zs_malloc(struct zs_pool *pool, size_t size)
 {
-	void *obj;
-	struct link_free *link;
+	unsigned long handle;
 	int class_idx;
 	struct size_class *class;
+	struct zs_magazine *mag;
 
-	struct page *first_page, *m_page;
-	unsigned long m_objidx, m_offset;
-
-	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+	if (unlikely(!size || size > ZS_MAX_USER_SIZE))
 		return NULL;
 
+	/* Each object starts with a back-reference to its handle */
+	size += ZS_HANDLE_SIZE;
 	class_idx = get_size_class_index(size);
 	class = &pool->size_class[class_idx];
 	BUG_ON(class_idx != class->index);
 
-	spin_lock(&class->lock);
-	first_page = find_get_zspage(class);
+	handle = 0;
+	mag = &get_cpu_ptr(pool->mags)->mag[class_idx];
+	spin_lock(&mag->lock);
+	if (mag->count)
+		handle = mag->handles[--mag->count];
+	spin_unlock(&mag->lock);
+	put_cpu_ptr(pool->mags);
 
-	if (!first_page) {
-		spin_unlock(&class->lock);
-		first_page = alloc_zspage(class, pool->flags);
-		if (unlikely(!first_page))
-			return NULL;
+	if (handle)
+		return (void *)handle;
 
-		set_zspage_mapping(first_page, class->index, ZS_EMPTY);
-		spin_lock(&class->lock);
-		class->pages_allocated += class->zspage_order;
-	}
-
-	obj = first_page->freelist;
-	obj_handle_to_location(obj, &m_page, &m_objidx);
-	m_offset = obj_idx_to_offset(m_page, m_objidx, class->size);
-
-	link = (struct link_free *)kmap_atomic(m_page) +
-					m_offset / sizeof(*link);
-	first_page->freelist = link->next;
-	memset(link, POISON_INUSE, sizeof(*link));
-	kunmap_atomic(link);
-
-	first_page->inuse++;
-	/* Now move the zspage to another fullness group, if required */
-	fix_fullness_group(pool, first_page);
-	spin_unlock(&class->lock);
-
-	return obj;
+	return zs_malloc_refill(pool, class);
 }
 EXPORT_SYMBOL_GPL(zs_malloc);
 
-void zs_free(struct zs_pool *pool, void *obj)
+void zs_free(struct zs_pool *pool, void *handle)
 {
-	struct link_free *link;
-	struct page *first_page, *f_page;
-	unsigned long f_objidx, f_offset;
-
-	int class_idx;
-	struct size_class *class;
+	void *obj;
+	struct page *f_page;
+	unsigned long f_objidx;
+	unsigned long drain[ZS_MAG_BATCH];
+	int class_idx, nr = 0;
 	enum fullness_group fullness;
+	struct zs_magazine *mag;
 
-	if (unlikely(!obj))
+	if (unlikely(!handle))
 		return;
 
-	obj_handle_to_location(obj, &f_page, &f_objidx);
-	first_page = get_first_page(f_page);
-
-	get_zspage_mapping(first_page, &class_idx, &fullness);
-	class = &pool->size_class[class_idx];
-	f_offset = obj_idx_to_offset(f_page, f_objidx, class->size);
-
-	spin_lock(&class->lock);
-
-	/* Insert this object in containing zspage's freelist */
-	link = (struct link_free *)((unsigned char *)kmap_atomic(f_page)
-							+ f_offset);
-	link->next = first_page->freelist;
-	kunmap_atomic(link);
-	first_page->freelist = obj;
-
-	first_page->inuse--;
-	fullness = fix_fullness_group(pool, first_page);
-
-	if (fullness == ZS_EMPTY)
-		class->pages_allocated -= class->zspage_order;
-
-	spin_unlock(&class->lock);
+	/* Keep compaction from freeing the zspage while we look it up */
+	pin_tag((unsigned long)handle);
+	obj = handle_to_obj((unsigned long)handle);
+	obj_to_location(obj, &f_page, &f_objidx);
+	get_zspage_mapping(get_first_page(f_page), &class_idx, &fullness);
+	unpin_tag((unsigned long)handle);
+
+	mag = &get_cpu_ptr(pool->mags)->mag[class_idx];
+	spin_lock(&mag->lock);
+	if (mag->count == ZS_MAG_SIZE) {
+		/* Make room by handing the coldest objects back */
+		nr = ZS_MAG_BATCH;
+		memcpy(drain, mag->handles, nr * sizeof(drain[0]));
+		memmove(mag->handles, mag->handles + nr,
+			(mag->count - nr) * sizeof(mag->handles[0]));
+		mag->count -= nr;
+	}
+	mag->handles[mag->count++] = (unsigned long)handle;
+	spin_unlock(&mag->lock);
+	put_cpu_ptr(pool->mags);
 
-	if (fullness == ZS_EMPTY)
-		free_zspage(first_page);
+	if (nr)
+		zs_free_batch(pool, &pool->size_class[class_idx], drain, nr);
 }
 EXPORT_SYMBOL_GPL(zs_free);
 
 void *zs_map_object(struct zs_pool *pool, void *handle)
 {
+	void *obj;
 	struct page *page;
 	unsigned long obj_idx, off;
 
@@ -711,7 +1394,11 @@ void *zs_map_object(struct zs_pool *pool, void *handle)
 
 	BUG_ON(!handle);
 
-	obj_handle_to_location(handle, &page, &obj_idx);
+	/* The object cannot be migrated until zs_unmap_object() */
+	pin_tag((unsigned long)handle);
+
+	obj = handle_to_obj((unsigned long)handle);
+	obj_to_location(obj, &page, &obj_idx);
 	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
 	class = &pool->size_class[class_idx];
 	off = obj_idx_to_offset(page, obj_idx, class->size);
@@ -720,16 +1407,17 @@ void *zs_map_object(struct zs_pool *pool, void *handle)
 	if (off + class->size <= PAGE_SIZE) {
 		/* this object is contained entirely within a page */
 		area->vm_addr = kmap_atomic(page);
-		return area->vm_addr + off;
+		return area->vm_addr + off + ZS_HANDLE_SIZE;
 	}
 
 	zs_copy_map_object(area->vm_buf, page, off, class->size);
-	return area->vm_buf;
+	return area->vm_buf + ZS_HANDLE_SIZE;
 }
 EXPORT_SYMBOL_GPL(zs_map_object);
 
 void zs_unmap_object(struct zs_pool *pool, void *handle)
 {
+	void *obj;
 	struct page *page;
 	unsigned long obj_idx, off;
 
@@ -740,7 +1428,8 @@ void zs_unmap_object(struct zs_pool *pool, void *handle)
 
 	BUG_ON(!handle);
 
-	obj_handle_to_location(handle, &page, &obj_idx);
+	obj = handle_to_obj((unsigned long)handle);
+	obj_to_location(obj, &page, &obj_idx);
 	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
 	class = &pool->size_class[class_idx];
 	off = obj_idx_to_offset(page, obj_idx, class->size);
@@ -751,9 +1440,37 @@ void zs_unmap_object(struct zs_pool *pool, void *handle)
 	else
 		zs_copy_unmap_object(area->vm_buf, page, off, class->size);
 	put_cpu_var(zs_map_area);
+
+	unpin_tag((unsigned long)handle);
 }
 EXPORT_SYMBOL_GPL(zs_unmap_object);
 
+/**
+ * zs_compact - Defragment all size classes of a pool.
+ * @pool: pool to compact
+ *
+ * Objects cached in per-cpu magazines are first returned to their size
+ * classes. Live objects are then moved out of sparsely used zspages into
+ * fuller ones of the same size class, and the zspages emptied this way
+ * are freed. Objects which are mapped at the time are left in place.
+ *
+ * Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	int i;
+	unsigned long freed = 0;
+
+	mutex_lock(&pool->compact_lock);
+	zs_drain_mags(pool);
+	for (i = 0; i < ZS_SIZE_CLASSES; i++)
+		freed += __zs_compact(&pool->size_class[i]);
+	mutex_unlock(&pool->compact_lock);
+
+	return freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
 u64 zs_get_total_size_bytes(struct zs_pool *pool)
 {
 	int i;
@@ -14,6 +14,8 @@
 #define _ZS_MALLOC_INT_H_
 
 #include <linux/kernel.h>
+#include <linux/mutex.h>
+#include <linux/shrinker.h>
 #include <linux/spinlock.h>
 #include <linux/types.h>
 
@@ -34,13 +36,20 @@
 
 /*
  * Object location (<PFN>, <obj_idx>) is encoded as
- * as single (void *) handle value.
+ * a single unsigned long 'obj' value, shifted left by OBJ_TAG_BITS
+ * so that its low bit is always clear.
  *
  * Note that object index <obj_idx> is relative to system
  * page <PFN> it is stored in, so for each sub-page belonging
  * to a zspage, obj_idx starts with 0.
  *
  * This is made more complicated by various memory models and PAE.
+ *
+ * Handles returned to users do not encode the location directly: a
+ * handle points to a word holding the current obj value, so that objects
+ * can be moved between zspages by compaction. The low bit of that word
+ * is used as a lock (HANDLE_PIN_BIT) which keeps the object in place
+ * while it is mapped or being freed.
  */
 
 #ifndef MAX_PHYSMEM_BITS
@@ -55,14 +64,27 @@
 #endif
 #endif
 #define _PFN_BITS		(MAX_PHYSMEM_BITS - PAGE_SHIFT)
-#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS)
+#define OBJ_TAG_BITS	1
+#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS - OBJ_TAG_BITS)
 #define OBJ_INDEX_MASK	((_AC(1, UL) << OBJ_INDEX_BITS) - 1)
 
+/*
+ * The first word of every allocated object holds its handle with
+ * OBJ_ALLOCATED_TAG set, while free objects hold a (tag clear) obj value
+ * linking them into their zspage's freelist. This lets compaction find
+ * the live objects of a zspage, and their handles, by scanning it.
+ */
+#define OBJ_ALLOCATED_TAG	1
+#define HANDLE_PIN_BIT		0
+#define ZS_HANDLE_SIZE		(sizeof(unsigned long))
+
 #define MAX(a, b) ((a) >= (b) ? (a) : (b))
 /* ZS_MIN_ALLOC_SIZE must be multiple of ZS_ALIGN */
 #define ZS_MIN_ALLOC_SIZE \
 	MAX(32, (ZS_MAX_PAGES_PER_ZSPAGE << PAGE_SHIFT >> OBJ_INDEX_BITS))
 #define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+/* Largest size zs_malloc() accepts, leaving room for the object header */
+#define ZS_MAX_USER_SIZE	(ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE)
 
 /*
  * On systems with 4K page size, this gives 254 size classes! There is a
@@ -109,6 +131,26 @@ enum fullness_group {
  */
 static const int fullness_threshold_frac = 4;
 
+/*
+ * Each CPU keeps a 'magazine' of up to ZS_MAG_SIZE allocated objects per
+ * size class, so that most zs_malloc() and zs_free() calls are served
+ * without taking the class lock. Magazines are refilled from, and drained
+ * to, their class ZS_MAG_BATCH objects at a time under a single lock hold.
+ */
+#define ZS_MAG_SIZE		8
+#define ZS_MAG_BATCH		4
+
+struct zs_magazine {
+	/* Only contended when another CPU drains this magazine */
+	spinlock_t lock;
+	int count;
+	unsigned long handles[ZS_MAG_SIZE];
+};
+
+struct zs_pcpu_mags {
+	struct zs_magazine mag[ZS_SIZE_CLASSES];
+};
+
 struct mapping_area {
 	char *vm_buf; /* copy buffer for objects that span pages */
 	char *vm_addr; /* address of kmap_atomic()'ed pages */
@@ -125,10 +167,26 @@ struct size_class {
 	/* Number of PAGE_SIZE sized pages to combine to form a 'zspage' */
 	int zspage_order;
 
+	/* Number of objects a zspage of this class can store */
+	int objs_per_zspage;
+
 	spinlock_t lock;
 
 	/* stats */
 	u64 pages_allocated;
+	unsigned long objs_inuse;
+	unsigned long zspage_count[_ZS_NR_FULLNESS_GROUPS];
+	unsigned long pages_compacted;
+	unsigned long mag_refills;	/* magazine refills from this class */
+	unsigned long mag_drains;	/* objects drained from magazines */
+
+	/* lock statistics, updated with the lock held */
+	unsigned long lock_acquired;
+	unsigned long lock_contended;
+#ifdef CONFIG_ZSMALLOC_LOCK_STAT
+	u64 lock_hold_ns;
+	u64 lock_start;
+#endif
 
 	struct page *fullness_list[_ZS_NR_FULLNESS_GROUPS];
 };
@@ -140,8 +198,12 @@ struct size_class {
  * This must be power of 2 and less than or equal to ZS_ALIGN
  */
 struct link_free {
-	/* Handle of next free chunk (encodes <PFN, obj_idx>) */
-	void *next;
+	union {
+		/* obj value of next free chunk (encodes <PFN, obj_idx>) */
+		void *next;
+		/* Handle of allocated object, with OBJ_ALLOCATED_TAG set */
+		unsigned long handle;
+	};
 };
 
 struct zs_pool {
@@ -149,6 +211,20 @@ struct zs_pool {
 
 	gfp_t flags;	/* allocation flags used when growing pool */
 	const char *name;
+
+	struct zs_pcpu_mags __percpu *mags;
+
+	int id;			/* distinguishes pools sharing a name */
+	char *handle_cache_name;
+	struct kmem_cache *handle_cache;
+
+	/* Compacts the pool under memory pressure */
+	struct shrinker shrinker;
+	struct mutex compact_lock;	/* serializes zs_compact() */
+
+#ifdef CONFIG_DEBUG_FS
+	struct dentry *stat_dentry;
+#endif
 };
 
 #endif
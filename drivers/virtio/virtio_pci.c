@@ -51,6 +51,8 @@ struct virtio_pci_device
 	/* Name strings for interrupts. This size should be enough,
 	 * and I'm too lazy to allocate each name separately. */
 	char (*msix_names)[256];
+	/* Affinity hints handed to the irq core, one per vector */
+	cpumask_var_t *msix_affinity_masks;
 	/* Number of available vectors */
 	unsigned msix_vectors;
 	/* Vectors allocated, excluding per-vq vectors if any */
@@ -279,6 +281,13 @@ static void vp_free_vectors(struct virtio_device *vdev)
 	for (i = 0; i < vp_dev->msix_used_vectors; ++i)
 		free_irq(vp_dev->msix_entries[i].vector, vp_dev);
 
+	if (vp_dev->msix_affinity_masks) {
+		for (i = 0; i < vp_dev->msix_vectors; ++i)
+			free_cpumask_var(vp_dev->msix_affinity_masks[i]);
+		kfree(vp_dev->msix_affinity_masks);
+		vp_dev->msix_affinity_masks = NULL;
+	}
+
 	if (vp_dev->msix_enabled) {
 		/* Disable the vector used for configuration */
 		iowrite16(VIRTIO_MSI_NO_VECTOR,
@@ -327,6 +336,20 @@ static int vp_request_msix_vectors(struct virtio_device *vdev, int nvectors,
 	vp_dev->msix_vectors = nvectors;
 	vp_dev->msix_enabled = 1;
 
+	vp_dev->msix_affinity_masks =
+		kzalloc(nvectors * sizeof *vp_dev->msix_affinity_masks,
+			GFP_KERNEL);
+	if (!vp_dev->msix_affinity_masks) {
+		err = -ENOMEM;
+		goto error;
+	}
+	for (i = 0; i < nvectors; ++i)
+		if (!zalloc_cpumask_var(&vp_dev->msix_affinity_masks[i],
+					GFP_KERNEL)) {
+			err = -ENOMEM;
+			goto error;
+		}
+
 	/* Set the vector used for configuration */
 	v = vp_dev->msix_used_vectors;
 	snprintf(vp_dev->msix_names[v], sizeof *vp_dev->msix_names,
@@ -496,9 +519,12 @@ static void vp_del_vqs(struct virtio_device *vdev)
 	list_for_each_entry_safe(vq, n, &vdev->vqs, list) {
 		info = vq->priv;
 		if (vp_dev->per_vq_vectors &&
-			info->msix_vector != VIRTIO_MSI_NO_VECTOR)
-			free_irq(vp_dev->msix_entries[info->msix_vector].vector,
-				 vq);
+			info->msix_vector != VIRTIO_MSI_NO_VECTOR) {
+			int irq = vp_dev->msix_entries[info->msix_vector].vector;
+
+			irq_set_affinity_hint(irq, NULL);
+			free_irq(irq, vq);
+		}
 		vp_del_vq(vq);
 	}
 	vp_dev->per_vq_vectors = false;
@@ -609,6 +635,33 @@ static const char *vp_bus_name(struct virtio_device *vdev)
 	return pci_name(vp_dev->pci_dev);
 }
 
+/*
+ * the config->set_vq_affinity() implementation.  Only a virtqueue with an
+ * MSI-X vector of its own can be steered; a shared vector is left alone.
+ */
+static int vp_set_vq_affinity(struct virtqueue *vq, const struct cpumask *mask)
+{
+	struct virtio_pci_device *vp_dev = to_vp_device(vq->vdev);
+	struct virtio_pci_vq_info *info = vq->priv;
+	struct cpumask *hint;
+	int irq;
+
+	if (!vq->callback)
+		return -EINVAL;
+
+	if (!vp_dev->msix_enabled || !vp_dev->per_vq_vectors ||
+	    info->msix_vector == VIRTIO_MSI_NO_VECTOR)
+		return 0;
+
+	irq = vp_dev->msix_entries[info->msix_vector].vector;
+	if (!mask || cpumask_empty(mask))
+		return irq_set_affinity_hint(irq, NULL);
+
+	hint = vp_dev->msix_affinity_masks[info->msix_vector];
+	cpumask_copy(hint, mask);
+	return irq_set_affinity_hint(irq, hint);
+}
+
 static struct virtio_config_ops virtio_pci_config_ops = {
 	.get		= vp_get,
 	.set		= vp_set,
@@ -620,6 +673,7 @@ static struct virtio_config_ops virtio_pci_config_ops = {
 	.get_features	= vp_get_features,
 	.finalize_features = vp_finalize_features,
 	.bus_name	= vp_bus_name,
+	.set_vq_affinity = vp_set_vq_affinity,
 };
 
 static void virtio_pci_release_dev(struct device *_d)
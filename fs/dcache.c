@@ -37,6 +37,7 @@
 #include <linux/rculist_bl.h>
 #include <linux/prefetch.h>
 #include <linux/ratelimit.h>
+#include <linux/memcontrol.h>
 #include "internal.h"
 #include "mount.h"
 
@@ -835,15 +836,17 @@ static void shrink_dentry_list(struct list_head *list)
  * prune_dcache_sb - shrink the dcache
  * @sb: superblock
  * @count: number of entries to try to free
+ * @memcg: only free dentries charged to this memcg, or any if %NULL
  *
  * Attempt to shrink the superblock dcache LRU by @count entries. This is
  * done when we need more memory an called from the superblock shrinker
- * function.
+ * function.  Dentries skipped for @memcg count against @count as well.
  *
  * This function may fail to free any resources if all the dentries are in
  * use.
  */
-void prune_dcache_sb(struct super_block *sb, int count)
+void prune_dcache_sb(struct super_block *sb, int count,
+		     struct mem_cgroup *memcg)
 {
 	struct dentry *dentry;
 	LIST_HEAD(referenced);
@@ -862,7 +865,12 @@ relock:
 			goto relock;
 		}
 
-		if (dentry->d_flags & DCACHE_REFERENCED) {
+		if (memcg && !memcg_kmem_owns(memcg, dentry)) {
+			list_move(&dentry->d_lru, &referenced);
+			spin_unlock(&dentry->d_lock);
+			if (!--count)
+				break;
+		} else if (dentry->d_flags & DCACHE_REFERENCED) {
 			dentry->d_flags &= ~DCACHE_REFERENCED;
 			list_move(&dentry->d_lru, &referenced);
 			spin_unlock(&dentry->d_lock);
@@ -3041,7 +3049,7 @@ static void __init dcache_init(void)
 	 * of the dcache. 
 	 */
 	dentry_cache = KMEM_CACHE(dentry,
-		SLAB_RECLAIM_ACCOUNT|SLAB_PANIC|SLAB_MEM_SPREAD);
+		SLAB_RECLAIM_ACCOUNT|SLAB_PANIC|SLAB_MEM_SPREAD|SLAB_ACCOUNT);
 
 	/* Hash may have been set up in dcache_init_early */
 	if (!hashdist)
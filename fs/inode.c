@@ -17,6 +17,7 @@
 #include <linux/prefetch.h>
 #include <linux/buffer_head.h> /* for inode_has_buffers */
 #include <linux/ratelimit.h>
+#include <linux/memcontrol.h>
 #include "internal.h"
 
 /*
@@ -347,6 +348,7 @@ void address_space_init_once(struct address_space *mapping)
 	spin_lock_init(&mapping->tree_lock);
 	mutex_init(&mapping->i_mmap_mutex);
 	INIT_LIST_HEAD(&mapping->private_list);
+	INIT_LIST_HEAD(&mapping->shadow_list);
 	spin_lock_init(&mapping->private_lock);
 	INIT_RAW_PRIO_TREE_ROOT(&mapping->i_mmap);
 	INIT_LIST_HEAD(&mapping->i_mmap_nonlinear);
@@ -497,6 +499,14 @@ void end_writeback(struct inode *inode)
 	spin_lock_irq(&inode->i_data.tree_lock);
 	BUG_ON(inode->i_data.nrpages);
 	spin_unlock_irq(&inode->i_data.tree_lock);
+	/*
+	 * Reclaim may have left shadow entries of evicted pages behind,
+	 * also when racing with the final truncate.  No more can appear
+	 * once the mapping is marked exiting and tree_lock was cycled.
+	 */
+	if (inode->i_data.nrshadows)
+		truncate_inode_pages(&inode->i_data, 0);
+	workingset_forget_mapping(&inode->i_data);
 	BUG_ON(!list_empty(&inode->i_data.private_list));
 	BUG_ON(!(inode->i_state & I_FREEING));
 	BUG_ON(inode->i_state & I_CLEAR);
@@ -531,6 +541,9 @@ static void evict(struct inode *inode)
 
 	inode_sb_list_del(inode);
 
+	/* Stop reclaim from leaving shadow entries in the dying mapping */
+	mapping_set_exiting(&inode->i_data);
+
 	if (op->evict_inode) {
 		op->evict_inode(inode);
 	} else {
@@ -683,8 +696,12 @@ static int can_unuse(struct inode *inode)
  * the fact we are doing lazy LRU updates to minimise lock contention so the
  * LRU does not have strict ordering. Hence we don't want to reclaim inodes
  * with this flag set because they are the inodes that are out of order.
+ *
+ * With @memcg set, only inodes charged to that memcg are freed; the others
+ * are rotated and count as scanned.
  */
-void prune_icache_sb(struct super_block *sb, int nr_to_scan)
+void prune_icache_sb(struct super_block *sb, int nr_to_scan,
+		     struct mem_cgroup *memcg)
 {
 	LIST_HEAD(freeable);
 	int nr_scanned;
@@ -699,6 +716,11 @@ void prune_icache_sb(struct super_block *sb, int nr_to_scan)
 
 		inode = list_entry(sb->s_inode_lru.prev, struct inode, i_lru);
 
+		if (memcg && !memcg_kmem_owns(memcg, inode)) {
+			list_move(&inode->i_lru, &sb->s_inode_lru);
+			continue;
+		}
+
 		/*
 		 * we are inverting the sb->s_inode_lru_lock/inode->i_lock here,
 		 * so use a trylock. If we fail to get the lock, just move the
@@ -1662,7 +1684,7 @@ void __init inode_init(void)
 					 sizeof(struct inode),
 					 0,
 					 (SLAB_RECLAIM_ACCOUNT|SLAB_PANIC|
-					 SLAB_MEM_SPREAD),
+					 SLAB_MEM_SPREAD|SLAB_ACCOUNT),
 					 init_once);
 
 	/* Hash may have been set up in inode_init_early */
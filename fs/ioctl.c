@@ -73,8 +73,9 @@ static int ioctl_fibmap(struct file *filp, int __user *p)
  * @flags:	FIEMAP_EXTENT flags that describe this extent
  *
  * Called from file system ->fiemap callback. Will populate extent
- * info as passed in via arguments and copy to user memory. On
- * success, extent count on fieinfo is incremented.
+ * info as passed in via arguments and copy to user memory, or to
+ * fi_kernel_extents if the caller is in the kernel. On success,
+ * extent count on fieinfo is incremented.
  *
  * Returns 0 on success, -errno on error, 1 if this was the last
  * extent that will fit in user array.
@@ -110,9 +111,13 @@ int fiemap_fill_next_extent(struct fiemap_extent_info *fieinfo, u64 logical,
 	extent.fe_length = len;
 	extent.fe_flags = flags;
 
-	dest += fieinfo->fi_extents_mapped;
-	if (copy_to_user(dest, &extent, sizeof(extent)))
-		return -EFAULT;
+	if (fieinfo->fi_kernel_extents) {
+		fieinfo->fi_kernel_extents[fieinfo->fi_extents_mapped] = extent;
+	} else {
+		dest += fieinfo->fi_extents_mapped;
+		if (copy_to_user(dest, &extent, sizeof(extent)))
+			return -EFAULT;
+	}
 
 	fieinfo->fi_extents_mapped++;
 	if (fieinfo->fi_extents_mapped == fieinfo->fi_extents_max)
@@ -63,6 +63,13 @@ void task_mem(struct seq_file *m, struct mm_struct *mm)
 		mm->stack_vm << (PAGE_SHIFT-10), text, lib,
 		(PTRS_PER_PTE*sizeof(pte_t)*mm->nr_ptes) >> 10,
 		swap << (PAGE_SHIFT-10));
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	seq_printf(m,
+		"HugeCollapsed:\t%lu\n"
+		"HugeCollapseFailed:\t%lu\n",
+		atomic_long_read(&mm->thp_collapsed),
+		atomic_long_read(&mm->thp_collapse_failed));
+#endif
 }
 
 unsigned long task_vsize(struct mm_struct *mm)
@@ -33,6 +33,7 @@
 #include <linux/rculist_bl.h>
 #include <linux/cleancache.h>
 #include <linux/fsnotify.h>
+#include <linux/memcontrol.h>
 #include "internal.h"
 
 
@@ -64,7 +65,8 @@ static int prune_super(struct shrinker *shrink, struct shrink_control *sc)
 	if (!grab_super_passive(sb))
 		return !sc->nr_to_scan ? 0 : -1;
 
-	if (sb->s_op && sb->s_op->nr_cached_objects)
+	/* Filesystem private caches are not charged to memcgs */
+	if (sb->s_op && sb->s_op->nr_cached_objects && !sc->target_mem_cgroup)
 		fs_objects = sb->s_op->nr_cached_objects(sb);
 
 	total_objects = sb->s_nr_dentry_unused +
@@ -86,8 +88,8 @@ static int prune_super(struct shrinker *shrink, struct shrink_control *sc)
 		 * prune the dcache first as the icache is pinned by it, then
 		 * prune the icache, followed by the filesystem specific caches
 		 */
-		prune_dcache_sb(sb, dentries);
-		prune_icache_sb(sb, inodes);
+		prune_dcache_sb(sb, dentries, sc->target_mem_cgroup);
+		prune_icache_sb(sb, inodes, sc->target_mem_cgroup);
 
 		if (fs_objects && sb->s_op->free_cached_objects) {
 			sb->s_op->free_cached_objects(sb, fs_objects);
@@ -97,6 +99,10 @@ static int prune_super(struct shrinker *shrink, struct shrink_control *sc)
 				sb->s_nr_inodes_unused + fs_objects;
 	}
 
+	if (sc->target_mem_cgroup)
+		total_objects = memcg_kmem_shrink_share(sc->target_mem_cgroup,
+							total_objects);
+
 	total_objects = (total_objects / 100) * sysctl_vfs_cache_pressure;
 	drop_super(sb);
 	return total_objects;
@@ -185,6 +191,7 @@ static struct super_block *alloc_super(struct file_system_type *type)
 		s->s_shrink.seeks = DEFAULT_SEEKS;
 		s->s_shrink.shrink = prune_super;
 		s->s_shrink.batch = 1024;
+		s->s_shrink.flags = SHRINKER_MEMCG_AWARE;
 	}
 out:
 	return s;
@@ -19,7 +19,15 @@ extern int sysctl_extfrag_threshold;
 extern int sysctl_extfrag_handler(struct ctl_table *table, int write,
 			void __user *buffer, size_t *length, loff_t *ppos);
 
+extern int sysctl_proactive_compaction_threshold;
+extern int sysctl_proactive_compaction_order;
+extern int sysctl_kcompactd_cpu_percent;
+
 extern int fragmentation_index(struct zone *zone, unsigned int order);
+extern void wakeup_kcompactd(struct zone *zone, int order);
+extern void kcompactd_account_alloc(struct page *page, int order);
+extern int kcompactd_run(int nid);
+extern void kcompactd_stop(int nid);
 extern unsigned long try_to_compact_pages(struct zonelist *zonelist,
 			int order, gfp_t gfp_mask, nodemask_t *mask,
 			bool sync);
@@ -74,6 +82,23 @@ static inline int compact_pgdat(pg_data_t *pgdat, int order)
 	return COMPACT_CONTINUE;
 }
 
+static inline void wakeup_kcompactd(struct zone *zone, int order)
+{
+}
+
+static inline void kcompactd_account_alloc(struct page *page, int order)
+{
+}
+
+static inline int kcompactd_run(int nid)
+{
+	return 0;
+}
+
+static inline void kcompactd_stop(int nid)
+{
+}
+
 static inline unsigned long compaction_suitable(struct zone *zone, int order)
 {
 	return COMPACT_SKIPPED;
@@ -411,6 +411,7 @@ struct iovec;
 struct nameidata;
 struct kiocb;
 struct kobject;
+struct mem_cgroup;
 struct pipe_inode_info;
 struct poll_table_struct;
 struct kstatfs;
@@ -653,6 +654,9 @@ struct address_space {
 	struct mutex		i_mmap_mutex;	/* protect tree, count, list */
 	/* Protected by tree_lock together with the radix tree */
 	unsigned long		nrpages;	/* number of total pages */
+	unsigned long		nrshadows;	/* number of shadow entries */
+	pgoff_t			shadow_cursor;	/* shadow reclaim resumes here */
+	struct list_head	shadow_list;	/* mappings with shadow entries */
 	pgoff_t			writeback_index;/* writeback starts here */
 	const struct address_space_operations *a_ops;	/* methods */
 	unsigned long		flags;		/* error bits/gfp mask */
@@ -947,6 +951,18 @@ struct fown_struct {
 	int signum;		/* posix.1b rt signal to be delivered on IO */
 };
 
+/*
+ * Readahead window of one sequential stream
+ */
+struct file_ra_stream {
+	pgoff_t start;			/* where readahead started */
+	unsigned int size;		/* # of readahead pages */
+	unsigned int async_size;	/* do asynchronous readahead when
+					   there are only # of pages ahead */
+};
+
+#define RA_STREAMS	4		/* interleaved streams tracked per file */
+
 /*
  * Track a single file's readahead state
  */
@@ -959,6 +975,12 @@ struct file_ra_state {
 	unsigned int ra_pages;		/* Maximum readahead window */
 	unsigned int mmap_miss;		/* Cache miss stat for mmap accesses */
 	loff_t prev_pos;		/* Cache last read() position */
+	pgoff_t prev_fault;		/* Last page faulted in through mmap */
+
+	unsigned short boost;		/* window may grow to ra_pages << boost */
+	unsigned short stalled;		/* reader waited on the current window */
+	/* windows of the other interleaved streams, most recent first */
+	struct file_ra_stream streams[RA_STREAMS - 1];
 };
 
 /*
@@ -1510,8 +1532,10 @@ struct super_block {
 };
 
 /* superblock cache pruning functions */
-extern void prune_icache_sb(struct super_block *sb, int nr_to_scan);
-extern void prune_dcache_sb(struct super_block *sb, int nr_to_scan);
+extern void prune_icache_sb(struct super_block *sb, int nr_to_scan,
+			    struct mem_cgroup *memcg);
+extern void prune_dcache_sb(struct super_block *sb, int nr_to_scan,
+			    struct mem_cgroup *memcg);
 
 extern struct timespec current_fs_time(struct super_block *sb);
 
@@ -1570,6 +1594,8 @@ struct fiemap_extent_info {
 	unsigned int fi_extents_max;	/* Size of fiemap_extent array */
 	struct fiemap_extent __user *fi_extents_start; /* Start of
 							fiemap_extent array */
+	struct fiemap_extent *fi_kernel_extents; /* Instead of the above,
+						    for in-kernel callers */
 };
 int fiemap_fill_next_extent(struct fiemap_extent_info *info, u64 logical,
 			    u64 phys, u64 len, u32 flags);
@@ -88,6 +88,26 @@ struct disk_stats {
 	unsigned long time_in_queue;
 };
 
+#ifdef CONFIG_BLK_LAT_HIST
+enum {
+	DISK_LAT_READ,
+	DISK_LAT_WRITE,
+	DISK_LAT_FLUSH,
+	DISK_LAT_DISCARD,
+	DISK_LAT_NR_OPS,
+};
+
+/*
+ * Bucket 0 counts completions under 2 usecs, bucket n > 0 those taking
+ * [2^n, 2^(n+1)) usecs, and the last bucket everything slower.
+ */
+#define DISK_LAT_BUCKETS	25
+
+struct disk_lat_hist {
+	unsigned long buckets[DISK_LAT_NR_OPS][DISK_LAT_BUCKETS];
+};
+#endif
+
 #define PARTITION_META_INFO_VOLNAMELTH	64
 #define PARTITION_META_INFO_UUIDLTH	16
 
@@ -189,6 +209,9 @@ struct gendisk {
 	struct disk_events *ev;
 #ifdef  CONFIG_BLK_DEV_INTEGRITY
 	struct blk_integrity *integrity;
+#endif
+#ifdef CONFIG_BLK_LAT_HIST
+	struct disk_lat_hist __percpu *lat_hist;
 #endif
 	int node_id;
 };
@@ -419,6 +442,11 @@ extern void disk_unblock_events(struct gendisk *disk);
 extern void disk_flush_events(struct gendisk *disk, unsigned int mask);
 extern unsigned int disk_clear_events(struct gendisk *disk, unsigned int mask);
 
+#ifdef CONFIG_BLK_LAT_HIST
+extern void disk_lat_hist_add(int cpu, struct gendisk *disk, int op,
+			      u64 nsec);
+#endif
+
 /* drivers/char/random.c */
 extern void add_disk_randomness(struct gendisk *disk);
 extern void rand_initialize_disk(struct gendisk *disk);
@@ -27,6 +27,7 @@ enum {
 };
 
 struct loop_func_table;
+struct loop_extent;
 
 struct loop_device {
 	int		lo_number;
@@ -64,6 +65,13 @@ struct loop_device {
 
 	struct request_queue	*lo_queue;
 	struct gendisk		*lo_disk;
+
+	/* LO_FLAGS_DIRECT_IO: where the backing file's blocks are */
+	struct block_device	*lo_dio_bdev;
+	struct loop_extent	*lo_extents;
+	unsigned int		lo_nr_extents;
+	atomic_t		lo_dio_inflight;
+	wait_queue_head_t	lo_dio_wait;
 };
 
 #endif /* __KERNEL__ */
@@ -75,6 +83,7 @@ enum {
 	LO_FLAGS_READ_ONLY	= 1,
 	LO_FLAGS_AUTOCLEAR	= 4,
 	LO_FLAGS_PARTSCAN	= 8,
+	LO_FLAGS_DIRECT_IO	= 16,
 };
 
 #include <asm/posix_types.h>	/* for __kernel_old_dev_t */
@@ -159,6 +168,7 @@ int loop_unregister_transfer(int number);
 #define LOOP_GET_STATUS64	0x4C05
 #define LOOP_CHANGE_FD		0x4C06
 #define LOOP_SET_CAPACITY	0x4C07
+#define LOOP_SET_DIRECT_IO	0x4C08
 
 /* /dev/loop-control interface */
 #define LOOP_CTL_ADD		0x4C80
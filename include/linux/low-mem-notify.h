@@ -1,17 +1,35 @@
 #ifndef _LINUX_LOW_MEM_NOTIFY_H
 #define _LINUX_LOW_MEM_NOTIFY_H
 
+#include <linux/jiffies.h>
 #include <linux/mm.h>
 #include <linux/stddef.h>
 #include <linux/swap.h>
 
+/*
+ * Up to this many margins can be set.  Level N means that available memory
+ * is below the Nth largest margin, so level 0 is not low on memory.
+ */
+#define LOW_MEM_MAX_THRESHOLDS	4
+
 extern unsigned low_mem_margin_percent;
 extern unsigned long low_mem_minfree;
+extern unsigned long low_mem_hysteresis;
+extern unsigned int low_mem_pressure;
+extern unsigned int low_mem_pressure_threshold;
+extern unsigned long low_mem_pressure_stamp;
 void low_mem_notify(void);
+void low_mem_vmpressure(unsigned long scanned, unsigned long reclaimed);
 extern const struct file_operations low_mem_notify_fops;
 extern bool low_mem_margin_enabled;
 extern unsigned long low_mem_lowest_seen_anon_mem;
 extern const unsigned long low_mem_anon_mem_delta;
+extern atomic_t low_mem_level;
+
+static inline unsigned int low_mem_get_level(void)
+{
+	return atomic_read(&low_mem_level);
+}
 
 /*
  * Compute "available" memory, that is either free memory or memory that can be
@@ -35,39 +53,43 @@ static inline unsigned long get_available_mem(int lru_base)
 }
 
 /*
- * Return TRUE if we are in a low memory state.
+ * Available memory as compared against the margins.  We declare a
+ * low-memory condition when a combination of RAM and swap space is low.
+ * The contribution of swap is reduced by a factor of ram_vs_swap_weight.
  */
-static inline bool _is_low_mem_situation(void)
+static inline unsigned long get_available_mem_adj(void)
 {
 	const int lru_base = NR_LRU_BASE - LRU_BASE;
-	static bool was_low_mem;	/* = false, as per style guide */
-	/* We declare a low-memory condition when a combination of RAM and swap
-	 * space is low.  The contribution of swap is reduced by a factor of
-	 * ram_vs_swap_weight.
-	 */
 	const int ram_vs_swap_weight = 4;
-	unsigned long available_mem = get_available_mem(lru_base) +
+
+	return get_available_mem(lru_base) +
 		nr_swap_pages / ram_vs_swap_weight;
-	bool is_low_mem = available_mem < low_mem_minfree;
+}
+
+/*
+ * Return TRUE if reclaim has recently been failing to make progress, even
+ * though available memory may still look fine.
+ */
+static inline bool low_mem_pressure_high(void)
+{
+	return low_mem_pressure_threshold &&
+		low_mem_pressure >= low_mem_pressure_threshold &&
+		time_before(jiffies, low_mem_pressure_stamp + HZ);
+}
+
+/*
+ * Return TRUE if we are in a low memory state.  This only checks the
+ * largest margin; low_mem_notify() works out the actual level.
+ */
+static inline bool _is_low_mem_situation(void)
+{
+	unsigned long minfree = low_mem_minfree;
 
-	if (unlikely(is_low_mem && !was_low_mem)) {
-		unsigned long anon_mem =
-			global_page_state(lru_base + LRU_ACTIVE_ANON) +
-			global_page_state(lru_base + LRU_INACTIVE_ANON);
-		if (anon_mem < low_mem_lowest_seen_anon_mem) {
-			printk(KERN_INFO "entering low_mem "
-			       "(avail RAM = %lu kB, avail swap %lu kB) "
-			       "with lowest seen anon mem: %lu kB\n",
-			       available_mem * PAGE_SIZE / 1024,
-			       nr_swap_pages * PAGE_SIZE / 1024,
-			       anon_mem * PAGE_SIZE / 1024);
-			low_mem_lowest_seen_anon_mem = anon_mem -
-				low_mem_anon_mem_delta;
-		}
-	}
-	was_low_mem = is_low_mem;
+	/* Once entered, stay low until memory recovers past the hysteresis */
+	if (low_mem_get_level())
+		minfree += low_mem_hysteresis;
 
-	return is_low_mem;
+	return get_available_mem_adj() < minfree || low_mem_pressure_high();
 }
 
 static inline bool is_low_mem_situation(void)
@@ -21,6 +21,7 @@
 #define _LINUX_MEMCONTROL_H
 #include <linux/cgroup.h>
 #include <linux/vm_event_item.h>
+#include <linux/static_key.h>
 
 struct mem_cgroup;
 struct page_cgroup;
@@ -63,12 +64,12 @@ extern int mem_cgroup_cache_charge(struct page *page, struct mm_struct *mm,
 					gfp_t gfp_mask);
 
 struct lruvec *mem_cgroup_zone_lruvec(struct zone *, struct mem_cgroup *);
-struct lruvec *mem_cgroup_lru_add_list(struct zone *, struct page *,
-				       enum lru_list);
+struct lruvec *mem_cgroup_page_lruvec(struct page *, struct zone *);
+void mem_cgroup_lru_add_list(struct lruvec *, struct page *, enum lru_list);
 void mem_cgroup_lru_del_list(struct page *, enum lru_list);
 void mem_cgroup_lru_del(struct page *);
-struct lruvec *mem_cgroup_lru_move_lists(struct zone *, struct page *,
-					 enum lru_list, enum lru_list);
+void mem_cgroup_lru_move_lists(struct lruvec *, struct page *,
+			       enum lru_list, enum lru_list);
 
 /* For coalescing uncharge for reducing memcg' overhead*/
 extern void mem_cgroup_uncharge_start(void);
@@ -251,13 +252,18 @@ static inline struct lruvec *mem_cgroup_zone_lruvec(struct zone *zone,
 	return &zone->lruvec;
 }
 
-static inline struct lruvec *mem_cgroup_lru_add_list(struct zone *zone,
-						     struct page *page,
-						     enum lru_list lru)
+static inline struct lruvec *mem_cgroup_page_lruvec(struct page *page,
+						    struct zone *zone)
 {
 	return &zone->lruvec;
 }
 
+static inline void mem_cgroup_lru_add_list(struct lruvec *lruvec,
+					   struct page *page,
+					   enum lru_list lru)
+{
+}
+
 static inline void mem_cgroup_lru_del_list(struct page *page, enum lru_list lru)
 {
 }
@@ -266,12 +272,11 @@ static inline void mem_cgroup_lru_del(struct page *page)
 {
 }
 
-static inline struct lruvec *mem_cgroup_lru_move_lists(struct zone *zone,
-						       struct page *page,
-						       enum lru_list from,
-						       enum lru_list to)
+static inline void mem_cgroup_lru_move_lists(struct lruvec *lruvec,
+					     struct page *page,
+					     enum lru_list from,
+					     enum lru_list to)
 {
-	return &zone->lruvec;
 }
 
 static inline struct mem_cgroup *try_get_mem_cgroup_from_page(struct page *page)
@@ -448,5 +453,80 @@ static inline void sock_release_memcg(struct sock *sk)
 {
 }
 #endif /* CONFIG_CGROUP_MEM_RES_CTLR_KMEM */
+
+struct kmem_cache;
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR_KMEM_SLAB
+extern struct static_key memcg_kmem_enabled_key;
+
+static inline bool memcg_kmem_enabled(void)
+{
+	return static_key_false(&memcg_kmem_enabled_key);
+}
+
+struct kmem_cache *__memcg_kmem_get_cache(struct kmem_cache *cachep,
+					  gfp_t gfp);
+bool memcg_kmem_is_active(struct mem_cgroup *memcg);
+bool memcg_kmem_owns(struct mem_cgroup *memcg, const void *obj);
+unsigned long memcg_kmem_shrink_share(struct mem_cgroup *memcg,
+				      unsigned long objects);
+unsigned long memcg_nr_lru_pages(struct mem_cgroup *memcg);
+int memcg_charge_kmem(struct mem_cgroup *memcg, gfp_t gfp,
+		      unsigned int nr_pages);
+void memcg_uncharge_kmem(struct mem_cgroup *memcg, unsigned int nr_pages);
+int memcg_register_cache(struct mem_cgroup *memcg, struct kmem_cache *s,
+			 struct kmem_cache *root);
+void memcg_release_cache(struct kmem_cache *s);
+
+extern int memcg_limited_groups_array_size;
+
+/**
+ * memcg_kmem_get_cache - select the cache to allocate from
+ * @cachep: the SLAB_ACCOUNT cache the caller asked for
+ * @gfp: allocation flags
+ *
+ * Returns the copy of @cachep that belongs to the memcg of the current
+ * task, or @cachep itself if the allocation is not to be accounted or
+ * the copy does not exist yet.
+ */
+static __always_inline struct kmem_cache *
+memcg_kmem_get_cache(struct kmem_cache *cachep, gfp_t gfp)
+{
+	if (!memcg_kmem_enabled())
+		return cachep;
+	return __memcg_kmem_get_cache(cachep, gfp);
+}
+#else
+static inline bool memcg_kmem_enabled(void)
+{
+	return false;
+}
+
+static inline struct kmem_cache *
+memcg_kmem_get_cache(struct kmem_cache *cachep, gfp_t gfp)
+{
+	return cachep;
+}
+
+static inline bool memcg_kmem_is_active(struct mem_cgroup *memcg)
+{
+	return false;
+}
+
+static inline bool memcg_kmem_owns(struct mem_cgroup *memcg, const void *obj)
+{
+	return true;
+}
+
+static inline unsigned long memcg_kmem_shrink_share(struct mem_cgroup *memcg,
+						    unsigned long objects)
+{
+	return objects;
+}
+
+static inline unsigned long memcg_nr_lru_pages(struct mem_cgroup *memcg)
+{
+	return 0;
+}
+#endif /* CONFIG_CGROUP_MEM_RES_CTLR_KMEM_SLAB */
 #endif /* _LINUX_MEMCONTROL_H */
 
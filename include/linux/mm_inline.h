@@ -21,22 +21,91 @@ static inline int page_is_file_cache(struct page *page)
 	return !PageSwapBacked(page);
 }
 
-static inline void
-add_page_to_lru_list(struct zone *zone, struct page *page, enum lru_list lru)
+/*
+ * Each lruvec - the zone's own, or one per memcg per zone - has its own
+ * lru_lock, always taken with interrupts disabled.  A page on an lru list
+ * is linked on the lruvec which mem_cgroup_page_lruvec() returns for it,
+ * and the memcg a page is charged to only changes under the lru_lock of
+ * the lruvec it currently maps to; so having taken that lock, the answer
+ * has to be checked again.  lock_page_lruvec_irq() and friends do that.
+ */
+static inline void __lruvec_lock(struct lruvec *lruvec)
+{
+	if (!spin_trylock(&lruvec->lru_lock)) {
+		__inc_zone_state(lruvec->zone, NR_LRU_LOCK_CONTENDED);
+		spin_lock(&lruvec->lru_lock);
+	}
+	__inc_zone_state(lruvec->zone, NR_LRU_LOCK_ACQUIRED);
+}
+
+static inline void lock_lruvec_irq(struct lruvec *lruvec)
+{
+	local_irq_disable();
+	__lruvec_lock(lruvec);
+}
+
+static inline void unlock_lruvec_irq(struct lruvec *lruvec)
 {
-	struct lruvec *lruvec;
+	spin_unlock_irq(&lruvec->lru_lock);
+}
 
-	lruvec = mem_cgroup_lru_add_list(zone, page, lru);
+static inline void unlock_lruvec_irqrestore(struct lruvec *lruvec,
+					    unsigned long flags)
+{
+	spin_unlock_irqrestore(&lruvec->lru_lock, flags);
+}
+
+/*
+ * Return the lruvec of @page with its lru_lock held, dropping the lock of
+ * @locked (which may be NULL) if that is a different lruvec.  Interrupts
+ * must be disabled.
+ */
+extern struct lruvec *relock_page_lruvec(struct page *page,
+					 struct lruvec *locked);
+
+static inline struct lruvec *lock_page_lruvec_irq(struct page *page)
+{
+	local_irq_disable();
+	return relock_page_lruvec(page, NULL);
+}
+
+static inline struct lruvec *lock_page_lruvec_irqsave(struct page *page,
+						      unsigned long *flags)
+{
+	local_irq_save(*flags);
+	return relock_page_lruvec(page, NULL);
+}
+
+/*
+ * Is @page on an lru list of @lruvec, whose lru_lock the caller holds?
+ * A page seen on the lru of another lruvec must be left alone.
+ */
+static inline bool page_lru_locked(struct page *page, struct lruvec *lruvec)
+{
+	if (!PageLRU(page))
+		return false;
+	smp_rmb();
+	return mem_cgroup_page_lruvec(page, lruvec->zone) == lruvec;
+}
+
+static inline void
+add_page_to_lru_list(struct page *page, struct lruvec *lruvec,
+		     enum lru_list lru)
+{
+	mem_cgroup_lru_add_list(lruvec, page, lru);
 	list_add(&page->lru, &lruvec->lists[lru]);
-	__mod_zone_page_state(zone, NR_LRU_BASE + lru, hpage_nr_pages(page));
+	__mod_zone_page_state(lruvec->zone, NR_LRU_BASE + lru,
+			      hpage_nr_pages(page));
 }
 
 static inline void
-del_page_from_lru_list(struct zone *zone, struct page *page, enum lru_list lru)
+del_page_from_lru_list(struct page *page, struct lruvec *lruvec,
+		       enum lru_list lru)
 {
 	mem_cgroup_lru_del_list(page, lru);
 	list_del(&page->lru);
-	__mod_zone_page_state(zone, NR_LRU_BASE + lru, -hpage_nr_pages(page));
+	__mod_zone_page_state(lruvec->zone, NR_LRU_BASE + lru,
+			      -hpage_nr_pages(page));
 }
 
 /**
@@ -88,10 +88,10 @@ struct free_area {
 struct pglist_data;
 
 /*
- * zone->lock and zone->lru_lock are two of the hottest locks in the kernel.
- * So add a wild amount of padding here to ensure that they fall into separate
- * cachelines.  There are very few zone structures in the machine, so space
- * consumption is not a concern here.
+ * zone->lock and the zone's lruvec lru_lock are two of the hottest locks in
+ * the kernel.  So add a wild amount of padding here to ensure that they fall
+ * into separate cachelines.  There are very few zone structures in the
+ * machine, so space consumption is not a concern here.
  */
 #if defined(CONFIG_SMP)
 struct zone_padding {
@@ -141,7 +141,13 @@ enum zone_stat_item {
 	NUMA_LOCAL,		/* allocation from local node */
 	NUMA_OTHER,		/* allocation from other node */
 #endif
+	WORKINGSET_REFAULT,	/* evicted file pages faulted back in */
+	WORKINGSET_ACTIVATE,	/* ... and activated as part of the workingset */
 	NR_ANON_TRANSPARENT_HUGEPAGES,
+	NR_ZONE_LOCK_ACQUIRED,	/* zone->lock taken by the page allocator */
+	NR_ZONE_LOCK_CONTENDED,	/* ... and found held by another cpu */
+	NR_LRU_LOCK_ACQUIRED,	/* lruvec->lru_lock taken */
+	NR_LRU_LOCK_CONTENDED,	/* ... and found held by another cpu */
 	NR_VM_ZONE_STAT_ITEMS };
 
 /*
@@ -187,6 +193,8 @@ static inline int is_unevictable_lru(enum lru_list lru)
 
 struct lruvec {
 	struct list_head lists[NR_LRU_LISTS];
+	spinlock_t lru_lock;		/* protects lists, see mm_inline.h */
+	struct zone *zone;
 };
 
 /* Mask used at gathering information at once (see memcontrol.c) */
@@ -224,6 +232,10 @@ struct per_cpu_pages {
 	int count;		/* number of pages in the list */
 	int high;		/* high watermark, emptying needed */
 	int batch;		/* chunk size for buddy add/remove */
+	int high_min;		/* high shrinks back to this when freeing */
+	int high_max;		/* high may grow up to this when allocating */
+	u8 alloc_factor;	/* refill batch is batch << alloc_factor */
+	u8 free_factor;		/* drain batch is batch << free_factor */
 
 	/* Lists of pages, one per migrate type stored on the pcp-lists */
 	struct list_head lists[MIGRATE_PCPTYPES];
@@ -404,7 +416,6 @@ struct zone {
 	ZONE_PADDING(_pad1_)
 
 	/* Fields commonly accessed by the page reclaim scanner */
-	spinlock_t		lru_lock;
 	struct lruvec		lruvec;
 
 	struct zone_reclaim_stat reclaim_stat;
@@ -421,6 +432,8 @@ struct zone {
 	 */
 	unsigned int inactive_ratio;
 
+	/* Evictions & activations on the inactive file list */
+	atomic_long_t		inactive_age;
 
 	ZONE_PADDING(_pad2_)
 	/* Rarely used or read-mostly fields */
@@ -699,6 +712,33 @@ typedef struct pglist_data {
 	struct task_struct *kswapd;
 	int kswapd_max_order;
 	enum zone_type classzone_idx;
+#ifdef CONFIG_COMPACTION
+	wait_queue_head_t kcompactd_wait;
+	struct task_struct *kcompactd;
+	int kcompactd_max_order;	/* order requested by the allocator */
+	int kcompactd_credit_order;	/* order of the blocks credited */
+	atomic_t kcompactd_credit;	/* blocks kcompactd freed up */
+#endif
+#ifdef CONFIG_NUMA_BALANCING
+	/*
+	 * Lock serializing the per destination node AutoNUMA memory
+	 * migration rate limiting data.
+	 */
+	spinlock_t numabalancing_migrate_lock;
+
+	/* Rate limiting time interval */
+	unsigned long numabalancing_migrate_next_window;
+
+	/* Number of pages migrated during the rate limiting time interval */
+	unsigned long numabalancing_migrate_nr_pages;
+#endif
+#ifdef CONFIG_DEFERRED_STRUCT_PAGE_INIT
+	/*
+	 * First pfn of the highest zone whose struct page has not been
+	 * initialised yet, or ULONG_MAX once the pgdatinit thread is done.
+	 */
+	unsigned long first_deferred_pfn;
+#endif
 } pg_data_t;
 
 #define node_present_pages(nid)	(NODE_DATA(nid)->node_present_pages)
@@ -720,6 +760,7 @@ typedef struct pglist_data {
 #include <linux/memory_hotplug.h>
 
 extern struct mutex zonelists_mutex;
+void lruvec_init(struct lruvec *lruvec, struct zone *zone);
 void build_all_zonelists(void *data);
 void wakeup_kswapd(struct zone *zone, int order, enum zone_type classzone_idx);
 bool zone_watermark_ok(struct zone *z, int order, unsigned long mark,
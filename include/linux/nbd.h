@@ -47,20 +47,36 @@ enum {
 #define NBD_WRITE_NOCHK 0x0002
 
 struct request;
+struct task_struct;
+struct nbd_device;
+
+/* One connection to the server, each NBD_SET_SOCK adds one */
+struct nbd_sock {
+	struct nbd_device *nbd;
+	struct socket * sock;	/* NULL once shut down			*/
+	struct file * file;
+	int index;
+
+	struct mutex tx_lock;
+	struct request *active_req;	/* Request being sent */
+	wait_queue_head_t active_wq;
+	struct list_head waiting_queue;	/* Requests to be sent */
+	wait_queue_head_t waiting_wq;
+	atomic_t inflight;	/* Requests queued or waiting result	*/
+
+	struct task_struct *send_thread;
+	struct task_struct *recv_thread;
+};
 
 struct nbd_device {
 	int flags;
 	int harderror;		/* Code of hard error			*/
-	struct socket * sock;
-	struct file * file; 	/* If == NULL, device is not ready, yet	*/
+	struct nbd_sock **socks; /* If none, device is not ready, yet	*/
+	int num_connections;
+	int next_sock;
 	int magic;
 
-	spinlock_t queue_lock;
-	struct list_head queue_head;	/* Requests waiting result */
-	struct request *active_req;
-	wait_queue_head_t active_wq;
-	struct list_head waiting_queue;	/* Requests to be sent */
-	wait_queue_head_t waiting_wq;
+	spinlock_t queue_lock;	/* socks[] and their waiting queues	*/
 
 	struct mutex tx_lock;
 	struct gendisk *disk;
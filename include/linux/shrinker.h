@@ -10,6 +10,13 @@ struct shrink_control {
 
 	/* How many slab objects shrinker() should scan and try to reclaim */
 	unsigned long nr_to_scan;
+
+	/*
+	 * The memcg whose limit is being enforced, NULL for global reclaim.
+	 * Only shrinkers with SHRINKER_MEMCG_AWARE are called for memcg
+	 * reclaim, and they should only free objects charged to it.
+	 */
+	struct mem_cgroup *target_mem_cgroup;
 };
 
 /*
@@ -32,12 +39,17 @@ struct shrinker {
 	int (*shrink)(struct shrinker *, struct shrink_control *sc);
 	int seeks;	/* seeks to recreate an obj */
 	long batch;	/* reclaim batch size, 0 = default */
+	unsigned long flags;
 
 	/* These are for internal use */
 	struct list_head list;
 	atomic_long_t nr_in_batch; /* objs pending delete */
 };
 #define DEFAULT_SEEKS 2 /* A good number if you don't know better. */
+
+/* Flags */
+#define SHRINKER_MEMCG_AWARE	(1 << 0)
+
 extern void register_shrinker(struct shrinker *);
 extern void unregister_shrinker(struct shrinker *);
 #endif
@@ -75,6 +75,12 @@
 #else
 # define SLAB_FAILSLAB		0x00000000UL
 #endif
+/* Charge objects to the memory cgroup of the allocating task */
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR_KMEM_SLAB
+# define SLAB_ACCOUNT		0x04000000UL
+#else
+# define SLAB_ACCOUNT		0x00000000UL
+#endif
 
 /* The following flags affect the page allocator grouping pages by mobility */
 #define SLAB_RECLAIM_ACCOUNT	0x00020000UL		/* Objects are reclaimable */
@@ -106,6 +112,55 @@ int kmem_cache_shrink(struct kmem_cache *);
 void kmem_cache_free(struct kmem_cache *, void *);
 unsigned int kmem_cache_size(struct kmem_cache *);
 
+/*
+ * Bulk allocation and freeing of objects.  kmem_cache_alloc_bulk()
+ * returns the number of objects allocated, which is either all of
+ * them or zero.  The contents of the array are undefined after
+ * kmem_cache_free_bulk().
+ */
+int kmem_cache_alloc_bulk(struct kmem_cache *, gfp_t, size_t, void **);
+void kmem_cache_free_bulk(struct kmem_cache *, size_t, void **);
+
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR_KMEM_SLAB
+struct mem_cgroup;
+/*
+ * Memory cgroup state of a SLAB_ACCOUNT cache.
+ *
+ * A root cache, the one created with kmem_cache_create(), keeps an array
+ * of its per-memcg copies, indexed by the kmem id of the memcg.  Each
+ * copy records the memcg it charges its slab pages to and the cache it
+ * was copied from.
+ *
+ * @nr_pages counts the slab pages of a copy, plus one for the copy
+ * itself that is dropped once the memcg is gone and the copy has been
+ * shrunk.  The copy is destroyed when it reaches zero.
+ */
+struct memcg_cache_params {
+	bool is_root_cache;
+	union {
+		struct {
+			struct rcu_head rcu_head;
+			int nr_caches;
+			struct kmem_cache *memcg_caches[0];
+		};
+		struct {
+			struct mem_cgroup *memcg;
+			struct list_head list;
+			struct kmem_cache *root_cache;
+			struct kmem_cache *cachep;
+			bool dead;
+			bool drained;
+			atomic_t nr_pages;
+			struct work_struct destroy;
+		};
+	};
+};
+
+struct kmem_cache *kmem_cache_create_memcg(struct mem_cgroup *memcg,
+		struct kmem_cache *root, const char *name);
+int memcg_update_all_caches(int num_memcgs);
+#endif
+
 /*
  * Please use this macro to create slab caches. Simply specify the
  * name of the structure and maybe some flags that are listed above.
@@ -184,6 +184,8 @@ static inline void set_notify_resume(struct task_struct *task)
  */
 static inline void tracehook_notify_resume(struct pt_regs *regs)
 {
+	/* The NUMA balancing scan is deferred to here from the tick */
+	task_numa_work();
 }
 #endif	/* TIF_NOTIFY_RESUME */
 
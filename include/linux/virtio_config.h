@@ -107,6 +107,10 @@
  *	vdev: the virtio_device
  *      This returns a pointer to the bus name a la pci_name from which
  *      the caller can then copy.
+ * @set_vq_affinity: set the affinity for a virtqueue's interrupt (optional)
+ *	vq: the virtqueue
+ *	mask: the cpus that should handle its interrupt, or NULL to clear
+ *	Only meaningful if the virtqueue has an interrupt of its own.
  */
 typedef void vq_callback_t(struct virtqueue *);
 struct virtio_config_ops {
@@ -125,6 +129,8 @@ struct virtio_config_ops {
 	u32 (*get_features)(struct virtio_device *vdev);
 	void (*finalize_features)(struct virtio_device *vdev);
 	const char *(*bus_name)(struct virtio_device *vdev);
+	int (*set_vq_affinity)(struct virtqueue *vq,
+			       const struct cpumask *mask);
 };
 
 /* If driver didn't advertise the feature, it will never appear. */
@@ -199,5 +205,24 @@ const char *virtio_bus_name(struct virtio_device *vdev)
 	return vdev->config->bus_name(vdev);
 }
 
+/**
+ * virtqueue_set_affinity - set the affinity of a virtqueue's interrupt
+ * @vq: the virtqueue
+ * @mask: the cpus that should handle the interrupt, or NULL to clear
+ *
+ * This is only a hint: the transport may not support it, or the
+ * virtqueue may share its interrupt with others, in which case nothing
+ * is changed.
+ */
+static inline
+int virtqueue_set_affinity(struct virtqueue *vq, const struct cpumask *mask)
+{
+	struct virtio_device *vdev = vq->vdev;
+
+	if (vdev->config->set_vq_affinity)
+		return vdev->config->set_vq_affinity(vq, mask);
+	return 0;
+}
+
 #endif /* __KERNEL__ */
 #endif /* _LINUX_VIRTIO_CONFIG_H */
@@ -32,6 +32,12 @@ enum vm_event_item { PGPGIN, PGPGOUT, PSWPIN, PSWPOUT,
 		FOR_ALL_ZONES(PGSCAN_DIRECT),
 #ifdef CONFIG_NUMA
 		PGSCAN_ZONE_RECLAIM_FAILED,
+#endif
+#ifdef CONFIG_NUMA_BALANCING
+		NUMA_PTE_UPDATES,	/* ptes marked for hinting faults */
+		NUMA_HINT_FAULTS,
+		NUMA_HINT_FAULTS_LOCAL,	/* ... on pages already local */
+		NUMA_PAGE_MIGRATE,	/* misplaced pages migrated */
 #endif
 		PGINODESTEAL, SLABS_SCANNED, KSWAPD_INODESTEAL,
 		KSWAPD_LOW_WMARK_HIT_QUICKLY, KSWAPD_HIGH_WMARK_HIT_QUICKLY,
@@ -40,6 +46,8 @@ enum vm_event_item { PGPGIN, PGPGOUT, PSWPIN, PSWPOUT,
 #ifdef CONFIG_COMPACTION
 		COMPACTBLOCKS, COMPACTPAGES, COMPACTPAGEFAILED,
 		COMPACTSTALL, COMPACTFAIL, COMPACTSUCCESS,
+		COMPACTSTALL_USECS, COMPACTSTALL_AVOIDED,
+		KCOMPACTD_WAKE, KCOMPACTD_PROACTIVE,
 #endif
 #ifdef CONFIG_HUGETLB_PAGE
 		HTLB_BUDDY_PGALLOC, HTLB_BUDDY_PGALLOC_FAIL,
@@ -52,6 +60,16 @@ enum vm_event_item { PGPGIN, PGPGOUT, PSWPIN, PSWPOUT,
 		UNEVICTABLE_PGCLEARED,	/* on COW, page truncate */
 		UNEVICTABLE_PGSTRANDED,	/* unable to isolate on unlock */
 		UNEVICTABLE_MLOCKFREED,
+		FILE_RA,		/* pages read ahead from files */
+		FILE_RA_HIT,		/* file reads/faults found the page read ahead */
+		FILE_RA_MISS,		/* ... had to read it synchronously */
+		FILE_RA_STALL,		/* ... waited on readahead still in flight */
+		FILE_RA_THRASH,		/* readahead pages reclaimed before use */
+#ifdef CONFIG_SWAP
+		SWAP_RA,		/* pages read ahead from swap */
+		SWAP_RA_HIT,		/* faults on a read-ahead page */
+		SWAP_RA_MISS,		/* faults that had to read from swap */
+#endif
 #ifdef CONFIG_TRANSPARENT_HUGEPAGE
 		THP_FAULT_ALLOC,
 		THP_FAULT_FALLBACK,
@@ -69,3 +69,13 @@ SCHED_FEAT(TTWU_QUEUE, true)
 SCHED_FEAT(FORCE_SD_OVERLAP, false)
 SCHED_FEAT(RT_RUNTIME_SHARE, true)
 SCHED_FEAT(LB_MIN, false)
+
+#ifdef CONFIG_NUMA_BALANCING
+/*
+ * Load balancing picks tasks that prefer the destination node first
+ * (NUMA_FAVOUR_HIGHER), and can treat a task running on its preferred
+ * node as cache hot (NUMA_RESIST_LOWER).
+ */
+SCHED_FEAT(NUMA_FAVOUR_HIGHER, true)
+SCHED_FEAT(NUMA_RESIST_LOWER, false)
+#endif
@@ -14,6 +14,9 @@
 #include <linux/backing-dev.h>
 #include <linux/sysctl.h>
 #include <linux/sysfs.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
+#include <linux/huge_mm.h>
 #include "internal.h"
 
 #if defined CONFIG_COMPACTION || defined CONFIG_CMA
@@ -185,6 +188,15 @@ static void acct_isolated(struct zone *zone, struct compact_control *cc)
 	__mod_zone_page_state(zone, NR_ISOLATED_FILE, count[1]);
 }
 
+/* Drop the lru_lock we hold, if any, and enable interrupts again */
+static void release_lruvec_irq(struct lruvec **lruvec)
+{
+	if (*lruvec)
+		spin_unlock(&(*lruvec)->lru_lock);
+	*lruvec = NULL;
+	local_irq_enable();
+}
+
 /* Similar to reclaim, but different enough that they don't share logic */
 static bool too_many_isolated(struct zone *zone)
 {
@@ -227,6 +239,7 @@ isolate_migratepages_range(struct zone *zone, struct compact_control *cc,
 	unsigned long nr_scanned = 0, nr_isolated = 0;
 	struct list_head *migratelist = &cc->migratepages;
 	isolate_mode_t mode = ISOLATE_ACTIVE|ISOLATE_INACTIVE;
+	struct lruvec *lruvec = NULL;
 
 	/*
 	 * Ensure that there are not too many pages isolated from the LRU
@@ -245,26 +258,32 @@ isolate_migratepages_range(struct zone *zone, struct compact_control *cc,
 	}
 
 	/* Time to isolate some pages for migration */
+	/*
+	 * Interrupts stay disabled while scanning; the lru_lock of the
+	 * lruvec each page belongs to is taken when it is found on an lru,
+	 * and kept for as long as the following pages share that lruvec.
+	 */
 	cond_resched();
-	spin_lock_irq(&zone->lru_lock);
+	local_irq_disable();
 	for (; low_pfn < end_pfn; low_pfn++) {
 		struct page *page;
 		bool locked = true;
 
 		/* give a chance to irqs before checking need_resched() */
 		if (!((low_pfn+1) % SWAP_CLUSTER_MAX)) {
-			spin_unlock_irq(&zone->lru_lock);
+			release_lruvec_irq(&lruvec);
 			locked = false;
 		}
-		if (need_resched() || spin_is_contended(&zone->lru_lock)) {
+		if (need_resched() ||
+		    (lruvec && spin_is_contended(&lruvec->lru_lock))) {
 			if (locked)
-				spin_unlock_irq(&zone->lru_lock);
+				release_lruvec_irq(&lruvec);
 			cond_resched();
-			spin_lock_irq(&zone->lru_lock);
+			local_irq_disable();
 			if (fatal_signal_pending(current))
 				break;
 		} else if (!locked)
-			spin_lock_irq(&zone->lru_lock);
+			local_irq_disable();
 
 		/*
 		 * migrate_pfn does not necessarily start aligned to a
@@ -311,6 +330,14 @@ isolate_migratepages_range(struct zone *zone, struct compact_control *cc,
 			continue;
 		}
 
+		if (!PageLRU(page))
+			continue;
+
+		/*
+		 * The page may be isolated, or change lruvec, until we hold
+		 * the lru_lock of the lruvec it belongs to: check again.
+		 */
+		lruvec = relock_page_lruvec(page, lruvec);
 		if (!PageLRU(page))
 			continue;
 
@@ -334,7 +361,7 @@ isolate_migratepages_range(struct zone *zone, struct compact_control *cc,
 		VM_BUG_ON(PageTransCompound(page));
 
 		/* Successfully isolated */
-		del_page_from_lru_list(zone, page, page_lru(page));
+		del_page_from_lru_list(page, lruvec, page_lru(page));
 		list_add(&page->lru, migratelist);
 		cc->nr_migratepages++;
 		nr_isolated++;
@@ -348,7 +375,7 @@ isolate_migratepages_range(struct zone *zone, struct compact_control *cc,
 
 	acct_isolated(zone, cc);
 
-	spin_unlock_irq(&zone->lru_lock);
+	release_lruvec_irq(&lruvec);
 
 	trace_mm_compaction_isolate_migratepages(nr_scanned, nr_isolated);
 
@@ -750,6 +777,7 @@ unsigned long try_to_compact_pages(struct zonelist *zonelist,
 	struct zoneref *z;
 	struct zone *zone;
 	int rc = COMPACT_SKIPPED;
+	ktime_t start;
 
 	/*
 	 * Check whether it is worth even starting compaction. The order check is
@@ -760,6 +788,7 @@ unsigned long try_to_compact_pages(struct zonelist *zonelist,
 		return rc;
 
 	count_vm_event(COMPACTSTALL);
+	start = ktime_get();
 
 	/* Compact each zone in the list */
 	for_each_zone_zonelist_nodemask(zone, z, zonelist, high_zoneidx,
@@ -774,6 +803,8 @@ unsigned long try_to_compact_pages(struct zonelist *zonelist,
 			break;
 	}
 
+	count_vm_events(COMPACTSTALL_USECS,
+			ktime_us_delta(ktime_get(), start));
 	return rc;
 }
 
@@ -871,6 +902,226 @@ int sysctl_extfrag_handler(struct ctl_table *table, int write,
 	return 0;
 }
 
+/*
+ * kcompactd: one per node, compacting in the background so that high-order
+ * allocations find free blocks instead of stalling in direct compaction.
+ * It runs when an allocation falling into the slow path asks for it, and
+ * proactively when the fragmentation index of a zone for
+ * proactive_compaction_order rises above proactive_compaction_threshold.
+ * Either way, kcompactd_cpu_percent bounds the CPU time it takes.
+ */
+#define KCOMPACTD_INTERVAL	(HZ / 2)
+
+int sysctl_proactive_compaction_threshold = 800;
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+int sysctl_proactive_compaction_order = HPAGE_PMD_ORDER;
+#else
+int sysctl_proactive_compaction_order = PAGE_ALLOC_COSTLY_ORDER;
+#endif
+int sysctl_kcompactd_cpu_percent = 10;
+
+/* Free blocks of at least @order in @pgdat, counted in @order units */
+static unsigned long pgdat_free_blocks(pg_data_t *pgdat, int order)
+{
+	unsigned long nr_blocks = 0;
+	int zoneid, o;
+
+	for (zoneid = 0; zoneid < MAX_NR_ZONES; zoneid++) {
+		struct zone *zone = &pgdat->node_zones[zoneid];
+
+		if (!populated_zone(zone))
+			continue;
+		for (o = order; o < MAX_ORDER; o++)
+			nr_blocks += zone->free_area[o].nr_free << (o - order);
+	}
+	return nr_blocks;
+}
+
+static bool kcompactd_proactive_needed(pg_data_t *pgdat)
+{
+	int threshold = sysctl_proactive_compaction_threshold;
+	int order = sysctl_proactive_compaction_order;
+	int zoneid;
+
+	/* the index never exceeds 1000, so that value turns this off */
+	if (threshold >= 1000)
+		return false;
+
+	for (zoneid = 0; zoneid < MAX_NR_ZONES; zoneid++) {
+		struct zone *zone = &pgdat->node_zones[zoneid];
+
+		if (!populated_zone(zone))
+			continue;
+		if (fragmentation_index(zone, order) > threshold &&
+		    compaction_suitable(zone, order) == COMPACT_CONTINUE)
+			return true;
+	}
+	return false;
+}
+
+static void kcompactd_do_work(pg_data_t *pgdat, int order)
+{
+	struct compact_control cc = {
+		.order = order,
+		.migratetype = MIGRATE_MOVABLE,
+		.sync = true,
+	};
+	unsigned long before, after;
+
+	before = pgdat_free_blocks(pgdat, order);
+	lru_add_drain();
+	__compact_pgdat(pgdat, &cc);
+	after = pgdat_free_blocks(pgdat, order);
+
+	/*
+	 * Blocks we freed up are credited to the node: allocations served
+	 * from them without entering the slow path count as stalls avoided.
+	 */
+	if (order != pgdat->kcompactd_credit_order) {
+		atomic_set(&pgdat->kcompactd_credit, 0);
+		pgdat->kcompactd_credit_order = order;
+	}
+	if (after > before)
+		atomic_add(after - before, &pgdat->kcompactd_credit);
+}
+
+/* Sleep off the CPU time we took beyond kcompactd_cpu_percent */
+static void kcompactd_throttle(u64 runtime)
+{
+	int percent = sysctl_kcompactd_cpu_percent;
+	u64 idle;
+
+	if (percent >= 100 || !runtime)
+		return;
+
+	idle = div_u64(runtime * (100 - percent), percent);
+	schedule_timeout_interruptible(nsecs_to_jiffies(idle));
+	try_to_freeze();
+}
+
+static bool kcompactd_work_requested(pg_data_t *pgdat)
+{
+	return pgdat->kcompactd_max_order > 0 || kthread_should_stop();
+}
+
+static int kcompactd(void *p)
+{
+	pg_data_t *pgdat = (pg_data_t *)p;
+	struct task_struct *tsk = current;
+	const struct cpumask *cpumask = cpumask_of_node(pgdat->node_id);
+
+	if (!cpumask_empty(cpumask))
+		set_cpus_allowed_ptr(tsk, cpumask);
+	set_freezable();
+
+	pgdat->kcompactd_max_order = 0;
+
+	while (!kthread_should_stop()) {
+		u64 runtime;
+		int order;
+
+		wait_event_freezable_timeout(pgdat->kcompactd_wait,
+				kcompactd_work_requested(pgdat),
+				KCOMPACTD_INTERVAL);
+		if (kthread_should_stop())
+			break;
+
+		runtime = task_sched_runtime(tsk);
+		order = pgdat->kcompactd_max_order;
+		pgdat->kcompactd_max_order = 0;
+		if (order) {
+			count_vm_event(KCOMPACTD_WAKE);
+			kcompactd_do_work(pgdat, order);
+		} else if (kcompactd_proactive_needed(pgdat)) {
+			count_vm_event(KCOMPACTD_PROACTIVE);
+			kcompactd_do_work(pgdat,
+					  sysctl_proactive_compaction_order);
+		} else
+			continue;
+
+		kcompactd_throttle(task_sched_runtime(tsk) - runtime);
+	}
+
+	return 0;
+}
+
+/*
+ * Called from the allocator slow path: ask the node's kcompactd to compact
+ * for @order, if compaction looks likely to help there.
+ */
+void wakeup_kcompactd(struct zone *zone, int order)
+{
+	pg_data_t *pgdat = zone->zone_pgdat;
+
+	if (!order || !populated_zone(zone) || !pgdat->kcompactd)
+		return;
+
+	if (compaction_suitable(zone, order) != COMPACT_CONTINUE)
+		return;
+
+	if (pgdat->kcompactd_max_order < order)
+		pgdat->kcompactd_max_order = order;
+
+	if (waitqueue_active(&pgdat->kcompactd_wait))
+		wake_up_interruptible(&pgdat->kcompactd_wait);
+}
+
+/*
+ * Called for high-order allocations satisfied without entering the slow
+ * path: if kcompactd freed up blocks for it, count a stall avoided.
+ */
+void kcompactd_account_alloc(struct page *page, int order)
+{
+	pg_data_t *pgdat = NODE_DATA(page_to_nid(page));
+
+	if (order >= pgdat->kcompactd_credit_order &&
+	    atomic_add_unless(&pgdat->kcompactd_credit, -1, 0))
+		count_vm_event(COMPACTSTALL_AVOIDED);
+}
+
+/*
+ * Started for each node with memory at boot, and on node-hot-add.
+ */
+int kcompactd_run(int nid)
+{
+	pg_data_t *pgdat = NODE_DATA(nid);
+	int ret = 0;
+
+	if (pgdat->kcompactd)
+		return 0;
+
+	pgdat->kcompactd = kthread_run(kcompactd, pgdat, "kcompactd%d", nid);
+	if (IS_ERR(pgdat->kcompactd)) {
+		printk(KERN_ERR "Failed to start kcompactd on node %d\n", nid);
+		pgdat->kcompactd = NULL;
+		ret = -1;
+	}
+	return ret;
+}
+
+/*
+ * Called by memory hotplug when all memory in a node is offlined.
+ */
+void kcompactd_stop(int nid)
+{
+	struct task_struct *kcompactd = NODE_DATA(nid)->kcompactd;
+
+	if (kcompactd) {
+		kthread_stop(kcompactd);
+		NODE_DATA(nid)->kcompactd = NULL;
+	}
+}
+
+static int __init kcompactd_init(void)
+{
+	int nid;
+
+	for_each_node_state(nid, N_HIGH_MEMORY)
+		kcompactd_run(nid);
+	return 0;
+}
+subsys_initcall(kcompactd_init);
+
 #if defined(CONFIG_SYSFS) && defined(CONFIG_NUMA)
 ssize_t sysfs_compact_node(struct device *dev,
 			struct device_attribute *attr,
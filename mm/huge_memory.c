@@ -69,12 +69,15 @@ static struct kmem_cache *mm_slot_cache __read_mostly;
  * struct mm_slot - hash lookup from mm to mm_slot
  * @hash: hash collision list
  * @mm_node: khugepaged scan list headed in khugepaged_scan.mm_head
+ *	     or khugepaged_prio_scan.mm_head
  * @mm: the mm that this information is valid for
+ * @prio: MADV_HUGEPAGE was used in this mm, scan it on khugepaged_prio_scan
  */
 struct mm_slot {
 	struct hlist_node hash;
 	struct list_head mm_node;
 	struct mm_struct *mm;
+	bool prio;
 };
 
 /**
@@ -83,7 +86,9 @@ struct mm_slot {
  * @mm_slot: the current mm_slot we are scanning
  * @address: the next address inside that to be scanned
  *
- * There is only the one khugepaged_scan instance of this cursor structure.
+ * There are two instances of this cursor structure: khugepaged_prio_scan
+ * walks the mms that used MADV_HUGEPAGE, and gets its own pages_to_scan
+ * budget on every pass before khugepaged_scan walks all the others.
  */
 struct khugepaged_scan {
 	struct list_head mm_head;
@@ -93,6 +98,56 @@ struct khugepaged_scan {
 static struct khugepaged_scan khugepaged_scan = {
 	.mm_head = LIST_HEAD_INIT(khugepaged_scan.mm_head),
 };
+static struct khugepaged_scan khugepaged_prio_scan = {
+	.mm_head = LIST_HEAD_INIT(khugepaged_prio_scan.mm_head),
+};
+
+/* khugepaged_scan_pmd() and collapse_huge_page() flags */
+#define KHUGEPAGED_MAY_QUEUE	0x1	/* may queue collapse to a node worker */
+#define KHUGEPAGED_FORCE	0x2	/* MADV_COLLAPSE, ignore access and
+					   the enabled and max_ptes_none knobs */
+
+/*
+ * In parallel mode the khugepaged scanner only finds the pmds worth
+ * collapsing, and queues them to a worker thread on the node the huge
+ * page will be allocated on, which does the allocation and the copy.
+ * If a worker has KHUGEPAGED_MAX_QUEUED requests pending the scanner
+ * collapses inline instead.
+ */
+#define KHUGEPAGED_MAX_QUEUED	64
+
+/**
+ * struct khugepaged_request - a pmd queued for a node worker to collapse
+ * @list: entry in khugepaged_node.requests
+ * @mm: the mm to collapse in, with a mm_count reference held
+ * @address: the HPAGE_PMD_SIZE aligned address to collapse
+ */
+struct khugepaged_request {
+	struct list_head list;
+	struct mm_struct *mm;
+	unsigned long address;
+};
+
+/**
+ * struct khugepaged_node - collapse worker of a node
+ * @lock: protects @requests, @nr_requests and @thread
+ * @requests: the pending collapse requests
+ * @nr_requests: the length of @requests
+ * @wait: the worker waits here for requests
+ * @thread: the worker, or NULL if parallel mode is off
+ */
+struct khugepaged_node {
+	spinlock_t lock;
+	struct list_head requests;
+	unsigned int nr_requests;
+	wait_queue_head_t wait;
+	struct task_struct *thread;
+};
+static struct khugepaged_node *khugepaged_nodes[MAX_NUMNODES];
+static bool khugepaged_parallel __read_mostly;
+static int khugepaged_start_workers(void);
+static void khugepaged_stop_workers(void);
+static void khugepaged_nodes_init(void);
 
 
 static int set_recommended_min_free_kbytes(void)
@@ -154,7 +209,8 @@ static int start_khugepaged(void)
 			err = PTR_ERR(khugepaged_thread);
 			khugepaged_thread = NULL;
 		}
-		wakeup = !list_empty(&khugepaged_scan.mm_head);
+		wakeup = !list_empty(&khugepaged_scan.mm_head) ||
+			 !list_empty(&khugepaged_prio_scan.mm_head);
 		mutex_unlock(&khugepaged_mutex);
 		if (wakeup)
 			wake_up_interruptible(&khugepaged_wait);
@@ -472,9 +528,40 @@ static struct kobj_attribute khugepaged_max_ptes_none_attr =
 	__ATTR(max_ptes_none, 0644, khugepaged_max_ptes_none_show,
 	       khugepaged_max_ptes_none_store);
 
+static ssize_t khugepaged_parallel_show(struct kobject *kobj,
+					struct kobj_attribute *attr,
+					char *buf)
+{
+	return sprintf(buf, "%u\n", khugepaged_parallel);
+}
+static ssize_t khugepaged_parallel_store(struct kobject *kobj,
+					 struct kobj_attribute *attr,
+					 const char *buf, size_t count)
+{
+	int err;
+	unsigned long parallel;
+
+	err = strict_strtoul(buf, 10, &parallel);
+	if (err || parallel > 1)
+		return -EINVAL;
+
+	mutex_lock(&khugepaged_mutex);
+	if (parallel && !khugepaged_parallel)
+		err = khugepaged_start_workers();
+	else if (!parallel && khugepaged_parallel)
+		khugepaged_stop_workers();
+	mutex_unlock(&khugepaged_mutex);
+
+	return err ? err : count;
+}
+static struct kobj_attribute khugepaged_parallel_attr =
+	__ATTR(parallel, 0644, khugepaged_parallel_show,
+	       khugepaged_parallel_store);
+
 static struct attribute *khugepaged_attr[] = {
 	&khugepaged_defrag_attr.attr,
 	&khugepaged_max_ptes_none_attr.attr,
+	&khugepaged_parallel_attr.attr,
 	&pages_to_scan_attr.attr,
 	&pages_collapsed_attr.attr,
 	&full_scans_attr.attr,
@@ -560,6 +647,8 @@ static int __init hugepage_init(void)
 		goto out;
 	}
 
+	khugepaged_nodes_init();
+
 	/*
 	 * By default disable transparent hugepages on smaller systems,
 	 * where the extra memory used could hurt more than TLB overhead
@@ -1224,10 +1313,11 @@ static void __split_huge_page_refcount(struct page *page)
 {
 	int i;
 	struct zone *zone = page_zone(page);
+	struct lruvec *lruvec;
 	int tail_count = 0;
 
 	/* prevent PageLRU to go away from under us, and freeze lru stats */
-	spin_lock_irq(&zone->lru_lock);
+	lruvec = lock_page_lruvec_irq(page);
 	compound_lock(page);
 	/* complete memcg works before add pages to LRU */
 	mem_cgroup_split_huge_fixup(page);
@@ -1303,7 +1393,7 @@ static void __split_huge_page_refcount(struct page *page)
 		BUG_ON(!PageSwapBacked(page_tail));
 
 
-		lru_add_page_tail(zone, page, page_tail);
+		lru_add_page_tail(lruvec, page, page_tail);
 	}
 	atomic_sub(tail_count, &page->_count);
 	BUG_ON(atomic_read(&page->_count) <= 0);
@@ -1313,7 +1403,7 @@ static void __split_huge_page_refcount(struct page *page)
 
 	ClearPageCompound(page);
 	compound_unlock(page);
-	spin_unlock_irq(&zone->lru_lock);
+	unlock_lruvec_irq(lruvec);
 
 	for (i = 1; i < HPAGE_PMD_NR; i++) {
 		struct page *page_tail = page + i;
@@ -1485,6 +1575,8 @@ out:
 #define VM_NO_THP (VM_SPECIAL|VM_INSERTPAGE|VM_MIXEDMAP|VM_SAO| \
 		   VM_HUGETLB|VM_SHARED|VM_MAYSHARE)
 
+static void khugepaged_prioritize(struct mm_struct *mm);
+
 int hugepage_madvise(struct vm_area_struct *vma,
 		     unsigned long *vm_flags, int advice)
 {
@@ -1504,6 +1596,7 @@ int hugepage_madvise(struct vm_area_struct *vma,
 		 */
 		if (unlikely(khugepaged_enter_vma_merge(vma)))
 			return -ENOMEM;
+		khugepaged_prioritize(vma->vm_mm);
 		break;
 	case MADV_NOHUGEPAGE:
 		/*
@@ -1665,7 +1758,8 @@ void __khugepaged_exit(struct mm_struct *mm)
 
 	spin_lock(&khugepaged_mm_lock);
 	mm_slot = get_mm_slot(mm);
-	if (mm_slot && khugepaged_scan.mm_slot != mm_slot) {
+	if (mm_slot && khugepaged_scan.mm_slot != mm_slot &&
+	    khugepaged_prio_scan.mm_slot != mm_slot) {
 		hlist_del(&mm_slot->hash);
 		list_del(&mm_slot->mm_node);
 		free = 1;
@@ -1676,13 +1770,15 @@ void __khugepaged_exit(struct mm_struct *mm)
 		clear_bit(MMF_VM_HUGEPAGE, &mm->flags);
 		free_mm_slot(mm_slot);
 		mmdrop(mm);
-	} else if (mm_slot) {
+	}
+	if (mm_slot && (!free || khugepaged_parallel)) {
 		/*
 		 * This is required to serialize against
 		 * khugepaged_test_exit() (which is guaranteed to run
 		 * under mmap sem read mode). Stop here (after we
 		 * return all pagetables will be destroyed) until
-		 * khugepaged has finished working on the pagetables
+		 * khugepaged, or a node worker with a request queued
+		 * for this mm, has finished working on the pagetables
 		 * under the mmap_sem.
 		 */
 		down_write(&mm->mmap_sem);
@@ -1690,6 +1786,25 @@ void __khugepaged_exit(struct mm_struct *mm)
 	}
 }
 
+/*
+ * Scan the mm on khugepaged_prio_scan from now on.  If one of the
+ * cursors is on it, it is moved over once that cursor moves on.
+ */
+static void khugepaged_prioritize(struct mm_struct *mm)
+{
+	struct mm_slot *mm_slot;
+
+	spin_lock(&khugepaged_mm_lock);
+	mm_slot = get_mm_slot(mm);
+	if (mm_slot && !mm_slot->prio) {
+		mm_slot->prio = true;
+		if (khugepaged_scan.mm_slot != mm_slot)
+			list_move_tail(&mm_slot->mm_node,
+				       &khugepaged_prio_scan.mm_head);
+	}
+	spin_unlock(&khugepaged_mm_lock);
+}
+
 static void release_pte_page(struct page *page)
 {
 	/* 0 stands for page_is_file_cache(page) == false */
@@ -1712,9 +1827,16 @@ static void release_all_pte_pages(pte_t *pte)
 	release_pte_pages(pte, pte + HPAGE_PMD_NR);
 }
 
+static unsigned int khugepaged_max_none(unsigned int flags)
+{
+	if (flags & KHUGEPAGED_FORCE)
+		return HPAGE_PMD_NR - 1;
+	return khugepaged_max_ptes_none;
+}
+
 static int __collapse_huge_page_isolate(struct vm_area_struct *vma,
 					unsigned long address,
-					pte_t *pte)
+					pte_t *pte, unsigned int flags)
 {
 	struct page *page;
 	pte_t *_pte;
@@ -1723,7 +1845,7 @@ static int __collapse_huge_page_isolate(struct vm_area_struct *vma,
 	     _pte++, address += PAGE_SIZE) {
 		pte_t pteval = *_pte;
 		if (pte_none(pteval)) {
-			if (++none <= khugepaged_max_ptes_none)
+			if (++none <= khugepaged_max_none(flags))
 				continue;
 			else {
 				release_pte_pages(pte, _pte);
@@ -1777,7 +1899,7 @@ static int __collapse_huge_page_isolate(struct vm_area_struct *vma,
 		    mmu_notifier_test_young(vma->vm_mm, address))
 			referenced = 1;
 	}
-	if (unlikely(!referenced))
+	if (unlikely(!referenced) && !(flags & KHUGEPAGED_FORCE))
 		release_all_pte_pages(pte);
 	else
 		isolated = 1;
@@ -1825,11 +1947,57 @@ static void __collapse_huge_page_copy(pte_t *pte, struct page *page,
 	}
 }
 
+/*
+ * Check whether khugepaged may collapse in this vma at all.
+ */
+static bool khugepaged_vma_ok(struct vm_area_struct *vma, unsigned int flags)
+{
+	if (vma->vm_flags & VM_NOHUGEPAGE)
+		return false;
+	if (!(vma->vm_flags & VM_HUGEPAGE) && !khugepaged_always() &&
+	    !(flags & KHUGEPAGED_FORCE))
+		return false;
+	if (!vma->anon_vma || vma->vm_ops)
+		return false;
+	if (is_vma_temporary_stack(vma))
+		return false;
+	/*
+	 * If is_pfn_mapping() is true is_learn_pfn_mapping() must be
+	 * true too, verify it here.
+	 */
+	VM_BUG_ON(is_linear_pfn_mapping(vma) || vma->vm_flags & VM_NO_THP);
+	return true;
+}
+
+/*
+ * Find the vma the pmd at address can be collapsed in, if any.  Must be
+ * called with the mmap_sem held.
+ */
+static struct vm_area_struct *khugepaged_collapse_vma(struct mm_struct *mm,
+						      unsigned long address,
+						      unsigned int flags)
+{
+	struct vm_area_struct *vma;
+	unsigned long hstart, hend;
+
+	if (unlikely(khugepaged_test_exit(mm)))
+		return NULL;
+
+	vma = find_vma(mm, address);
+	if (!vma || !khugepaged_vma_ok(vma, flags))
+		return NULL;
+	hstart = (vma->vm_start + ~HPAGE_PMD_MASK) & HPAGE_PMD_MASK;
+	hend = vma->vm_end & HPAGE_PMD_MASK;
+	if (address < hstart || address + HPAGE_PMD_SIZE > hend)
+		return NULL;
+	return vma;
+}
+
 static void collapse_huge_page(struct mm_struct *mm,
 			       unsigned long address,
 			       struct page **hpage,
 			       struct vm_area_struct *vma,
-			       int node)
+			       int node, unsigned int flags)
 {
 	pgd_t *pgd;
 	pud_t *pud;
@@ -1839,7 +2007,6 @@ static void collapse_huge_page(struct mm_struct *mm,
 	struct page *new_page;
 	spinlock_t *ptl;
 	int isolated;
-	unsigned long hstart, hend;
 
 	VM_BUG_ON(address & ~HPAGE_PMD_MASK);
 #ifndef CONFIG_NUMA
@@ -1868,6 +2035,7 @@ static void collapse_huge_page(struct mm_struct *mm,
 	up_read(&mm->mmap_sem);
 	if (unlikely(!new_page)) {
 		count_vm_event(THP_COLLAPSE_ALLOC_FAILED);
+		atomic_long_inc(&mm->thp_collapse_failed);
 		*hpage = ERR_PTR(-ENOMEM);
 		return;
 	}
@@ -1878,6 +2046,7 @@ static void collapse_huge_page(struct mm_struct *mm,
 #ifdef CONFIG_NUMA
 		put_page(new_page);
 #endif
+		atomic_long_inc(&mm->thp_collapse_failed);
 		return;
 	}
 
@@ -1887,29 +2056,10 @@ static void collapse_huge_page(struct mm_struct *mm,
 	 * handled by the anon_vma lock + PG_lock.
 	 */
 	down_write(&mm->mmap_sem);
-	if (unlikely(khugepaged_test_exit(mm)))
-		goto out;
-
-	vma = find_vma(mm, address);
-	hstart = (vma->vm_start + ~HPAGE_PMD_MASK) & HPAGE_PMD_MASK;
-	hend = vma->vm_end & HPAGE_PMD_MASK;
-	if (address < hstart || address + HPAGE_PMD_SIZE > hend)
+	vma = khugepaged_collapse_vma(mm, address, flags);
+	if (!vma)
 		goto out;
 
-	if ((!(vma->vm_flags & VM_HUGEPAGE) && !khugepaged_always()) ||
-	    (vma->vm_flags & VM_NOHUGEPAGE))
-		goto out;
-
-	if (!vma->anon_vma || vma->vm_ops)
-		goto out;
-	if (is_vma_temporary_stack(vma))
-		goto out;
-	/*
-	 * If is_pfn_mapping() is true is_learn_pfn_mapping() must be
-	 * true too, verify it here.
-	 */
-	VM_BUG_ON(is_linear_pfn_mapping(vma) || vma->vm_flags & VM_NO_THP);
-
 	pgd = pgd_offset(mm, address);
 	if (!pgd_present(*pgd))
 		goto out;
@@ -1939,7 +2089,7 @@ static void collapse_huge_page(struct mm_struct *mm,
 	spin_unlock(&mm->page_table_lock);
 
 	spin_lock(ptl);
-	isolated = __collapse_huge_page_isolate(vma, address, pte);
+	isolated = __collapse_huge_page_isolate(vma, address, pte, flags);
 	spin_unlock(ptl);
 
 	if (unlikely(!isolated)) {
@@ -1988,11 +2138,13 @@ static void collapse_huge_page(struct mm_struct *mm,
 	*hpage = NULL;
 #endif
 	khugepaged_pages_collapsed++;
+	atomic_long_inc(&mm->thp_collapsed);
 out_up_write:
 	up_write(&mm->mmap_sem);
 	return;
 
 out:
+	atomic_long_inc(&mm->thp_collapse_failed);
 	mem_cgroup_uncharge_page(new_page);
 #ifdef CONFIG_NUMA
 	put_page(new_page);
@@ -2000,10 +2152,19 @@ out:
 	goto out_up_write;
 }
 
+static bool khugepaged_queue_collapse(struct mm_struct *mm,
+				      unsigned long address, int node);
+
+/*
+ * Returns 1 if the pmd was collapsed (or queued for collapse) and the
+ * mmap_sem released, 0 if it was left alone with the mmap_sem held.
+ * In parallel mode a queued collapse returns 0 so the scan can go on.
+ */
 static int khugepaged_scan_pmd(struct mm_struct *mm,
 			       struct vm_area_struct *vma,
 			       unsigned long address,
-			       struct page **hpage)
+			       struct page **hpage,
+			       unsigned int flags)
 {
 	pgd_t *pgd;
 	pud_t *pud;
@@ -2034,7 +2195,7 @@ static int khugepaged_scan_pmd(struct mm_struct *mm,
 	     _pte++, _address += PAGE_SIZE) {
 		pte_t pteval = *_pte;
 		if (pte_none(pteval)) {
-			if (++none <= khugepaged_max_ptes_none)
+			if (++none <= khugepaged_max_none(flags))
 				continue;
 			else
 				goto out_unmap;
@@ -2061,13 +2222,16 @@ static int khugepaged_scan_pmd(struct mm_struct *mm,
 		    mmu_notifier_test_young(vma->vm_mm, address))
 			referenced = 1;
 	}
-	if (referenced)
+	if (referenced || (flags & KHUGEPAGED_FORCE))
 		ret = 1;
 out_unmap:
 	pte_unmap_unlock(pte, ptl);
-	if (ret)
+	if (ret && (flags & KHUGEPAGED_MAY_QUEUE) &&
+	    khugepaged_queue_collapse(mm, address, node))
+		ret = 0;
+	else if (ret)
 		/* collapse_huge_page will return with the mmap_sem released */
-		collapse_huge_page(mm, address, hpage, vma, node);
+		collapse_huge_page(mm, address, hpage, vma, node, flags);
 out:
 	return ret;
 }
@@ -2095,7 +2259,8 @@ static void collect_mm_slot(struct mm_slot *mm_slot)
 	}
 }
 
-static unsigned int khugepaged_scan_mm_slot(unsigned int pages,
+static unsigned int khugepaged_scan_mm_slot(struct khugepaged_scan *scan,
+					    unsigned int pages,
 					    struct page **hpage)
 	__releases(&khugepaged_mm_lock)
 	__acquires(&khugepaged_mm_lock)
@@ -2108,13 +2273,13 @@ static unsigned int khugepaged_scan_mm_slot(unsigned int pages,
 	VM_BUG_ON(!pages);
 	VM_BUG_ON(NR_CPUS != 1 && !spin_is_locked(&khugepaged_mm_lock));
 
-	if (khugepaged_scan.mm_slot)
-		mm_slot = khugepaged_scan.mm_slot;
+	if (scan->mm_slot)
+		mm_slot = scan->mm_slot;
 	else {
-		mm_slot = list_entry(khugepaged_scan.mm_head.next,
+		mm_slot = list_entry(scan->mm_head.next,
 				     struct mm_slot, mm_node);
-		khugepaged_scan.address = 0;
-		khugepaged_scan.mm_slot = mm_slot;
+		scan->address = 0;
+		scan->mm_slot = mm_slot;
 	}
 	spin_unlock(&khugepaged_mm_lock);
 
@@ -2123,7 +2288,7 @@ static unsigned int khugepaged_scan_mm_slot(unsigned int pages,
 	if (unlikely(khugepaged_test_exit(mm)))
 		vma = NULL;
 	else
-		vma = find_vma(mm, khugepaged_scan.address);
+		vma = find_vma(mm, scan->address);
 
 	progress++;
 	for (; vma; vma = vma->vm_next) {
@@ -2135,48 +2300,38 @@ static unsigned int khugepaged_scan_mm_slot(unsigned int pages,
 			break;
 		}
 
-		if ((!(vma->vm_flags & VM_HUGEPAGE) &&
-		     !khugepaged_always()) ||
-		    (vma->vm_flags & VM_NOHUGEPAGE)) {
+		if (!khugepaged_vma_ok(vma, 0)) {
 		skip:
 			progress++;
 			continue;
 		}
-		if (!vma->anon_vma || vma->vm_ops)
-			goto skip;
-		if (is_vma_temporary_stack(vma))
-			goto skip;
-		/*
-		 * If is_pfn_mapping() is true is_learn_pfn_mapping()
-		 * must be true too, verify it here.
-		 */
-		VM_BUG_ON(is_linear_pfn_mapping(vma) ||
-			  vma->vm_flags & VM_NO_THP);
+		/* Also catches mms registered before MADV_HUGEPAGE was used */
+		if (vma->vm_flags & VM_HUGEPAGE)
+			mm_slot->prio = true;
 
 		hstart = (vma->vm_start + ~HPAGE_PMD_MASK) & HPAGE_PMD_MASK;
 		hend = vma->vm_end & HPAGE_PMD_MASK;
 		if (hstart >= hend)
 			goto skip;
-		if (khugepaged_scan.address > hend)
+		if (scan->address > hend)
 			goto skip;
-		if (khugepaged_scan.address < hstart)
-			khugepaged_scan.address = hstart;
-		VM_BUG_ON(khugepaged_scan.address & ~HPAGE_PMD_MASK);
+		if (scan->address < hstart)
+			scan->address = hstart;
+		VM_BUG_ON(scan->address & ~HPAGE_PMD_MASK);
 
-		while (khugepaged_scan.address < hend) {
+		while (scan->address < hend) {
 			int ret;
 			cond_resched();
 			if (unlikely(khugepaged_test_exit(mm)))
 				goto breakouterloop;
 
-			VM_BUG_ON(khugepaged_scan.address < hstart ||
-				  khugepaged_scan.address + HPAGE_PMD_SIZE >
+			VM_BUG_ON(scan->address < hstart ||
+				  scan->address + HPAGE_PMD_SIZE >
 				  hend);
-			ret = khugepaged_scan_pmd(mm, vma,
-						  khugepaged_scan.address,
-						  hpage);
+			ret = khugepaged_scan_pmd(mm, vma, scan->address,
+						  hpage, KHUGEPAGED_MAY_QUEUE);
 			/* move to next address */
-			khugepaged_scan.address += HPAGE_PMD_SIZE;
+			scan->address += HPAGE_PMD_SIZE;
 			progress += HPAGE_PMD_NR;
 			if (ret)
 				/* we released mmap_sem so break loop */
@@ -2190,7 +2345,7 @@ breakouterloop:
 breakouterloop_mmap_sem:
 
 	spin_lock(&khugepaged_mm_lock);
-	VM_BUG_ON(khugepaged_scan.mm_slot != mm_slot);
+	VM_BUG_ON(scan->mm_slot != mm_slot);
 	/*
 	 * Release the current mm_slot if this mm is about to die, or
 	 * if we scanned all vmas of this mm.
@@ -2201,16 +2356,22 @@ breakouterloop_mmap_sem:
 		 * khugepaged runs here, khugepaged_exit will find
 		 * mm_slot not pointing to the exiting mm.
 		 */
-		if (mm_slot->mm_node.next != &khugepaged_scan.mm_head) {
-			khugepaged_scan.mm_slot = list_entry(
+		if (mm_slot->mm_node.next != &scan->mm_head) {
+			scan->mm_slot = list_entry(
 				mm_slot->mm_node.next,
 				struct mm_slot, mm_node);
-			khugepaged_scan.address = 0;
+			scan->address = 0;
 		} else {
-			khugepaged_scan.mm_slot = NULL;
-			khugepaged_full_scans++;
+			scan->mm_slot = NULL;
+			if (scan == &khugepaged_scan)
+				khugepaged_full_scans++;
 		}
 
+		/* Prioritized while we were scanning it */
+		if (mm_slot->prio && scan == &khugepaged_scan)
+			list_move_tail(&mm_slot->mm_node,
+				       &khugepaged_prio_scan.mm_head);
+
 		collect_mm_slot(mm_slot);
 	}
 
@@ -2219,17 +2380,20 @@ breakouterloop_mmap_sem:
 
 static int khugepaged_has_work(void)
 {
-	return !list_empty(&khugepaged_scan.mm_head) &&
+	return (!list_empty(&khugepaged_scan.mm_head) ||
+		!list_empty(&khugepaged_prio_scan.mm_head)) &&
 		khugepaged_enabled();
 }
 
 static int khugepaged_wait_event(void)
 {
 	return !list_empty(&khugepaged_scan.mm_head) ||
+		!list_empty(&khugepaged_prio_scan.mm_head) ||
 		!khugepaged_enabled();
 }
 
-static void khugepaged_do_scan(struct page **hpage)
+static void khugepaged_do_scan(struct khugepaged_scan *scan,
+			       struct page **hpage)
 {
 	unsigned int progress = 0, pass_through_head = 0;
 	unsigned int pages = khugepaged_pages_to_scan;
@@ -2257,11 +2421,12 @@ static void khugepaged_do_scan(struct page **hpage)
 			break;
 
 		spin_lock(&khugepaged_mm_lock);
-		if (!khugepaged_scan.mm_slot)
+		if (!scan->mm_slot)
 			pass_through_head++;
-		if (khugepaged_has_work() &&
+		if (khugepaged_enabled() && !list_empty(&scan->mm_head) &&
 		    pass_through_head < 2)
-			progress += khugepaged_scan_mm_slot(pages - progress,
+			progress += khugepaged_scan_mm_slot(scan,
+							    pages - progress,
 							    hpage);
 		else
 			progress = pages;
@@ -2312,7 +2477,8 @@ static void khugepaged_loop(void)
 		}
 #endif
 
-		khugepaged_do_scan(&hpage);
+		khugepaged_do_scan(&khugepaged_prio_scan, &hpage);
+		khugepaged_do_scan(&khugepaged_scan, &hpage);
 #ifndef CONFIG_NUMA
 		if (hpage)
 			put_page(hpage);
@@ -2357,6 +2523,10 @@ static int khugepaged(void *none)
 	spin_lock(&khugepaged_mm_lock);
 	mm_slot = khugepaged_scan.mm_slot;
 	khugepaged_scan.mm_slot = NULL;
+	if (mm_slot)
+		collect_mm_slot(mm_slot);
+	mm_slot = khugepaged_prio_scan.mm_slot;
+	khugepaged_prio_scan.mm_slot = NULL;
 	if (mm_slot)
 		collect_mm_slot(mm_slot);
 	spin_unlock(&khugepaged_mm_lock);
@@ -2367,6 +2537,282 @@ static int khugepaged(void *none)
 	return 0;
 }
 
+static bool khugepaged_queue_collapse(struct mm_struct *mm,
+				      unsigned long address, int node)
+{
+	struct khugepaged_node *kn;
+	struct khugepaged_request *req;
+
+	if (!khugepaged_parallel || node < 0)
+		return false;
+	kn = khugepaged_nodes[node];
+	if (!kn || ACCESS_ONCE(kn->nr_requests) >= KHUGEPAGED_MAX_QUEUED)
+		return false;
+
+	req = kmalloc(sizeof(*req), GFP_KERNEL);
+	if (!req)
+		return false;
+	req->mm = mm;
+	req->address = address;
+
+	spin_lock(&kn->lock);
+	if (!kn->thread || kn->nr_requests >= KHUGEPAGED_MAX_QUEUED) {
+		spin_unlock(&kn->lock);
+		kfree(req);
+		return false;
+	}
+	atomic_inc(&mm->mm_count);
+	list_add_tail(&req->list, &kn->requests);
+	kn->nr_requests++;
+	spin_unlock(&kn->lock);
+
+	wake_up(&kn->wait);
+	return true;
+}
+
+static void khugepaged_do_request(struct khugepaged_request *req,
+				  struct page **hpage)
+{
+	struct mm_struct *mm = req->mm;
+	struct vm_area_struct *vma;
+
+#ifndef CONFIG_NUMA
+	if (!*hpage) {
+		*hpage = alloc_hugepage(khugepaged_defrag());
+		if (unlikely(!*hpage)) {
+			count_vm_event(THP_COLLAPSE_ALLOC_FAILED);
+			return;
+		}
+		count_vm_event(THP_COLLAPSE_ALLOC);
+	}
+#else
+	/* A failed allocation is retried on the next request */
+	*hpage = NULL;
+#endif
+
+	/* Rescan the pmd, it may have changed since it was queued */
+	down_read(&mm->mmap_sem);
+	vma = khugepaged_collapse_vma(mm, req->address, 0);
+	if (!vma || !khugepaged_scan_pmd(mm, vma, req->address, hpage, 0))
+		up_read(&mm->mmap_sem);
+}
+
+static struct khugepaged_request *khugepaged_next_request(
+						struct khugepaged_node *kn)
+{
+	struct khugepaged_request *req = NULL;
+
+	spin_lock(&kn->lock);
+	if (!list_empty(&kn->requests)) {
+		req = list_first_entry(&kn->requests,
+				       struct khugepaged_request, list);
+		list_del(&req->list);
+		kn->nr_requests--;
+	}
+	spin_unlock(&kn->lock);
+	return req;
+}
+
+static int khugepaged_worker(void *data)
+{
+	struct khugepaged_node *kn = data;
+	struct khugepaged_request *req;
+	struct page *hpage = NULL;
+
+	set_freezable();
+	set_user_nice(current, 19);
+
+	while (!kthread_should_stop()) {
+		wait_event_freezable(kn->wait, !list_empty(&kn->requests) ||
+				     kthread_should_stop());
+
+		while (!kthread_should_stop() &&
+		       (req = khugepaged_next_request(kn))) {
+			khugepaged_do_request(req, &hpage);
+			mmdrop(req->mm);
+			kfree(req);
+			cond_resched();
+		}
+	}
+
+	/* No more requests can be queued once the thread is cleared */
+	while ((req = khugepaged_next_request(kn))) {
+		mmdrop(req->mm);
+		kfree(req);
+	}
+#ifndef CONFIG_NUMA
+	if (hpage)
+		put_page(hpage);
+#endif
+	return 0;
+}
+
+/* Called with khugepaged_mutex held */
+static int khugepaged_start_workers(void)
+{
+	struct khugepaged_node *kn;
+	struct task_struct *thread;
+	int nid;
+
+	/* Before any worker runs: __khugepaged_exit() must wait for them */
+	khugepaged_parallel = true;
+	for_each_online_node(nid) {
+		kn = khugepaged_nodes[nid];
+		if (!kn)
+			continue;
+		thread = kthread_create_on_node(khugepaged_worker, kn, nid,
+						"khugepaged/%d", nid);
+		if (IS_ERR(thread)) {
+			printk(KERN_ERR "khugepaged: failed to start worker "
+			       "for node %d\n", nid);
+			khugepaged_stop_workers();
+			return PTR_ERR(thread);
+		}
+		if (!cpumask_empty(cpumask_of_node(nid)))
+			set_cpus_allowed_ptr(thread, cpumask_of_node(nid));
+		spin_lock(&kn->lock);
+		kn->thread = thread;
+		spin_unlock(&kn->lock);
+		wake_up_process(thread);
+	}
+	return 0;
+}
+
+/* Called with khugepaged_mutex held */
+static void khugepaged_stop_workers(void)
+{
+	struct khugepaged_node *kn;
+	struct task_struct *thread;
+	int nid;
+
+	for (nid = 0; nid < MAX_NUMNODES; nid++) {
+		kn = khugepaged_nodes[nid];
+		if (!kn)
+			continue;
+		spin_lock(&kn->lock);
+		thread = kn->thread;
+		kn->thread = NULL;
+		spin_unlock(&kn->lock);
+		if (thread)
+			kthread_stop(thread);
+	}
+	khugepaged_parallel = false;
+}
+
+/* Nodes without a khugepaged_node just have their collapses done inline */
+static void __init khugepaged_nodes_init(void)
+{
+	struct khugepaged_node *kn;
+	int nid;
+
+	for_each_node_state(nid, N_HIGH_MEMORY) {
+		kn = kzalloc_node(sizeof(*kn), GFP_KERNEL, nid);
+		if (!kn)
+			continue;
+		spin_lock_init(&kn->lock);
+		INIT_LIST_HEAD(&kn->requests);
+		init_waitqueue_head(&kn->wait);
+		khugepaged_nodes[nid] = kn;
+	}
+}
+
+static pmd_t *khugepaged_find_pmd(struct mm_struct *mm, unsigned long address)
+{
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+
+	pgd = pgd_offset(mm, address);
+	if (!pgd_present(*pgd))
+		return NULL;
+	pud = pud_offset(pgd, address);
+	if (!pud_present(*pud))
+		return NULL;
+	pmd = pmd_offset(pud, address);
+	if (!pmd_present(*pmd))
+		return NULL;
+	return pmd;
+}
+
+/**
+ * khugepaged_collapse_range - collapse a range into huge pages now
+ * @mm: the mm to collapse in
+ * @start: start of the range
+ * @end: end of the range
+ *
+ * Collapses every HPAGE_PMD_SIZE aligned pmd within [start, end)
+ * synchronously, for MADV_COLLAPSE.  Unlike khugepaged this ignores the
+ * enabled and max_ptes_none settings and whether the pages were
+ * recently accessed, but VM_NOHUGEPAGE is still honoured.
+ *
+ * Returns 0 if every mapped pmd in the range is now huge, -EINVAL if
+ * part of the range can't be collapsed at all, -ENOMEM if a huge page
+ * couldn't be allocated, or -EAGAIN if some pmd couldn't be collapsed
+ * right now (e.g. pages swapped out, locked or pinned).
+ */
+int khugepaged_collapse_range(struct mm_struct *mm, unsigned long start,
+			      unsigned long end)
+{
+	struct vm_area_struct *vma;
+	struct page *hpage = NULL;
+	unsigned long address;
+	pmd_t *pmd;
+	int err = 0;
+
+	if (!has_transparent_hugepage())
+		return -EINVAL;
+
+	start = (start + ~HPAGE_PMD_MASK) & HPAGE_PMD_MASK;
+	end &= HPAGE_PMD_MASK;
+	for (address = start; address < end; address += HPAGE_PMD_SIZE) {
+		cond_resched();
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			break;
+		}
+#ifndef CONFIG_NUMA
+		if (!hpage) {
+			hpage = alloc_hugepage(khugepaged_defrag());
+			if (unlikely(!hpage)) {
+				count_vm_event(THP_COLLAPSE_ALLOC_FAILED);
+				err = -ENOMEM;
+				break;
+			}
+			count_vm_event(THP_COLLAPSE_ALLOC);
+		}
+#endif
+
+		down_read(&mm->mmap_sem);
+		vma = khugepaged_collapse_vma(mm, address, KHUGEPAGED_FORCE);
+		if (!vma) {
+			up_read(&mm->mmap_sem);
+			err = -EINVAL;
+			continue;
+		}
+		/* collapse_huge_page returns with the mmap_sem released */
+		if (khugepaged_scan_pmd(mm, vma, address, &hpage,
+					KHUGEPAGED_FORCE))
+			down_read(&mm->mmap_sem);
+#ifdef CONFIG_NUMA
+		if (IS_ERR(hpage)) {
+			up_read(&mm->mmap_sem);
+			err = -ENOMEM;
+			break;
+		}
+#endif
+		pmd = khugepaged_find_pmd(mm, address);
+		if (pmd && !pmd_trans_huge(*pmd) && !err)
+			err = -EAGAIN;
+		up_read(&mm->mmap_sem);
+	}
+
+#ifndef CONFIG_NUMA
+	if (hpage)
+		put_page(hpage);
+#endif
+	return err;
+}
+
 void __split_huge_page_pmd(struct mm_struct *mm, pmd_t *pmd)
 {
 	struct page *page;
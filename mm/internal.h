@@ -16,6 +16,11 @@
 void free_pgtables(struct mmu_gather *tlb, struct vm_area_struct *start_vma,
 		unsigned long floor, unsigned long ceiling);
 
+/* mm/slab_common.c: bulk operations for allocators without a fast path */
+void __kmem_cache_free_bulk(struct kmem_cache *s, size_t size, void **p);
+int __kmem_cache_alloc_bulk(struct kmem_cache *s, gfp_t flags, size_t size,
+			    void **p);
+
 static inline void set_page_count(struct page *page, int v)
 {
 	atomic_set(&page->_count, v);
@@ -317,6 +322,27 @@ static inline void mminit_verify_zonelist(void)
 }
 #endif /* CONFIG_DEBUG_MEMORY_INIT */
 
+#ifdef CONFIG_DEFERRED_STRUCT_PAGE_INIT
+extern void deferred_init_reserved(phys_addr_t start, phys_addr_t end);
+
+/* Pages of @nid from this pfn on are initialised by pgdatinit */
+static inline unsigned long first_deferred_pfn(int nid)
+{
+	if (nid < 0 || nid >= MAX_NUMNODES)
+		return ULONG_MAX;
+	return NODE_DATA(nid)->first_deferred_pfn;
+}
+#else
+static inline void deferred_init_reserved(phys_addr_t start, phys_addr_t end)
+{
+}
+
+static inline unsigned long first_deferred_pfn(int nid)
+{
+	return ULONG_MAX;
+}
+#endif /* CONFIG_DEFERRED_STRUCT_PAGE_INIT */
+
 /* mminit_validate_memmodel_limits is independent of CONFIG_DEBUG_MEMORY_INIT */
 #if defined(CONFIG_SPARSEMEM)
 extern void mminit_validate_memmodel_limits(unsigned long *start_pfn,
@@ -19,6 +19,17 @@
  *
  * This is tailored to Chromium OS, where a single program (the browser)
  * controls most of the memory, and (currently) no swap space is used.
+ *
+ * Several margins can be set, giving increasing low-memory levels as
+ * available memory drops below each of them in turn.  A process selects
+ * the level it wants to be notified of by writing it to its /dev/low-mem
+ * file descriptor (the default is level 1, the largest margin), and can
+ * read the current level from it.  A level is only left again once
+ * available memory rises above its margin plus a hysteresis, and wakeups
+ * at an unchanged level are rate limited.
+ *
+ * Independently of the margins, level 1 is also entered when page reclaim
+ * has recently been scanning many more pages than it managed to reclaim.
  */
 
 
@@ -28,13 +39,43 @@
 #include <linux/wait.h>
 #include <linux/poll.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/ctype.h>
+#include <linux/string.h>
 #include <linux/mm.h>
 
 static DECLARE_WAIT_QUEUE_HEAD(low_mem_wait);
-static atomic_t low_mem_state = ATOMIC_INIT(0);
-unsigned low_mem_margin_mb = 50;
+atomic_t low_mem_level = ATOMIC_INIT(0);
+/* Margins in MB, sorted in decreasing order */
+static unsigned low_mem_margin_mb[LOW_MEM_MAX_THRESHOLDS] = { 50 };
+static unsigned low_mem_margin_count = 1;
+/* The same margins, in pages */
+static unsigned long low_mem_thresholds[LOW_MEM_MAX_THRESHOLDS];
 bool low_mem_margin_enabled = true;
 unsigned long low_mem_minfree;
+static unsigned low_mem_hysteresis_mb = 5;
+unsigned long low_mem_hysteresis;
+/* Wakeups at an unchanged level are sent at most once per this interval */
+static unsigned low_mem_ratelimit_ms = 1000;
+static unsigned long low_mem_last_wakeup;
+static unsigned int low_mem_last_wakeup_level;
+static DEFINE_SPINLOCK(low_mem_wakeup_lock);
+
+/*
+ * Reclaim efficiency: the percentage of scanned pages which were not
+ * reclaimed, computed over windows of LOW_MEM_PRESSURE_WINDOW scanned pages.
+ */
+#define LOW_MEM_PRESSURE_WINDOW	(SWAP_CLUSTER_MAX * 16)
+static DEFINE_SPINLOCK(low_mem_pressure_lock);
+static unsigned long low_mem_window_scanned;
+static unsigned long low_mem_window_reclaimed;
+unsigned int low_mem_pressure;
+unsigned int low_mem_pressure_threshold = 95;
+unsigned long low_mem_pressure_stamp;
+
+/* Statistics */
+static atomic_long_t low_mem_events[LOW_MEM_MAX_THRESHOLDS];
+static atomic_long_t low_mem_events_suppressed;
 /*
  * We're interested in worst-case anon memory usage when the low-memory
  * notification fires.  To contain logging, we limit our interest to
@@ -44,13 +85,129 @@ unsigned long low_mem_lowest_seen_anon_mem;
 const unsigned long low_mem_anon_mem_delta = 10 * 1024 * 1024 / PAGE_SIZE;
 
 struct low_mem_notify_file_info {
-	unsigned long unused;
+	unsigned int level;	/* level this file is notified of */
 };
 
+static unsigned long low_mem_margin_to_minfree(unsigned margin_mb)
+{
+	return margin_mb * (1024 * 1024 / PAGE_SIZE);
+}
+
+static void low_mem_log_entry(unsigned long available_mem)
+{
+	const int lru_base = NR_LRU_BASE - LRU_BASE;
+	unsigned long anon_mem =
+		global_page_state(lru_base + LRU_ACTIVE_ANON) +
+		global_page_state(lru_base + LRU_INACTIVE_ANON);
+
+	if (anon_mem < low_mem_lowest_seen_anon_mem) {
+		printk(KERN_INFO "entering low_mem "
+		       "(avail RAM = %lu kB, avail swap %lu kB) "
+		       "with lowest seen anon mem: %lu kB\n",
+		       available_mem * PAGE_SIZE / 1024,
+		       nr_swap_pages * PAGE_SIZE / 1024,
+		       anon_mem * PAGE_SIZE / 1024);
+		low_mem_lowest_seen_anon_mem = anon_mem -
+			low_mem_anon_mem_delta;
+	}
+}
+
+/*
+ * Work out the current low-memory level and record it.  Levels already
+ * entered are only left once available memory exceeds their margin by
+ * low_mem_hysteresis.
+ */
+static unsigned int low_mem_update_level(void)
+{
+	unsigned int i, level = 0;
+	unsigned int old_level = atomic_read(&low_mem_level);
+	unsigned long available_mem, threshold;
+
+	if (!low_mem_margin_enabled) {
+		atomic_set(&low_mem_level, 0);
+		return 0;
+	}
+
+	available_mem = get_available_mem_adj();
+	for (i = 0; i < low_mem_margin_count; i++) {
+		threshold = low_mem_thresholds[i];
+		if (i < old_level)
+			threshold += low_mem_hysteresis;
+		if (available_mem < threshold)
+			level = i + 1;
+	}
+
+	if (!level && low_mem_pressure_high())
+		level = 1;
+
+	if (level && !old_level)
+		low_mem_log_entry(available_mem);
+
+	atomic_set(&low_mem_level, level);
+	return level;
+}
+
 void low_mem_notify(void)
 {
-	atomic_set(&low_mem_state, true);
-	wake_up(&low_mem_wait);
+	unsigned int level = low_mem_update_level();
+	unsigned long flags;
+	bool wakeup = false;
+
+	if (!level)
+		return;
+
+	/*
+	 * This is called for every allocation while memory is low, so only
+	 * wake up pollers when the level rises, or periodically otherwise.
+	 */
+	spin_lock_irqsave(&low_mem_wakeup_lock, flags);
+	if (level > low_mem_last_wakeup_level ||
+	    time_after_eq(jiffies, low_mem_last_wakeup +
+			  msecs_to_jiffies(low_mem_ratelimit_ms))) {
+		low_mem_last_wakeup = jiffies;
+		low_mem_last_wakeup_level = level;
+		wakeup = true;
+	}
+	spin_unlock_irqrestore(&low_mem_wakeup_lock, flags);
+
+	if (wakeup) {
+		atomic_long_inc(&low_mem_events[level - 1]);
+		wake_up(&low_mem_wait);
+	} else {
+		atomic_long_inc(&low_mem_events_suppressed);
+	}
+}
+
+/*
+ * Called by page reclaim with the number of pages it just scanned and
+ * reclaimed.
+ */
+void low_mem_vmpressure(unsigned long scanned, unsigned long reclaimed)
+{
+	unsigned long flags;
+
+	if (!scanned)
+		return;
+
+	spin_lock_irqsave(&low_mem_pressure_lock, flags);
+	low_mem_window_scanned += scanned;
+	low_mem_window_reclaimed += reclaimed;
+	if (low_mem_window_scanned < LOW_MEM_PRESSURE_WINDOW) {
+		spin_unlock_irqrestore(&low_mem_pressure_lock, flags);
+		return;
+	}
+
+	scanned = low_mem_window_scanned;
+	reclaimed = min(low_mem_window_reclaimed, scanned);
+	low_mem_window_scanned = 0;
+	low_mem_window_reclaimed = 0;
+
+	low_mem_pressure = (scanned - reclaimed) * 100 / scanned;
+	low_mem_pressure_stamp = jiffies;
+	spin_unlock_irqrestore(&low_mem_pressure_lock, flags);
+
+	if (low_mem_margin_enabled && low_mem_pressure_high())
+		low_mem_notify();
 }
 
 static int low_mem_notify_open(struct inode *inode, struct file *file)
@@ -64,6 +221,7 @@ static int low_mem_notify_open(struct inode *inode, struct file *file)
 		goto out;
 	}
 
+	info->level = 1;
 	file->private_data = info;
 out:
 	return err;
@@ -77,23 +235,54 @@ static int low_mem_notify_release(struct inode *inode, struct file *file)
 
 static unsigned int low_mem_notify_poll(struct file *file, poll_table *wait)
 {
+	struct low_mem_notify_file_info *info = file->private_data;
 	unsigned int ret = 0;
 
-	/* Update state to reflect any recent freeing. */
-	atomic_set(&low_mem_state, is_low_mem_situation());
-
 	poll_wait(file, &low_mem_wait, wait);
 
-	if (low_mem_margin_enabled && atomic_read(&low_mem_state) != 0)
+	/* Update state to reflect any recent freeing. */
+	if (low_mem_update_level() >= info->level)
 		ret = POLLIN;
 
 	return ret;
 }
 
+/* Reading returns the current level. */
+static ssize_t low_mem_notify_read(struct file *file, char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	char tmp[16];
+	int len;
+
+	len = snprintf(tmp, sizeof(tmp), "%u\n", low_mem_update_level());
+	return simple_read_from_buffer(buf, count, ppos, tmp, len);
+}
+
+/* Writing a level selects which level this file is notified of. */
+static ssize_t low_mem_notify_write(struct file *file, const char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	struct low_mem_notify_file_info *info = file->private_data;
+	unsigned int level;
+	int err;
+
+	err = kstrtouint_from_user(buf, count, 10, &level);
+	if (err)
+		return err;
+	if (level < 1 || level > LOW_MEM_MAX_THRESHOLDS)
+		return -EINVAL;
+
+	info->level = level;
+	return count;
+}
+
 const struct file_operations low_mem_notify_fops = {
 	.open = low_mem_notify_open,
 	.release = low_mem_notify_release,
 	.poll = low_mem_notify_poll,
+	.read = low_mem_notify_read,
+	.write = low_mem_notify_write,
+	.llseek = noop_llseek,
 };
 EXPORT_SYMBOL(low_mem_notify_fops);
 
@@ -104,25 +293,50 @@ EXPORT_SYMBOL(low_mem_notify_fops);
 		__ATTR(_name, 0644, low_mem_##_name##_show,   \
 		       low_mem_##_name##_store)
 
+#define LOW_MEM_RO_ATTR(_name)				      \
+	static struct kobj_attribute low_mem_##_name##_attr = \
+		__ATTR(_name, 0444, low_mem_##_name##_show, NULL)
+
 static ssize_t low_mem_margin_show(struct kobject *kobj,
 				  struct kobj_attribute *attr, char *buf)
 {
-	if (low_mem_margin_enabled)
-		return sprintf(buf, "%u\n", low_mem_margin_mb);
-	else
+	unsigned i;
+	ssize_t len = 0;
+
+	if (!low_mem_margin_enabled)
 		return sprintf(buf, "off\n");
+
+	for (i = 0; i < low_mem_margin_count; i++)
+		len += sprintf(buf + len, "%s%u", i ? " " : "",
+			       low_mem_margin_mb[i]);
+	len += sprintf(buf + len, "\n");
+	return len;
 }
 
-static unsigned low_mem_margin_to_minfree(unsigned margin_mb)
+static int low_mem_margin_cmp(const void *a, const void *b)
 {
-	return margin_mb * (1024 * 1024 / PAGE_SIZE);
+	unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+
+	return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+static void low_mem_set_thresholds(void)
+{
+	unsigned i;
+
+	for (i = 0; i < low_mem_margin_count; i++)
+		low_mem_thresholds[i] =
+			low_mem_margin_to_minfree(low_mem_margin_mb[i]);
+	low_mem_minfree = low_mem_thresholds[0];
+	low_mem_hysteresis = low_mem_margin_to_minfree(low_mem_hysteresis_mb);
 }
 
 static ssize_t low_mem_margin_store(struct kobject *kobj,
 				    struct kobj_attribute *attr,
 				    const char *buf, size_t count)
 {
-	int err;
+	unsigned int margins[LOW_MEM_MAX_THRESHOLDS] = { 0 };
+	unsigned int nr = 0;
 	unsigned long margin;
 	/*
 	 * Even though the API does not say anything about this, the string in
@@ -141,24 +355,139 @@ static ssize_t low_mem_margin_store(struct kobject *kobj,
 		return count;
 	}
 
-	err = strict_strtoul(buf, 10, &margin);
-	if (err)
-		return -EINVAL;
-	if (margin * ((1024 * 1024) / PAGE_SIZE) > totalram_pages)
+	/* A list of up to LOW_MEM_MAX_THRESHOLDS margins, in any order. */
+	while (*buf) {
+		char *end;
+
+		buf = skip_spaces(buf);
+		if (!*buf)
+			break;
+		if (nr == LOW_MEM_MAX_THRESHOLDS)
+			return -EINVAL;
+		margin = simple_strtoul(buf, &end, 10);
+		if (end == buf || (*end && !isspace(*end)))
+			return -EINVAL;
+		if (margin * ((1024 * 1024) / PAGE_SIZE) > totalram_pages)
+			return -EINVAL;
+		margins[nr++] = (unsigned int) margin;
+		buf = end;
+	}
+	if (!nr)
 		return -EINVAL;
+	sort(margins, nr, sizeof(margins[0]), low_mem_margin_cmp, NULL);
+
 	/* Notify when the "free" memory is below margin megabytes. */
 	low_mem_margin_enabled = true;
-	low_mem_margin_mb = (unsigned int) margin;
+	memcpy(low_mem_margin_mb, margins, sizeof(margins));
+	low_mem_margin_count = nr;
 	/* Convert to pages outside the allocator fast path. */
-	low_mem_minfree = low_mem_margin_to_minfree(low_mem_margin_mb);
+	low_mem_set_thresholds();
 	printk(KERN_INFO "low_mem: setting minfree to %lu kB\n",
 	       low_mem_minfree * (PAGE_SIZE / 1024));
 	return count;
 }
 LOW_MEM_ATTR(margin);
 
+static ssize_t low_mem_hysteresis_show(struct kobject *kobj,
+				       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", low_mem_hysteresis_mb);
+}
+
+static ssize_t low_mem_hysteresis_store(struct kobject *kobj,
+					struct kobj_attribute *attr,
+					const char *buf, size_t count)
+{
+	unsigned int hysteresis;
+	int err;
+
+	err = kstrtouint(buf, 10, &hysteresis);
+	if (err)
+		return -EINVAL;
+	if (hysteresis * ((1024 * 1024) / PAGE_SIZE) > totalram_pages)
+		return -EINVAL;
+	low_mem_hysteresis_mb = hysteresis;
+	low_mem_set_thresholds();
+	return count;
+}
+LOW_MEM_ATTR(hysteresis);
+
+static ssize_t low_mem_ratelimit_ms_show(struct kobject *kobj,
+					 struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", low_mem_ratelimit_ms);
+}
+
+static ssize_t low_mem_ratelimit_ms_store(struct kobject *kobj,
+					  struct kobj_attribute *attr,
+					  const char *buf, size_t count)
+{
+	int err = kstrtouint(buf, 10, &low_mem_ratelimit_ms);
+
+	return err ? -EINVAL : count;
+}
+LOW_MEM_ATTR(ratelimit_ms);
+
+static ssize_t low_mem_pressure_threshold_show(struct kobject *kobj,
+					       struct kobj_attribute *attr,
+					       char *buf)
+{
+	return sprintf(buf, "%u\n", low_mem_pressure_threshold);
+}
+
+/* 0 disables the reclaim efficiency signal. */
+static ssize_t low_mem_pressure_threshold_store(struct kobject *kobj,
+						struct kobj_attribute *attr,
+						const char *buf, size_t count)
+{
+	unsigned int threshold;
+	int err;
+
+	err = kstrtouint(buf, 10, &threshold);
+	if (err || threshold > 100)
+		return -EINVAL;
+	low_mem_pressure_threshold = threshold;
+	return count;
+}
+LOW_MEM_ATTR(pressure_threshold);
+
+static ssize_t low_mem_level_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", low_mem_update_level());
+}
+LOW_MEM_RO_ATTR(level);
+
+static ssize_t low_mem_pressure_show(struct kobject *kobj,
+				     struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", low_mem_pressure);
+}
+LOW_MEM_RO_ATTR(pressure);
+
+static ssize_t low_mem_events_show(struct kobject *kobj,
+				   struct kobj_attribute *attr, char *buf)
+{
+	unsigned i;
+	ssize_t len = 0;
+
+	for (i = 0; i < LOW_MEM_MAX_THRESHOLDS; i++)
+		len += sprintf(buf + len, "level%u %ld\n", i + 1,
+			       atomic_long_read(&low_mem_events[i]));
+	len += sprintf(buf + len, "suppressed %ld\n",
+		       atomic_long_read(&low_mem_events_suppressed));
+	return len;
+}
+LOW_MEM_RO_ATTR(events);
+
 static struct attribute *low_mem_attrs[] = {
 	&low_mem_margin_attr.attr,
+	&low_mem_hysteresis_attr.attr,
+	&low_mem_ratelimit_ms_attr.attr,
+	&low_mem_pressure_threshold_attr.attr,
+	&low_mem_level_attr.attr,
+	&low_mem_pressure_attr.attr,
+	&low_mem_events_attr.attr,
 	NULL,
 };
 
@@ -172,7 +501,7 @@ static int __init low_mem_init(void)
 	int err = sysfs_create_group(mm_kobj, &low_mem_attr_group);
 	if (err)
 		printk(KERN_ERR "low_mem: register sysfs failed\n");
-	low_mem_minfree = low_mem_margin_to_minfree(low_mem_margin_mb);
+	low_mem_set_thresholds();
 	low_mem_lowest_seen_anon_mem = totalram_pages;
 	return err;
 }
@@ -13,6 +13,7 @@
 #include <linux/hugetlb.h>
 #include <linux/sched.h>
 #include <linux/ksm.h>
+#include <linux/khugepaged.h>
 
 /*
  * Any behaviour which results in changes to the vma->vm_flags needs to
@@ -279,6 +280,23 @@ madvise_vma(struct vm_area_struct *vma, struct vm_area_struct **prev,
 	}
 }
 
+/*
+ * MADV_COLLAPSE takes and drops the mmap_sem itself, as collapsing
+ * needs it in write mode for each huge page.
+ */
+static int madvise_collapse(unsigned long start, size_t len_in)
+{
+	size_t len;
+
+	if (start & ~PAGE_MASK)
+		return -EINVAL;
+	len = (len_in + ~PAGE_MASK) & PAGE_MASK;
+	if ((len_in && !len) || start + len < start)
+		return -EINVAL;
+
+	return khugepaged_collapse_range(current->mm, start, start + len);
+}
+
 static int
 madvise_behavior_valid(int behavior)
 {
@@ -338,6 +356,8 @@ madvise_behavior_valid(int behavior)
  *  MADV_MERGEABLE - the application recommends that KSM try to merge pages in
  *		this area with pages of identical content from other such areas.
  *  MADV_UNMERGEABLE- cancel MADV_MERGEABLE: no longer merge pages with others.
+ *  MADV_COLLAPSE - collapse the area into transparent huge pages now,
+ *		rather than waiting for khugepaged to get to it.
  *
  * return values:
  *  zero    - success
@@ -363,6 +383,8 @@ SYSCALL_DEFINE3(madvise, unsigned long, start, size_t, len_in, int, behavior)
 	if (behavior == MADV_HWPOISON || behavior == MADV_SOFT_OFFLINE)
 		return madvise_hwpoison(behavior, start, start+len_in);
 #endif
+	if (behavior == MADV_COLLAPSE)
+		return madvise_collapse(start, len_in);
 	if (!madvise_behavior_valid(behavior))
 		return error;
 
@@ -39,6 +39,7 @@
 #include <linux/slab.h>
 #include <linux/swap.h>
 #include <linux/swapops.h>
+#include <linux/shmem_fs.h>
 #include <linux/spinlock.h>
 #include <linux/eventfd.h>
 #include <linux/sort.h>
@@ -227,6 +228,11 @@ struct mem_cgroup {
 	 * the counter to account for memory usage
 	 */
 	struct res_counter res;
+	/*
+	 * the counter to account for kernel memory usage, which is
+	 * charged to res (and memsw) as well.
+	 */
+	struct res_counter kmem;
 
 	union {
 		/*
@@ -316,6 +322,12 @@ struct mem_cgroup {
 #ifdef CONFIG_INET
 	struct tcp_memcontrol tcp_mem;
 #endif
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR_KMEM_SLAB
+	/* index into the per memcg cache arrays, -1 if not accounted */
+	int kmemcg_id;
+	/* per memcg copies of slab caches, see memcg_cache_params */
+	struct list_head memcg_slab_caches;
+#endif
 };
 
 /* Stuffs for move charges at task migration. */
@@ -377,6 +389,7 @@ enum charge_type {
 #define _MEM			(0)
 #define _MEMSWAP		(1)
 #define _OOM_TYPE		(2)
+#define _KMEM			(3)
 #define MEMFILE_PRIVATE(x, val)	(((x) << 16) | (val))
 #define MEMFILE_TYPE(val)	(((val) >> 16) & 0xffff)
 #define MEMFILE_ATTR(val)	((val) & 0xffff)
@@ -1031,6 +1044,41 @@ struct lruvec *mem_cgroup_zone_lruvec(struct zone *zone,
 	return &mz->lruvec;
 }
 
+/**
+ * mem_cgroup_page_lruvec - get the lru list vector of a page
+ * @page: the page
+ * @zone: zone of the page
+ *
+ * Returns the lruvec @page is linked on, or would be linked on if it
+ * were added to the lru now: that of the memcg it is charged to, or
+ * of the root memcg if it is neither charged nor on an lru.
+ *
+ * The answer is only stable under the lru_lock of the returned lruvec,
+ * see relock_page_lruvec().  Interrupts must be disabled, which keeps
+ * the memcg from being freed under us.
+ */
+struct lruvec *mem_cgroup_page_lruvec(struct page *page, struct zone *zone)
+{
+	struct mem_cgroup_per_zone *mz;
+	struct mem_cgroup *memcg = NULL;
+	struct page_cgroup *pc;
+
+	if (mem_cgroup_disabled())
+		return &zone->lruvec;
+
+	pc = lookup_page_cgroup(page);
+	if (PageLRU(page) || PageCgroupUsed(pc)) {
+		/* see __mem_cgroup_commit_charge() */
+		smp_rmb();
+		memcg = ACCESS_ONCE(pc->mem_cgroup);
+	}
+	if (!memcg)
+		memcg = root_mem_cgroup;
+
+	mz = mem_cgroup_zoneinfo(memcg, zone_to_nid(zone), zone_idx(zone));
+	return &mz->lruvec;
+}
+
 /*
  * Following LRU functions are allowed to be used without PCG_LOCK.
  * Operations are called by routine of global LRU independently from memcg.
@@ -1040,52 +1088,47 @@ struct lruvec *mem_cgroup_zone_lruvec(struct zone *zone,
  * 1. charge
  * 2. moving account
  * In typical case, "charge" is done before add-to-lru. Exception is SwapCache.
- * It is added to LRU before charge.
+ * It is added to LRU before charge, so charging it takes the lru_lock.
  * If PCG_USED bit is not set, page_cgroup is not added to this private LRU.
  * When moving account, the page is not on LRU. It's isolated.
  */
 
 /**
- * mem_cgroup_lru_add_list - account for adding an lru page and return lruvec
- * @zone: zone of the page
+ * mem_cgroup_lru_add_list - account for adding an lru page
+ * @lruvec: lruvec the page is added to, with its lru_lock held
  * @page: the page
  * @lru: current lru
  *
- * This function accounts for @page being added to @lru, and returns
- * the lruvec for the given @zone and the memcg @page is charged to.
+ * This function accounts for @page being added to @lru of @lruvec,
+ * which the caller found with mem_cgroup_page_lruvec().
  *
  * The callsite is then responsible for physically linking the page to
- * the returned lruvec->lists[@lru].
+ * lruvec->lists[@lru].
  */
-struct lruvec *mem_cgroup_lru_add_list(struct zone *zone, struct page *page,
-				       enum lru_list lru)
+void mem_cgroup_lru_add_list(struct lruvec *lruvec, struct page *page,
+			     enum lru_list lru)
 {
 	struct mem_cgroup_per_zone *mz;
-	struct mem_cgroup *memcg;
 	struct page_cgroup *pc;
 
 	if (mem_cgroup_disabled())
-		return &zone->lruvec;
+		return;
 
+	mz = container_of(lruvec, struct mem_cgroup_per_zone, lruvec);
 	pc = lookup_page_cgroup(page);
-	memcg = pc->mem_cgroup;
+	VM_BUG_ON(PageCgroupUsed(pc) && pc->mem_cgroup != mz->memcg);
 
 	/*
-	 * Surreptitiously switch any uncharged page to root:
-	 * an uncharged page off lru does nothing to secure
-	 * its former mem_cgroup from sudden removal.
-	 *
-	 * Our caller holds lru_lock, and PageCgroupUsed is updated
-	 * under page_cgroup lock: between them, they make all uses
-	 * of pc->mem_cgroup safe.
+	 * An uncharged page is surreptitiously switched to root, since
+	 * an uncharged page off lru does nothing to secure its former
+	 * mem_cgroup from sudden removal: that is the lruvec we were
+	 * given.  If it was uncharged since our caller looked it up, it
+	 * stays with its memcg, like any page uncharged while on lru.
 	 */
-	if (!PageCgroupUsed(pc) && memcg != root_mem_cgroup)
-		pc->mem_cgroup = memcg = root_mem_cgroup;
+	pc->mem_cgroup = mz->memcg;
 
-	mz = page_cgroup_zoneinfo(memcg, page);
 	/* compound_order() is stabilized through lru_lock */
 	mz->lru_size[lru] += 1 << compound_order(page);
-	return &mz->lruvec;
 }
 
 /**
@@ -1123,26 +1166,31 @@ void mem_cgroup_lru_del(struct page *page)
 
 /**
  * mem_cgroup_lru_move_lists - account for moving a page between lrus
- * @zone: zone of the page
+ * @lruvec: lruvec the page is on, with its lru_lock held
  * @page: the page
  * @from: current lru
  * @to: target lru
  *
  * This function accounts for @page being moved between the lrus @from
- * and @to, and returns the lruvec for the given @zone and the memcg
- * @page is charged to.
+ * and @to of @lruvec.
  *
  * The callsite is then responsible for physically relinking
- * @page->lru to the returned lruvec->lists[@to].
+ * @page->lru to lruvec->lists[@to].
  */
-struct lruvec *mem_cgroup_lru_move_lists(struct zone *zone,
-					 struct page *page,
-					 enum lru_list from,
-					 enum lru_list to)
+void mem_cgroup_lru_move_lists(struct lruvec *lruvec, struct page *page,
+			       enum lru_list from, enum lru_list to)
 {
-	/* XXX: Optimize this, especially for @from == @to */
-	mem_cgroup_lru_del_list(page, from);
-	return mem_cgroup_lru_add_list(zone, page, to);
+	struct mem_cgroup_per_zone *mz;
+	int nr_pages;
+
+	if (mem_cgroup_disabled() || from == to)
+		return;
+
+	mz = container_of(lruvec, struct mem_cgroup_per_zone, lruvec);
+	nr_pages = 1 << compound_order(page);
+	VM_BUG_ON(mz->lru_size[from] < nr_pages);
+	mz->lru_size[from] -= nr_pages;
+	mz->lru_size[to] += nr_pages;
 }
 
 /*
@@ -2426,6 +2474,465 @@ static void __mem_cgroup_cancel_charge(struct mem_cgroup *memcg,
 	}
 }
 
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR_KMEM_SLAB
+/*
+ * Slab accounting.
+ *
+ * A memcg is accounted once a kmem limit is set on it, which gives it
+ * a kmem id.  Allocations of its tasks from SLAB_ACCOUNT caches are
+ * then served from per memcg copies of the caches, found in the
+ * memcg_caches array of the root cache at the kmem id.  The slab pages
+ * of a copy are charged to the kmem counter and to the memory counter
+ * of the memcg, so the memory limit covers them too.
+ *
+ * A copy is created by a work item on the first allocation that misses
+ * it; that allocation and the ones racing with it are served from the
+ * root cache, unaccounted.  When the memcg goes away its copies are
+ * shrunk and destroyed once their last slab page has been freed.
+ */
+struct static_key memcg_kmem_enabled_key;
+
+/* Size of the memcg_caches arrays of newly created root caches */
+int memcg_limited_groups_array_size;
+#define MEMCG_CACHES_MIN_SIZE	4
+#define MEMCG_CACHES_MAX_SIZE	65535
+
+static DEFINE_IDA(kmem_limited_groups);
+
+/* Protects the memcg_caches arrays and the memcg_slab_caches lists */
+static DEFINE_MUTEX(memcg_cache_mutex);
+
+/* Creates the copies, flushed when a root cache is destroyed */
+static struct workqueue_struct *memcg_cache_wq;
+
+bool memcg_kmem_is_active(struct mem_cgroup *memcg)
+{
+	return memcg->kmemcg_id >= 0;
+}
+
+static int memcg_activate_kmem(struct mem_cgroup *memcg)
+{
+	int id, ret = 0;
+
+	id = ida_simple_get(&kmem_limited_groups, 0, MEMCG_CACHES_MAX_SIZE,
+			    GFP_KERNEL);
+	if (id < 0)
+		return id;
+
+	mutex_lock(&memcg_cache_mutex);
+	if (!memcg_cache_wq) {
+		memcg_cache_wq = alloc_workqueue("memcg_cache", 0, 0);
+		if (!memcg_cache_wq)
+			ret = -ENOMEM;
+	}
+	if (!ret && id >= memcg_limited_groups_array_size) {
+		int size = max(2 * (id + 1), MEMCG_CACHES_MIN_SIZE);
+
+		ret = memcg_update_all_caches(min(size, MEMCG_CACHES_MAX_SIZE));
+	}
+	if (!ret)
+		memcg->kmemcg_id = id;
+	mutex_unlock(&memcg_cache_mutex);
+
+	if (ret) {
+		ida_simple_remove(&kmem_limited_groups, id);
+		return ret;
+	}
+	static_key_slow_inc(&memcg_kmem_enabled_key);
+	return 0;
+}
+
+static void memcg_cache_destroy_func(struct work_struct *work)
+{
+	struct memcg_cache_params *params;
+	struct kmem_cache *cachep;
+
+	params = container_of(work, struct memcg_cache_params, destroy);
+	cachep = params->cachep;
+
+	if (!params->drained) {
+		/*
+		 * First run after the memcg went away: give back the
+		 * empty slabs and drop the reference of the copy itself.
+		 * Otherwise freeing the last slab page requeues us.
+		 */
+		params->drained = true;
+		kmem_cache_shrink(cachep);
+		if (!atomic_dec_and_test(&params->nr_pages))
+			return;
+	}
+	kmem_cache_destroy(cachep);
+}
+
+/**
+ * memcg_register_cache - set up the memcg state of a new cache
+ * @memcg: memcg of a per memcg copy, %NULL for a root cache
+ * @s: the new cache
+ * @root: the cache @s is a copy of
+ *
+ * Only caches created with SLAB_ACCOUNT are concerned.
+ */
+int memcg_register_cache(struct mem_cgroup *memcg, struct kmem_cache *s,
+			 struct kmem_cache *root)
+{
+	struct memcg_cache_params *params;
+	size_t size = sizeof(*params);
+
+	if (!(s->flags & SLAB_ACCOUNT))
+		return 0;
+
+	if (!memcg)
+		size += memcg_limited_groups_array_size *
+			sizeof(struct kmem_cache *);
+
+	params = kzalloc(size, GFP_KERNEL);
+	if (!params)
+		return -ENOMEM;
+
+	if (memcg) {
+		params->memcg = memcg;
+		params->root_cache = root;
+		params->cachep = s;
+		INIT_LIST_HEAD(&params->list);
+		atomic_set(&params->nr_pages, 1);
+		INIT_WORK(&params->destroy, memcg_cache_destroy_func);
+		mem_cgroup_get(memcg);
+	} else {
+		params->is_root_cache = true;
+		params->nr_caches = memcg_limited_groups_array_size;
+	}
+	s->memcg_params = params;
+	return 0;
+}
+
+/**
+ * memcg_release_cache - tear down the memcg state of a cache
+ * @s: the cache being destroyed
+ *
+ * The per memcg copies of a root cache are destroyed along with it.
+ */
+void memcg_release_cache(struct kmem_cache *s)
+{
+	struct memcg_cache_params *params = s->memcg_params;
+	struct mem_cgroup *memcg;
+	int i;
+
+	if (!params)
+		return;
+
+	if (params->is_root_cache) {
+		/* Copies still being created refer to the root cache */
+		if (memcg_cache_wq)
+			flush_workqueue(memcg_cache_wq);
+
+		for (i = 0; i < params->nr_caches; i++) {
+			struct kmem_cache *c;
+
+			mutex_lock(&memcg_cache_mutex);
+			c = params->memcg_caches[i];
+			mutex_unlock(&memcg_cache_mutex);
+			if (c)
+				kmem_cache_destroy(c);
+		}
+		s->memcg_params = NULL;
+		kfree_rcu(params, rcu_head);
+		return;
+	}
+
+	memcg = params->memcg;
+	/* A copy that failed creation was never published */
+	if (!list_empty(&params->list)) {
+		mutex_lock(&memcg_cache_mutex);
+		list_del(&params->list);
+		if (!params->dead)
+			params->root_cache->memcg_params->
+				memcg_caches[memcg->kmemcg_id] = NULL;
+		mutex_unlock(&memcg_cache_mutex);
+	}
+	s->memcg_params = NULL;
+	kfree(params);
+	mem_cgroup_put(memcg);
+}
+
+static void memcg_create_kmem_cache(struct mem_cgroup *memcg,
+				    struct kmem_cache *root)
+{
+	struct memcg_cache_params *params;
+	struct kmem_cache *new;
+	struct dentry *dentry;
+	char *name;
+	int idx;
+
+	mutex_lock(&memcg_cache_mutex);
+	idx = memcg->kmemcg_id;
+	params = root->memcg_params;
+	if (params->memcg_caches[idx])
+		goto out;
+
+	/* a rename may free the name once we leave the RCU section */
+	rcu_read_lock();
+	dentry = rcu_dereference(memcg->css.cgroup->dentry);
+	name = kasprintf(GFP_ATOMIC, "%s(%d:%s)", root->name, idx,
+			 dentry->d_name.name);
+	rcu_read_unlock();
+	if (!name)
+		goto out;
+
+	new = kmem_cache_create_memcg(memcg, root, name);
+	if (!new)
+		goto out;
+
+	list_add(&new->memcg_params->list, &memcg->memcg_slab_caches);
+	/* Publish the copy only once it is fully set up */
+	smp_wmb();
+	params->memcg_caches[idx] = new;
+out:
+	mutex_unlock(&memcg_cache_mutex);
+}
+
+struct create_work {
+	struct mem_cgroup *memcg;
+	struct kmem_cache *cachep;
+	struct work_struct work;
+};
+
+static void memcg_create_cache_work_func(struct work_struct *work)
+{
+	struct create_work *cw = container_of(work, struct create_work, work);
+
+	memcg_create_kmem_cache(cw->memcg, cw->cachep);
+	css_put(&cw->memcg->css);
+	kfree(cw);
+}
+
+/*
+ * Called with a css reference on @memcg, which is dropped once the copy
+ * has been created.
+ */
+static void memcg_create_cache_enqueue(struct mem_cgroup *memcg,
+				       struct kmem_cache *cachep)
+{
+	struct create_work *cw;
+
+	cw = kmalloc(sizeof(*cw), GFP_NOWAIT | __GFP_NOWARN);
+	if (!cw) {
+		css_put(&memcg->css);
+		return;
+	}
+	cw->memcg = memcg;
+	cw->cachep = cachep;
+	INIT_WORK(&cw->work, memcg_create_cache_work_func);
+	queue_work(memcg_cache_wq, &cw->work);
+}
+
+struct kmem_cache *__memcg_kmem_get_cache(struct kmem_cache *cachep,
+					  gfp_t gfp)
+{
+	struct memcg_cache_params *params;
+	struct kmem_cache *memcg_cachep = NULL;
+	struct mem_cgroup *memcg;
+	int idx;
+
+	if (!current->mm || in_interrupt() || (gfp & __GFP_NOFAIL))
+		return cachep;
+
+	rcu_read_lock();
+	memcg = mem_cgroup_from_task(current);
+	if (!memcg || !memcg_kmem_is_active(memcg))
+		goto out;
+
+	idx = memcg->kmemcg_id;
+	params = rcu_dereference(cachep->memcg_params);
+	if (idx < params->nr_caches)
+		memcg_cachep = rcu_dereference(params->memcg_caches[idx]);
+	if (likely(memcg_cachep)) {
+		cachep = memcg_cachep;
+		goto out;
+	}
+
+	/* The first allocation from this cache in this memcg */
+	if (css_tryget(&memcg->css))
+		memcg_create_cache_enqueue(memcg, cachep);
+out:
+	rcu_read_unlock();
+	return cachep;
+}
+
+/*
+ * The memcg is going away: its copies can not be allocated from any
+ * more and are destroyed as soon as they are empty.
+ */
+static void memcg_destroy_kmem_caches(struct mem_cgroup *memcg)
+{
+	struct memcg_cache_params *params;
+
+	if (!memcg_kmem_is_active(memcg))
+		return;
+
+	mutex_lock(&memcg_cache_mutex);
+	list_for_each_entry(params, &memcg->memcg_slab_caches, list) {
+		params->root_cache->memcg_params->
+			memcg_caches[memcg->kmemcg_id] = NULL;
+		params->dead = true;
+		schedule_work(&params->destroy);
+	}
+	mutex_unlock(&memcg_cache_mutex);
+}
+
+int memcg_charge_kmem(struct mem_cgroup *memcg, gfp_t gfp,
+		      unsigned int nr_pages)
+{
+	unsigned long bytes = nr_pages * PAGE_SIZE;
+	struct mem_cgroup *_memcg = memcg;
+	struct res_counter *fail_res;
+	int ret;
+
+	ret = res_counter_charge(&memcg->kmem, bytes, &fail_res);
+	if (ret)
+		return ret;
+
+	ret = __mem_cgroup_try_charge(NULL, gfp, nr_pages, &_memcg, false);
+	if (ret == -EINTR) {
+		/*
+		 * A dying task bypassed the limit.  Force the charge so
+		 * that the counters stay balanced for the uncharge.
+		 */
+		ret = res_counter_charge_nofail(&memcg->res, bytes, &fail_res);
+		if (do_swap_account)
+			ret = res_counter_charge_nofail(&memcg->memsw, bytes,
+							&fail_res);
+		ret = 0;
+	} else if (ret)
+		res_counter_uncharge(&memcg->kmem, bytes);
+
+	return ret;
+}
+
+void memcg_uncharge_kmem(struct mem_cgroup *memcg, unsigned int nr_pages)
+{
+	res_counter_uncharge(&memcg->kmem, nr_pages * PAGE_SIZE);
+	__mem_cgroup_cancel_charge(memcg, nr_pages);
+}
+
+/**
+ * memcg_kmem_owns - check the owner of a slab object
+ * @memcg: memcg that reclaims
+ * @obj: the object
+ *
+ * Returns true if @obj was allocated from a copy of a cache that
+ * belongs to @memcg or, with hierarchy, to one of its descendants.
+ */
+bool memcg_kmem_owns(struct mem_cgroup *memcg, const void *obj)
+{
+	struct page *page = virt_to_head_page(obj);
+	struct memcg_cache_params *params;
+	bool ret;
+
+	if (!PageSlab(page))
+		return false;
+
+	params = page->slab->memcg_params;
+	if (!params || params->is_root_cache)
+		return false;
+
+	rcu_read_lock();
+	ret = mem_cgroup_same_or_subtree(memcg, params->memcg);
+	rcu_read_unlock();
+	return ret;
+}
+
+/**
+ * memcg_kmem_shrink_share - scale a shrinker's object count to a memcg
+ * @memcg: memcg that reclaims
+ * @objects: number of objects in the cache
+ *
+ * Returns the part of @objects that corresponds to the share of slab
+ * memory charged to @memcg.
+ */
+unsigned long memcg_kmem_shrink_share(struct mem_cgroup *memcg,
+				      unsigned long objects)
+{
+	u64 kmem = res_counter_read_u64(&memcg->kmem, RES_USAGE) >> PAGE_SHIFT;
+	unsigned long slab = global_page_state(NR_SLAB_RECLAIMABLE) +
+			     global_page_state(NR_SLAB_UNRECLAIMABLE);
+
+	if (kmem >= slab)
+		return objects;
+	return div64_u64((u64)objects * kmem, slab + 1);
+}
+
+/* Pages on the LRU lists of @memcg and its descendants */
+unsigned long memcg_nr_lru_pages(struct mem_cgroup *memcg)
+{
+	struct mem_cgroup *iter;
+	unsigned long nr = 0;
+
+	for_each_mem_cgroup_tree(iter, memcg)
+		nr += mem_cgroup_nr_lru_pages(iter, LRU_ALL);
+	return nr;
+}
+
+static int memcg_update_kmem_limit(struct cgroup *cont, u64 val)
+{
+	struct mem_cgroup *memcg = mem_cgroup_from_cont(cont);
+	int ret = 0;
+
+	cgroup_lock();
+	/*
+	 * Accounting starts with the first limit and stays on for the
+	 * life of the memcg.  It has to start out empty so that kmem
+	 * charges and uncharges match.
+	 */
+	if (!memcg_kmem_is_active(memcg) && val != RESOURCE_MAX) {
+		if (cgroup_task_count(cont) || !list_empty(&cont->children))
+			ret = -EBUSY;
+		else
+			ret = memcg_activate_kmem(memcg);
+	}
+	if (!ret)
+		ret = res_counter_set_limit(&memcg->kmem, val);
+	cgroup_unlock();
+	return ret;
+}
+
+/* Children of an accounted memcg are accounted along with it */
+static int memcg_propagate_kmem(struct mem_cgroup *memcg,
+				struct mem_cgroup *parent)
+{
+	if (!parent || !parent->use_hierarchy ||
+	    !memcg_kmem_is_active(parent))
+		return 0;
+	return memcg_activate_kmem(memcg);
+}
+
+static void memcg_free_kmem(struct mem_cgroup *memcg)
+{
+	if (!memcg_kmem_is_active(memcg))
+		return;
+	ida_simple_remove(&kmem_limited_groups, memcg->kmemcg_id);
+	static_key_slow_dec(&memcg_kmem_enabled_key);
+}
+#else
+static int memcg_update_kmem_limit(struct cgroup *cont, u64 val)
+{
+	return -EINVAL;
+}
+
+static int memcg_propagate_kmem(struct mem_cgroup *memcg,
+				struct mem_cgroup *parent)
+{
+	return 0;
+}
+
+static void memcg_destroy_kmem_caches(struct mem_cgroup *memcg)
+{
+}
+
+static void memcg_free_kmem(struct mem_cgroup *memcg)
+{
+}
+#endif /* CONFIG_CGROUP_MEM_RES_CTLR_KMEM_SLAB */
+
 /*
  * A helper function to get mem_cgroup from ID. must be called under
  * rcu_read_lock(). The caller must check css_is_removed() or some if
@@ -2480,7 +2987,7 @@ static void __mem_cgroup_commit_charge(struct mem_cgroup *memcg,
 				       bool lrucare)
 {
 	struct page_cgroup *pc = lookup_page_cgroup(page);
-	struct zone *uninitialized_var(zone);
+	struct lruvec *uninitialized_var(lruvec);
 	bool was_on_lru = false;
 	bool anon;
 
@@ -2497,14 +3004,15 @@ static void __mem_cgroup_commit_charge(struct mem_cgroup *memcg,
 
 	/*
 	 * In some cases, SwapCache and FUSE(splice_buf->radixtree), the page
-	 * may already be on some other mem_cgroup's LRU.  Take care of it.
+	 * may already be on some other mem_cgroup's LRU.  Take care of it:
+	 * holding the lru_lock its lookup leads to across the change of
+	 * pc->mem_cgroup keeps others from putting it on the old lruvec.
 	 */
 	if (lrucare) {
-		zone = page_zone(page);
-		spin_lock_irq(&zone->lru_lock);
+		lruvec = lock_page_lruvec_irq(page);
 		if (PageLRU(page)) {
 			ClearPageLRU(page);
-			del_page_from_lru_list(zone, page, page_lru(page));
+			del_page_from_lru_list(page, lruvec, page_lru(page));
 			was_on_lru = true;
 		}
 	}
@@ -2515,18 +3023,19 @@ static void __mem_cgroup_commit_charge(struct mem_cgroup *memcg,
 	 * Especially when a page_cgroup is taken from a page, pc->mem_cgroup
 	 * is accessed after testing USED bit. To make pc->mem_cgroup visible
 	 * before USED bit, we need memory barrier here.
-	 * See mem_cgroup_add_lru_list(), etc.
+	 * See mem_cgroup_page_lruvec(), etc.
  	 */
 	smp_wmb();
 	SetPageCgroupUsed(pc);
 
 	if (lrucare) {
 		if (was_on_lru) {
+			lruvec = relock_page_lruvec(page, lruvec);
 			VM_BUG_ON(PageLRU(page));
 			SetPageLRU(page);
-			add_page_to_lru_list(zone, page, page_lru(page));
+			add_page_to_lru_list(page, lruvec, page_lru(page));
 		}
-		spin_unlock_irq(&zone->lru_lock);
+		unlock_lruvec_irq(lruvec);
 	}
 
 	if (ctype == MEM_CGROUP_CHARGE_TYPE_MAPPED)
@@ -2550,7 +3059,7 @@ static void __mem_cgroup_commit_charge(struct mem_cgroup *memcg,
 #define PCGF_NOCOPY_AT_SPLIT ((1 << PCG_LOCK) | (1 << PCG_MIGRATION))
 /*
  * Because tail pages are not marked as "used", set it. We're under
- * zone->lru_lock, 'splitting on pmd' and compound_lock.
+ * the head's lru_lock, 'splitting on pmd' and compound_lock.
  * charge/uncharge will be never happen and move_account() is done under
  * compound_lock(), so we don't have to take care of races.
  */
@@ -2632,7 +3141,10 @@ static int mem_cgroup_move_account(struct page *page,
 		/* This is not "cancel", but cancel_charge does all we need. */
 		__mem_cgroup_cancel_charge(from, nr_pages);
 
-	/* caller should have done css_get */
+	/*
+	 * caller should have done css_get.  The page is isolated, so
+	 * nobody can link it to either lruvec meanwhile.
+	 */
 	pc->mem_cgroup = to;
 	mem_cgroup_charge_statistics(to, anon, nr_pages);
 	/*
@@ -3658,10 +4170,8 @@ static int mem_cgroup_force_empty_list(struct mem_cgroup *memcg,
 	unsigned long flags, loop;
 	struct list_head *list;
 	struct page *busy;
-	struct zone *zone;
 	int ret = 0;
 
-	zone = &NODE_DATA(node)->node_zones[zid];
 	mz = mem_cgroup_zoneinfo(memcg, node, zid);
 	list = &mz->lruvec.lists[lru];
 
@@ -3674,19 +4184,20 @@ static int mem_cgroup_force_empty_list(struct mem_cgroup *memcg,
 		struct page *page;
 
 		ret = 0;
-		spin_lock_irqsave(&zone->lru_lock, flags);
+		local_irq_save(flags);
+		__lruvec_lock(&mz->lruvec);
 		if (list_empty(list)) {
-			spin_unlock_irqrestore(&zone->lru_lock, flags);
+			unlock_lruvec_irqrestore(&mz->lruvec, flags);
 			break;
 		}
 		page = list_entry(list->prev, struct page, lru);
 		if (busy == page) {
 			list_move(&page->lru, list);
 			busy = NULL;
-			spin_unlock_irqrestore(&zone->lru_lock, flags);
+			unlock_lruvec_irqrestore(&mz->lruvec, flags);
 			continue;
 		}
-		spin_unlock_irqrestore(&zone->lru_lock, flags);
+		unlock_lruvec_irqrestore(&mz->lruvec, flags);
 
 		pc = lookup_page_cgroup(page);
 
@@ -3707,6 +4218,16 @@ static int mem_cgroup_force_empty_list(struct mem_cgroup *memcg,
 	return ret;
 }
 
+/*
+ * Usage by pages on the LRU lists.  Slab pages can not be moved or
+ * reclaimed here; their charges go away with the objects.
+ */
+static u64 mem_cgroup_lru_usage(struct mem_cgroup *memcg)
+{
+	return res_counter_read_u64(&memcg->res, RES_USAGE) -
+		res_counter_read_u64(&memcg->kmem, RES_USAGE);
+}
+
 /*
  * make mem_cgroup's charge to be 0 if there is no task.
  * This enables deleting this mem_cgroup.
@@ -3757,7 +4278,7 @@ move_account:
 			goto try_to_free;
 		cond_resched();
 	/* "ret" should also be checked to ensure all lists are empty. */
-	} while (res_counter_read_u64(&memcg->res, RES_USAGE) > 0 || ret);
+	} while (mem_cgroup_lru_usage(memcg) > 0 || ret);
 out:
 	css_put(&memcg->css);
 	return ret;
@@ -3772,7 +4293,7 @@ try_to_free:
 	lru_add_drain_all();
 	/* try to free all pages in this cgroup */
 	shrink = 1;
-	while (nr_retries && res_counter_read_u64(&memcg->res, RES_USAGE) > 0) {
+	while (nr_retries && mem_cgroup_lru_usage(memcg) > 0) {
 		int progress;
 
 		if (signal_pending(current)) {
@@ -3894,6 +4415,9 @@ static u64 mem_cgroup_read(struct cgroup *cont, struct cftype *cft)
 		else
 			val = res_counter_read_u64(&memcg->memsw, name);
 		break;
+	case _KMEM:
+		val = res_counter_read_u64(&memcg->kmem, name);
+		break;
 	default:
 		BUG();
 	}
@@ -3925,8 +4449,10 @@ static int mem_cgroup_write(struct cgroup *cont, struct cftype *cft,
 			break;
 		if (type == _MEM)
 			ret = mem_cgroup_resize_limit(memcg, val);
-		else
+		else if (type == _MEMSWAP)
 			ret = mem_cgroup_resize_memsw_limit(memcg, val);
+		else
+			ret = memcg_update_kmem_limit(cont, val);
 		break;
 	case RES_SOFT_LIMIT:
 		ret = res_counter_memparse_write_strategy(buffer, &val);
@@ -3988,14 +4514,18 @@ static int mem_cgroup_reset(struct cgroup *cont, unsigned int event)
 	case RES_MAX_USAGE:
 		if (type == _MEM)
 			res_counter_reset_max(&memcg->res);
-		else
+		else if (type == _MEMSWAP)
 			res_counter_reset_max(&memcg->memsw);
+		else
+			res_counter_reset_max(&memcg->kmem);
 		break;
 	case RES_FAILCNT:
 		if (type == _MEM)
 			res_counter_reset_failcnt(&memcg->res);
-		else
+		else if (type == _MEMSWAP)
 			res_counter_reset_failcnt(&memcg->memsw);
+		else
+			res_counter_reset_failcnt(&memcg->kmem);
 		break;
 	}
 
@@ -4624,8 +5154,44 @@ static int mem_control_numa_stat_open(struct inode *unused, struct file *file)
 #endif /* CONFIG_NUMA */
 
 #ifdef CONFIG_CGROUP_MEM_RES_CTLR_KMEM
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR_KMEM_SLAB
+static struct cftype kmem_cgroup_files[] = {
+	{
+		.name = "kmem.limit_in_bytes",
+		.private = MEMFILE_PRIVATE(_KMEM, RES_LIMIT),
+		.write_string = mem_cgroup_write,
+		.read_u64 = mem_cgroup_read,
+	},
+	{
+		.name = "kmem.usage_in_bytes",
+		.private = MEMFILE_PRIVATE(_KMEM, RES_USAGE),
+		.read_u64 = mem_cgroup_read,
+	},
+	{
+		.name = "kmem.failcnt",
+		.private = MEMFILE_PRIVATE(_KMEM, RES_FAILCNT),
+		.trigger = mem_cgroup_reset,
+		.read_u64 = mem_cgroup_read,
+	},
+	{
+		.name = "kmem.max_usage_in_bytes",
+		.private = MEMFILE_PRIVATE(_KMEM, RES_MAX_USAGE),
+		.trigger = mem_cgroup_reset,
+		.read_u64 = mem_cgroup_read,
+	},
+};
+#endif
+
 static int register_kmem_files(struct cgroup *cont, struct cgroup_subsys *ss)
 {
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR_KMEM_SLAB
+	int ret;
+
+	ret = cgroup_add_files(cont, ss, kmem_cgroup_files,
+			       ARRAY_SIZE(kmem_cgroup_files));
+	if (ret)
+		return ret;
+#endif
 	/*
 	 * Part of this would be better living in a separate allocation
 	 * function, leaving us with just the cgroup tree population work.
@@ -4770,7 +5336,6 @@ static int alloc_mem_cgroup_per_zone_info(struct mem_cgroup *memcg, int node)
 {
 	struct mem_cgroup_per_node *pn;
 	struct mem_cgroup_per_zone *mz;
-	enum lru_list lru;
 	int zone, tmp = node;
 	/*
 	 * This routine is called against possible nodes.
@@ -4788,8 +5353,7 @@ static int alloc_mem_cgroup_per_zone_info(struct mem_cgroup *memcg, int node)
 
 	for (zone = 0; zone < MAX_NR_ZONES; zone++) {
 		mz = &pn->zoneinfo[zone];
-		for_each_lru(lru)
-			INIT_LIST_HEAD(&mz->lruvec.lists[lru]);
+		lruvec_init(&mz->lruvec, &NODE_DATA(node)->node_zones[zone]);
 		mz->usage_in_excess = 0;
 		mz->on_tree = false;
 		mz->memcg = memcg;
@@ -4821,6 +5385,10 @@ static struct mem_cgroup *mem_cgroup_alloc(void)
 	if (!memcg->stat)
 		goto out_free;
 	spin_lock_init(&memcg->pcp_counter_lock);
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR_KMEM_SLAB
+	memcg->kmemcg_id = -1;
+	INIT_LIST_HEAD(&memcg->memcg_slab_caches);
+#endif
 	return memcg;
 
 out_free:
@@ -4832,23 +5400,37 @@ out_free:
 }
 
 /*
- * Helpers for freeing a vzalloc()ed mem_cgroup by RCU,
- * but in process context.  The work_freeing structure is overlaid
- * on the rcu_freeing structure, which itself is overlaid on memsw.
+ * Helpers for freeing a mem_cgroup by RCU, but in process context.
+ * The work_freeing structure is overlaid on the rcu_freeing structure,
+ * which itself is overlaid on memsw.
+ *
+ * The lruvecs live in the per-zone info: someone who looked up a page's
+ * lruvec just before the page left this memcg may still be spinning on
+ * its lru_lock.  That is done with interrupts disabled, so
+ * synchronize_sched() waits for it.
  */
-static void vfree_work(struct work_struct *work)
+static void free_work(struct work_struct *work)
 {
 	struct mem_cgroup *memcg;
+	int node;
 
 	memcg = container_of(work, struct mem_cgroup, work_freeing);
-	vfree(memcg);
+	memcg_free_kmem(memcg);
+	synchronize_sched();
+	for_each_node(node)
+		free_mem_cgroup_per_zone_info(memcg, node);
+
+	if (sizeof(struct mem_cgroup) < PAGE_SIZE)
+		kfree(memcg);
+	else
+		vfree(memcg);
 }
-static void vfree_rcu(struct rcu_head *rcu_head)
+static void free_rcu(struct rcu_head *rcu_head)
 {
 	struct mem_cgroup *memcg;
 
 	memcg = container_of(rcu_head, struct mem_cgroup, rcu_freeing);
-	INIT_WORK(&memcg->work_freeing, vfree_work);
+	INIT_WORK(&memcg->work_freeing, free_work);
 	schedule_work(&memcg->work_freeing);
 }
 
@@ -4865,19 +5447,11 @@ static void vfree_rcu(struct rcu_head *rcu_head)
 
 static void __mem_cgroup_free(struct mem_cgroup *memcg)
 {
-	int node;
-
 	mem_cgroup_remove_from_trees(memcg);
 	free_css_id(&mem_cgroup_subsys, &memcg->css);
 
-	for_each_node(node)
-		free_mem_cgroup_per_zone_info(memcg, node);
-
 	free_percpu(memcg->stat);
-	if (sizeof(struct mem_cgroup) < PAGE_SIZE)
-		kfree_rcu(memcg, rcu_freeing);
-	else
-		call_rcu(&memcg->rcu_freeing, vfree_rcu);
+	call_rcu(&memcg->rcu_freeing, free_rcu);
 }
 
 static void mem_cgroup_get(struct mem_cgroup *memcg)
@@ -4993,9 +5567,14 @@ mem_cgroup_create(struct cgroup *cont)
 		memcg->oom_kill_disable = parent->oom_kill_disable;
 	}
 
+	error = memcg_propagate_kmem(memcg, parent);
+	if (error)
+		goto free_out;
+
 	if (parent && parent->use_hierarchy) {
 		res_counter_init(&memcg->res, &parent->res);
 		res_counter_init(&memcg->memsw, &parent->memsw);
+		res_counter_init(&memcg->kmem, &parent->kmem);
 		/*
 		 * We increment refcnt of the parent to ensure that we can
 		 * safely access it on res_counter_charge/uncharge.
@@ -5006,6 +5585,7 @@ mem_cgroup_create(struct cgroup *cont)
 	} else {
 		res_counter_init(&memcg->res, NULL);
 		res_counter_init(&memcg->memsw, NULL);
+		res_counter_init(&memcg->kmem, NULL);
 	}
 	memcg->last_scanned_node = MAX_NUMNODES;
 	INIT_LIST_HEAD(&memcg->oom_notify);
@@ -5034,6 +5614,7 @@ static void mem_cgroup_destroy(struct cgroup *cont)
 	struct mem_cgroup *memcg = mem_cgroup_from_cont(cont);
 
 	kmem_cgroup_destroy(cont);
+	memcg_destroy_kmem_caches(memcg);
 
 	mem_cgroup_put(memcg);
 }
@@ -5200,17 +5781,19 @@ static struct page *mc_handle_file_pte(struct vm_area_struct *vma,
 		pgoff = pte_to_pgoff(ptent);
 
 	/* page is moved even if it's not RSS of this task(page-faulted). */
-	page = find_get_page(mapping, pgoff);
-
-#ifdef CONFIG_SWAP
-	/* shmem/tmpfs may report page out on swap: account for that too. */
+	page = find_get_entry(mapping, pgoff);
 	if (radix_tree_exceptional_entry(page)) {
-		swp_entry_t swap = radix_to_swp_entry(page);
-		if (do_swap_account)
-			*entry = swap;
-		page = find_get_page(&swapper_space, swap.val);
-	}
+#ifdef CONFIG_SWAP
+		/* shmem/tmpfs may report page out on swap: account for that too. */
+		if (shmem_mapping(mapping)) {
+			swp_entry_t swap = radix_to_swp_entry(page);
+			if (do_swap_account)
+				*entry = swap;
+			page = find_get_page(&swapper_space, swap.val);
+		} else
 #endif
+			page = NULL;
+	}
 	return page;
 }
 
@@ -90,6 +90,7 @@
 #include <linux/syscalls.h>
 #include <linux/ctype.h>
 #include <linux/mm_inline.h>
+#include <linux/mmu_notifier.h>
 
 #include <asm/tlbflush.h>
 #include <asm/uaccess.h>
@@ -114,7 +115,7 @@ enum zone_type policy_zone = 0;
 static struct mempolicy default_policy = {
 	.refcnt = ATOMIC_INIT(1), /* never free it */
 	.mode = MPOL_PREFERRED,
-	.flags = MPOL_F_LOCAL,
+	.flags = MPOL_F_LOCAL | MPOL_F_MOF,
 };
 
 static const struct mempolicy_operations {
@@ -561,6 +562,30 @@ static inline int check_pgd_range(struct vm_area_struct *vma,
 	return 0;
 }
 
+#ifdef CONFIG_NUMA_BALANCING
+/*
+ * Make the ptes of a range inaccessible.  The next access to each page
+ * takes a NUMA hinting fault, see do_numa_page(), which restores the
+ * pte and may migrate the page closer to the faulting CPU.
+ *
+ * Returns the number of ptes that were changed.
+ */
+unsigned long change_prot_numa(struct vm_area_struct *vma,
+			unsigned long addr, unsigned long end)
+{
+	unsigned long nr_updated;
+
+	mmu_notifier_invalidate_range_start(vma->vm_mm, addr, end);
+	nr_updated = change_protection(vma, addr, end, vma_prot_none(vma),
+				       0, 1);
+	mmu_notifier_invalidate_range_end(vma->vm_mm, addr, end);
+	if (nr_updated)
+		count_vm_events(NUMA_PTE_UPDATES, nr_updated);
+
+	return nr_updated;
+}
+#endif /* CONFIG_NUMA_BALANCING */
+
 /*
  * Check if all pages in a range are on a set of nodes.
  * If pagelist != NULL then isolate pages from the LRU and
@@ -2032,6 +2057,84 @@ bool __mpol_equal(struct mempolicy *a, struct mempolicy *b)
 	}
 }
 
+/**
+ * mpol_misplaced - check whether current page node is valid in policy
+ *
+ * @page: page to be checked
+ * @vma: vm area where page mapped
+ * @addr: virtual address where page mapped
+ *
+ * Lookup current policy node id for vma,addr and "compare to" page's
+ * node id.  Only policies that ask for migrate on fault, which so far
+ * is the default local policy alone, are considered.
+ *
+ * Returns:
+ *	-1	- not misplaced, page is in the right node
+ *	node	- node id where the page should be
+ *
+ * Policy determination "mimics" alloc_page_vma().
+ * Called from fault path where we know the vma and faulting address.
+ */
+int mpol_misplaced(struct page *page, struct vm_area_struct *vma,
+		   unsigned long addr)
+{
+	struct mempolicy *pol;
+	struct zone *zone;
+	int curnid = page_to_nid(page);
+	unsigned long pgoff;
+	int polnid = -1;
+	int ret = -1;
+
+	BUG_ON(!vma);
+
+	pol = get_vma_policy(current, vma, addr);
+	if (!(pol->flags & MPOL_F_MOF))
+		goto out;
+
+	switch (pol->mode) {
+	case MPOL_INTERLEAVE:
+		BUG_ON(addr >= vma->vm_end);
+		BUG_ON(addr < vma->vm_start);
+
+		pgoff = vma->vm_pgoff;
+		pgoff += (addr - vma->vm_start) >> PAGE_SHIFT;
+		polnid = offset_il_node(pol, vma, pgoff);
+		break;
+
+	case MPOL_PREFERRED:
+		if (pol->flags & MPOL_F_LOCAL)
+			polnid = numa_node_id();
+		else
+			polnid = pol->v.preferred_node;
+		break;
+
+	case MPOL_BIND:
+		/*
+		 * allows binding to multiple nodes.
+		 * use current page if in policy nodemask,
+		 * else select nearest allowed node, if any.
+		 * If no allowed nodes, use current [!misplaced].
+		 */
+		if (node_isset(curnid, pol->v.nodes))
+			goto out;
+		(void)first_zones_zonelist(
+				node_zonelist(numa_node_id(), GFP_HIGHUSER),
+				gfp_zone(GFP_HIGHUSER),
+				&pol->v.nodes, &zone);
+		polnid = zone ? zone_to_nid(zone) : curnid;
+		break;
+
+	default:
+		BUG();
+	}
+	if (curnid != polnid)
+		ret = polnid;
+out:
+	mpol_cond_put(pol);
+
+	return ret;
+}
+
 /*
  * Shared memory backing store policy support.
  *
@@ -2280,6 +2383,52 @@ void mpol_free_shared_policy(struct shared_policy *p)
 	spin_unlock(&p->lock);
 }
 
+#ifdef CONFIG_NUMA_BALANCING
+static bool __initdata numabalancing_override;
+
+static void __init check_numabalancing_enable(void)
+{
+	if (numabalancing_override)
+		return;
+
+	sysctl_numa_balancing = 0;
+	if (IS_ENABLED(CONFIG_NUMA_BALANCING_DEFAULT_ENABLED) &&
+	    num_online_nodes() > 1) {
+		printk(KERN_INFO "Enabling automatic NUMA balancing. "
+		       "Configure with numa_balancing= or the "
+		       "kernel.numa_balancing sysctl\n");
+		sysctl_numa_balancing = 1;
+	}
+}
+
+static int __init setup_numabalancing(char *str)
+{
+	int ret = 0;
+
+	if (!str)
+		goto out;
+
+	if (!strcmp(str, "enable")) {
+		sysctl_numa_balancing = 1;
+		ret = 1;
+	} else if (!strcmp(str, "disable")) {
+		sysctl_numa_balancing = 0;
+		ret = 1;
+	}
+	numabalancing_override = ret;
+out:
+	if (!ret)
+		printk(KERN_WARNING "Unable to parse numa_balancing=\n");
+
+	return ret;
+}
+__setup("numa_balancing=", setup_numabalancing);
+#else
+static inline void __init check_numabalancing_enable(void)
+{
+}
+#endif /* CONFIG_NUMA_BALANCING */
+
 /* assumes fs == KERNEL_DS */
 void __init numa_policy_init(void)
 {
@@ -2321,6 +2470,8 @@ void __init numa_policy_init(void)
 
 	if (do_set_mempolicy(MPOL_INTERLEAVE, 0, &interleave_nodes))
 		printk("numa_policy_init: interleaving failed\n");
+
+	check_numabalancing_enable();
 }
 
 /* Reset policy of current process to default */
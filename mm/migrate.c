@@ -1426,3 +1426,127 @@ int migrate_vmas(struct mm_struct *mm, const nodemask_t *to,
  	return err;
 }
 #endif
+
+#ifdef CONFIG_NUMA_BALANCING
+/*
+ * Misplaced pages are only migrated to a node that has free memory to
+ * spare: taking it below the high watermark would just wake kswapd to
+ * push out other pages.
+ */
+static bool migrate_balanced_pgdat(struct pglist_data *pgdat,
+				   unsigned long nr_migrate_pages)
+{
+	int z;
+
+	for (z = pgdat->nr_zones - 1; z >= 0; z--) {
+		struct zone *zone = pgdat->node_zones + z;
+
+		if (!populated_zone(zone))
+			continue;
+
+		if (zone->all_unreclaimable)
+			continue;
+
+		if (!zone_watermark_ok(zone, 0,
+				       high_wmark_pages(zone) +
+				       nr_migrate_pages,
+				       0, 0))
+			continue;
+		return true;
+	}
+	return false;
+}
+
+static struct page *alloc_misplaced_dst_page(struct page *page,
+					   unsigned long data,
+					   int **result)
+{
+	int nid = (int) data;
+
+	return alloc_pages_exact_node(nid,
+				      (GFP_HIGHUSER_MOVABLE | GFP_THISNODE |
+				       __GFP_NOMEMALLOC | __GFP_NORETRY |
+				       __GFP_NOWARN) & ~GFP_IOFS, 0);
+}
+
+/*
+ * Do not migrate more than ratelimit_pages to a node within one
+ * migrate_interval_millisecs window, 1280M per second by default.
+ * Optimal placement is no good if the memory bus is saturated and
+ * all the time is being spent migrating!
+ */
+static unsigned int migrate_interval_millisecs __read_mostly = 100;
+static unsigned int ratelimit_pages __read_mostly = 128 << (20 - PAGE_SHIFT);
+
+static bool numamigrate_update_ratelimit(pg_data_t *pgdat,
+					 unsigned long nr_pages)
+{
+	bool rate_limited = false;
+
+	spin_lock(&pgdat->numabalancing_migrate_lock);
+	if (time_after(jiffies, pgdat->numabalancing_migrate_next_window)) {
+		pgdat->numabalancing_migrate_nr_pages = 0;
+		pgdat->numabalancing_migrate_next_window = jiffies +
+			msecs_to_jiffies(migrate_interval_millisecs);
+	}
+	if (pgdat->numabalancing_migrate_nr_pages > ratelimit_pages)
+		rate_limited = true;
+	else
+		pgdat->numabalancing_migrate_nr_pages += nr_pages;
+	spin_unlock(&pgdat->numabalancing_migrate_lock);
+
+	return rate_limited;
+}
+
+/**
+ * migrate_misplaced_page - move a page to the node a hinting fault wants
+ * @page: page to migrate, with a reference the caller hands over
+ * @node: destination node
+ *
+ * Called from the NUMA hinting fault path with mmap_sem held for read,
+ * but without the page table lock.  The reference on @page is always
+ * dropped.
+ *
+ * Returns 1 if the page was migrated, 0 otherwise.
+ */
+int migrate_misplaced_page(struct page *page, int node)
+{
+	pg_data_t *pgdat = NODE_DATA(node);
+	int nr_remaining;
+	LIST_HEAD(migratepages);
+
+	/*
+	 * Don't migrate pages that are mapped in multiple processes:
+	 * whichever of them faulted last would pull the page around.
+	 */
+	if (page_mapcount(page) != 1)
+		goto out_put;
+
+	if (numamigrate_update_ratelimit(pgdat, 1))
+		goto out_put;
+
+	if (!migrate_balanced_pgdat(pgdat, 1))
+		goto out_put;
+
+	if (isolate_lru_page(page))
+		goto out_put;
+
+	/* The isolation holds its own reference from here on */
+	put_page(page);
+	inc_zone_page_state(page, NR_ISOLATED_ANON + page_is_file_cache(page));
+
+	list_add(&page->lru, &migratepages);
+	nr_remaining = migrate_pages(&migratepages, alloc_misplaced_dst_page,
+				     node, false, MIGRATE_ASYNC);
+	if (nr_remaining) {
+		putback_lru_pages(&migratepages);
+		return 0;
+	}
+	count_vm_event(NUMA_PAGE_MIGRATE);
+	return 1;
+
+out_put:
+	put_page(page);
+	return 0;
+}
+#endif /* CONFIG_NUMA_BALANCING */
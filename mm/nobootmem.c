@@ -108,16 +108,25 @@ static void __init __free_pages_memory(unsigned long start, unsigned long end)
 unsigned long __init free_low_memory_core_early(int nodeid)
 {
 	unsigned long count = 0;
+	struct memblock_region *reg;
 	phys_addr_t start, end;
+	int nid;
 	u64 i;
 
+	/* reserved pages must be valid even where the memmap is deferred */
+	for_each_memblock(reserved, reg)
+		deferred_init_reserved(reg->base, reg->base + reg->size);
+
 	/* free reserved array temporarily so that it's treated as free area */
 	memblock_free_reserved_regions();
 
-	for_each_free_mem_range(i, MAX_NUMNODES, &start, &end, NULL) {
+	for_each_free_mem_range(i, MAX_NUMNODES, &start, &end, &nid) {
 		unsigned long start_pfn = PFN_UP(start);
 		unsigned long end_pfn = min_t(unsigned long,
 					      PFN_DOWN(end), max_low_pfn);
+
+		/* the deferred part of the node is freed by pgdatinit */
+		end_pfn = min(end_pfn, first_deferred_pfn(nid));
 		if (start_pfn < end_pfn) {
 			__free_pages_memory(start_pfn, end_pfn);
 			count += end_pfn - start_pfn;
@@ -60,6 +60,7 @@
 #include <linux/migrate.h>
 #include <linux/page-debug-flags.h>
 #include <linux/low-mem-notify.h>
+#include <linux/kthread.h>
 
 #include <asm/tlbflush.h>
 #include <asm/div64.h>
@@ -620,6 +621,22 @@ static inline int free_pages_check(struct page *page)
 	return 0;
 }
 
+/*
+ * Take zone->lock, which the caller must already have disabled interrupts
+ * for, and account the acquisition in the zone statistics.  A failed trylock
+ * is counted as contention: NR_ZONE_LOCK_CONTENDED against
+ * NR_ZONE_LOCK_ACQUIRED in /proc/zoneinfo shows how hard the zone is being
+ * hammered and whether the pcp lists are sized well for the workload.
+ */
+static inline void zone_lock(struct zone *zone)
+{
+	if (!spin_trylock(&zone->lock)) {
+		__inc_zone_state(zone, NR_ZONE_LOCK_CONTENDED);
+		spin_lock(&zone->lock);
+	}
+	__inc_zone_state(zone, NR_ZONE_LOCK_ACQUIRED);
+}
+
 /*
  * Frees a number of pages from the PCP lists
  * Assumes all pages on list are in same zone, and of same order.
@@ -638,7 +655,7 @@ static void free_pcppages_bulk(struct zone *zone, int count,
 	int batch_free = 0;
 	int to_free = count;
 
-	spin_lock(&zone->lock);
+	zone_lock(zone);
 	zone->all_unreclaimable = 0;
 	zone->pages_scanned = 0;
 
@@ -680,7 +697,7 @@ static void free_pcppages_bulk(struct zone *zone, int count,
 static void free_one_page(struct zone *zone, struct page *page, int order,
 				int migratetype)
 {
-	spin_lock(&zone->lock);
+	zone_lock(zone);
 	zone->all_unreclaimable = 0;
 	zone->pages_scanned = 0;
 
@@ -1108,7 +1125,7 @@ static int rmqueue_bulk(struct zone *zone, unsigned int order,
 {
 	int mt = migratetype, i;
 
-	spin_lock(&zone->lock);
+	zone_lock(zone);
 	for (i = 0; i < count; ++i) {
 		struct page *page = __rmqueue(zone, order, migratetype);
 		if (unlikely(page == NULL))
@@ -1282,25 +1299,64 @@ void mark_free_pages(struct zone *zone)
 #endif /* CONFIG_PM */
 
 /*
- * Free a 0-order page
- * cold == 1 ? free a cold page : free a hot page
+ * The pcp lists adapt to the workload.  A cpu that keeps refilling its lists
+ * takes progressively larger batches from the buddy allocator and raises its
+ * high mark, so a burst of allocations needs zone->lock less often.  A cpu
+ * that keeps freeing drains progressively larger batches and lowers its high
+ * mark back towards high_min, so that pages are not left stranded on its
+ * lists once the burst is over.  Each direction halves the other's factor.
+ *
+ * Adaptation is disabled when high_min == high_max, which is the case for
+ * the boot pagesets and when percpu_pagelist_fraction is set.
  */
-void free_hot_cold_page(struct page *page, int cold)
+#define PCP_FACTOR_MAX	3
+
+static int nr_pcp_alloc(struct per_cpu_pages *pcp)
+{
+	int batch;
+
+	if (pcp->high_max <= pcp->high_min)
+		return pcp->batch;
+
+	batch = pcp->batch << pcp->alloc_factor;
+	if (batch <= pcp->high / 2) {
+		if (pcp->alloc_factor < PCP_FACTOR_MAX)
+			pcp->alloc_factor++;
+	} else {
+		batch = max(pcp->high / 2, pcp->batch);
+	}
+	pcp->high = min(pcp->high + pcp->batch, pcp->high_max);
+	pcp->free_factor >>= 1;
+
+	return batch;
+}
+
+static int nr_pcp_free(struct per_cpu_pages *pcp)
+{
+	int batch;
+
+	if (pcp->high_max <= pcp->high_min)
+		return min(pcp->batch, pcp->count);
+
+	batch = min(pcp->batch << pcp->free_factor, pcp->count);
+	if (pcp->free_factor < PCP_FACTOR_MAX)
+		pcp->free_factor++;
+	pcp->high = max(pcp->high - pcp->batch, pcp->high_min);
+	pcp->alloc_factor >>= 1;
+
+	return batch;
+}
+
+/*
+ * Put a page prepared by free_pages_prepare(), with its migratetype stashed
+ * in page_private, on the local pcp list.  Interrupts must be disabled.
+ */
+static void __free_hot_cold_page(struct page *page, int cold)
 {
 	struct zone *zone = page_zone(page);
 	struct per_cpu_pages *pcp;
-	unsigned long flags;
-	int migratetype;
-	int wasMlocked = __TestClearPageMlocked(page);
+	int migratetype = page_private(page);
 
-	if (!free_pages_prepare(page, 0))
-		return;
-
-	migratetype = get_pageblock_migratetype(page);
-	set_page_private(page, migratetype);
-	local_irq_save(flags);
-	if (unlikely(wasMlocked))
-		free_page_mlock(page);
 	__count_vm_event(PGFREE);
 
 	/*
@@ -1313,7 +1369,7 @@ void free_hot_cold_page(struct page *page, int cold)
 	if (migratetype >= MIGRATE_PCPTYPES) {
 		if (unlikely(migratetype == MIGRATE_ISOLATE)) {
 			free_one_page(zone, page, 0, migratetype);
-			goto out;
+			return;
 		}
 		migratetype = MIGRATE_MOVABLE;
 	}
@@ -1325,26 +1381,96 @@ void free_hot_cold_page(struct page *page, int cold)
 		list_add(&page->lru, &pcp->lists[migratetype]);
 	pcp->count++;
 	if (pcp->count >= pcp->high) {
-		free_pcppages_bulk(zone, pcp->batch, pcp);
-		pcp->count -= pcp->batch;
+		int batch = nr_pcp_free(pcp);
+
+		free_pcppages_bulk(zone, batch, pcp);
+		pcp->count -= batch;
 	}
+}
 
-out:
+/*
+ * Free a 0-order page
+ * cold == 1 ? free a cold page : free a hot page
+ */
+void free_hot_cold_page(struct page *page, int cold)
+{
+	unsigned long flags;
+	int wasMlocked = __TestClearPageMlocked(page);
+
+	if (!free_pages_prepare(page, 0))
+		return;
+
+	set_page_private(page, get_pageblock_migratetype(page));
+	local_irq_save(flags);
+	if (unlikely(wasMlocked))
+		free_page_mlock(page);
+	__free_hot_cold_page(page, cold);
 	local_irq_restore(flags);
 }
 
 /*
  * Free a list of 0-order pages
+ *
+ * The pages are prepared with interrupts enabled and then handed to the pcp
+ * lists in batches of SWAP_CLUSTER_MAX, rather than disabling interrupts
+ * once per page.
  */
 void free_hot_cold_page_list(struct list_head *list, int cold)
 {
 	struct page *page, *next;
+	unsigned long flags;
+	int batch = 0;
 
+	list_for_each_entry_safe(page, next, list, lru) {
+		/* Mlocked pages need their accounting fixed up one by one */
+		if (unlikely(PageMlocked(page))) {
+			list_del(&page->lru);
+			trace_mm_page_free_batched(page, cold);
+			free_hot_cold_page(page, cold);
+			continue;
+		}
+		if (!free_pages_prepare(page, 0)) {
+			list_del(&page->lru);
+			continue;
+		}
+		set_page_private(page, get_pageblock_migratetype(page));
+	}
+
+	local_irq_save(flags);
 	list_for_each_entry_safe(page, next, list, lru) {
 		trace_mm_page_free_batched(page, cold);
-		free_hot_cold_page(page, cold);
+		__free_hot_cold_page(page, cold);
+
+		/* Don't keep interrupts disabled across a huge list */
+		if (++batch == SWAP_CLUSTER_MAX) {
+			local_irq_restore(flags);
+			batch = 0;
+			local_irq_save(flags);
+		}
+	}
+	local_irq_restore(flags);
+}
+
+/**
+ * free_pages_bulk - drop a reference on a list of 0-order pages
+ * @list: pages linked through page->lru
+ *
+ * The counterpart of alloc_pages_bulk().  Each page whose count drops to
+ * zero is freed through the batched pcp path; @list is empty on return.
+ */
+void free_pages_bulk(struct list_head *list)
+{
+	struct page *page, *next;
+	LIST_HEAD(pages_to_free);
+
+	list_for_each_entry_safe(page, next, list, lru) {
+		list_del(&page->lru);
+		if (put_page_testzero(page))
+			list_add_tail(&page->lru, &pages_to_free);
 	}
+	free_hot_cold_page_list(&pages_to_free, 0);
 }
+EXPORT_SYMBOL(free_pages_bulk);
 
 /*
  * split_page takes a non-compound higher-order page, and splits it into
@@ -1447,7 +1573,7 @@ again:
 		list = &pcp->lists[migratetype];
 		if (list_empty(list)) {
 			pcp->count += rmqueue_bulk(zone, 0,
-					pcp->batch, list,
+					nr_pcp_alloc(pcp), list,
 					migratetype, cold);
 			if (unlikely(list_empty(list)))
 				goto failed;
@@ -1474,7 +1600,8 @@ again:
 			 */
 			WARN_ON_ONCE(order > 1);
 		}
-		spin_lock_irqsave(&zone->lock, flags);
+		local_irq_save(flags);
+		zone_lock(zone);
 		page = __rmqueue(zone, order, migratetype);
 		spin_unlock(&zone->lock);
 		if (!page)
@@ -2229,8 +2356,10 @@ void wake_all_kswapd(unsigned int order, struct zonelist *zonelist,
 	struct zoneref *z;
 	struct zone *zone;
 
-	for_each_zone_zonelist(zone, z, zonelist, high_zoneidx)
+	for_each_zone_zonelist(zone, z, zonelist, high_zoneidx) {
 		wakeup_kswapd(zone, order, classzone_idx);
+		wakeup_kcompactd(zone, order);
+	}
 }
 
 static inline int
@@ -2521,6 +2650,8 @@ retry_cpuset:
 		page = __alloc_pages_slowpath(gfp_mask, order,
 				zonelist, high_zoneidx, nodemask,
 				preferred_zone, migratetype);
+	else if (order)
+		kcompactd_account_alloc(page, order);
 
 	trace_mm_page_alloc(page, order, gfp_mask, migratetype);
 
@@ -2538,6 +2669,111 @@ out:
 }
 EXPORT_SYMBOL(__alloc_pages_nodemask);
 
+/**
+ * alloc_pages_bulk - allocate a number of 0-order pages onto a list
+ * @gfp_mask: GFP flags for the allocation
+ * @nr_pages: number of pages wanted
+ * @list: list the pages are added to, linked through page->lru
+ *
+ * Pages come from the local pcp list of the first zone in the local node's
+ * zonelist that is above its low watermark with room for @nr_pages to
+ * spare.  The pcp list is refilled from the buddy lists as needed, each
+ * refill under a single hold of zone->lock, and interrupts are disabled
+ * once for the whole batch rather than once per page.  This is a fast path
+ * only: it does not reclaim or compact, and memory policies are ignored.
+ * If it cannot provide any page a single page is allocated the usual way.
+ *
+ * Returns the number of pages added to @list, which may be fewer than
+ * @nr_pages.  Free them with free_pages_bulk() or one at a time.
+ */
+unsigned long alloc_pages_bulk(gfp_t gfp_mask, unsigned long nr_pages,
+			       struct list_head *list)
+{
+	enum zone_type high_zoneidx = gfp_zone(gfp_mask);
+	int migratetype = allocflags_to_migratetype(gfp_mask);
+	int cold = !!(gfp_mask & __GFP_COLD);
+	struct zonelist *zonelist = node_zonelist(numa_node_id(), gfp_mask);
+	struct zone *preferred_zone = NULL, *zone;
+	unsigned int cpuset_mems_cookie;
+	struct per_cpu_pages *pcp;
+	struct list_head *pcp_list;
+	struct page *page, *next;
+	struct zoneref *z;
+	unsigned long flags, allocated = 0;
+	LIST_HEAD(pages);
+
+	gfp_mask &= gfp_allowed_mask;
+
+	might_sleep_if(gfp_mask & __GFP_WAIT);
+
+	if (!nr_pages)
+		return 0;
+	if (nr_pages == 1 || should_fail_alloc_page(gfp_mask, 0))
+		goto single;
+
+	cpuset_mems_cookie = get_mems_allowed();
+	for_each_zone_zonelist_nodemask(zone, z, zonelist, high_zoneidx,
+					&cpuset_current_mems_allowed) {
+		if (!preferred_zone)
+			preferred_zone = zone;
+		if (!cpuset_zone_allowed_softwall(zone,
+						  gfp_mask | __GFP_HARDWALL))
+			continue;
+		if (zone_watermark_ok(zone, 0, low_wmark_pages(zone) + nr_pages,
+				      zone_idx(preferred_zone), 0))
+			break;
+	}
+	if (!zone) {
+		put_mems_allowed(cpuset_mems_cookie);
+		goto single;
+	}
+
+	local_irq_save(flags);
+	pcp = &this_cpu_ptr(zone->pageset)->pcp;
+	pcp_list = &pcp->lists[migratetype];
+	while (allocated < nr_pages) {
+		if (list_empty(pcp_list)) {
+			pcp->count += rmqueue_bulk(zone, 0, nr_pcp_alloc(pcp),
+						   pcp_list, migratetype, cold);
+			if (unlikely(list_empty(pcp_list)))
+				break;
+		}
+
+		if (cold)
+			page = list_entry(pcp_list->prev, struct page, lru);
+		else
+			page = list_entry(pcp_list->next, struct page, lru);
+		list_move_tail(&page->lru, &pages);
+		pcp->count--;
+		zone_statistics(preferred_zone, zone, gfp_mask);
+		allocated++;
+	}
+	__count_zone_vm_events(PGALLOC, zone, allocated);
+	local_irq_restore(flags);
+	put_mems_allowed(cpuset_mems_cookie);
+
+	list_for_each_entry_safe(page, next, &pages, lru) {
+		list_del(&page->lru);
+		/* A bad page is leaked, as in buffered_rmqueue() */
+		if (prep_new_page(page, 0, gfp_mask)) {
+			allocated--;
+			continue;
+		}
+		trace_mm_page_alloc(page, 0, gfp_mask, migratetype);
+		list_add_tail(&page->lru, list);
+	}
+	if (allocated)
+		return allocated;
+
+single:
+	page = alloc_pages(gfp_mask, 0);
+	if (!page)
+		return 0;
+	list_add_tail(&page->lru, list);
+	return 1;
+}
+EXPORT_SYMBOL(alloc_pages_bulk);
+
 /*
  * Common helper functions.
  */
@@ -3680,9 +3916,56 @@ static void setup_zone_migrate_reserve(struct zone *zone)
  * up by free_all_bootmem() once the early boot process is
  * done. Non-atomic initialization, single-pass.
  */
+static void __meminit __init_single_page(struct page *page, unsigned long pfn,
+					 unsigned long zone, int nid)
+{
+	set_page_links(page, zone, nid, pfn);
+	mminit_verify_page_links(page, zone, nid, pfn);
+	init_page_count(page);
+	reset_page_mapcount(page);
+	SetPageReserved(page);
+	INIT_LIST_HEAD(&page->lru);
+#ifdef WANT_PAGE_VIRTUAL
+	/* The shift won't overflow because ZONE_NORMAL is below 4G. */
+	if (!is_highmem_idx(zone))
+		set_page_address(page, __va(pfn << PAGE_SHIFT));
+#endif
+}
+
+#ifdef CONFIG_DEFERRED_STRUCT_PAGE_INIT
+/*
+ * Only this much of a node's highest zone is initialised during early boot,
+ * which is plenty to get to the initcalls.  Lower zones are always done in
+ * full so that address-constrained allocations work.  The rest of the node
+ * is left to its pgdatinit thread, see page_alloc_init_late().
+ */
+#define DEFERRED_INIT_PAGES	(2UL << (30 - PAGE_SHIFT))
+
+static inline bool __meminit update_defer_init(pg_data_t *pgdat,
+				unsigned long pfn, unsigned long zone_start_pfn,
+				unsigned long zone_end_pfn)
+{
+	if (zone_end_pfn < pgdat->node_start_pfn + pgdat->node_spanned_pages)
+		return true;
+	if (pfn - zone_start_pfn < DEFERRED_INIT_PAGES ||
+	    (pfn & (PAGES_PER_SECTION - 1)))
+		return true;
+	pgdat->first_deferred_pfn = pfn;
+	return false;
+}
+#else
+static inline bool update_defer_init(pg_data_t *pgdat,
+				unsigned long pfn, unsigned long zone_start_pfn,
+				unsigned long zone_end_pfn)
+{
+	return true;
+}
+#endif
+
 void __meminit memmap_init_zone(unsigned long size, int nid, unsigned long zone,
 		unsigned long start_pfn, enum memmap_context context)
 {
+	pg_data_t *pgdat = NODE_DATA(nid);
 	struct page *page;
 	unsigned long end_pfn = start_pfn + size;
 	unsigned long pfn;
@@ -3691,7 +3974,7 @@ void __meminit memmap_init_zone(unsigned long size, int nid, unsigned long zone,
 	if (highest_memmap_pfn < end_pfn - 1)
 		highest_memmap_pfn = end_pfn - 1;
 
-	z = &NODE_DATA(nid)->node_zones[zone];
+	z = &pgdat->node_zones[zone];
 	for (pfn = start_pfn; pfn < end_pfn; pfn++) {
 		/*
 		 * There can be holes in boot-time mem_map[]s
@@ -3699,17 +3982,15 @@ void __meminit memmap_init_zone(unsigned long size, int nid, unsigned long zone,
 		 * exist on hotplugged memory.
 		 */
 		if (context == MEMMAP_EARLY) {
+			if (!update_defer_init(pgdat, pfn, start_pfn, end_pfn))
+				break;
 			if (!early_pfn_valid(pfn))
 				continue;
 			if (!early_pfn_in_nid(pfn, nid))
 				continue;
 		}
 		page = pfn_to_page(pfn);
-		set_page_links(page, zone, nid, pfn);
-		mminit_verify_page_links(page, zone, nid, pfn);
-		init_page_count(page);
-		reset_page_mapcount(page);
-		SetPageReserved(page);
+		__init_single_page(page, pfn, zone, nid);
 		/*
 		 * Mark the block movable so that blocks are reserved for
 		 * movable at startup. This will force kernel allocations
@@ -3728,14 +4009,223 @@ void __meminit memmap_init_zone(unsigned long size, int nid, unsigned long zone,
 		    && (pfn < z->zone_start_pfn + z->spanned_pages)
 		    && !(pfn & (pageblock_nr_pages - 1)))
 			set_pageblock_migratetype(page, MIGRATE_MOVABLE);
+	}
+}
 
-		INIT_LIST_HEAD(&page->lru);
-#ifdef WANT_PAGE_VIRTUAL
-		/* The shift won't overflow because ZONE_NORMAL is below 4G. */
-		if (!is_highmem_idx(zone))
-			set_page_address(page, __va(pfn << PAGE_SHIFT));
-#endif
+#ifdef CONFIG_DEFERRED_STRUCT_PAGE_INIT
+static atomic_t pgdat_init_n_undone __initdata;
+static __initdata DECLARE_COMPLETION(pgdat_init_all_done_comp);
+static atomic_long_t pgdat_init_nr_pages __initdata;
+
+static void __init pgdat_init_report_one_done(void)
+{
+	if (atomic_dec_and_test(&pgdat_init_n_undone))
+		complete(&pgdat_init_all_done_comp);
+}
+
+/* The zone that memmap_init_zone() stopped in */
+static struct zone * __init deferred_zone(pg_data_t *pgdat)
+{
+	unsigned long pfn = pgdat->first_deferred_pfn;
+	int zid;
+
+	for (zid = MAX_NR_ZONES - 1; zid >= 0; zid--) {
+		struct zone *zone = &pgdat->node_zones[zid];
+
+		if (zone->spanned_pages && pfn >= zone->zone_start_pfn &&
+		    pfn < zone->zone_start_pfn + zone->spanned_pages)
+			return zone;
+	}
+	BUG();
+}
+
+/*
+ * Called for each memblock-reserved range before the free memory is handed
+ * to the buddy allocator.  Reserved pages in the deferred part of a node get
+ * their struct page initialised now, so that they are valid from the start
+ * and so that pgdatinit, seeing page->flags set, leaves them alone.
+ */
+void __init deferred_init_reserved(phys_addr_t start, phys_addr_t end)
+{
+	unsigned long start_pfn = PFN_DOWN(start);
+	unsigned long end_pfn = PFN_UP(end);
+	unsigned long spfn, epfn, pfn;
+	int i, nid;
+
+	for_each_mem_pfn_range(i, MAX_NUMNODES, &spfn, &epfn, &nid) {
+		unsigned long first_pfn = first_deferred_pfn(nid);
+		struct zone *zone;
+
+		spfn = max3(spfn, start_pfn, first_pfn);
+		epfn = min(epfn, end_pfn);
+		if (spfn >= epfn)
+			continue;
+
+		zone = deferred_zone(NODE_DATA(nid));
+		for (pfn = spfn; pfn < epfn; pfn++)
+			__init_single_page(pfn_to_page(pfn), pfn,
+					   zone_idx(zone), nid);
+	}
+}
+
+static void __init deferred_free_range(struct page *page, unsigned long pfn,
+				       unsigned long nr_pages)
+{
+	if (!nr_pages)
+		return;
+
+	if (nr_pages == MAX_ORDER_NR_PAGES &&
+	    !(pfn & (MAX_ORDER_NR_PAGES - 1))) {
+		__free_pages_bootmem(page, MAX_ORDER - 1);
+		return;
+	}
+
+	for (; nr_pages; nr_pages--, page++)
+		__free_pages_bootmem(page, 0);
+}
+
+/*
+ * Initialise the struct pages of [pfn, end_pfn) in @zone that were skipped by
+ * memmap_init_zone() and, if @free, hand them to the buddy allocator a
+ * MAX_ORDER block at a time.  Returns the number of pages freed.
+ */
+static unsigned long __init deferred_init_pages(struct zone *zone,
+		unsigned long pfn, unsigned long end_pfn, bool free)
+{
+	int nid = zone_to_nid(zone);
+	unsigned long zid = zone_idx(zone);
+	struct page *free_base = NULL;
+	unsigned long free_base_pfn = 0;
+	unsigned long nr_free = 0;
+	unsigned long nr_pages = 0;
+
+	for (; pfn < end_pfn; pfn++) {
+		struct page *page;
+
+		if (!(pfn & (MAX_ORDER_NR_PAGES - 1))) {
+			deferred_free_range(free_base, free_base_pfn, nr_free);
+			nr_pages += nr_free;
+			nr_free = 0;
+			cond_resched();
+		}
+
+		if (!early_pfn_valid(pfn) ||
+		    (!free && !early_pfn_in_nid(pfn, nid)))
+			goto flush;
+
+		/* Reserved pages were done by deferred_init_reserved() */
+		page = pfn_to_page(pfn);
+		if (page->flags) {
+			if (!(pfn & (pageblock_nr_pages - 1)))
+				set_pageblock_migratetype(page, MIGRATE_MOVABLE);
+			goto flush;
+		}
+
+		__init_single_page(page, pfn, zid, nid);
+		if (!(pfn & (pageblock_nr_pages - 1)))
+			set_pageblock_migratetype(page, MIGRATE_MOVABLE);
+		if (!free)
+			continue;
+
+		if (!nr_free) {
+			free_base = page;
+			free_base_pfn = pfn;
+		}
+		nr_free++;
+		continue;
+flush:
+		deferred_free_range(free_base, free_base_pfn, nr_free);
+		nr_pages += nr_free;
+		nr_free = 0;
+	}
+	deferred_free_range(free_base, free_base_pfn, nr_free);
+
+	return nr_pages + nr_free;
+}
+
+/* Initialise remaining memory on a node */
+static int __init deferred_init_memmap(void *data)
+{
+	pg_data_t *pgdat = data;
+	int nid = pgdat->node_id;
+	const struct cpumask *cpumask = cpumask_of_node(nid);
+	unsigned long first_init_pfn = pgdat->first_deferred_pfn;
+	unsigned long start = jiffies;
+	unsigned long nr_pages = 0;
+	unsigned long spfn, epfn, pfn, end_pfn;
+	struct zone *zone;
+	int i;
+
+	if (first_init_pfn == ULONG_MAX) {
+		pgdat_init_report_one_done();
+		return 0;
+	}
+
+	/* Bind memory initialisation thread to a local node if possible */
+	if (!cpumask_empty(cpumask))
+		set_cpus_allowed_ptr(current, cpumask);
+
+	zone = deferred_zone(pgdat);
+	end_pfn = zone->zone_start_pfn + zone->spanned_pages;
+
+	/* Free the node's memory ranges, and initialise the holes between */
+	pfn = first_init_pfn;
+	for_each_mem_pfn_range(i, nid, &spfn, &epfn, NULL) {
+		spfn = max(spfn, first_init_pfn);
+		epfn = min(epfn, end_pfn);
+		if (spfn >= epfn)
+			continue;
+
+		if (pfn < spfn)
+			deferred_init_pages(zone, pfn, spfn, false);
+		nr_pages += deferred_init_pages(zone, spfn, epfn, true);
+		pfn = epfn;
+	}
+	if (pfn < end_pfn)
+		deferred_init_pages(zone, pfn, end_pfn, false);
+
+	pgdat->first_deferred_pfn = ULONG_MAX;
+	atomic_long_add(nr_pages, &pgdat_init_nr_pages);
+
+	pr_info("node %d initialised, %lu pages in %ums\n", nid, nr_pages,
+		jiffies_to_msecs(jiffies - start));
+
+	pgdat_init_report_one_done();
+	return 0;
+}
+#endif /* CONFIG_DEFERRED_STRUCT_PAGE_INIT */
+
+/*
+ * Finish off what memmap_init_zone() deferred: one pgdatinit thread per node
+ * initialises and frees the rest of the node's memory, and we wait for all
+ * of them before the initcalls run.
+ */
+void __init page_alloc_init_late(void)
+{
+#ifdef CONFIG_DEFERRED_STRUCT_PAGE_INIT
+	unsigned long start = jiffies;
+	unsigned long nr_pages;
+	int nid;
+
+	atomic_set(&pgdat_init_n_undone, num_node_state(N_HIGH_MEMORY));
+	for_each_node_state(nid, N_HIGH_MEMORY) {
+		struct task_struct *tsk;
+
+		tsk = kthread_run(deferred_init_memmap, NODE_DATA(nid),
+				  "pgdatinit%d", nid);
+		if (IS_ERR(tsk))
+			deferred_init_memmap(NODE_DATA(nid));
 	}
+
+	/* Block until all are initialised */
+	wait_for_completion(&pgdat_init_all_done_comp);
+
+	nr_pages = atomic_long_read(&pgdat_init_nr_pages);
+	totalram_pages += nr_pages;
+	pr_info("Deferred struct page init: %luk freed in %ums\n",
+		nr_pages << (PAGE_SHIFT - 10),
+		jiffies_to_msecs(jiffies - start));
+#endif
 }
 
 static void __meminit zone_init_free_lists(struct zone *zone)
@@ -3813,6 +4303,8 @@ static void setup_pageset(struct per_cpu_pageset *p, unsigned long batch)
 	pcp->count = 0;
 	pcp->high = 6 * batch;
 	pcp->batch = max(1UL, 1 * batch);
+	pcp->high_min = pcp->high;
+	pcp->high_max = 4 * pcp->high;
 	for (migratetype = 0; migratetype < MIGRATE_PCPTYPES; migratetype++)
 		INIT_LIST_HEAD(&pcp->lists[migratetype]);
 }
@@ -3829,6 +4321,10 @@ static void setup_pagelist_highmark(struct per_cpu_pageset *p,
 
 	pcp = &p->pcp;
 	pcp->high = high;
+	pcp->high_min = high;
+	pcp->high_max = high;
+	pcp->alloc_factor = 0;
+	pcp->free_factor = 0;
 	pcp->batch = max(1UL, high/4);
 	if ((high/4) > (PAGE_SHIFT * 8))
 		pcp->batch = PAGE_SHIFT * 8;
@@ -4362,12 +4858,22 @@ static void __paginginit free_area_init_core(struct pglist_data *pgdat,
 	pgdat->nr_zones = 0;
 	init_waitqueue_head(&pgdat->kswapd_wait);
 	pgdat->kswapd_max_order = 0;
+#ifdef CONFIG_COMPACTION
+	init_waitqueue_head(&pgdat->kcompactd_wait);
+	pgdat->kcompactd_max_order = 0;
+	pgdat->kcompactd_credit_order = MAX_ORDER;
+	atomic_set(&pgdat->kcompactd_credit, 0);
+#endif
+#ifdef CONFIG_NUMA_BALANCING
+	spin_lock_init(&pgdat->numabalancing_migrate_lock);
+	pgdat->numabalancing_migrate_nr_pages = 0;
+	pgdat->numabalancing_migrate_next_window = jiffies;
+#endif
 	pgdat_page_cgroup_init(pgdat);
 
 	for (j = 0; j < MAX_NR_ZONES; j++) {
 		struct zone *zone = pgdat->node_zones + j;
 		unsigned long size, realsize, memmap_pages;
-		enum lru_list lru;
 
 		size = zone_spanned_pages_in_node(nid, j, zones_size);
 		realsize = size - zone_absent_pages_in_node(nid, j,
@@ -4412,13 +4918,11 @@ static void __paginginit free_area_init_core(struct pglist_data *pgdat,
 #endif
 		zone->name = zone_names[j];
 		spin_lock_init(&zone->lock);
-		spin_lock_init(&zone->lru_lock);
 		zone_seqlock_init(zone);
 		zone->zone_pgdat = pgdat;
 
 		zone_pcp_init(zone);
-		for_each_lru(lru)
-			INIT_LIST_HEAD(&zone->lruvec.lists[lru]);
+		lruvec_init(&zone->lruvec, zone);
 		zone->reclaim_stat.recent_rotated[0] = 0;
 		zone->reclaim_stat.recent_rotated[1] = 0;
 		zone->reclaim_stat.recent_scanned[0] = 0;
@@ -4486,6 +4990,9 @@ void __paginginit free_area_init_node(int nid, unsigned long *zones_size,
 
 	pgdat->node_id = nid;
 	pgdat->node_start_pfn = node_start_pfn;
+#ifdef CONFIG_DEFERRED_STRUCT_PAGE_INIT
+	pgdat->first_deferred_pfn = ULONG_MAX;
+#endif
 	calculate_node_totalpages(pgdat, zones_size, zholes_size);
 
 	alloc_node_mem_map(pgdat);
@@ -18,6 +18,9 @@
 #include <linux/pagevec.h>
 #include <linux/pagemap.h>
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/readahead.h>
+
 /*
  * Initialise a struct file's readahead state.  Assumes that the caller has
  * memset *ra to zero.
@@ -27,6 +30,7 @@ file_ra_state_init(struct file_ra_state *ra, struct address_space *mapping)
 {
 	ra->ra_pages = mapping->backing_dev_info->ra_pages;
 	ra->prev_pos = -1;
+	ra->prev_fault = -1;
 }
 EXPORT_SYMBOL_GPL(file_ra_state_init);
 
@@ -177,7 +181,7 @@ __do_page_cache_readahead(struct address_space *mapping, struct file *filp,
 		rcu_read_lock();
 		page = radix_tree_lookup(&mapping->page_tree, page_offset);
 		rcu_read_unlock();
-		if (page)
+		if (page && !radix_tree_exceptional_entry(page))
 			continue;
 
 		page = page_cache_alloc_readahead(mapping);
@@ -195,8 +199,10 @@ __do_page_cache_readahead(struct address_space *mapping, struct file *filp,
 	 * uptodate then the caller will launch readpage again, and
 	 * will then handle the error.
 	 */
-	if (ret)
+	if (ret) {
 		read_pages(mapping, filp, &page_pool, ret);
+		count_vm_events(FILE_RA, ret);
+	}
 	BUG_ON(!list_empty(&page_pool));
 out:
 	return ret;
@@ -255,10 +261,97 @@ unsigned long ra_submit(struct file_ra_state *ra,
 
 	actual = __do_page_cache_readahead(mapping, filp,
 					ra->start, ra->size, ra->async_size);
+	trace_mm_readahead(mapping, ra, actual);
 
 	return actual;
 }
 
+/*
+ * A stream whose reader keeps waiting on readahead I/O may grow its
+ * window up to ra_pages << RA_MAX_BOOST.
+ */
+#define RA_MAX_BOOST	3
+
+static unsigned long ra_max_pages(struct file_ra_state *ra)
+{
+	return max_sane_readahead((unsigned long)ra->ra_pages << ra->boost);
+}
+
+/*
+ * Is @offset where a stream with this window is expected to continue?
+ */
+static bool ra_stream_next(pgoff_t start, unsigned int size,
+			   unsigned int async_size, pgoff_t offset)
+{
+	return offset == start + size - async_size || offset == start + size;
+}
+
+/*
+ * Save the current window to make room for a new stream, dropping the
+ * least recently read ahead one.
+ */
+static void ra_push_stream(struct file_ra_state *ra)
+{
+	if (!ra->size)
+		return;
+	memmove(&ra->streams[1], &ra->streams[0],
+		sizeof(ra->streams) - sizeof(ra->streams[0]));
+	ra->streams[0].start = ra->start;
+	ra->streams[0].size = ra->size;
+	ra->streams[0].async_size = ra->async_size;
+}
+
+/*
+ * Look for a saved stream that expects @offset and make it the current
+ * window.  Returns false if there is none.
+ */
+static bool ra_switch_stream(struct file_ra_state *ra, pgoff_t offset)
+{
+	struct file_ra_stream found;
+	int i;
+
+	for (i = 0; i < RA_STREAMS - 1; i++) {
+		struct file_ra_stream *s = &ra->streams[i];
+
+		if (s->size && ra_stream_next(s->start, s->size,
+					      s->async_size, offset))
+			break;
+	}
+	if (i == RA_STREAMS - 1)
+		return false;
+
+	found = ra->streams[i];
+	memmove(&ra->streams[1], &ra->streams[0], i * sizeof(found));
+	ra->streams[0].start = ra->start;
+	ra->streams[0].size = ra->size;
+	ra->streams[0].async_size = ra->async_size;
+	ra->start = found.start;
+	ra->size = found.size;
+	ra->async_size = found.async_size;
+	return true;
+}
+
+/**
+ * page_cache_readahead_stall - note a reader waiting for readahead I/O
+ * @ra: file_ra_state of the reader
+ * @offset: the page the reader found not uptodate
+ *
+ * The reader caught up with asynchronous readahead that is still in
+ * flight: at the rate it consumes pages, the window is too small to
+ * hide the device latency.  Let the next window of the stream grow
+ * beyond ra_pages.
+ */
+void page_cache_readahead_stall(struct file_ra_state *ra, pgoff_t offset)
+{
+	if (!ra->ra_pages || ra->stalled)
+		return;
+	if (!ra_has_index(ra, offset) ||
+	    offset < ra->start + ra->size - ra->async_size)
+		return;
+	ra->stalled = 1;
+	count_vm_event(FILE_RA_STALL);
+}
+
 /*
  * Set the initial window size, round to next power of 2 and square
  * for small size, x 4 for medium, and x 2 for large
@@ -334,6 +427,19 @@ static unsigned long get_next_ra_size(struct file_ra_state *ra,
  *
  * The code ramps up the readahead size aggressively at first, but slow down as
  * it approaches max_readhead.
+ *
+ * Up to RA_STREAMS interleaved streams keep their own windows: starting a new
+ * stream saves the current window in ra->streams[], and an access at the
+ * expected offset of a saved stream switches back to it, so that concurrent
+ * sequential readers of one file do not reset each other's window.
+ *
+ * The maximum window adapts to how well readahead keeps up.  If the reader
+ * had to wait for pages of the asynchronous part of the window (see
+ * page_cache_readahead_stall()), the stream's next window may grow up to
+ * ra_pages << RA_MAX_BOOST.  If instead read-ahead pages were reclaimed
+ * before the reader got to them, readahead is thrashing and the maximum
+ * shrinks back.  A sequential cache miss otherwise keeps ramping up from the
+ * previous window size instead of starting over.
  */
 
 /*
@@ -349,7 +455,7 @@ static pgoff_t count_history_pages(struct address_space *mapping,
 	pgoff_t head;
 
 	rcu_read_lock();
-	head = radix_tree_prev_hole(&mapping->page_tree, offset - 1, max);
+	head = page_cache_prev_hole(mapping, offset - 1, max);
 	rcu_read_unlock();
 
 	return offset - 1 - head;
@@ -382,6 +488,7 @@ static int try_context_readahead(struct address_space *mapping,
 	if (size >= offset)
 		size *= 2;
 
+	ra_push_stream(ra);
 	ra->start = offset;
 	ra->size = get_init_ra_size(size + req_size, max);
 	ra->async_size = ra->size;
@@ -398,20 +505,27 @@ ondemand_readahead(struct address_space *mapping,
 		   bool hit_readahead_marker, pgoff_t offset,
 		   unsigned long req_size)
 {
-	unsigned long max = max_sane_readahead(ra->ra_pages);
+	unsigned long max = ra_max_pages(ra);
 
 	/*
 	 * start of file
 	 */
 	if (!offset)
-		goto initial_readahead;
+		goto new_stream;
 
 	/*
 	 * It's the expected callback offset, assume sequential access.
 	 * Ramp up sizes, and push forward the readahead window.
 	 */
-	if ((offset == (ra->start + ra->size - ra->async_size) ||
-	     offset == (ra->start + ra->size))) {
+	if (ra_stream_next(ra->start, ra->size, ra->async_size, offset) ||
+	    ra_switch_stream(ra, offset)) {
+		if (ra->stalled) {
+			ra->stalled = 0;
+			if (ra->boost < RA_MAX_BOOST) {
+				ra->boost++;
+				max = ra_max_pages(ra);
+			}
+		}
 		ra->start += ra->size;
 		ra->size = get_next_ra_size(ra, max);
 		ra->async_size = ra->size;
@@ -428,12 +542,13 @@ ondemand_readahead(struct address_space *mapping,
 		pgoff_t start;
 
 		rcu_read_lock();
-		start = radix_tree_next_hole(&mapping->page_tree, offset+1,max);
+		start = page_cache_next_hole(mapping, offset + 1, max);
 		rcu_read_unlock();
 
 		if (!start || start - offset > max)
 			return 0;
 
+		ra_push_stream(ra);
 		ra->start = start;
 		ra->size = start - offset;	/* old async_size */
 		ra->size += req_size;
@@ -446,13 +561,33 @@ ondemand_readahead(struct address_space *mapping,
 	 * oversize read
 	 */
 	if (req_size > max)
-		goto initial_readahead;
+		goto new_stream;
 
 	/*
 	 * sequential cache miss
 	 */
-	if (offset - (ra->prev_pos >> PAGE_CACHE_SHIFT) <= 1UL)
-		goto initial_readahead;
+	if (offset - (ra->prev_pos >> PAGE_CACHE_SHIFT) <= 1UL) {
+		if (!ra->size)
+			goto initial_readahead;
+		/*
+		 * The stream's own read-ahead pages were reclaimed
+		 * before use: readahead is thrashing, back off.
+		 */
+		if (ra_has_index(ra, offset)) {
+			count_vm_event(FILE_RA_THRASH);
+			ra->stalled = 0;
+			if (ra->boost) {
+				ra->boost--;
+				max = ra_max_pages(ra);
+			}
+			goto initial_readahead;
+		}
+		/* Otherwise keep ramping up from the previous window */
+		ra->start = offset;
+		ra->size = get_next_ra_size(ra, max);
+		ra->async_size = ra->size;
+		goto readit;
+	}
 
 	/*
 	 * Query the page cache and look for the traces(cached history pages)
@@ -467,6 +602,8 @@ ondemand_readahead(struct address_space *mapping,
 	 */
 	return __do_page_cache_readahead(mapping, filp, offset, req_size, 0);
 
+new_stream:
+	ra_push_stream(ra);
 initial_readahead:
 	ra->start = offset;
 	ra->size = get_init_ra_size(req_size, max);
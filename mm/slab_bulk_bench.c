@@ -0,0 +1,112 @@
+/*
+ * mm/slab_bulk_bench.c
+ *
+ * Compares the cost per object of kmem_cache_alloc()/kmem_cache_free()
+ * against kmem_cache_alloc_bulk()/kmem_cache_free_bulk() for a range
+ * of batch sizes.  Results are reported in the kernel log.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/timex.h>
+
+static unsigned int loops = 10000;
+module_param(loops, uint, 0444);
+MODULE_PARM_DESC(loops, "Iterations per measurement");
+
+static unsigned int objsize = 256;
+module_param(objsize, uint, 0444);
+MODULE_PARM_DESC(objsize, "Object size of the test cache");
+
+static unsigned int max_bulk = 64;
+module_param(max_bulk, uint, 0444);
+MODULE_PARM_DESC(max_bulk, "Largest batch size to measure");
+
+static struct kmem_cache *bench_cache;
+
+static cycles_t bench_single(void **objs, unsigned int bulk)
+{
+	cycles_t start, stop;
+	unsigned int i, j;
+
+	start = get_cycles();
+	for (i = 0; i < loops; i++) {
+		for (j = 0; j < bulk; j++) {
+			objs[j] = kmem_cache_alloc(bench_cache, GFP_KERNEL);
+			if (!objs[j])
+				break;
+		}
+		while (j--)
+			kmem_cache_free(bench_cache, objs[j]);
+	}
+	stop = get_cycles();
+
+	return stop - start;
+}
+
+static cycles_t bench_bulk(void **objs, unsigned int bulk)
+{
+	cycles_t start, stop;
+	unsigned int i;
+
+	start = get_cycles();
+	for (i = 0; i < loops; i++) {
+		if (!kmem_cache_alloc_bulk(bench_cache, GFP_KERNEL, bulk, objs))
+			continue;
+		kmem_cache_free_bulk(bench_cache, bulk, objs);
+	}
+	stop = get_cycles();
+
+	return stop - start;
+}
+
+static int __init slab_bulk_bench_init(void)
+{
+	unsigned long long single, bulk, nr;
+	unsigned int size;
+	void **objs;
+
+	if (!loops || !max_bulk)
+		return -EINVAL;
+
+	objs = kcalloc(max_bulk, sizeof(void *), GFP_KERNEL);
+	if (!objs)
+		return -ENOMEM;
+
+	bench_cache = kmem_cache_create("slab_bulk_bench", objsize, 0,
+					SLAB_HWCACHE_ALIGN, NULL);
+	if (!bench_cache) {
+		kfree(objs);
+		return -ENOMEM;
+	}
+
+	for (size = 1; size <= max_bulk; size <<= 1) {
+		nr = (unsigned long long)loops * size;
+		single = bench_single(objs, size);
+		bulk = bench_bulk(objs, size);
+		do_div(single, nr);
+		do_div(bulk, nr);
+		pr_info("slab_bulk_bench: bulk %u: single %llu cycles/obj, "
+			"bulk %llu cycles/obj\n", size, single, bulk);
+	}
+
+	kmem_cache_destroy(bench_cache);
+	kfree(objs);
+
+	/* the results are in the log, no need to stay loaded */
+	return -EAGAIN;
+}
+module_init(slab_bulk_bench_init);
+
+static void __exit slab_bulk_bench_exit(void)
+{
+}
+module_exit(slab_bulk_bench_exit);
+
+MODULE_LICENSE("GPL");
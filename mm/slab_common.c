@@ -0,0 +1,35 @@
+/*
+ * Slab allocator functions that are independent of the allocator strategy
+ */
+#include <linux/kernel.h>
+#include <linux/slab.h>
+
+#include "internal.h"
+
+/*
+ * Generic bulk operations, for allocators that have no per cpu freelist
+ * to batch against: they just loop over the single object functions.
+ */
+void __kmem_cache_free_bulk(struct kmem_cache *s, size_t size, void **p)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		if (p[i])
+			kmem_cache_free(s, p[i]);
+}
+
+int __kmem_cache_alloc_bulk(struct kmem_cache *s, gfp_t flags, size_t size,
+			    void **p)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		p[i] = kmem_cache_alloc(s, flags);
+		if (unlikely(!p[i])) {
+			__kmem_cache_free_bulk(s, i, p);
+			return 0;
+		}
+	}
+	return size;
+}
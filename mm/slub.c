@@ -30,6 +30,7 @@
 #include <linux/fault-inject.h>
 #include <linux/stacktrace.h>
 #include <linux/prefetch.h>
+#include <linux/memcontrol.h>
 
 #include <trace/events/kmem.h>
 
@@ -166,7 +167,7 @@ static inline int kmem_cache_debug(struct kmem_cache *s)
 		SLAB_FAILSLAB)
 
 #define SLUB_MERGE_SAME (SLAB_DEBUG_FREE | SLAB_RECLAIM_ACCOUNT | \
-		SLAB_CACHE_DMA | SLAB_NOTRACK)
+		SLAB_CACHE_DMA | SLAB_NOTRACK | SLAB_ACCOUNT)
 
 #define OO_SHIFT	16
 #define OO_MASK		((1 << OO_SHIFT) - 1)
@@ -975,6 +976,24 @@ static inline void slab_free_hook(struct kmem_cache *s, void *x)
 		debug_check_no_obj_freed(x, s->objsize);
 }
 
+/*
+ * Run the free hooks on a detached freelist from @head to @tail, or on
+ * the single object @head if @tail is NULL.
+ */
+static inline void slab_free_freelist_hook(struct kmem_cache *s,
+					   void *head, void *tail)
+{
+	void *object = head;
+	void *tail_obj = tail ? : head;
+	void *next;
+
+	do {
+		/* The hooks may poison the object: read the link first */
+		next = object != tail_obj ? get_freepointer(s, object) : NULL;
+		slab_free_hook(s, object);
+	} while ((object = next));
+}
+
 /*
  * Tracking of fully allocated slabs for debugging purposes.
  *
@@ -1264,8 +1283,107 @@ static inline void slab_post_alloc_hook(struct kmem_cache *s, gfp_t flags,
 
 static inline void slab_free_hook(struct kmem_cache *s, void *x) {}
 
+static inline void slab_free_freelist_hook(struct kmem_cache *s,
+					   void *head, void *tail) {}
+
 #endif /* CONFIG_SLUB_DEBUG */
 
+/*
+ * Memory cgroup accounting.
+ *
+ * Allocations from a SLAB_ACCOUNT cache are served from a copy of the
+ * cache that belongs to the memcg of the allocating task.  The slab
+ * pages of the copy are charged to the memcg, objects are freed to the
+ * copy they came from.
+ */
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR_KMEM_SLAB
+static inline bool is_memcg_cache(struct kmem_cache *s)
+{
+	return s->memcg_params && !s->memcg_params->is_root_cache;
+}
+
+static inline bool memcg_cache_dead(struct kmem_cache *s)
+{
+	return is_memcg_cache(s) && s->memcg_params->dead;
+}
+
+static inline struct kmem_cache *cache_from_obj(struct kmem_cache *s,
+						struct page *page)
+{
+	if (!(s->flags & SLAB_ACCOUNT))
+		return s;
+
+	VM_BUG_ON(page->slab != s &&
+		  (!is_memcg_cache(page->slab) ||
+		   page->slab->memcg_params->root_cache != s));
+	return page->slab;
+}
+
+static inline int memcg_charge_slab(struct kmem_cache *s, gfp_t flags,
+				    int order)
+{
+	struct memcg_cache_params *params = s->memcg_params;
+	int ret;
+
+	if (!is_memcg_cache(s))
+		return 0;
+
+	ret = memcg_charge_kmem(params->memcg, flags, 1 << order);
+	if (!ret)
+		atomic_add(1 << order, &params->nr_pages);
+	return ret;
+}
+
+static inline void memcg_uncharge_slab(struct kmem_cache *s, int order)
+{
+	struct memcg_cache_params *params = s->memcg_params;
+
+	if (!is_memcg_cache(s))
+		return;
+
+	memcg_uncharge_kmem(params->memcg, 1 << order);
+	/* The last page of a copy whose memcg is gone */
+	if (atomic_sub_and_test(1 << order, &params->nr_pages))
+		schedule_work(&params->destroy);
+}
+#else
+static inline bool is_memcg_cache(struct kmem_cache *s)
+{
+	return false;
+}
+
+static inline bool memcg_cache_dead(struct kmem_cache *s)
+{
+	return false;
+}
+
+static inline struct kmem_cache *cache_from_obj(struct kmem_cache *s,
+						struct page *page)
+{
+	return s;
+}
+
+static inline int memcg_charge_slab(struct kmem_cache *s, gfp_t flags,
+				    int order)
+{
+	return 0;
+}
+
+static inline void memcg_uncharge_slab(struct kmem_cache *s, int order)
+{
+}
+#endif
+
+/*
+ * Empty slabs are kept on the node partial list up to min_partial,
+ * except in a memcg copy that is going away: it gives back every page.
+ */
+static inline bool slab_discard_empty(struct kmem_cache *s,
+				      struct kmem_cache_node *n)
+{
+	return n->nr_partial > s->min_partial || memcg_cache_dead(s);
+}
+
 /*
  * Slab allocation and freeing
  */
@@ -1314,6 +1432,11 @@ static struct page *allocate_slab(struct kmem_cache *s, gfp_t flags, int node)
 			stat(s, ORDER_FALLBACK);
 	}
 
+	if (page && memcg_charge_slab(s, flags, oo_order(oo))) {
+		__free_pages(page, oo_order(oo));
+		page = NULL;
+	}
+
 	if (flags & __GFP_WAIT)
 		local_irq_disable();
 
@@ -1418,6 +1541,7 @@ static void __free_slab(struct kmem_cache *s, struct page *page)
 	if (current->reclaim_state)
 		current->reclaim_state->reclaimed_slab += pages;
 	__free_pages(page, order);
+	memcg_uncharge_slab(s, order);
 }
 
 #define need_reserve_slab_rcu						\
@@ -1810,7 +1934,7 @@ redo:
 
 	new.frozen = 0;
 
-	if (!new.inuse && n->nr_partial > s->min_partial)
+	if (!new.inuse && slab_discard_empty(s, n))
 		m = M_FREE;
 	else if (new.freelist) {
 		m = M_PARTIAL;
@@ -1903,7 +2027,7 @@ static void unfreeze_partials(struct kmem_cache *s)
 
 			new.frozen = 0;
 
-			if (!new.inuse && (!n || n->nr_partial > s->min_partial))
+			if (!new.inuse && (!n || slab_discard_empty(s, n)))
 				m = M_FREE;
 			else {
 				struct kmem_cache_node *n2 = get_node(s,
@@ -2002,6 +2126,15 @@ int put_cpu_partial(struct kmem_cache *s, struct page *page, int drain)
 		page->next = oldpage;
 
 	} while (this_cpu_cmpxchg(s->cpu_slab->partial, oldpage, page) != oldpage);
+
+	/* Per cpu partial slabs are disabled: hand the page on right away */
+	if (unlikely(!s->cpu_partial)) {
+		unsigned long flags;
+
+		local_irq_save(flags);
+		unfreeze_partials(s);
+		local_irq_restore(flags);
+	}
 	return pobjects;
 }
 
@@ -2309,6 +2442,9 @@ static __always_inline void *slab_alloc(struct kmem_cache *s,
 	if (slab_pre_alloc_hook(s, gfpflags))
 		return NULL;
 
+	if (s->flags & SLAB_ACCOUNT)
+		s = memcg_kmem_get_cache(s, gfpflags);
+
 redo:
 
 	/*
@@ -2432,10 +2568,11 @@ EXPORT_SYMBOL(kmem_cache_alloc_node_trace);
  * handling required then we can return immediately.
  */
 static void __slab_free(struct kmem_cache *s, struct page *page,
-			void *x, unsigned long addr)
+			void *head, void *tail, int cnt,
+			unsigned long addr)
 {
 	void *prior;
-	void **object = (void *)x;
+	void *tail_obj = tail ? : head;
 	int was_frozen;
 	int inuse;
 	struct page new;
@@ -2445,16 +2582,18 @@ static void __slab_free(struct kmem_cache *s, struct page *page,
 
 	stat(s, FREE_SLOWPATH);
 
-	if (kmem_cache_debug(s) && !free_debug_processing(s, page, x, addr))
+	/* Debug caches never free more than one object at a time */
+	if (kmem_cache_debug(s) &&
+	    !free_debug_processing(s, page, head, addr))
 		return;
 
 	do {
 		prior = page->freelist;
 		counters = page->counters;
-		set_freepointer(s, object, prior);
+		set_freepointer(s, tail_obj, prior);
 		new.counters = counters;
 		was_frozen = new.frozen;
-		new.inuse--;
+		new.inuse -= cnt;
 		if ((!new.inuse || !prior) && !was_frozen && !n) {
 
 			if (!kmem_cache_debug(s) && !prior)
@@ -2484,7 +2623,7 @@ static void __slab_free(struct kmem_cache *s, struct page *page,
 
 	} while (!cmpxchg_double_slab(s, page,
 		prior, counters,
-		object, new.counters,
+		head, new.counters,
 		"__slab_free"));
 
 	if (likely(!n)) {
@@ -2513,7 +2652,7 @@ static void __slab_free(struct kmem_cache *s, struct page *page,
 	if (was_frozen)
 		stat(s, FREE_FROZEN);
 	else {
-		if (unlikely(!inuse && n->nr_partial > s->min_partial))
+		if (unlikely(!inuse && slab_discard_empty(s, n)))
                         goto slab_empty;
 
 		/*
@@ -2555,15 +2694,20 @@ slab_empty:
  *
  * If fastpath is not possible then fall back to __slab_free where we deal
  * with all sorts of special processing.
+ *
+ * Bulk free of a detached freelist of @cnt objects from the same page,
+ * linked from @head to @tail, is supported as well.  @tail is NULL for
+ * a single object.
  */
 static __always_inline void slab_free(struct kmem_cache *s,
-			struct page *page, void *x, unsigned long addr)
+			struct page *page, void *head, void *tail, int cnt,
+			unsigned long addr)
 {
-	void **object = (void *)x;
+	void *tail_obj = tail ? : head;
 	struct kmem_cache_cpu *c;
 	unsigned long tid;
 
-	slab_free_hook(s, x);
+	slab_free_freelist_hook(s, head, tail);
 
 redo:
 	/*
@@ -2578,19 +2722,19 @@ redo:
 	barrier();
 
 	if (likely(page == c->page)) {
-		set_freepointer(s, object, c->freelist);
+		set_freepointer(s, tail_obj, c->freelist);
 
 		if (unlikely(!this_cpu_cmpxchg_double(
 				s->cpu_slab->freelist, s->cpu_slab->tid,
 				c->freelist, tid,
-				object, next_tid(tid)))) {
+				head, next_tid(tid)))) {
 
 			note_cmpxchg_failure("slab_free", s, tid);
 			goto redo;
 		}
 		stat(s, FREE_FASTPATH);
 	} else
-		__slab_free(s, page, x, addr);
+		__slab_free(s, page, head, tail_obj, cnt, addr);
 
 }
 
@@ -2600,12 +2744,190 @@ void kmem_cache_free(struct kmem_cache *s, void *x)
 
 	page = virt_to_head_page(x);
 
-	slab_free(s, page, x, _RET_IP_);
+	slab_free(cache_from_obj(s, page), page, x, NULL, 1, _RET_IP_);
 
 	trace_kmem_cache_free(_RET_IP_, x);
 }
 EXPORT_SYMBOL(kmem_cache_free);
 
+struct detached_freelist {
+	struct page *page;
+	void *tail;
+	void *freelist;
+	int cnt;
+};
+
+/*
+ * Link the objects at the end of @p that share a slab page into a
+ * detached freelist, so that they can be freed with one transaction.
+ * Objects that were taken are cleared in @p.  Only a few objects from
+ * other pages are skipped before giving up the search.
+ *
+ * Returns the number of entries of @p still to be processed.
+ */
+static size_t build_detached_freelist(struct kmem_cache *s, size_t size,
+				      void **p, struct detached_freelist *df)
+{
+	size_t first_skipped_index = 0;
+	int lookahead = 3;
+	void *object;
+
+	df->page = NULL;
+	do {
+		object = p[--size];
+	} while (!object && size);
+
+	if (!object)
+		return 0;
+
+	/* Start a new detached freelist */
+	set_freepointer(s, object, NULL);
+	df->page = virt_to_head_page(object);
+	df->tail = object;
+	df->freelist = object;
+	df->cnt = 1;
+	p[size] = NULL;
+
+	while (size) {
+		object = p[--size];
+		if (!object)
+			continue;
+
+		if (df->page == virt_to_head_page(object)) {
+			set_freepointer(s, object, df->freelist);
+			df->freelist = object;
+			df->cnt++;
+			p[size] = NULL;
+			continue;
+		}
+
+		if (!--lookahead)
+			break;
+
+		if (!first_skipped_index)
+			first_skipped_index = size + 1;
+	}
+
+	return first_skipped_index;
+}
+
+/**
+ * kmem_cache_free_bulk - free an array of objects
+ * @s: the cache the objects belong to
+ * @size: number of entries in @p
+ * @p: the objects; %NULL entries are skipped
+ *
+ * Objects that share a slab page are freed together, with a single
+ * per cpu freelist transaction.  The contents of @p are undefined
+ * afterwards.
+ */
+void kmem_cache_free_bulk(struct kmem_cache *s, size_t size, void **p)
+{
+	if (WARN_ON(!size))
+		return;
+
+	if (kmem_cache_debug(s)) {
+		while (size--) {
+			struct page *page;
+
+			if (!p[size])
+				continue;
+			page = virt_to_head_page(p[size]);
+			slab_free(cache_from_obj(s, page), page,
+				  p[size], NULL, 1, _RET_IP_);
+		}
+		return;
+	}
+
+	do {
+		struct detached_freelist df;
+
+		size = build_detached_freelist(s, size, p, &df);
+		if (unlikely(!df.page))
+			continue;
+
+		slab_free(cache_from_obj(s, df.page), df.page,
+			  df.freelist, df.tail, df.cnt, _RET_IP_);
+	} while (likely(size));
+}
+EXPORT_SYMBOL(kmem_cache_free_bulk);
+
+/**
+ * kmem_cache_alloc_bulk - allocate an array of objects
+ * @s: the cache to allocate from
+ * @flags: GFP flags
+ * @size: number of objects to allocate
+ * @p: array that receives the objects
+ *
+ * Takes the objects straight off the per cpu freelist with interrupts
+ * disabled, rather than with a cmpxchg_double per object, and
+ * prefetches the freelist link of the next object while doing so.
+ *
+ * Returns @size on success.  On failure nothing is allocated and 0 is
+ * returned.
+ */
+int kmem_cache_alloc_bulk(struct kmem_cache *s, gfp_t flags, size_t size,
+			  void **p)
+{
+	struct kmem_cache_cpu *c;
+	size_t i, j;
+
+	if (slab_pre_alloc_hook(s, flags))
+		return 0;
+
+	if (s->flags & SLAB_ACCOUNT)
+		s = memcg_kmem_get_cache(s, flags);
+
+	/*
+	 * Disabling interrupts excludes the fastpath of interrupt
+	 * handlers as well as preemption.  Tasks preempted in the
+	 * middle of a fastpath have their cmpxchg fail on the tid.
+	 */
+	local_irq_disable();
+	c = this_cpu_ptr(s->cpu_slab);
+
+	for (i = 0; i < size; i++) {
+		void *object = c->freelist;
+
+		if (unlikely(!object)) {
+			/*
+			 * The slowpath refills the per cpu freelist.  It
+			 * may enable interrupts to allocate a new slab, so
+			 * bump the tid for the objects taken so far.
+			 */
+			c->tid = next_tid(c->tid);
+			p[i] = __slab_alloc(s, flags, NUMA_NO_NODE,
+					    _RET_IP_, c);
+			if (unlikely(!p[i]))
+				goto error;
+			c = this_cpu_ptr(s->cpu_slab);
+			continue;
+		}
+		c->freelist = get_freepointer(s, object);
+		prefetch_freepointer(s, c->freelist);
+		p[i] = object;
+		stat(s, ALLOC_FASTPATH);
+	}
+	c->tid = next_tid(c->tid);
+	local_irq_enable();
+
+	for (j = 0; j < size; j++) {
+		if (unlikely(flags & __GFP_ZERO))
+			memset(p[j], 0, s->objsize);
+		slab_post_alloc_hook(s, flags, p[j]);
+	}
+	return size;
+
+error:
+	local_irq_enable();
+	for (j = 0; j < i; j++)
+		slab_post_alloc_hook(s, flags, p[j]);
+	if (i)
+		kmem_cache_free_bulk(s, i, p);
+	return 0;
+}
+EXPORT_SYMBOL(kmem_cache_alloc_bulk);
+
 /*
  * Object placement in a slab is made very easy because we always start at
  * offset 0. If we tune the size of the object to the alignment then we can
@@ -3201,6 +3523,9 @@ void kmem_cache_destroy(struct kmem_cache *s)
 		}
 		if (s->flags & SLAB_DESTROY_BY_RCU)
 			rcu_barrier();
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR_KMEM_SLAB
+		memcg_release_cache(s);
+#endif
 		sysfs_slab_remove(s);
 	} else
 		up_write(&slub_lock);
@@ -3473,7 +3798,7 @@ void kfree(const void *x)
 		put_page(page);
 		return;
 	}
-	slab_free(page->slab, page, object, _RET_IP_);
+	slab_free(page->slab, page, object, NULL, 1, _RET_IP_);
 }
 EXPORT_SYMBOL(kfree);
 
@@ -3502,6 +3827,10 @@ int kmem_cache_shrink(struct kmem_cache *s)
 	if (!slabs_by_inuse)
 		return -ENOMEM;
 
+	/* A dead memcg copy keeps no partial slabs on the cpus from now on */
+	if (memcg_cache_dead(s))
+		s->cpu_partial = 0;
+
 	flush_all(s);
 	for_each_node_state(node, N_NORMAL_MEMORY) {
 		n = get_node(s, node);
@@ -3877,6 +4206,10 @@ static int slab_unmergeable(struct kmem_cache *s)
 	if (s->refcount < 0)
 		return 1;
 
+	/* Per memcg copies belong to their memcg alone */
+	if (is_memcg_cache(s))
+		return 1;
+
 	return 0;
 }
 
@@ -3957,6 +4290,12 @@ struct kmem_cache *kmem_cache_create(const char *name, size_t size,
 	if (s) {
 		if (kmem_cache_open(s, n,
 				size, align, flags, ctor)) {
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR_KMEM_SLAB
+			if (memcg_register_cache(NULL, s, NULL)) {
+				kmem_cache_close(s);
+				goto err_free;
+			}
+#endif
 			list_add(&s->list, &slab_caches);
 			up_write(&slub_lock);
 			if (sysfs_slab_add(s)) {
@@ -3968,6 +4307,9 @@ struct kmem_cache *kmem_cache_create(const char *name, size_t size,
 			}
 			return s;
 		}
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR_KMEM_SLAB
+err_free:
+#endif
 		kfree(n);
 		kfree(s);
 	}
@@ -3982,6 +4324,94 @@ err:
 }
 EXPORT_SYMBOL(kmem_cache_create);
 
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR_KMEM_SLAB
+/**
+ * kmem_cache_create_memcg - create the copy of a cache for a memcg
+ * @memcg: the memcg the copy charges its pages to
+ * @root: the SLAB_ACCOUNT cache to copy
+ * @name: name of the copy, which is taken over by the cache
+ *
+ * The copy has the object layout of @root and is never merged with
+ * another cache.
+ */
+struct kmem_cache *kmem_cache_create_memcg(struct mem_cgroup *memcg,
+		struct kmem_cache *root, const char *name)
+{
+	struct kmem_cache *s;
+
+	s = kmalloc(kmem_size, GFP_KERNEL);
+	if (!s)
+		goto err;
+
+	down_write(&slub_lock);
+	if (!kmem_cache_open(s, name, root->objsize, root->align,
+			     root->flags & ~SLAB_PANIC, root->ctor))
+		goto err_unlock;
+
+	if (memcg_register_cache(memcg, s, root)) {
+		kmem_cache_close(s);
+		goto err_unlock;
+	}
+
+	list_add(&s->list, &slab_caches);
+	up_write(&slub_lock);
+	if (sysfs_slab_add(s)) {
+		down_write(&slub_lock);
+		list_del(&s->list);
+		up_write(&slub_lock);
+		memcg_release_cache(s);
+		kmem_cache_close(s);
+		kfree(s);
+		return NULL;
+	}
+	return s;
+
+err_unlock:
+	up_write(&slub_lock);
+	kfree(s);
+err:
+	kfree(name);
+	return NULL;
+}
+
+/*
+ * Grow the arrays of per memcg copies of all root caches so that they
+ * can hold @num_memcgs entries.  Called under the memcg cache mutex.
+ */
+int memcg_update_all_caches(int num_memcgs)
+{
+	struct kmem_cache *s;
+	int ret = 0;
+
+	down_write(&slub_lock);
+	list_for_each_entry(s, &slab_caches, list) {
+		struct memcg_cache_params *cur, *new;
+
+		cur = s->memcg_params;
+		if (!cur || !cur->is_root_cache)
+			continue;
+
+		new = kzalloc(sizeof(*new) +
+			      num_memcgs * sizeof(struct kmem_cache *),
+			      GFP_KERNEL);
+		if (!new) {
+			ret = -ENOMEM;
+			break;
+		}
+		new->is_root_cache = true;
+		new->nr_caches = num_memcgs;
+		memcpy(new->memcg_caches, cur->memcg_caches,
+		       cur->nr_caches * sizeof(struct kmem_cache *));
+		rcu_assign_pointer(s->memcg_params, new);
+		kfree_rcu(cur, rcu_head);
+	}
+	if (!ret)
+		memcg_limited_groups_array_size = num_memcgs;
+	up_write(&slub_lock);
+	return ret;
+}
+#endif
+
 #ifdef CONFIG_SMP
 /*
  * Use the cpu notifier to insure that the cpu slabs are flushed when
@@ -17,6 +17,8 @@
 #include <linux/pagevec.h>
 #include <linux/migrate.h>
 #include <linux/page_cgroup.h>
+#include <linux/blkdev.h>
+#include <linux/workqueue.h>
 
 #include <asm/pgtable.h>
 
@@ -45,6 +47,50 @@ struct address_space swapper_space = {
 
 #define INC_CACHE_INFO(x)	do { swap_cache_info.x++; } while (0)
 
+/*
+ * Swap-in readahead.  The readahead window grows with the number of
+ * read-ahead pages which were actually faulted in, and is capped at both
+ * (1 << page_cluster) and SWAP_RA_MAX_PAGES.
+ *
+ * With VMA-based readahead the window follows the faulting address
+ * within the VMA rather than the swap offset; the last fault address,
+ * window and hits of each VMA are packed into vma->swap_readahead_info.
+ */
+#define SWAP_RA_MAX_PAGES	32
+#define SWAP_RA_MAX_INFLIGHT	64
+
+#define SWAP_RA_WIN_SHIFT	(PAGE_SHIFT / 2)
+#define SWAP_RA_HITS_MASK	((1UL << SWAP_RA_WIN_SHIFT) - 1)
+#define SWAP_RA_HITS_MAX	SWAP_RA_HITS_MASK
+#define SWAP_RA_WIN_MASK	(~PAGE_MASK & ~SWAP_RA_HITS_MASK)
+
+#define SWAP_RA_HITS(v)		((v) & SWAP_RA_HITS_MASK)
+#define SWAP_RA_WIN(v)		(((v) & SWAP_RA_WIN_MASK) >> SWAP_RA_WIN_SHIFT)
+#define SWAP_RA_ADDR(v)		((v) & PAGE_MASK)
+
+#define SWAP_RA_VAL(addr, win, hits)				\
+	(((addr) & PAGE_MASK) |					\
+	 (((win) << SWAP_RA_WIN_SHIFT) & SWAP_RA_WIN_MASK) |	\
+	 ((hits) & SWAP_RA_HITS_MASK))
+
+/* Tunables, in /sys/kernel/mm/swap/ */
+static bool swap_vma_ra_enabled = true;
+static bool swap_ra_async = true;
+
+/* State of the swap offset based readahead */
+static atomic_t swapin_readahead_hits = ATOMIC_INIT(4);
+static atomic_t last_readahead_pages;
+static unsigned long swapin_prev_offset;
+
+/* Readahead batches handed off to the workqueue */
+struct swap_ra_work {
+	struct work_struct work;
+	gfp_t gfp_mask;
+	int nr;
+	swp_entry_t entries[SWAP_RA_MAX_PAGES];
+};
+static atomic_t swap_ra_inflight;
+
 static struct {
 	unsigned long add_total;
 	unsigned long del_total;
@@ -258,14 +304,37 @@ void free_pages_and_swap_cache(struct page **pages, int nr)
  * lock getting page table operations atomic even if we drop the page
  * lock before returning.
  */
-struct page * lookup_swap_cache(swp_entry_t entry)
+struct page * lookup_swap_cache(swp_entry_t entry,
+				struct vm_area_struct *vma, unsigned long addr)
 {
 	struct page *page;
+	bool hit = false;
 
 	page = find_get_page(&swapper_space, entry.val);
 
-	if (page)
-		INC_CACHE_INFO(find_success);
+	if (!page) {
+		count_vm_event(SWAP_RA_MISS);
+		goto out;
+	}
+
+	INC_CACHE_INFO(find_success);
+	/* PG_reclaim shares the readahead bit while under writeback */
+	hit = !PageWriteback(page) && TestClearPageReadahead(page);
+	if (hit)
+		count_vm_event(SWAP_RA_HIT);
+
+	if (vma && swap_vma_ra_enabled) {
+		unsigned long ra_val = atomic_long_read(&vma->swap_readahead_info);
+		unsigned long hits = SWAP_RA_HITS(ra_val);
+
+		if (hit)
+			hits = min_t(unsigned long, hits + 1, SWAP_RA_HITS_MAX);
+		atomic_long_set(&vma->swap_readahead_info,
+				SWAP_RA_VAL(addr, SWAP_RA_WIN(ra_val), hits));
+	} else if (hit) {
+		atomic_inc(&swapin_readahead_hits);
+	}
+out:
 
 	INC_CACHE_INFO(find_total);
 	return page;
@@ -277,12 +346,15 @@ struct page * lookup_swap_cache(swp_entry_t entry)
  * A failure return means that either the page allocation failed or that
  * the swap entry is no longer in use.
  */
-struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
-			struct vm_area_struct *vma, unsigned long addr)
+static struct page *__read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
+			struct vm_area_struct *vma, unsigned long addr,
+			bool *page_was_read)
 {
 	struct page *found_page, *new_page = NULL;
 	int err;
 
+	*page_was_read = false;
+
 	do {
 		/*
 		 * First check the swap cache.  Since this is normally
@@ -333,6 +405,7 @@ struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
 			 */
 			lru_cache_add_anon(new_page);
 			swap_readpage(new_page);
+			*page_was_read = true;
 			return new_page;
 		}
 		radix_tree_preload_end();
@@ -350,6 +423,163 @@ struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
 	return found_page;
 }
 
+struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
+			struct vm_area_struct *vma, unsigned long addr)
+{
+	bool page_was_read;
+
+	return __read_swap_cache_async(entry, gfp_mask, vma, addr,
+				       &page_was_read);
+}
+
+static unsigned int swap_ra_max_pages(void)
+{
+	return min_t(unsigned int, 1U << page_cluster, SWAP_RA_MAX_PAGES);
+}
+
+/*
+ * Size the next readahead window: sequential faults with no hits yet
+ * get a small window, otherwise it is rounded up from the hit count.
+ * Shrink it by at most half per fault so a few misses don't collapse it.
+ */
+static unsigned int __swapin_nr_pages(unsigned long prev, unsigned long cur,
+				      unsigned int hits, unsigned int max_pages,
+				      unsigned int prev_win)
+{
+	unsigned int pages, last_ra;
+
+	pages = hits + 2;
+	if (pages == 2) {
+		if (cur != prev + 1 && cur != prev - 1)
+			pages = 1;
+	} else {
+		unsigned int roundup = 4;
+
+		while (roundup < pages)
+			roundup <<= 1;
+		pages = roundup;
+	}
+
+	if (pages > max_pages)
+		pages = max_pages;
+
+	last_ra = prev_win / 2;
+	if (pages < last_ra)
+		pages = last_ra;
+
+	return pages;
+}
+
+static unsigned int swapin_nr_pages(unsigned long offset)
+{
+	unsigned int pages, max_pages = swap_ra_max_pages();
+
+	if (max_pages <= 1)
+		return 1;
+
+	pages = __swapin_nr_pages(swapin_prev_offset, offset,
+				  atomic_xchg(&swapin_readahead_hits, 0),
+				  max_pages, atomic_read(&last_readahead_pages));
+	swapin_prev_offset = offset;
+	atomic_set(&last_readahead_pages, pages);
+
+	return pages;
+}
+
+/*
+ * Read ahead the given swap entries, marking pages we actually read so
+ * lookup_swap_cache() can count them as hits.
+ */
+static void swap_ra_read(swp_entry_t *entries, int nr, gfp_t gfp_mask,
+			 struct vm_area_struct *vma, unsigned long addr)
+{
+	struct blk_plug plug;
+	struct page *page;
+	bool page_was_read;
+	int i;
+
+	blk_start_plug(&plug);
+	for (i = 0; i < nr; i++) {
+		page = __read_swap_cache_async(entries[i], gfp_mask, vma, addr,
+					       &page_was_read);
+		if (!page)
+			continue;
+		if (page_was_read) {
+			SetPageReadahead(page);
+			count_vm_event(SWAP_RA);
+		}
+		page_cache_release(page);
+	}
+	blk_finish_plug(&plug);
+	lru_add_drain();	/* Push any new pages onto the LRU now */
+}
+
+static void swap_ra_workfn(struct work_struct *work)
+{
+	struct swap_ra_work *ra = container_of(work, struct swap_ra_work, work);
+
+	/*
+	 * The entries may have been freed, or their swap area turned off,
+	 * since they were collected: read_swap_cache_async() then finds
+	 * them unused and skips them.
+	 */
+	swap_ra_read(ra->entries, ra->nr, ra->gfp_mask, NULL, 0);
+	kfree(ra);
+	atomic_dec(&swap_ra_inflight);
+}
+
+static bool swap_ra_queue(swp_entry_t *entries, int nr, gfp_t gfp_mask)
+{
+	struct swap_ra_work *ra;
+
+	if (atomic_inc_return(&swap_ra_inflight) > SWAP_RA_MAX_INFLIGHT)
+		goto fail;
+
+	ra = kmalloc(sizeof(*ra), GFP_NOWAIT | __GFP_NOWARN);
+	if (!ra)
+		goto fail;
+
+	INIT_WORK(&ra->work, swap_ra_workfn);
+	ra->gfp_mask = gfp_mask;
+	ra->nr = nr;
+	memcpy(ra->entries, entries, nr * sizeof(entries[0]));
+	queue_work(system_unbound_wq, &ra->work);
+	return true;
+fail:
+	atomic_dec(&swap_ra_inflight);
+	return false;
+}
+
+/*
+ * Read the faulting entry and its readahead window.  Synchronously, the
+ * whole window is submitted as one plugged batch with the faulting page
+ * last, which suits rotating disks.  Asynchronously, only the faulting
+ * page is read here and the rest of the window is left to a worker, so
+ * that on compressed swap the faulting task does not pay for
+ * decompressing pages it may never use.
+ */
+static struct page *swap_ra_finish(swp_entry_t entry, swp_entry_t *entries,
+				   int nr, gfp_t gfp_mask,
+				   struct vm_area_struct *vma, unsigned long addr)
+{
+	struct blk_plug plug;
+	struct page *page;
+
+	if (nr && swap_ra_async) {
+		page = read_swap_cache_async(entry, gfp_mask, vma, addr);
+		if (!swap_ra_queue(entries, nr, gfp_mask))
+			swap_ra_read(entries, nr, gfp_mask, vma, addr);
+		return page;
+	}
+
+	blk_start_plug(&plug);
+	swap_ra_read(entries, nr, gfp_mask, vma, addr);
+	page = read_swap_cache_async(entry, gfp_mask, vma, addr);
+	blk_finish_plug(&plug);
+
+	return page;
+}
+
 /**
  * swapin_readahead - swap in pages in hope we need them soon
  * @entry: swap entry of this memory
@@ -360,9 +590,10 @@ struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
  * Returns the struct page for entry and addr, after queueing swapin.
  *
  * Primitive swap readahead code. We simply read an aligned block of
- * (1 << page_cluster) entries in the swap area. This method is chosen
- * because it doesn't cost us any seek time.  We also make sure to queue
- * the 'original' request together with the readahead ones...
+ * swap entries around the faulting one, sized by swapin_nr_pages().
+ * This method is chosen because it doesn't cost us any seek time.  We
+ * also make sure to queue the 'original' request together with the
+ * readahead ones...
  *
  * This has been extended to use the NUMA policies from the mm triggering
  * the readahead.
@@ -372,25 +603,186 @@ struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
 struct page *swapin_readahead(swp_entry_t entry, gfp_t gfp_mask,
 			struct vm_area_struct *vma, unsigned long addr)
 {
-	struct page *page;
+	swp_entry_t entries[SWAP_RA_MAX_PAGES];
 	unsigned long offset = swp_offset(entry);
-	unsigned long start_offset, end_offset;
-	unsigned long mask = (1UL << page_cluster) - 1;
+	unsigned long start_offset, end_offset, ra_offset;
+	unsigned long mask = swapin_nr_pages(offset) - 1;
+	int nr = 0;
 
-	/* Read a page_cluster sized and aligned cluster around offset. */
+	/* Read a window sized and aligned cluster around offset. */
 	start_offset = offset & ~mask;
 	end_offset = offset | mask;
 	if (!start_offset)	/* First page is swap header. */
 		start_offset++;
 
-	for (offset = start_offset; offset <= end_offset ; offset++) {
-		/* Ok, do the async read-ahead now */
-		page = read_swap_cache_async(swp_entry(swp_type(entry), offset),
-						gfp_mask, vma, addr);
-		if (!page)
+	for (ra_offset = start_offset; ra_offset <= end_offset; ra_offset++) {
+		if (ra_offset == offset)
 			continue;
-		page_cache_release(page);
+		entries[nr++] = swp_entry(swp_type(entry), ra_offset);
 	}
-	lru_add_drain();	/* Push any new pages onto the LRU now */
-	return read_swap_cache_async(entry, gfp_mask, vma, addr);
+
+	return swap_ra_finish(entry, entries, nr, gfp_mask, vma, addr);
+}
+
+/**
+ * swap_vma_readahead - swap in pages in hope we need them soon
+ * @entry: swap entry of this memory
+ * @gfp_mask: memory allocation flags
+ * @vma: user vma this address belongs to
+ * @addr: faulting address
+ *
+ * Like swapin_readahead(), but reads ahead the swap entries mapped around
+ * @addr in @vma rather than those next to @entry in the swap area, since
+ * on devices without seek cost virtual address locality predicts future
+ * faults better.  The window is kept within @vma and the page table
+ * covering @addr.  Falls back to swapin_readahead() when VMA-based
+ * readahead is disabled.
+ *
+ * Caller must hold down_read on the vma->vm_mm.
+ */
+struct page *swap_vma_readahead(swp_entry_t entry, gfp_t gfp_mask,
+			struct vm_area_struct *vma, unsigned long addr)
+{
+	swp_entry_t entries[SWAP_RA_MAX_PAGES];
+	unsigned long ra_val, pfn, fpfn, lo, start, end;
+	unsigned int max_win, win, left;
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+	pte_t *orig_pte, *pte;
+	int nr = 0;
+
+	if (!swap_vma_ra_enabled)
+		return swapin_readahead(entry, gfp_mask, vma, addr);
+
+	max_win = swap_ra_max_pages();
+	if (max_win <= 1)
+		goto out;
+
+	addr &= PAGE_MASK;
+	fpfn = PFN_DOWN(addr);
+	ra_val = atomic_long_read(&vma->swap_readahead_info);
+	pfn = PFN_DOWN(SWAP_RA_ADDR(ra_val));
+	win = __swapin_nr_pages(pfn, fpfn, SWAP_RA_HITS(ra_val), max_win,
+				SWAP_RA_WIN(ra_val));
+	atomic_long_set(&vma->swap_readahead_info, SWAP_RA_VAL(addr, win, 0));
+	if (win == 1)
+		goto out;
+
+	/* Extend the window in the direction the faults are moving. */
+	if (fpfn == pfn + 1)
+		left = 0;
+	else if (pfn == fpfn + 1)
+		left = win - 1;
+	else
+		left = (win - 1) / 2;
+	lo = max(PFN_DOWN(vma->vm_start), PFN_DOWN(addr & PMD_MASK));
+	start = fpfn - min_t(unsigned long, left, fpfn - lo);
+	end = min3(fpfn + win - left, PFN_DOWN(vma->vm_end),
+		   PFN_DOWN((addr & PMD_MASK) + PMD_SIZE));
+
+	pgd = pgd_offset(vma->vm_mm, addr);
+	if (pgd_none_or_clear_bad(pgd))
+		goto out;
+	pud = pud_offset(pgd, addr);
+	if (pud_none_or_clear_bad(pud))
+		goto out;
+	pmd = pmd_offset(pud, addr);
+	if (pmd_none_or_trans_huge_or_clear_bad(pmd))
+		goto out;
+
+	/* The entries are only hints, so the pte lock isn't needed. */
+	orig_pte = pte = pte_offset_map(pmd, start << PAGE_SHIFT);
+	for (pfn = start; pfn < end; pfn++, pte++) {
+		pte_t pteval = *pte;
+		swp_entry_t ra_entry;
+
+		if (pfn == fpfn || pte_none(pteval) || pte_present(pteval) ||
+		    pte_file(pteval))
+			continue;
+		ra_entry = pte_to_swp_entry(pteval);
+		if (unlikely(non_swap_entry(ra_entry)))
+			continue;
+		entries[nr++] = ra_entry;
+	}
+	pte_unmap(orig_pte);
+out:
+	return swap_ra_finish(entry, entries, nr, gfp_mask, vma, addr);
+}
+
+#ifdef CONFIG_SYSFS
+static ssize_t vma_ra_enabled_show(struct kobject *kobj,
+				   struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%s\n", swap_vma_ra_enabled ? "true" : "false");
+}
+
+static ssize_t vma_ra_enabled_store(struct kobject *kobj,
+				    struct kobj_attribute *attr,
+				    const char *buf, size_t count)
+{
+	if (!strncmp(buf, "true", 4) || !strncmp(buf, "1", 1))
+		swap_vma_ra_enabled = true;
+	else if (!strncmp(buf, "false", 5) || !strncmp(buf, "0", 1))
+		swap_vma_ra_enabled = false;
+	else
+		return -EINVAL;
+
+	return count;
+}
+static struct kobj_attribute vma_ra_enabled_attr =
+	__ATTR(vma_ra_enabled, 0644, vma_ra_enabled_show,
+	       vma_ra_enabled_store);
+
+static ssize_t ra_async_show(struct kobject *kobj,
+			     struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%s\n", swap_ra_async ? "true" : "false");
+}
+
+static ssize_t ra_async_store(struct kobject *kobj,
+			      struct kobj_attribute *attr,
+			      const char *buf, size_t count)
+{
+	if (!strncmp(buf, "true", 4) || !strncmp(buf, "1", 1))
+		swap_ra_async = true;
+	else if (!strncmp(buf, "false", 5) || !strncmp(buf, "0", 1))
+		swap_ra_async = false;
+	else
+		return -EINVAL;
+
+	return count;
+}
+static struct kobj_attribute ra_async_attr =
+	__ATTR(ra_async, 0644, ra_async_show, ra_async_store);
+
+static struct attribute *swap_attrs[] = {
+	&vma_ra_enabled_attr.attr,
+	&ra_async_attr.attr,
+	NULL,
+};
+
+static struct attribute_group swap_attr_group = {
+	.attrs = swap_attrs,
+};
+
+static int __init swap_init_sysfs(void)
+{
+	struct kobject *swap_kobj;
+	int err;
+
+	swap_kobj = kobject_create_and_add("swap", mm_kobj);
+	if (!swap_kobj) {
+		printk(KERN_ERR "failed to create swap kobject\n");
+		return -ENOMEM;
+	}
+	err = sysfs_create_group(swap_kobj, &swap_attr_group);
+	if (err) {
+		printk(KERN_ERR "failed to register swap group\n");
+		kobject_put(swap_kobj);
+		return err;
+	}
+	return 0;
 }
+subsys_initcall(swap_init_sysfs);
+#endif
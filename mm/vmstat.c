@@ -721,7 +721,13 @@ const char * const vmstat_text[] = {
 	"numa_local",
 	"numa_other",
 #endif
+	"workingset_refault",
+	"workingset_activate",
 	"nr_anon_transparent_hugepages",
+	"zone_lock_acquired",
+	"zone_lock_contended",
+	"lru_lock_acquired",
+	"lru_lock_contended",
 	"nr_dirty_threshold",
 	"nr_dirty_background_threshold",
 
@@ -748,6 +754,12 @@ const char * const vmstat_text[] = {
 
 #ifdef CONFIG_NUMA
 	"zone_reclaim_failed",
+#endif
+#ifdef CONFIG_NUMA_BALANCING
+	"numa_pte_updates",
+	"numa_hint_faults",
+	"numa_hint_faults_local",
+	"numa_pages_migrated",
 #endif
 	"pginodesteal",
 	"slabs_scanned",
@@ -767,6 +779,10 @@ const char * const vmstat_text[] = {
 	"compact_stall",
 	"compact_fail",
 	"compact_success",
+	"compact_stall_usecs",
+	"compact_stall_avoided",
+	"compact_daemon_wake",
+	"compact_daemon_proactive",
 #endif
 
 #ifdef CONFIG_HUGETLB_PAGE
@@ -781,6 +797,17 @@ const char * const vmstat_text[] = {
 	"unevictable_pgs_cleared",
 	"unevictable_pgs_stranded",
 	"unevictable_pgs_mlockfreed",
+	"file_ra",
+	"file_ra_hit",
+	"file_ra_miss",
+	"file_ra_stall",
+	"file_ra_thrash",
+
+#ifdef CONFIG_SWAP
+	"swap_ra",
+	"swap_ra_hit",
+	"swap_ra_miss",
+#endif
 
 #ifdef CONFIG_TRANSPARENT_HUGEPAGE
 	"thp_fault_alloc",
@@ -0,0 +1,337 @@
+/*
+ * mm/workingset.c - refault detection for the page cache
+ */
+
+#include <linux/pagemap.h>
+#include <linux/pagevec.h>
+#include <linux/atomic.h>
+#include <linux/vmstat.h>
+#include <linux/swap.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/init.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/shrinker.h>
+#include <linux/module.h>
+
+/*
+ *		Double CLOCK lists
+ *
+ * Per zone, two clock lists are maintained for file pages: the
+ * inactive and the active list.  Freshly faulted pages start out at
+ * the head of the inactive list and page reclaim scans pages from the
+ * tail.  Pages that are accessed multiple times on the inactive list
+ * are promoted to the active list, to protect them from reclaim,
+ * whereas active pages are demoted to the inactive list when the
+ * active list grows too big.
+ *
+ * This way, a single streaming read can not push the frequently used
+ * pages out of memory.  But the balance between the two lists is
+ * decided by inactive_file_is_low() alone, which only compares their
+ * sizes: a workingset that is bigger than the active list, but would
+ * fit into memory as a whole, is thrashing through the inactive list
+ * without ever getting the second access that would activate it.
+ *
+ *		Approximating inactive page access frequency
+ *
+ * Each zone maintains a counter, inactive_age, that is incremented
+ * whenever a page leaves the inactive list, either by eviction at the
+ * tail or by activation.  The difference between the counter value
+ * when a page is evicted and when it refaults is thus the minimum
+ * number of accesses the inactive list saw in between; this is the
+ * refault distance.
+ *
+ * Had the inactive list been bigger by the refault distance, the page
+ * would have been activated instead of evicted.  The inactive list
+ * can only grow at the cost of the active list, so if
+ *
+ *   refault_distance <= nr_active
+ *
+ * the refaulting page stood a chance against the current active pages
+ * and it is activated right away, to challenge them for their spot.
+ * A page that refaults further out belongs to a stream, or to a
+ * workingset that does not fit into memory anyway, and enters the
+ * inactive list as usual.
+ *
+ *		Implementation
+ *
+ * When a file page is evicted by reclaim, the zone's inactive_age is
+ * stored, together with the zone, in the page cache radix tree slot
+ * the page leaves behind.  Such a shadow entry is an exceptional
+ * radix tree entry, like the swap entries of shmem/tmpfs.  Page cache
+ * insertion, in add_to_page_cache_lru(), hands any shadow entry it
+ * replaces to workingset_refault().
+ *
+ * Shadow entries are dropped with the mapping: by truncation, and by
+ * inode eviction which also stops reclaim from leaving new ones.
+ *
+ *		Shadow entry reclaim
+ *
+ * Shadow entries pin the radix tree nodes they live in, and a big file
+ * that is read once and stays in the inode cache would leave a shadow
+ * entry for each of its pages behind.  But a shadow entry is only of
+ * use while its refault distance can still be smaller than the active
+ * list, and the distance grows with every eviction after it.  So there
+ * is no point in keeping more shadow entries around than there are file
+ * pages in memory.
+ *
+ * Mappings that hold shadow entries are kept on a global list, and a
+ * shrinker drops the entries in excess of the file LRU pages, going
+ * round the mappings in turn and through each mapping in index order.
+ */
+
+#define EVICTION_SHIFT	(RADIX_TREE_EXCEPTIONAL_SHIFT + \
+			 ZONES_SHIFT + NODES_SHIFT)
+#define EVICTION_MASK	(~0UL >> EVICTION_SHIFT)
+
+static void *pack_shadow(unsigned long eviction, struct zone *zone)
+{
+	eviction = (eviction << NODES_SHIFT) | zone_to_nid(zone);
+	eviction = (eviction << ZONES_SHIFT) | zone_idx(zone);
+	eviction = (eviction << RADIX_TREE_EXCEPTIONAL_SHIFT);
+
+	return (void *)(eviction | RADIX_TREE_EXCEPTIONAL_ENTRY);
+}
+
+static void unpack_shadow(void *shadow,
+			  struct zone **zone,
+			  unsigned long *distance)
+{
+	unsigned long entry = (unsigned long)shadow;
+	unsigned long eviction;
+	unsigned long refault;
+	struct pglist_data *pgdat;
+	int zid;
+
+	entry >>= RADIX_TREE_EXCEPTIONAL_SHIFT;
+	zid = entry & ((1UL << ZONES_SHIFT) - 1);
+	entry >>= ZONES_SHIFT;
+	pgdat = NODE_DATA(entry & ((1UL << NODES_SHIFT) - 1));
+	entry >>= NODES_SHIFT;
+	eviction = entry;
+
+	*zone = pgdat->node_zones + zid;
+
+	refault = atomic_long_read(&(*zone)->inactive_age);
+	/*
+	 * The masked unsigned subtraction copes with inactive_age
+	 * wrapping around the bits left in the shadow entry.  A shadow
+	 * entry that lives long enough to be lapped yields a falsely
+	 * small distance and one unwarranted activation, which the
+	 * active list's own aging corrects soon enough.
+	 */
+	*distance = (refault - eviction) & EVICTION_MASK;
+}
+
+/**
+ * workingset_eviction - note the eviction of a page from memory
+ * @mapping: address space the page was backing
+ * @page: the page being evicted
+ *
+ * Returns a shadow entry to be stored in @mapping->page_tree in place
+ * of the evicted @page so that a later refault can be detected.
+ */
+void *workingset_eviction(struct address_space *mapping, struct page *page)
+{
+	struct zone *zone = page_zone(page);
+	unsigned long eviction;
+
+	eviction = atomic_long_inc_return(&zone->inactive_age);
+	return pack_shadow(eviction, zone);
+}
+
+/**
+ * workingset_refault - evaluate the refault of a previously evicted page
+ * @shadow: shadow entry of the evicted page
+ *
+ * Calculates and evaluates the refault distance of the previously
+ * evicted page in the context of the zone it was allocated in.
+ *
+ * Returns %true if the page should be activated, %false otherwise.
+ */
+bool workingset_refault(void *shadow)
+{
+	unsigned long refault_distance;
+	struct zone *zone;
+
+	unpack_shadow(shadow, &zone, &refault_distance);
+	inc_zone_state(zone, WORKINGSET_REFAULT);
+
+	if (refault_distance <= zone_page_state(zone, NR_ACTIVE_FILE)) {
+		inc_zone_state(zone, WORKINGSET_ACTIVATE);
+		return true;
+	}
+	return false;
+}
+
+/**
+ * workingset_activation - note a page activation
+ * @page: page that is being activated
+ */
+void workingset_activation(struct page *page)
+{
+	atomic_long_inc(&page_zone(page)->inactive_age);
+}
+
+static LIST_HEAD(shadow_mappings);
+static DEFINE_SPINLOCK(shadow_lock);
+static DEFINE_PER_CPU(long, nr_shadows);
+
+/* shadow entries looked at per mapping in one go, in PAGEVEC_SIZE batches */
+#define SHADOW_SCAN_BATCHES	8
+
+/*
+ * shadow_lock nests inside tree_lock, which is taken from IO completion
+ * interrupts, so it must only be held with interrupts off.  The shrinker
+ * goes the other way round and only trylocks tree_lock.
+ */
+
+/**
+ * workingset_shadow_add - account a shadow entry stored in a mapping
+ * @mapping: the mapping, with tree_lock held
+ */
+void workingset_shadow_add(struct address_space *mapping)
+{
+	if (!mapping->nrshadows++ && list_empty(&mapping->shadow_list)) {
+		spin_lock(&shadow_lock);
+		list_add_tail(&mapping->shadow_list, &shadow_mappings);
+		spin_unlock(&shadow_lock);
+	}
+	this_cpu_inc(nr_shadows);
+}
+
+/**
+ * workingset_shadow_del - account a shadow entry removed from a mapping
+ * @mapping: the mapping, with tree_lock held
+ *
+ * The mapping stays on the shrinker's list until the shrinker finds it
+ * without shadow entries, or until it is torn down.
+ */
+void workingset_shadow_del(struct address_space *mapping)
+{
+	mapping->nrshadows--;
+	this_cpu_dec(nr_shadows);
+}
+
+/**
+ * workingset_forget_mapping - take a mapping off the shadow shrinker
+ * @mapping: the mapping of an inode that is being evicted
+ *
+ * Called once the mapping is marked exiting and its shadow entries are
+ * gone.  Taking shadow_lock also waits for the shrinker to be done with
+ * the mapping, before it is freed.
+ */
+void workingset_forget_mapping(struct address_space *mapping)
+{
+	spin_lock_irq(&shadow_lock);
+	list_del_init(&mapping->shadow_list);
+	spin_unlock_irq(&shadow_lock);
+}
+
+static long nr_shadow_entries(void)
+{
+	long sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu(nr_shadows, cpu);
+	return sum < 0 ? 0 : sum;
+}
+
+/*
+ * Drop up to @nr shadow entries of @mapping, from where the last round
+ * left off.  Called with tree_lock held.
+ */
+static unsigned long shadow_drop_entries(struct address_space *mapping,
+					 unsigned long nr)
+{
+	void **slots[PAGEVEC_SIZE];
+	unsigned long indices[PAGEVEC_SIZE];
+	pgoff_t index = mapping->shadow_cursor;
+	int batches = SHADOW_SCAN_BATCHES;
+	unsigned long dropped = 0;
+	unsigned int n, i;
+
+	while (dropped < nr && mapping->nrshadows && batches--) {
+		n = radix_tree_gang_lookup_slot(&mapping->page_tree, slots,
+						indices, index, PAGEVEC_SIZE);
+		if (!n) {
+			if (!index)
+				break;
+			/* wrap around */
+			index = 0;
+			continue;
+		}
+		for (i = 0; i < n && dropped < nr; i++) {
+			void *entry;
+
+			index = indices[i] + 1;
+			entry = radix_tree_lookup(&mapping->page_tree,
+						  indices[i]);
+			if (!radix_tree_exceptional_entry(entry))
+				continue;
+			radix_tree_delete(&mapping->page_tree, indices[i]);
+			workingset_shadow_del(mapping);
+			dropped++;
+		}
+	}
+	mapping->shadow_cursor = index;
+	return dropped;
+}
+
+static void shadow_reclaim(unsigned long nr)
+{
+	unsigned long visits;
+
+	spin_lock_irq(&shadow_lock);
+	/* mappings we fail to lock count against @nr as well */
+	for (visits = 0; nr && visits < nr; visits++) {
+		struct address_space *mapping;
+
+		if (list_empty(&shadow_mappings))
+			break;
+		mapping = list_first_entry(&shadow_mappings,
+					   struct address_space, shadow_list);
+		list_move_tail(&mapping->shadow_list, &shadow_mappings);
+
+		if (!spin_trylock(&mapping->tree_lock))
+			continue;
+		nr -= min(nr, shadow_drop_entries(mapping, nr));
+		if (!mapping->nrshadows)
+			list_del_init(&mapping->shadow_list);
+		spin_unlock(&mapping->tree_lock);
+	}
+	spin_unlock_irq(&shadow_lock);
+}
+
+static int shadow_shrink(struct shrinker *shrink, struct shrink_control *sc)
+{
+	long excess;
+
+	excess = nr_shadow_entries() -
+		 (long)(global_page_state(NR_ACTIVE_FILE) +
+			global_page_state(NR_INACTIVE_FILE));
+	if (excess <= 0)
+		return 0;
+
+	if (sc->nr_to_scan) {
+		shadow_reclaim(min_t(long, sc->nr_to_scan, excess));
+		excess = nr_shadow_entries() -
+			 (long)(global_page_state(NR_ACTIVE_FILE) +
+				global_page_state(NR_INACTIVE_FILE));
+	}
+	return clamp_t(long, excess, 0, INT_MAX);
+}
+
+static struct shrinker shadow_shrinker = {
+	.shrink = shadow_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+static int __init workingset_init(void)
+{
+	register_shrinker(&shadow_shrinker);
+	return 0;
+}
+module_init(workingset_init);